@@ -98,12 +98,22 @@ AccessScanner::AccessScanner(EventuallyPersistentStore &_store, EPStats &st,
 {}
 
 bool AccessScanner::callback(Dispatcher &d, TaskId t) {
-    // @todo we should be able to suspend this task to ensure that we're not
-    //       running multiple in parallel
-    shared_ptr<ItemAccessVisitor> pv(new ItemAccessVisitor(store));
-    store.resetAccessScannerTasktime();
-    store.visit(pv, "Item access scanner", &d, Priority::ItemPagerPriority);
-    ++stats.alogRuns;
+    // The access log is only swapped in once a visit has been through
+    // every vbucket, so a run never stops part way and always starts
+    // where the last one did.  The cursor is kept for the coverage
+    // stats and to tell whether the last run is still going.
+    VBucketVisitorCursor &cursor = store.getAccessScannerCursor();
+    if (cursor.isInUse()) {
+        getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                         "The last access scanner run is still going, "
+                         "skipping this one\n");
+    } else {
+        shared_ptr<ItemAccessVisitor> pv(new ItemAccessVisitor(store));
+        store.resetAccessScannerTasktime();
+        store.visit(pv, "Item access scanner", &d, Priority::ItemPagerPriority,
+                    true, 0, &cursor);
+        ++stats.alogRuns;
+    }
     d.snooze(t, sleepTime);
     stats.alogTime.set(t->getWaketime().tv_sec);
     return true;
@@ -6,6 +6,7 @@
 #include <queue>
 #include <sched.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -189,6 +190,157 @@ private:
     volatile T value;
 };
 
+/**
+ * A counter spread over a number of shards, each on its own cache line.
+ *
+ * Updates go to the shard of the CPU the caller is running on, so
+ * threads on different cores don't keep stealing the same cache line
+ * from each other.  Reads add up all the shards, which makes them more
+ * expensive than reading an Atomic, so use this for counters that are
+ * updated on every mutation but only read now and then (e.g. by
+ * stats).
+ *
+ * Updates don't return the new value since no single shard knows it.
+ * An individual shard of an unsigned counter may wrap below zero, the
+ * sum still comes out right.
+ */
+template <typename T, size_t N = 16>
+class ShardedCounter {
+public:
+
+    //! Reads of a shard between sums of all of them in getApprox().
+    static const uint32_t APPROX_READS = 64;
+
+    ShardedCounter(const T &initial = 0) : approx(0), approxValid(false) {
+        Shard *sh = shards();
+        for (size_t i = 0; i < N; ++i) {
+            sh[i].reads = 0;
+        }
+        set(initial);
+    }
+
+    T get() const {
+        const Shard *sh = shards();
+        T rv = 0;
+        for (size_t i = 0; i < N; ++i) {
+            rv += sh[i].value;
+        }
+        return rv;
+    }
+
+    /**
+     * Get the value as of the last time any thread summed the shards.
+     *
+     * Threads sum them again every APPROX_READS reads of their own
+     * shard, so this is cheap enough for checks made on every update.
+     */
+    T getApprox() const {
+        Shard &sh = shards()[shard()];
+        if (++sh.reads % APPROX_READS == 0 || !approxValid) {
+            approx = get();
+            approxValid = true;
+        }
+        return approx;
+    }
+
+    /**
+     * Set the value of the counter.
+     *
+     * Updates made while this is running may or may not be lost.
+     */
+    void set(const T &newValue) {
+        Shard *sh = shards();
+        for (size_t i = 1; i < N; ++i) {
+            sh[i].value = 0;
+        }
+        sh[0].value = newValue;
+        approxValid = false;
+        ep_sync_synchronize();
+    }
+
+    operator T() const {
+        return get();
+    }
+
+    void operator =(const T &newValue) {
+        set(newValue);
+    }
+
+    void operator ++() {
+        incr(1);
+    }
+
+    void operator ++(int) {
+        incr(1);
+    }
+
+    void operator --() {
+        decr(1);
+    }
+
+    void operator --(int) {
+        decr(1);
+    }
+
+    void operator +=(const T &increment) {
+        incr(increment);
+    }
+
+    void operator -=(const T &decrement) {
+        decr(decrement);
+    }
+
+    void incr(const T &increment) {
+        ep_sync_add_and_fetch(&shards()[shard()].value, increment);
+    }
+
+    void decr(const T &decrement) {
+        ep_sync_add_and_fetch(&shards()[shard()].value, -decrement);
+    }
+
+private:
+
+    static const size_t CACHE_LINE_SIZE = 64;
+
+    static size_t shard() {
+#ifdef HAVE_SCHED_GETCPU
+        int cpu = sched_getcpu();
+        if (cpu >= 0) {
+            return static_cast<size_t>(cpu) % N;
+        }
+#endif
+        // Thread stacks are far apart, so this spreads threads over the
+        // shards about as well.
+        char here;
+        return (reinterpret_cast<uintptr_t>(&here) >> 16) % N;
+    }
+
+    struct Shard {
+        volatile T        value;
+        //! Reads through getApprox() that landed on this shard.
+        volatile uint32_t reads;
+        char              pad[CACHE_LINE_SIZE - sizeof(T) - sizeof(uint32_t)];
+    } __attribute__((aligned(CACHE_LINE_SIZE)));
+
+    /**
+     * The shards, at the first cache line boundary in the storage.
+     *
+     * Heap allocations aren't aligned to a cache line, so the storage
+     * has room for one more shard than needed.
+     */
+    Shard *shards() const {
+        uintptr_t p = reinterpret_cast<uintptr_t>(storage);
+        p = (p + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+        return reinterpret_cast<Shard*>(p);
+    }
+
+    mutable char          storage[(N + 1) * CACHE_LINE_SIZE];
+    mutable volatile T    approx;
+    mutable volatile bool approxValid;
+
+    DISALLOW_COPY_AND_ASSIGN(ShardedCounter);
+};
+
 /**
  * Atomic pointer.
  *
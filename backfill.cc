@@ -99,13 +99,16 @@ bool BackFillVisitor::visitBucket(RCPtr<VBucket> &vb) {
         double num_non_resident = static_cast<double>(vb->ht.getNumNonResidentItems());
         size_t num_backfill_items = 0;
 
-        if (num_items == 0) {
+        // Under full eviction the hash table doesn't hold every item,
+        // so the disk has to be read regardless of the resident ratio.
+        bool fullEviction = engine->epstore->isFullEviction();
+        if (num_items == 0 && !fullEviction) {
             return false;
         }
 
         double resident_threshold = engine->getTapConfig().getBackfillResidentThreshold();
-        residentRatioBelowThreshold =
-            ((num_items - num_non_resident) / num_items) < resident_threshold ? true : false;
+        residentRatioBelowThreshold = fullEviction ||
+            ((num_items - num_non_resident) / num_items) < resident_threshold;
 
         if (efficientVBDump && residentRatioBelowThreshold) {
             // disk backfill for persisted items + memory backfill for resident items
@@ -140,8 +143,8 @@ void BackFillVisitor::visit(StoredValue *v) {
         return;
     }
 
-    queued_item qi(new QueuedItem(v->getKey(), currentBucket->getId(), queue_op_set,
-                                  v->getId()));
+    queued_item qi(QueuedItem::New(v->getKey(), currentBucket->getId(), queue_op_set,
+                                   v->getId()));
     queue->push_back(qi);
 }
 
@@ -227,6 +230,10 @@ bool BackFillVisitor::checkValidity() {
 
 bool BackfillTask::callback(Dispatcher &d, TaskId t) {
     (void) t;
+    // No cursor: a backfill has to send every item of its vbuckets to
+    // this one connection, so it never stops short of the end.  Pausing
+    // on a full TAP queue snoozes the visit where it is, and a new
+    // connection starts a backfill of its own from the top.
     epstore->visit(bfv, "Backfill task", &d, Priority::BackfillTaskPriority, true, 1);
     return false;
 }
@@ -52,8 +52,8 @@ public:
         return numRemainingItems > 0;
     }
 
-    void notifyBGEvent(void) {
-        if (++numRemainingItems == 1) {
+    void notifyBGEvent(size_t n = 1) {
+        if (numRemainingItems.incr(n) == 0) {
             LockHolder lh(taskMutex);
             assert(task.get());
             dispatcher->wake(task, &task);
@@ -80,8 +80,9 @@ void BlackholeKVStore::dump(uint16_t, shared_ptr<Callback<GetValue> >)
 
 StorageProperties BlackholeKVStore::getStorageProperties()
 {
+    // Nothing is kept, so any number of flushers can write side by side.
     size_t concurrency(10);
-    StorageProperties rv(concurrency, concurrency - 1, 1, true, true,
+    StorageProperties rv(concurrency, concurrency - 1, concurrency, true, true,
                          true, false);
     return rv;
 }
@@ -0,0 +1,135 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef BLOOMFILTER_HH
+#define BLOOMFILTER_HH 1
+
+#include "config.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common.hh"
+#include "locks.hh"
+
+/**
+ * A Bloom filter over the keys a vbucket has on disk.
+ *
+ * Keys are only ever added.  The flusher can't tell whether a write
+ * created a document or replaced one, so the counters of a counting
+ * filter could never be kept balanced, and removing a key that was
+ * counted once too few would make the filter lie about another one.
+ * A deleted key remains a false positive until warmup rebuilds the
+ * filter.
+ *
+ * Keys are given by their 64 bit hash, which is split in two for
+ * double hashing, so callers can reuse the hash they looked the key
+ * up in the hash table with.
+ */
+class BloomFilter {
+public:
+
+    /**
+     * Create a filter.
+     *
+     * @param keyCount the number of keys to size the filter for
+     * @param fpProb the false positive probability wanted once it
+     *        holds keyCount keys
+     */
+    BloomFilter(size_t keyCount, double fpProb) :
+        numBits(0), numHashes(0), bits(NULL), bitsSet(0) {
+        double n = static_cast<double>(keyCount > 0 ? keyCount : 1);
+        double ln2 = log(2.0);
+        double m = ceil(-n * log(fpProb) / (ln2 * ln2));
+        numBits = static_cast<size_t>(m) | 1;
+        numHashes = static_cast<size_t>(floor(m / n * ln2 + 0.5));
+        if (numHashes == 0) {
+            numHashes = 1;
+        }
+        bits = new uint8_t[(numBits + 7) / 8];
+        memset(bits, 0, (numBits + 7) / 8);
+    }
+
+    ~BloomFilter() {
+        delete []bits;
+    }
+
+    /**
+     * Add the key with the given hash to the filter.
+     */
+    void addKey(uint64_t h) {
+        LockHolder lh(mutex);
+        for (size_t i = 0; i < numHashes; ++i) {
+            size_t b = bit(h, i);
+            uint8_t mask = static_cast<uint8_t>(1 << (b & 7));
+            if ((bits[b >> 3] & mask) == 0) {
+                bits[b >> 3] |= mask;
+                ++bitsSet;
+            }
+        }
+    }
+
+    /**
+     * Check whether the key with the given hash may have been added.
+     *
+     * This doesn't take the lock.  Bits are only ever set, so a racing
+     * add can at worst be missed, and callers that need to see an add
+     * are ordered after it by the hash table bucket lock.
+     *
+     * @return false if the key was definitely never added
+     */
+    bool maybeKeyExists(uint64_t h) const {
+        for (size_t i = 0; i < numHashes; ++i) {
+            size_t b = bit(h, i);
+            if ((bits[b >> 3] & (1 << (b & 7))) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Estimate the current false positive probability from the
+     * fraction of bits that are set.
+     */
+    double getFalsePositiveProb() const {
+        double fill = static_cast<double>(bitsSet) / static_cast<double>(numBits);
+        return pow(fill, static_cast<double>(numHashes));
+    }
+
+    size_t getNumBits() const {
+        return numBits;
+    }
+
+    size_t getNumHashes() const {
+        return numHashes;
+    }
+
+    size_t getNumBitsSet() const {
+        return bitsSet;
+    }
+
+    /**
+     * Get the number of bytes used by the filter.
+     */
+    size_t memorySize() const {
+        return sizeof(BloomFilter) + (numBits + 7) / 8;
+    }
+
+private:
+
+    size_t bit(uint64_t h, size_t i) const {
+        uint64_t h1 = h & 0xffffffff;
+        uint64_t h2 = (h >> 32) | 1;
+        return static_cast<size_t>((h1 + i * h2) % numBits);
+    }
+
+    size_t   numBits;
+    size_t   numHashes;
+    uint8_t *bits;
+    size_t   bitsSet;
+    Mutex    mutex;
+
+    DISALLOW_COPY_AND_ASSIGN(BloomFilter);
+};
+
+#endif /* BLOOMFILTER_HH */
@@ -1,5 +1,10 @@
 /* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 #include "config.h"
+#include <fcntl.h>
+#include <limits>
+#include <stdlib.h>
+#include <unistd.h>
+
 #include "vbucket.hh"
 #include "checkpoint.hh"
 #include "ep_engine.h"
@@ -40,6 +45,187 @@ private:
 #include "statwriter.hh"
 #undef STATWRITER_NAMESPACE
 
+CheckpointSpillFile *CheckpointSpillFile::create(const std::string &path, EPStats &st) {
+    std::string name = path + ".XXXXXX";
+    std::vector<char> buf(name.begin(), name.end());
+    buf.push_back('\0');
+    int fd = mkstemp(&buf[0]);
+    if (fd < 0) {
+        getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                         "Failed to create a checkpoint spill file from %s: %s\n",
+                         path.c_str(), strerror(errno));
+        return NULL;
+    }
+    unlink(&buf[0]);
+    return new CheckpointSpillFile(fd, st);
+}
+
+CheckpointSpillFile::~CheckpointSpillFile() {
+    close(fd);
+    stats.chkSpilledBytes.decr(size);
+}
+
+bool CheckpointSpillFile::append(const std::string &data, uint64_t &offset) {
+    ssize_t nw = pwrite(fd, data.data(), data.size(), size);
+    if (nw != static_cast<ssize_t>(data.size())) {
+        getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                         "Failed to write %ld bytes to a checkpoint spill file: %s\n",
+                         data.size(), nw < 0 ? strerror(errno) : "short write");
+        return false;
+    }
+    offset = size;
+    size += data.size();
+    stats.chkSpilledBytes.incr(data.size());
+    return true;
+}
+
+bool CheckpointSpillFile::read(uint64_t offset, size_t length, std::string &data) {
+    data.resize(length);
+    ssize_t nr = pread(fd, &data[0], length, offset);
+    return nr == static_cast<ssize_t>(length);
+}
+
+/**
+ * The fixed part of a spilled item slot; the key follows it.  An empty slot
+ * is spilled as a header with present set to zero and nothing after it.
+ */
+struct spilled_item {
+    uint64_t keyHash;
+    int64_t  rowId;
+    uint64_t seqNum;
+    uint32_t queued;
+    uint16_t op;
+    uint16_t vbucket;
+    uint16_t keylen;
+    uint16_t present;
+};
+
+static size_t encodeChunk(const queued_item *items, std::string &data) {
+    size_t numItems = 0;
+    for (size_t i = 0; i < CHECKPOINT_CHUNK_SIZE; ++i) {
+        spilled_item hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        const queued_item &qi = items[i];
+        if (qi) {
+            hdr.keyHash = qi->getKeyHash();
+            hdr.rowId = qi->getRowId();
+            hdr.seqNum = qi->getSeqno();
+            hdr.queued = qi->getQueuedTime();
+            hdr.op = static_cast<uint16_t>(qi->getOperation());
+            hdr.vbucket = qi->getVBucketId();
+            hdr.keylen = static_cast<uint16_t>(qi->getKeyLen());
+            hdr.present = 1;
+            data.append(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+            data.append(qi->getKeyBytes(), qi->getKeyLen());
+            ++numItems;
+        } else {
+            data.append(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+        }
+    }
+    return numItems;
+}
+
+static void decodeChunk(const std::string &data, queued_item *items) {
+    size_t offset = 0;
+    for (size_t i = 0; i < CHECKPOINT_CHUNK_SIZE; ++i) {
+        spilled_item hdr;
+        assert(offset + sizeof(hdr) <= data.size());
+        memcpy(&hdr, data.data() + offset, sizeof(hdr));
+        offset += sizeof(hdr);
+        if (!hdr.present) {
+            continue;
+        }
+        assert(offset + hdr.keylen <= data.size());
+        std::string key(data.data() + offset, hdr.keylen);
+        offset += hdr.keylen;
+        queued_item qi(QueuedItem::New(key, hdr.vbucket,
+                                       static_cast<enum queue_operation>(hdr.op),
+                                       hdr.rowId, hdr.seqNum, hdr.keyHash));
+        qi->setQueuedTime(hdr.queued);
+        items[i] = qi;
+    }
+}
+
+/**
+ * Read a spilled chunk back and decode it.
+ * @return false if it couldn't be read
+ */
+static bool readChunk(CheckpointSpillFile &file, const spilled_chunk &where,
+                      queued_item *items) {
+    EPStats &stats = file.getStats();
+    hrtime_t start = gethrtime();
+    std::string data;
+    if (!file.read(where.offset, where.length, data)) {
+        getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                         "Failed to read a spilled checkpoint chunk back: %s\n",
+                         strerror(errno));
+        ++stats.chkSpillReadErrors;
+        return false;
+    }
+    decodeChunk(data, items);
+    ++stats.chkSpillReads;
+    stats.chkSpillReadHisto.add((gethrtime() - start) / 1000);
+    return true;
+}
+
+bool CheckpointItemList::hasItems(size_t c) const {
+    assert(chunks[c]);
+    for (size_t i = 0; i < CHECKPOINT_CHUNK_SIZE; ++i) {
+        if (chunks[c]->items[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t CheckpointItemList::encodeChunk(size_t c, std::string &data) const {
+    assert(chunks[c]);
+    return ::encodeChunk(chunks[c]->items, data);
+}
+
+void CheckpointItemList::releaseChunk(size_t c) {
+    assert(chunks[c] && isSpilled(c));
+    delete chunks[c];
+    chunks[c] = NULL;
+    --numResident;
+}
+
+void CheckpointItemList::releaseChunk(size_t c, const RCPtr<CheckpointSpillFile> &file,
+                                      const spilled_chunk &where) {
+    assert(!spillFile || spillFile.get() == file.get());
+    spillFile = file;
+    if (spilled.size() < chunks.size()) {
+        spilled.resize(chunks.size());
+    }
+    spilled[c] = where;
+    releaseChunk(c);
+}
+
+void CheckpointItemList::installChunk(size_t c, const std::vector<queued_item> &items) {
+    assert(items.size() == CHECKPOINT_CHUNK_SIZE);
+    if (chunks[c] != NULL) {
+        return;
+    }
+    Chunk *chunk = new Chunk;
+    std::copy(items.begin(), items.end(), chunk->items);
+    chunks[c] = chunk;
+    ++numResident;
+}
+
+CheckpointItemList::Chunk *CheckpointItemList::load(size_t c) {
+    assert(spillFile && isSpilled(c));
+    Chunk *chunk = new Chunk;
+    if (!readChunk(*spillFile, spilled[c], chunk->items)) {
+        // Put the chunk back without its items rather than take the process
+        // down.  The cursors that needed them are dropped by the next call
+        // to CheckpointManager::loadSpilledChunks().
+        readFailed = true;
+    }
+    chunks[c] = chunk;
+    ++numResident;
+    return chunk;
+}
+
 Checkpoint::~Checkpoint() {
     getLogger()->log(EXTENSION_LOG_INFO, NULL,
                      "Checkpoint %llu for vbucket %d is purged from memory.\n",
@@ -54,12 +240,26 @@ void Checkpoint::setState(checkpoint_state state) {
 
 void Checkpoint::popBackCheckpointEndItem() {
     if (toWrite.size() > 0 && toWrite.back()->getOperation() == queue_op_checkpoint_end) {
+        const queued_item &qi = toWrite.back();
+        index_entry *entry = findKey(*qi);
+        if (entry) {
+            keyIndex.erase(entry);
+        }
         toWrite.pop_back();
+        updateContainerOverhead();
     }
 }
 
 bool Checkpoint::keyExists(const std::string &key) {
-    return keyIndex.find(key) != keyIndex.end();
+    return findKey(key, hash64(key.data(), key.size())) != NULL;
+}
+
+bool Checkpoint::getKeyPosition(const std::string &key, uint64_t h, uint32_t &pos) {
+    index_entry *entry = findKey(key, h);
+    if (entry) {
+        pos = entry->position;
+    }
+    return entry != NULL;
 }
 
 queue_dirty_t Checkpoint::queueDirty(const queued_item &qi, CheckpointManager *checkpointManager) {
@@ -68,20 +268,20 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi, CheckpointManager *c
     uint64_t newMutationId = checkpointManager->nextMutationId();
     queue_dirty_t rv;
 
-    checkpoint_index::iterator it = keyIndex.find(qi->getKey());
+    index_entry *entry = findKey(*qi);
     // Check if this checkpoint already had an item for the same key.
-    if (it != keyIndex.end()) {
-        std::list<queued_item>::iterator currPos = it->second.position;
-        uint64_t currMutationId = it->second.mutation_id;
+    if (entry) {
+        CheckpointItemList::iterator currPos = toWrite.at(entry->position);
+        uint64_t currMutationId = entry->mutation_id;
         CheckpointCursor &pcursor = checkpointManager->persistenceCursor;
 
         if (*(pcursor.currentCheckpoint) == this) {
             // If the existing item is in the left-hand side of the item pointed by the
             // persistence cursor, decrease the persistence cursor's offset by 1.
-            const std::string &key = (*(pcursor.currentPos))->getKey();
-            checkpoint_index::iterator ita = keyIndex.find(key);
-            if (ita != keyIndex.end()) {
-                uint64_t mutationId = ita->second.mutation_id;
+            const queued_item &cur = *(pcursor.currentPos);
+            index_entry *ita = findKey(*cur);
+            if (ita) {
+                uint64_t mutationId = ita->mutation_id;
                 if (currMutationId <= mutationId) {
                     checkpointManager->decrCursorOffset_UNLOCKED(pcursor, 1);
                 }
@@ -98,10 +298,10 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi, CheckpointManager *c
              map_it != checkpointManager->tapCursors.end(); map_it++) {
 
             if (*(map_it->second.currentCheckpoint) == this) {
-                const std::string &key = (*(map_it->second.currentPos))->getKey();
-                checkpoint_index::iterator ita = keyIndex.find(key);
-                if (ita != keyIndex.end()) {
-                    uint64_t mutationId = ita->second.mutation_id;
+                const queued_item &cur = *(map_it->second.currentPos);
+                index_entry *ita = findKey(*cur);
+                if (ita) {
+                    uint64_t mutationId = ita->mutation_id;
                     if (currMutationId <= mutationId) {
                         checkpointManager->decrCursorOffset_UNLOCKED(map_it->second, 1);
                     }
@@ -113,12 +313,12 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi, CheckpointManager *c
             }
         }
 
-        queued_item &existing_itm = *currPos;
+        queued_item existing_itm = *currPos;
         existing_itm->setOperation(qi->getOperation());
         existing_itm->setQueuedTime(qi->getQueuedTime());
-        toWrite.push_back(existing_itm);
-        // Remove the existing item for the same key from the list.
+        // Leave a tombstone where the existing item for the same key was.
         toWrite.erase(currPos);
+        toWrite.push_back(existing_itm);
         rv = EXISTING_ITEM;
     } else {
         if (qi->getOperation() == queue_op_set || qi->getOperation() == queue_op_del) {
@@ -129,60 +329,222 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi, CheckpointManager *c
         toWrite.push_back(qi);
     }
 
-    if (qi->getKey().size() > 0) {
-        std::list<queued_item>::iterator last = toWrite.end();
+    if (qi->getKeyLen() > 0) {
+        CheckpointItemList::iterator last = toWrite.end();
         // --last is okay as the list is not empty now.
-        index_entry entry = {--last, newMutationId};
+        uint32_t position = (--last).position();
         // Set the index of the key to the new item that is pushed back into the list.
-        keyIndex[qi->getKey()] = entry;
-        if (rv == NEW_ITEM) {
-            size_t newEntrySize = qi->getKey().size() + sizeof(index_entry) + sizeof(queued_item);
-            memOverhead += newEntrySize;
-            stats.memOverhead.incr(newEntrySize);
-            assert(stats.memOverhead.get() < GIGANTOR);
+        if (entry) {
+            entry->position = position;
+            entry->mutation_id = newMutationId;
+        } else {
+            keyIndex.insert(qi->getKeyHash(), position, newMutationId);
         }
     }
+    updateContainerOverhead();
+
+    // Squeeze the tombstones out once they outnumber the items, so that a few
+    // hot keys can't grow the list without bound.
+    size_t tombstones = toWrite.getNumTombstones();
+    if (tombstones >= CHECKPOINT_CHUNK_SIZE && tombstones > toWrite.size()) {
+        std::vector<std::pair<queued_item, uint64_t> > noInserts;
+        rebuild(checkpointManager, noInserts);
+    }
     return rv;
 }
 
-size_t Checkpoint::mergePrevCheckpoint(Checkpoint *pPrevCheckpoint) {
+void Checkpoint::rebuild(CheckpointManager *checkpointManager,
+                         const std::vector<std::pair<queued_item, uint64_t> > &inserts) {
+    // Find the cursors walking through this checkpoint.
+    std::vector<CheckpointCursor*> walkers;
+    CheckpointCursor &pcursor = checkpointManager->persistenceCursor;
+    if (*(pcursor.currentCheckpoint) == this) {
+        walkers.push_back(&pcursor);
+    }
+    std::map<const std::string, CheckpointCursor>::iterator map_it;
+    for (map_it = checkpointManager->tapCursors.begin();
+         map_it != checkpointManager->tapCursors.end(); ++map_it) {
+        if (*(map_it->second.currentCheckpoint) == this) {
+            walkers.push_back(&(map_it->second));
+        }
+    }
+
+    CheckpointItemList items;
+    std::vector<std::pair<index_entry*, uint32_t> > entries;
+    std::vector<std::pair<CheckpointCursor*, uint32_t> > moved;
+    std::vector<uint32_t> inserted;
+    std::vector<std::pair<queued_item, uint64_t> >::const_iterator iit;
+    size_t n = 0;
+    CheckpointItemList::iterator it = toWrite.begin();
+    for (; it != toWrite.end(); ++it, ++n) {
+        if (n == 2) {
+            // Skip the first two meta items
+            for (iit = inserts.begin(); iit != inserts.end(); ++iit) {
+                items.push_back(iit->first);
+                inserted.push_back((--items.end()).position());
+            }
+        }
+        items.push_back(*it);
+        uint32_t pos = (--items.end()).position();
+        std::vector<CheckpointCursor*>::iterator wit = walkers.begin();
+        for (; wit != walkers.end(); ++wit) {
+            if ((*wit)->currentPos == it) {
+                moved.push_back(std::make_pair(*wit, pos));
+            }
+        }
+        if ((*it)->getKeyLen() > 0) {
+            index_entry *entry = findKey(**it);
+            if (entry) {
+                entries.push_back(std::make_pair(entry, pos));
+            }
+        }
+    }
+    if (n <= 2) {
+        for (iit = inserts.begin(); iit != inserts.end(); ++iit) {
+            items.push_back(iit->first);
+            inserted.push_back((--items.end()).position());
+        }
+    }
+    assert(moved.size() == walkers.size());
+
+    if (toWrite.hasReadFailed()) {
+        // The items of a chunk that couldn't be read back are missing from
+        // the copy as well.
+        items.setReadFailed();
+    }
+    toWrite.swap(items);
+
+    std::vector<std::pair<index_entry*, uint32_t> >::iterator eit = entries.begin();
+    for (; eit != entries.end(); ++eit) {
+        eit->first->position = eit->second;
+    }
+    std::vector<std::pair<CheckpointCursor*, uint32_t> >::iterator mit = moved.begin();
+    for (; mit != moved.end(); ++mit) {
+        mit->first->currentPos = toWrite.at(mit->second);
+    }
+    for (size_t i = 0; i < inserts.size(); ++i) {
+        keyIndex.insert(inserts[i].first->getKeyHash(), inserted[i], inserts[i].second);
+    }
+    updateContainerOverhead();
+}
+
+void Checkpoint::updateContainerOverhead() {
+    size_t newSize = containerSize();
+    if (newSize > containerOverhead) {
+        memOverhead += newSize - containerOverhead;
+        stats.memOverhead.incr(newSize - containerOverhead);
+    } else if (newSize < containerOverhead) {
+        memOverhead -= containerOverhead - newSize;
+        stats.memOverhead.decr(containerOverhead - newSize);
+    }
+    containerOverhead = newSize;
+    assert(stats.memOverhead.get() < GIGANTOR);
+}
+
+size_t Checkpoint::prepareSpill(const std::set<size_t> &pinned,
+                                std::vector<spill_io> &writes) {
+    assert(checkpointState == closed);
+    size_t numReleased = 0;
+    for (size_t c = 0; c < toWrite.getNumChunks(); ++c) {
+        if (!toWrite.isResident(c * CHECKPOINT_CHUNK_SIZE) || pinned.count(c) > 0) {
+            continue;
+        }
+        if (toWrite.isSpilled(c)) {
+            // Read back since the last spill, closed checkpoints don't change.
+            toWrite.releaseChunk(c);
+            ++numReleased;
+            continue;
+        }
+        spill_io write;
+        write.checkpointId = checkpointId;
+        write.generation = toWrite.getGeneration();
+        write.chunk = c;
+        write.file = toWrite.getSpillFile();
+        write.numItems = toWrite.encodeChunk(c, write.data);
+        writes.push_back(write);
+    }
+    updateContainerOverhead();
+    return numReleased;
+}
+
+bool Checkpoint::completeSpill(const spill_io &write, const std::set<size_t> &pinned) {
+    if (write.generation != toWrite.getGeneration() ||
+        !toWrite.isResident(write.chunk * CHECKPOINT_CHUNK_SIZE) ||
+        pinned.count(write.chunk) > 0) {
+        return false;
+    }
+    toWrite.releaseChunk(write.chunk, write.file, write.where);
+    stats.chkSpilledItems.incr(write.numItems);
+    updateContainerOverhead();
+    return true;
+}
+
+bool Checkpoint::prepareLoad(size_t c, spill_io &read) {
+    if (!toWrite.getSpilledChunk(c, read.where)) {
+        return false;
+    }
+    read.checkpointId = checkpointId;
+    read.generation = toWrite.getGeneration();
+    read.chunk = c;
+    read.file = toWrite.getSpillFile();
+    return true;
+}
+
+void Checkpoint::completeLoad(const spill_io &read, const std::vector<queued_item> &items) {
+    if (read.generation != toWrite.getGeneration()) {
+        return;
+    }
+    if (items.empty()) {
+        toWrite.setReadFailed();
+        return;
+    }
+    toWrite.installChunk(read.chunk, items);
+    updateContainerOverhead();
+}
+
+size_t Checkpoint::mergePrevCheckpoint(Checkpoint *pPrevCheckpoint,
+                                       CheckpointManager *checkpointManager) {
     size_t numNewItems = 0;
-    size_t newEntryMemOverhead = 0;
-    std::list<queued_item>::reverse_iterator rit = pPrevCheckpoint->rbegin();
+    std::vector<std::pair<queued_item, uint64_t> > inserts;
+    CheckpointItemList::iterator it = pPrevCheckpoint->begin();
 
     getLogger()->log(EXTENSION_LOG_INFO, NULL,
                      "Collapse the checkpoint %llu into the checkpoint %llu for vbucket %d.\n",
                      pPrevCheckpoint->getId(), checkpointId, vbucketId);
 
-    for (; rit != pPrevCheckpoint->rend(); ++rit) {
-        const std::string &key = (*rit)->getKey();
-        if (key.size() == 0) {
+    for (; it != pPrevCheckpoint->end(); ++it) {
+        const QueuedItem &qi = **it;
+        if (qi.getKeyLen() == 0) {
             continue;
         }
-        checkpoint_index::iterator it = keyIndex.find(key);
-        if (it == keyIndex.end()) {
-            std::list<queued_item>::iterator pos = toWrite.begin();
-            // Skip the first two meta items
-            ++pos; ++pos;
-            toWrite.insert(pos, *rit);
-            index_entry entry = {--pos, pPrevCheckpoint->getMutationIdForKey(key)};
-            keyIndex[key] = entry;
-            newEntryMemOverhead += key.size() + sizeof(index_entry);
+        if (findKey(qi) == NULL) {
+            inserts.push_back(std::make_pair(*it,
+                              pPrevCheckpoint->getMutationIdForKey(qi.getKeyBytes(),
+                                                                   qi.getKeyLen(),
+                                                                   qi.getKeyHash())));
             ++numItems;
             ++numNewItems;
         }
     }
-    memOverhead += newEntryMemOverhead;
-    stats.memOverhead.incr(newEntryMemOverhead);
-    assert(stats.memOverhead.get() < GIGANTOR);
+    if (numNewItems > 0) {
+        rebuild(checkpointManager, inserts);
+    }
+    if (pPrevCheckpoint->hasReadFailed()) {
+        toWrite.setReadFailed();
+    }
     return numNewItems;
 }
 
-uint64_t Checkpoint::getMutationIdForKey(const std::string &key) {
+uint64_t Checkpoint::getMutationIdForKey(const char *key, size_t nkey, uint64_t h,
+                                         bool load) {
     uint64_t mid = 0;
-    checkpoint_index::iterator it = keyIndex.find(key);
-    if (it != keyIndex.end()) {
-        mid = it->second.mutation_id;
+    index_entry *entry = keyIndex.find(key, nkey, h, toWrite, load);
+    if (entry) {
+        mid = entry->mutation_id;
+        if (!toWrite.isResident(entry->position)) {
+            // The key wasn't compared, so it may be newer than any mutation.
+            mid = std::numeric_limits<uint64_t>::max();
+        }
     }
     return mid;
 }
@@ -207,6 +569,7 @@ uint64_t CheckpointManager::getOpenCheckpointId_UNLOCKED() {
 
 uint64_t CheckpointManager::getOpenCheckpointId() {
     LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
     return getOpenCheckpointId_UNLOCKED();
 }
 
@@ -220,6 +583,7 @@ uint64_t CheckpointManager::getLastClosedCheckpointId_UNLOCKED() {
 
 uint64_t CheckpointManager::getLastClosedCheckpointId() {
     LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
     return getLastClosedCheckpointId_UNLOCKED();
 }
 
@@ -231,7 +595,7 @@ void CheckpointManager::setOpenCheckpointId_UNLOCKED(uint64_t id) {
         checkpointList.back()->setId(id);
         // Update the checkpoint_start item with the new Id.
         queued_item qi = createCheckpointItem(id, vbucketId, queue_op_checkpoint_start);
-        std::list<queued_item>::iterator it = ++(checkpointList.back()->begin());
+        CheckpointItemList::iterator it = ++(checkpointList.back()->begin());
         *it = qi;
     }
 }
@@ -251,7 +615,7 @@ bool CheckpointManager::addNewCheckpoint_UNLOCKED(uint64_t id) {
     // Add a dummy item into the new checkpoint, so that any cursor referring to the actual first
     // item in this new checkpoint can be safely shifted left by 1 if the first item is removed
     // and pushed into the tail.
-    queued_item dummyItem(new QueuedItem("dummy_key", 0xffff, queue_op_empty));
+    queued_item dummyItem(QueuedItem::New("dummy_key", 0xffff, queue_op_empty));
     checkpoint->queueDirty(dummyItem, this);
 
     // This item represents the start of the new checkpoint and is also sent to the slave node.
@@ -318,6 +682,7 @@ bool CheckpointManager::closeOpenCheckpoint_UNLOCKED(uint64_t id) {
 
 bool CheckpointManager::closeOpenCheckpoint(uint64_t id) {
     LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
     return closeOpenCheckpoint_UNLOCKED(id);
 }
 
@@ -332,6 +697,7 @@ void CheckpointManager::registerPersistenceCursor() {
 bool CheckpointManager::registerTAPCursor(const std::string &name, uint64_t checkpointId,
                                           bool closedCheckpointOnly, bool alwaysFromBeginning) {
     LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
     return registerTAPCursor_UNLOCKED(name,
                                       checkpointId,
                                       closedCheckpointOnly,
@@ -352,6 +718,12 @@ bool CheckpointManager::registerTAPCursor_UNLOCKED(const std::string &name,
             break;
         }
     }
+    // Starting in front of spilled items that couldn't be read back would
+    // skip them, so that takes a backfill like a checkpoint that's gone.
+    std::list<Checkpoint*>::iterator fit = it;
+    for (; found && fit != checkpointList.end(); ++fit) {
+        found = !(*fit)->hasReadFailed();
+    }
 
     getLogger()->log(EXTENSION_LOG_INFO, NULL,
                      "Register the tap cursor with the name \"%s\" for vbucket %d.\n",
@@ -383,7 +755,7 @@ bool CheckpointManager::registerTAPCursor_UNLOCKED(const std::string &name,
         (*it)->registerCursorName(name);
     } else {
         size_t offset = 0;
-        std::list<queued_item>::iterator curr;
+        CheckpointItemList::iterator curr;
 
         getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
                          "Checkpoint %llu for vbucket %d exists in memory. "
@@ -443,6 +815,7 @@ bool CheckpointManager::removeTAPCursor(const std::string &name) {
 
 uint64_t CheckpointManager::getCheckpointIdForTAPCursor(const std::string &name) {
     LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
     std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.find(name);
     if (it == tapCursors.end()) {
         return 0;
@@ -456,8 +829,36 @@ size_t CheckpointManager::getNumOfTAPCursors() {
     return tapCursors.size();
 }
 
+bool CheckpointManager::isTAPCursorPastKey(const std::string &name,
+                                           const std::string &key) {
+    LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
+    std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.find(name);
+    if (it == tapCursors.end()) {
+        return false;
+    }
+
+    uint64_t h = hash64(key.data(), key.size());
+    uint32_t pos = 0;
+    std::list<Checkpoint*>::reverse_iterator rit = checkpointList.rbegin();
+    for (; rit != checkpointList.rend(); ++rit) {
+        if ((*rit)->getKeyPosition(key, h, pos)) {
+            break;
+        }
+    }
+    if (rit == checkpointList.rend()) {
+        return true;
+    }
+
+    uint64_t chkId = (*rit)->getId();
+    uint64_t cursorChkId = (*(it->second.currentCheckpoint))->getId();
+    return cursorChkId > chkId ||
+        (cursorChkId == chkId && it->second.currentPos.position() >= pos);
+}
+
 size_t CheckpointManager::getNumCheckpoints() {
     LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
     return checkpointList.size();
 }
 
@@ -496,6 +897,7 @@ size_t CheckpointManager::removeClosedUnrefCheckpoints(const RCPtr<VBucket> &vbu
 
     // This function is executed periodically by the non-IO dispatcher.
     LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
     assert(vbucket);
     uint64_t oldCheckpointId = 0;
     bool canCreateNewCheckpoint = false;
@@ -597,6 +999,235 @@ size_t CheckpointManager::removeClosedUnrefCheckpoints(const RCPtr<VBucket> &vbu
     return numUnrefItems;
 }
 
+void CheckpointManager::getPinnedChunks_UNLOCKED(std::list<Checkpoint*>::iterator it,
+                                                 std::set<size_t> &pinned) {
+    std::map<const std::string, CheckpointCursor>::iterator mit = tapCursors.begin();
+    for (; mit != tapCursors.end(); ++mit) {
+        if (mit->second.currentCheckpoint == it) {
+            size_t c = mit->second.currentPos.position() / CHECKPOINT_CHUNK_SIZE;
+            for (size_t i = 0; i <= CHECKPOINT_LOAD_AHEAD; ++i) {
+                pinned.insert(c + i);
+            }
+        }
+    }
+}
+
+std::list<Checkpoint*>::iterator
+CheckpointManager::findSpillableCheckpoint_UNLOCKED(uint64_t id) {
+    std::list<Checkpoint*>::iterator it = checkpointList.begin();
+    for (; it != persistenceCursor.currentCheckpoint; ++it) {
+        if ((*it)->getId() == id) {
+            return (*it)->getState() == closed ? it : persistenceCursor.currentCheckpoint;
+        }
+    }
+    return it;
+}
+
+size_t CheckpointManager::spillClosedCheckpoints() {
+    if (!checkpointConfig.canSpillClosedCheckpoints()) {
+        return 0;
+    }
+    LockHolder slh(spillLock);
+    size_t numReleased = 0;
+    std::vector<spill_io> writes;
+    LockHolder lh(queueLock);
+    bool memoryLow = stats.getTotalMemoryUsed() < stats.mem_low_wat;
+    std::list<Checkpoint*>::iterator it = checkpointList.begin();
+    for (; it != persistenceCursor.currentCheckpoint; ++it) {
+        if (memoryLow) {
+            // Account for the chunks the TAP cursors read back since the last pass.
+            (*it)->updateSpilledOverhead();
+            continue;
+        }
+        std::set<size_t> pinned;
+        getPinnedChunks_UNLOCKED(it, pinned);
+        numReleased += (*it)->prepareSpill(pinned, writes);
+    }
+    std::string path = checkpointConfig.getSpillPath();
+    lh.unlock();
+
+    // Write the chunks out, creating the files of checkpoints that don't
+    // have one yet.
+    std::map<uint64_t, RCPtr<CheckpointSpillFile> > newFiles;
+    size_t numWritten = 0;
+    std::vector<spill_io>::iterator wit = writes.begin();
+    for (; wit != writes.end(); ++wit, ++numWritten) {
+        if (!wit->file) {
+            RCPtr<CheckpointSpillFile> &file = newFiles[wit->checkpointId];
+            if (!file) {
+                file.reset(CheckpointSpillFile::create(path, stats));
+                if (!file) {
+                    break;
+                }
+            }
+            wit->file = file;
+        }
+        if (!wit->file->append(wit->data, wit->where.offset)) {
+            break;
+        }
+        wit->where.length = static_cast<uint32_t>(wit->data.size());
+    }
+
+    // Release the chunks that were written, unless they changed or a TAP
+    // cursor got close to them in the meantime.  Those are written again on
+    // the next pass if they still need to be.
+    lh.lock();
+    for (size_t i = 0; i < numWritten; ++i) {
+        it = findSpillableCheckpoint_UNLOCKED(writes[i].checkpointId);
+        if (it == persistenceCursor.currentCheckpoint) {
+            continue;
+        }
+        std::set<size_t> pinned;
+        getPinnedChunks_UNLOCKED(it, pinned);
+        if ((*it)->completeSpill(writes[i], pinned)) {
+            ++numReleased;
+        }
+    }
+    lh.unlock();
+
+    if (numReleased > 0) {
+        getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
+                         "Spilled %ld chunks of closed checkpoints for vbucket %d.\n",
+                         numReleased, vbucketId);
+    }
+    return numReleased;
+}
+
+void CheckpointManager::requestChunkLoad_UNLOCKED() {
+    SpilledChunkLoadListener *listener = checkpointConfig.getSpilledChunkLoadListener();
+    if (listener && !chunkLoadRequested) {
+        chunkLoadRequested = true;
+        listener->chunkLoadNeeded(vbucketId);
+    }
+}
+
+bool CheckpointManager::isTAPCursorLoaded_UNLOCKED(std::list<Checkpoint*>::iterator chk,
+                                                   size_t pos) {
+    if (!checkpointConfig.getSpilledChunkLoadListener()) {
+        // Nothing to read chunks back ahead of the cursor, it does it itself.
+        return true;
+    }
+    // The next item, and the one after it that isLastMutationItemInCheckpoint
+    // looks at, may be past tombstones or in the next checkpoint.
+    size_t needed = 2;
+    size_t n = pos + 1;
+    std::list<Checkpoint*>::iterator it = chk;
+    for (; it != checkpointList.end() && needed > 0; ++it, n = 0) {
+        Checkpoint *checkpoint = *it;
+        if (checkpoint->getState() == opened) {
+            // Open checkpoints are never spilled.
+            break;
+        }
+        if (checkpoint->hasReadFailed()) {
+            requestChunkLoad_UNLOCKED();
+            return false;
+        }
+        for (; n < checkpoint->getNumSlots() && needed > 0; ++n) {
+            if (!checkpoint->isResident(n)) {
+                requestChunkLoad_UNLOCKED();
+                return false;
+            }
+            if (checkpoint->isLive(n)) {
+                --needed;
+            }
+        }
+    }
+
+    // Have the chunks after those read back before the cursor gets there.
+    Checkpoint *checkpoint = *chk;
+    if (checkpoint->getState() == closed) {
+        size_t c = pos / CHECKPOINT_CHUNK_SIZE;
+        size_t last = std::min(c + CHECKPOINT_LOAD_AHEAD, checkpoint->getNumChunks() - 1);
+        for (; c <= last; ++c) {
+            if (!checkpoint->isResident(c * CHECKPOINT_CHUNK_SIZE)) {
+                requestChunkLoad_UNLOCKED();
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+size_t CheckpointManager::loadSpilledChunks(std::vector<std::string> &failed) {
+    std::vector<spill_io> reads;
+    LockHolder lh(queueLock);
+    chunkLoadRequested = false;
+    std::set<std::pair<uint64_t, size_t> > taken;
+    std::map<const std::string, CheckpointCursor>::iterator mit = tapCursors.begin();
+    for (; mit != tapCursors.end(); ++mit) {
+        // Take the spilled chunks among the next few that hold items, or may
+        // hold them, counting from the cursor's.
+        CheckpointCursor &cursor = mit->second;
+        size_t c = cursor.currentPos.position() / CHECKPOINT_CHUNK_SIZE;
+        size_t chunksLeft = CHECKPOINT_LOAD_AHEAD + 1;
+        std::list<Checkpoint*>::iterator it = cursor.currentCheckpoint;
+        for (; it != checkpointList.end() && chunksLeft > 0; ++it, c = 0) {
+            Checkpoint *checkpoint = *it;
+            if (checkpoint->getState() == opened) {
+                break;
+            }
+            for (; c < checkpoint->getNumChunks() && chunksLeft > 0; ++c) {
+                spill_io read;
+                if (checkpoint->prepareLoad(c, read)) {
+                    if (taken.insert(std::make_pair(read.checkpointId, c)).second) {
+                        reads.push_back(read);
+                    }
+                    --chunksLeft;
+                } else if (checkpoint->hasItems(c)) {
+                    --chunksLeft;
+                }
+            }
+        }
+    }
+    lh.unlock();
+
+    std::vector<std::vector<queued_item> > loaded(reads.size());
+    for (size_t i = 0; i < reads.size(); ++i) {
+        std::vector<queued_item> &items = loaded[i];
+        items.resize(CHECKPOINT_CHUNK_SIZE);
+        if (!readChunk(*reads[i].file, reads[i].where, &items[0])) {
+            items.clear();
+        }
+    }
+
+    lh.lock();
+    for (size_t i = 0; i < reads.size(); ++i) {
+        std::list<Checkpoint*>::iterator it = checkpointList.begin();
+        for (; it != checkpointList.end(); ++it) {
+            if ((*it)->getId() == reads[i].checkpointId) {
+                (*it)->completeLoad(reads[i], loaded[i]);
+                break;
+            }
+        }
+    }
+
+    // A cursor that would walk through a checkpoint with missing items has
+    // to start over, its TAP connection has to be backfilled.
+    mit = tapCursors.begin();
+    while (mit != tapCursors.end()) {
+        bool broken = false;
+        std::list<Checkpoint*>::iterator it = mit->second.currentCheckpoint;
+        for (; it != checkpointList.end(); ++it) {
+            if ((*it)->hasReadFailed()) {
+                broken = true;
+                break;
+            }
+        }
+        if (!broken) {
+            ++mit;
+            continue;
+        }
+        getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                         "Remove the tap cursor \"%s\" from vbucket %d, "
+                         "spilled checkpoint items it needs couldn't be read back.\n",
+                         mit->first.c_str(), vbucketId);
+        (*(mit->second.currentCheckpoint))->removeCursorName(mit->first);
+        failed.push_back(mit->first);
+        tapCursors.erase(mit++);
+    }
+    return reads.size();
+}
+
 void CheckpointManager::removeInvalidCursorsOnCheckpoint(Checkpoint *pCheckpoint) {
     std::list<std::string> invalidCursorNames;
     const std::set<std::string> &cursors = pCheckpoint->getCursorNameList();
@@ -635,7 +1266,7 @@ void CheckpointManager::collapseClosedCheckpoints(std::list<Checkpoint*> &collap
         ++rit; ++rit;// Move to the second lastest closed checkpoint.
         size_t numDuplicatedItems = 0, numMetaItems = 0;
         for (; rit != checkpointList.rend(); ++rit) {
-            size_t numAddedItems = (*lastClosedChk)->mergePrevCheckpoint(*rit);
+            size_t numAddedItems = (*lastClosedChk)->mergePrevCheckpoint(*rit, this);
             numDuplicatedItems += ((*rit)->getNumItems() - numAddedItems);
             numMetaItems += 2; // checkpoint start and end meta items
             slowCursors.insert((*rit)->getCursorNameList().begin(),
@@ -683,7 +1314,71 @@ void CheckpointManager::collapseClosedCheckpoints(std::list<Checkpoint*> &collap
 }
 
 bool CheckpointManager::queueDirty(const queued_item &qi, const RCPtr<VBucket> &vbucket) {
+    assert(vbucket);
+    bool isAppender = appending.cas(false, true);
+    if (!isAppender) {
+        // Someone else is appending to the checkpoint, so leave the item for
+        // them rather than queueing up behind them for the lock, unless they
+        // have fallen too far behind already.
+        SpinLockHolder slh(&stagingLock);
+        if (staged.size() < MAX_STAGED_ITEMS) {
+            staged.push_back(qi);
+            stagedVBucket = vbucket.get();
+            numStaged.set(staged.size());
+            slh.unlock();
+            oldestQueuedForPersistence.cas(NOTHING_QUEUED, qi->getQueuedTime());
+            return true;
+        }
+    }
+
     LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
+    bool rv = queueDirty_UNLOCKED(qi, vbucket);
+    if (rv) {
+        oldestQueuedForPersistence.cas(NOTHING_QUEUED, qi->getQueuedTime());
+    }
+    if (isAppender) {
+        // Pick up what was staged while this item was appended.
+        mergeStagedItems_UNLOCKED();
+        appending.set(false);
+    }
+    return rv;
+}
+
+void CheckpointManager::mergeStagedItems_UNLOCKED() {
+    if (numStaged.get() == 0) {
+        return;
+    }
+    RCPtr<VBucket> vbucket;
+    {
+        SpinLockHolder slh(&stagingLock);
+        stagedBatch.swap(staged);
+        vbucket.reset(stagedVBucket);
+        numStaged.set(0);
+    }
+
+    // The staged items were all counted as new ones for persistence, so
+    // take back the ones that weren't.
+    size_t numDups = 0, dupBytes = 0;
+    uint64_t dupQueuedTimes = 0;
+    std::vector<queued_item>::iterator it = stagedBatch.begin();
+    for (; it != stagedBatch.end(); ++it) {
+        if (!queueDirty_UNLOCKED(*it, vbucket)) {
+            ++numDups;
+            dupQueuedTimes += (*it)->getQueuedTime();
+            dupBytes += (*it)->size();
+        }
+    }
+    if (numDups > 0) {
+        vbucket->doStatsForFlushing(numDups, dupQueuedTimes, dupBytes);
+        stats.totalEnqueued.decr(numDups);
+    }
+    stats.chkStagedItems.incr(stagedBatch.size());
+    stagedBatch.clear();
+}
+
+bool CheckpointManager::queueDirty_UNLOCKED(const queued_item &qi,
+                                            const RCPtr<VBucket> &vbucket) {
     if (vbucket->getState() != vbucket_state_active &&
         checkpointList.back()->getState() == closed) {
         // Replica vbucket might receive items from the master even if the current open checkpoint
@@ -692,7 +1387,6 @@ bool CheckpointManager::queueDirty(const queued_item &qi, const RCPtr<VBucket> &
         return false;
     }
 
-    assert(vbucket);
     bool canCreateNewCheckpoint = false;
     if (checkpointList.size() < checkpointConfig.getMaxCheckpoints() ||
         (checkpointList.size() == checkpointConfig.getMaxCheckpoints() &&
@@ -718,9 +1412,13 @@ bool CheckpointManager::queueDirty(const queued_item &qi, const RCPtr<VBucket> &
     return (numItemsAfter - numItemsBefore) > 0;
 }
 
-void CheckpointManager::getAllItemsFromCurrentPosition(CheckpointCursor &cursor,
-                                                       uint64_t barrier,
-                                                       std::vector<queued_item> &items) {
+bool CheckpointManager::getItemsFromCurrentPosition(CheckpointCursor &cursor,
+                                                    uint64_t barrier,
+                                                    std::vector<queued_item> &items,
+                                                    size_t maxItems,
+                                                    size_t maxBytes) {
+    size_t numGrabbed = 0;
+    size_t bytesGrabbed = 0;
     while (true) {
         if ( barrier > 0 )  {
             if ((*(cursor.currentCheckpoint))->getId() >= barrier) {
@@ -728,8 +1426,18 @@ void CheckpointManager::getAllItemsFromCurrentPosition(CheckpointCursor &cursor,
             }
         }
         while (++(cursor.currentPos) != (*(cursor.currentCheckpoint))->end()) {
-            items.push_back(*(cursor.currentPos));
+            if (numGrabbed > 0 && (numGrabbed >= maxItems || bytesGrabbed >= maxBytes)) {
+                // Leave the cursor right behind the last item grabbed.
+                --(cursor.currentPos);
+                (*(cursor.currentCheckpoint))->updateSpilledOverhead();
+                return true;
+            }
+            const queued_item &qi = *(cursor.currentPos);
+            items.push_back(qi);
+            ++numGrabbed;
+            bytesGrabbed += qi->size();
         }
+        (*(cursor.currentCheckpoint))->updateSpilledOverhead();
         if ((*(cursor.currentCheckpoint))->getState() == closed) {
             if (!moveCursorToNextCheckpoint(cursor)) {
                 --(cursor.currentPos);
@@ -741,23 +1449,83 @@ void CheckpointManager::getAllItemsFromCurrentPosition(CheckpointCursor &cursor,
             break;
         }
     }
+    return false;
+}
+
+bool CheckpointManager::getOldestQueuedTimeForPersistence(rel_time_t &queued) {
+    rel_time_t oldest = oldestQueuedForPersistence.get();
+    if (oldest == NOTHING_QUEUED) {
+        return false;
+    }
+    queued = oldest;
+    return true;
+}
+
+void CheckpointManager::updateOldestQueuedForPersistence_UNLOCKED() {
+    // Mutations are queued in time order, a deduplicated one moving to
+    // the end of the open checkpoint, so the first one after the cursor
+    // is the oldest.
+    std::list<Checkpoint*>::iterator cit = persistenceCursor.currentCheckpoint;
+    CheckpointItemList::iterator pos = persistenceCursor.currentPos;
+    for (; cit != checkpointList.end(); ++cit) {
+        if (cit != persistenceCursor.currentCheckpoint) {
+            pos = (*cit)->begin();
+        }
+        while (++pos != (*cit)->end()) {
+            enum queue_operation op = (*pos)->getOperation();
+            if (op == queue_op_set || op == queue_op_del) {
+                oldestQueuedForPersistence.set((*pos)->getQueuedTime());
+                (*cit)->updateSpilledOverhead();
+                return;
+            }
+        }
+        (*cit)->updateSpilledOverhead();
+    }
+    oldestQueuedForPersistence.set(NOTHING_QUEUED);
 }
 
 void CheckpointManager::getAllItemsForPersistence(std::vector<queued_item> &items) {
+    getItemsForPersistence(items, std::numeric_limits<size_t>::max(),
+                           std::numeric_limits<size_t>::max());
+}
+
+bool CheckpointManager::getItemsForPersistence(std::vector<queued_item> &items,
+                                               size_t maxItems, size_t maxBytes) {
     LockHolder lh(queueLock);
-    // Get all the items up to the end of the current open checkpoint.
-    getAllItemsFromCurrentPosition(persistenceCursor, 0, items);
-    persistenceCursor.offset = numItems;
-    pCursorPreCheckpointId = getLastClosedCheckpointId_UNLOCKED();
+    // Anything staged from here on sets it again.
+    oldestQueuedForPersistence.set(NOTHING_QUEUED);
+    mergeStagedItems_UNLOCKED();
+    size_t numItemsBefore = items.size();
+    bool hasMore = getItemsFromCurrentPosition(persistenceCursor, 0, items,
+                                               maxItems, maxBytes);
+    size_t numGrabbed = items.size() - numItemsBefore;
+    if (hasMore) {
+        persistenceCursor.offset.incr(numGrabbed);
+        // Every checkpoint before the cursor's current one has been grabbed.
+        std::list<Checkpoint*>::iterator prev = persistenceCursor.currentCheckpoint;
+        if (prev != checkpointList.begin()) {
+            --prev;
+            pCursorPreCheckpointId = (*prev)->getId();
+        }
+    } else {
+        // Get all the items up to the end of the current open checkpoint.
+        persistenceCursor.offset = numItems;
+        pCursorPreCheckpointId = getLastClosedCheckpointId_UNLOCKED();
+    }
+    if (hasMore) {
+        updateOldestQueuedForPersistence_UNLOCKED();
+    }
 
     getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
                      "Grab %ld items through the persistence cursor from vbucket %d.\n",
-                     items.size(), vbucketId);
+                     numGrabbed, vbucketId);
+    return hasMore;
 }
 
 void CheckpointManager::getAllItemsForTAPConnection(const std::string &name,
                                                     std::vector<queued_item> &items) {
     LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
     std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.find(name);
     if (it == tapCursors.end()) {
         getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
@@ -765,7 +1533,7 @@ void CheckpointManager::getAllItemsForTAPConnection(const std::string &name,
                          name.c_str());
         return;
     }
-    getAllItemsFromCurrentPosition(it->second, 0, items);
+    getItemsFromCurrentPosition(it->second, 0, items);
     it->second.offset = numItems;
 
     getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
@@ -773,8 +1541,68 @@ void CheckpointManager::getAllItemsForTAPConnection(const std::string &name,
                      items.size(), name.c_str(), vbucketId);
 }
 
+bool CheckpointManager::getItemsForTAPConnection(const std::string &name,
+                                                 std::vector<queued_item> &items,
+                                                 size_t maxItems, size_t maxBytes) {
+    LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
+    std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.find(name);
+    if (it == tapCursors.end() || checkpointList.back()->getId() == 0) {
+        // nextItem reports a missing cursor and the backfill phase.
+        return false;
+    }
+
+    CheckpointCursor &cursor = it->second;
+    Checkpoint *checkpoint = *(cursor.currentCheckpoint);
+    if (cursor.closedCheckpointOnly &&
+        (checkpoint->getState() == opened ||
+         cursor.openChkIdAtRegistration <= checkpoint->getId())) {
+        return false;
+    }
+    if (!isTAPCursorLoaded_UNLOCKED(cursor.currentCheckpoint, cursor.currentPos.position())) {
+        // nextItem says there's nothing yet while the chunks are read back.
+        return false;
+    }
+
+    size_t numGrabbed = 0;
+    size_t bytesGrabbed = 0;
+    bool limited = false;
+    CheckpointItemList::iterator next = cursor.currentPos;
+    for (++next; next != checkpoint->end(); ++next) {
+        queue_operation op = (*next)->getOperation();
+        if (op != queue_op_set && op != queue_op_del) {
+            break;
+        }
+        if (checkpoint->getState() == closed &&
+            !isTAPCursorLoaded_UNLOCKED(cursor.currentCheckpoint, next.position())) {
+            // Don't walk into a spilled chunk, leave the rest for later.
+            break;
+        }
+        CheckpointItemList::iterator after = next;
+        ++after;
+        if (after == checkpoint->end() ||
+            (*after)->getOperation() == queue_op_checkpoint_end) {
+            // Leave the last mutation to nextItem, which flags it as such.
+            break;
+        }
+        if (numGrabbed > 0 && (numGrabbed >= maxItems || bytesGrabbed >= maxBytes)) {
+            limited = true;
+            break;
+        }
+        const queued_item &qi = *next;
+        items.push_back(qi);
+        ++numGrabbed;
+        bytesGrabbed += qi->size();
+        cursor.currentPos = next;
+        ++(cursor.offset);
+    }
+    checkpoint->updateSpilledOverhead();
+    return limited;
+}
+
 queued_item CheckpointManager::nextItem(const std::string &name, bool &isLastMutationItem) {
     LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
     isLastMutationItem = false;
     std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.find(name);
     if (it == tapCursors.end()) {
@@ -782,7 +1610,7 @@ queued_item CheckpointManager::nextItem(const std::string &name, bool &isLastMut
                          "The cursor with name \"%s\" is not found in "
                          "the checkpoint of vbucket %d.\n",
                          name.c_str(), vbucketId);
-        queued_item qi(new QueuedItem("", 0xffff, queue_op_empty));
+        queued_item qi(QueuedItem::New("", 0xffff, queue_op_empty));
         return qi;
     }
     if (checkpointList.back()->getId() == 0) {
@@ -790,13 +1618,23 @@ queued_item CheckpointManager::nextItem(const std::string &name, bool &isLastMut
                          "VBucket %d is still in backfill phase that doesn't allow "
                          " the tap cursor to fetch an item from it's current checkpoint.\n",
                          vbucketId);
-        queued_item qi(new QueuedItem("", 0xffff, queue_op_empty));
+        queued_item qi(QueuedItem::New("", 0xffff, queue_op_empty));
         return qi;
     }
 
     CheckpointCursor &cursor = it->second;
     if ((*(it->second.currentCheckpoint))->getState() == closed) {
-        return nextItemFromClosedCheckpoint(cursor, isLastMutationItem);
+        if (!isTAPCursorLoaded_UNLOCKED(cursor.currentCheckpoint,
+                                        cursor.currentPos.position())) {
+            // Nothing yet, the TAP connection is notified once the spilled
+            // chunks are read back.
+            queued_item qi(QueuedItem::New("", 0xffff, queue_op_empty));
+            return qi;
+        }
+        queued_item qi = nextItemFromClosedCheckpoint(cursor, isLastMutationItem);
+        // The cursor may have read spilled items back.
+        (*(cursor.currentCheckpoint))->updateSpilledOverhead();
+        return qi;
     } else {
         return nextItemFromOpenedCheckpoint(cursor, isLastMutationItem);
     }
@@ -809,7 +1647,7 @@ queued_item CheckpointManager::nextItemFromClosedCheckpoint(CheckpointCursor &cu
     // can close the connection.
     if (cursor.closedCheckpointOnly &&
         cursor.openChkIdAtRegistration <= (*(cursor.currentCheckpoint))->getId()) {
-        queued_item qi(new QueuedItem("", vbucketId, queue_op_empty));
+        queued_item qi(QueuedItem::New("", vbucketId, queue_op_empty));
         return qi;
     }
 
@@ -821,7 +1659,7 @@ queued_item CheckpointManager::nextItemFromClosedCheckpoint(CheckpointCursor &cu
     } else {
         if (!moveCursorToNextCheckpoint(cursor)) {
             --(cursor.currentPos);
-            queued_item qi(new QueuedItem("", 0xffff, queue_op_empty));
+            queued_item qi(QueuedItem::New("", 0xffff, queue_op_empty));
             return qi;
         }
         if ((*(cursor.currentCheckpoint))->getState() == closed) { // the close checkpoint.
@@ -838,7 +1676,7 @@ queued_item CheckpointManager::nextItemFromClosedCheckpoint(CheckpointCursor &cu
 queued_item CheckpointManager::nextItemFromOpenedCheckpoint(CheckpointCursor &cursor,
                                                             bool &isLastMutationItem) {
     if (cursor.closedCheckpointOnly) {
-        queued_item qi(new QueuedItem("", vbucketId, queue_op_empty));
+        queued_item qi(QueuedItem::New("", vbucketId, queue_op_empty));
         return qi;
     }
 
@@ -849,13 +1687,19 @@ queued_item CheckpointManager::nextItemFromOpenedCheckpoint(CheckpointCursor &cu
         return *(cursor.currentPos);
     } else {
         --(cursor.currentPos);
-        queued_item qi(new QueuedItem("", 0xffff, queue_op_empty));
+        queued_item qi(QueuedItem::New("", 0xffff, queue_op_empty));
         return qi;
     }
 }
 
 void CheckpointManager::clear(vbucket_state_t vbState) {
     LockHolder lh(queueLock);
+    {
+        // Staged items would be cleared along with the rest anyway.
+        SpinLockHolder slh(&stagingLock);
+        staged.clear();
+        numStaged.set(0);
+    }
     std::list<Checkpoint*>::iterator it = checkpointList.begin();
     // Remove all the checkpoints.
     while(it != checkpointList.end()) {
@@ -887,10 +1731,12 @@ void CheckpointManager::resetCursors() {
         cit->second.offset = 0;
         checkpointList.front()->registerCursorName(cit->second.name);
     }
+    updateOldestQueuedForPersistence_UNLOCKED();
 }
 
 void CheckpointManager::resetTAPCursors(const std::list<std::string> &cursors) {
     LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
     std::list<std::string>::const_iterator it = cursors.begin();
     for (; it != cursors.end(); it++) {
         registerTAPCursor_UNLOCKED(*it, getOpenCheckpointId_UNLOCKED(), false, true);
@@ -945,26 +1791,33 @@ uint64_t CheckpointManager::checkOpenCheckpoint_UNLOCKED(bool forceCreation, boo
 
 bool CheckpointManager::eligibleForEviction(const std::string &key) {
     LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
     uint64_t smallest_mid = 0;
 
     // Get the mutation id of the item pointed by the slowest cursor.
     // This won't cause much overhead as the number of cursors per vbucket is
     // usually bounded to 3 (persistence cursor + 2 replicas).
-    const std::string &pkey = (*(persistenceCursor.currentPos))->getKey();
-    smallest_mid = (*(persistenceCursor.currentCheckpoint))->getMutationIdForKey(pkey);
+    const queued_item &pitem = *(persistenceCursor.currentPos);
+    smallest_mid = (*(persistenceCursor.currentCheckpoint))->getMutationIdForKey(
+                                         pitem->getKeyBytes(), pitem->getKeyLen(),
+                                         pitem->getKeyHash());
     std::map<const std::string, CheckpointCursor>::iterator mit = tapCursors.begin();
     for (; mit != tapCursors.end(); ++mit) {
-        const std::string &tkey = (*(mit->second.currentPos))->getKey();
-        uint64_t mid = (*(mit->second.currentCheckpoint))->getMutationIdForKey(tkey);
+        const queued_item &titem = *(mit->second.currentPos);
+        uint64_t mid = (*(mit->second.currentCheckpoint))->getMutationIdForKey(
+                                         titem->getKeyBytes(), titem->getKeyLen(),
+                                         titem->getKeyHash());
         if (mid < smallest_mid) {
             smallest_mid = mid;
         }
     }
 
     bool can_evict = true;
+    uint64_t h = hash64(key.data(), key.size());
     std::list<Checkpoint*>::reverse_iterator it = checkpointList.rbegin();
     for (; it != checkpointList.rend(); ++it) {
-        uint64_t mid = (*it)->getMutationIdForKey(key);
+        // Don't read spilled items back just for this.
+        uint64_t mid = (*it)->getMutationIdForKey(key, h, false);
         if (mid == 0) { // key doesn't exist in a checkpoint.
             continue;
         }
@@ -979,6 +1832,7 @@ bool CheckpointManager::eligibleForEviction(const std::string &key) {
 
 size_t CheckpointManager::getNumItemsForTAPConnection(const std::string &name) {
     LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
     size_t remains = 0;
     std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.find(name);
     if (it != tapCursors.end()) {
@@ -989,6 +1843,7 @@ size_t CheckpointManager::getNumItemsForTAPConnection(const std::string &name) {
 
 void CheckpointManager::decrTapCursorFromCheckpointEnd(const std::string &name) {
     LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
     std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.find(name);
     if (it != tapCursors.end() &&
         (*(it->second.currentPos))->getOperation() == queue_op_checkpoint_end) {
@@ -998,7 +1853,7 @@ void CheckpointManager::decrTapCursorFromCheckpointEnd(const std::string &name)
 }
 
 bool CheckpointManager::isLastMutationItemInCheckpoint(CheckpointCursor &cursor) {
-    std::list<queued_item>::iterator it = cursor.currentPos;
+    CheckpointItemList::iterator it = cursor.currentPos;
     ++it;
     if (it == (*(cursor.currentCheckpoint))->end() ||
         (*it)->getOperation() == queue_op_checkpoint_end) {
@@ -1009,6 +1864,7 @@ bool CheckpointManager::isLastMutationItemInCheckpoint(CheckpointCursor &cursor)
 
 void CheckpointManager::checkAndAddNewCheckpoint(uint64_t id) {
     LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
 
     // Ignore CHECKPOINT_START message with ID 0 as 0 is reserved for representing backfill.
     if (id == 0) {
@@ -1068,7 +1924,7 @@ void CheckpointManager::checkAndAddNewCheckpoint(uint64_t id) {
         size_t numDuplicatedItems = 0, numMetaItems = 0;
         // Collapse all checkpoints.
         for (; rit != checkpointList.rend(); ++rit) {
-            size_t numAddedItems = checkpointList.back()->mergePrevCheckpoint(*rit);
+            size_t numAddedItems = checkpointList.back()->mergePrevCheckpoint(*rit, this);
             numDuplicatedItems += ((*rit)->getNumItems() - numAddedItems);
             numMetaItems += 2; // checkpoint start and end meta items
             delete *rit;
@@ -1092,17 +1948,18 @@ void CheckpointManager::checkAndAddNewCheckpoint(uint64_t id) {
 
 bool CheckpointManager::hasNext(const std::string &name) {
     LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
     std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.find(name);
     if (it == tapCursors.end() || getOpenCheckpointId_UNLOCKED() == 0) {
         return false;
     }
 
     bool hasMore = true;
-    std::list<queued_item>::iterator curr = it->second.currentPos;
-    ++curr;
-    if (curr == (*(it->second.currentCheckpoint))->end() &&
-        (*(it->second.currentCheckpoint))->getState() == opened) {
-        hasMore = false;
+    // Only the open checkpoint can run out, and it is never spilled.
+    if ((*(it->second.currentCheckpoint))->getState() == opened) {
+        CheckpointItemList::iterator curr = it->second.currentPos;
+        ++curr;
+        hasMore = curr != (*(it->second.currentCheckpoint))->end();
     }
     return hasMore;
 }
@@ -1117,14 +1974,15 @@ queued_item CheckpointManager::createCheckpointItem(uint64_t id,
     } else {
         key << "checkpoint_end";
     }
-    queued_item qi(new QueuedItem(key.str(), vbid, checkpoint_op, (int64_t) id));
+    queued_item qi(QueuedItem::New(key.str(), vbid, checkpoint_op, (int64_t) id));
     return qi;
 }
 
 bool CheckpointManager::hasNextForPersistence() {
     LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
     bool hasMore = true;
-    std::list<queued_item>::iterator curr = persistenceCursor.currentPos;
+    CheckpointItemList::iterator curr = persistenceCursor.currentPos;
     ++curr;
     if (curr == (*(persistenceCursor.currentCheckpoint))->end() &&
         (*(persistenceCursor.currentCheckpoint))->getState() == opened) {
@@ -1135,6 +1993,7 @@ bool CheckpointManager::hasNextForPersistence() {
 
 uint64_t CheckpointManager::createNewCheckpoint() {
     LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
     Checkpoint *currOpenChpt = checkpointList.back();
     uint64_t cptId = currOpenChpt->getId();
 
@@ -1193,6 +2052,8 @@ CheckpointConfig::CheckpointConfig(EventuallyPersistentEngine &e) {
     inconsistentSlaveCheckpoint = config.isInconsistentSlaveChk();
     itemNumBasedNewCheckpoint = config.isItemNumBasedNewChk();
     keepClosedCheckpoints = config.isKeepClosedChks();
+    spillPath = config.getChkSpillPath();
+    chunkLoadListener = NULL;
 }
 
 bool CheckpointConfig::validateCheckpointMaxItemsParam(size_t checkpoint_max_items) {
@@ -1257,6 +2118,7 @@ void CheckpointConfig::setMaxCheckpoints(size_t value) {
 
 void CheckpointManager::addStats(ADD_STAT add_stat, const void *cookie) {
     LockHolder lh(queueLock);
+    mergeStagedItems_UNLOCKED();
     char buf[256];
 
     snprintf(buf, sizeof(buf), "vb_%d:open_checkpoint_id", vbucketId);
@@ -3,9 +3,11 @@
 #define CHECKPOINT_HH 1
 
 #include <assert.h>
+#include <limits>
 #include <list>
 #include <map>
 #include <set>
+#include <vector>
 
 #include "common.hh"
 #include "atomic.hh"
@@ -32,18 +34,586 @@ typedef enum {
     closed  //!< The checkpoint is not open.
 } checkpoint_state;
 
+#define CHECKPOINT_CHUNK_SIZE 256 // Item slots per chunk of a checkpoint's item list.
+#define MAX_STAGED_ITEMS 1024 // Writers wait for the checkpoint lock beyond this.
+#define CHECKPOINT_LOAD_AHEAD 2 // Spilled chunks read back ahead of a TAP cursor.
+#define NOTHING_QUEUED static_cast<rel_time_t>(-1) // No mutation left to persist.
+
+/**
+ * A file that the chunks of a closed checkpoint are spilled to.
+ *
+ * The file is unlinked as soon as it is created, so it goes away when it is
+ * closed, or when the process dies.  It is reference counted so that it can
+ * be written and read without the checkpoint lock, while the checkpoint it
+ * belongs to may go away.
+ */
+class CheckpointSpillFile : public RCValue {
+public:
+    /**
+     * Create a spill file named after the given path.
+     * @return the new file, or NULL if it couldn't be created
+     */
+    static CheckpointSpillFile *create(const std::string &path, EPStats &st);
+
+    ~CheckpointSpillFile();
+
+    /**
+     * Append a record to the file.  Only one thread may append at a time.
+     * @param data the record
+     * @param offset set to the offset the record was written at
+     * @return true if the whole record was written
+     */
+    bool append(const std::string &data, uint64_t &offset);
+
+    /**
+     * Read a record back.
+     * @return true if the whole record was read
+     */
+    bool read(uint64_t offset, size_t length, std::string &data);
+
+    EPStats &getStats() {
+        return stats;
+    }
+
+private:
+    CheckpointSpillFile(int f, EPStats &st) : fd(f), size(0), stats(st) { }
+
+    int       fd;
+    uint64_t  size;
+    EPStats  &stats;
+
+    DISALLOW_COPY_AND_ASSIGN(CheckpointSpillFile);
+};
+
+/**
+ * Told when a TAP cursor runs into spilled checkpoint chunks, which are
+ * then to be read back by a call to CheckpointManager::loadSpilledChunks()
+ * that doesn't hold up the caller.
+ */
+class SpilledChunkLoadListener {
+public:
+    virtual ~SpilledChunkLoadListener() { }
+    virtual void chunkLoadNeeded(uint16_t vbid) = 0;
+};
+
+/**
+ * Where a spilled chunk of a CheckpointItemList is in its spill file.  A
+ * length of zero means the chunk was never written out.
+ */
+struct spilled_chunk {
+    uint64_t offset;
+    uint32_t length;
+};
+
+/**
+ * A chunk of a closed checkpoint on its way to or from the spill file,
+ * taken with the checkpoint lock held and written or read without it.
+ */
+struct spill_io {
+    uint64_t                    checkpointId;
+    uint64_t                    generation; // Of the item list the chunk is in.
+    size_t                      chunk;
+    RCPtr<CheckpointSpillFile>  file;
+    spilled_chunk               where;
+    std::string                 data;
+    size_t                      numItems;
+};
+
+/**
+ * The items of a checkpoint, in the order they were queued.
+ *
+ * Items are stored in fixed-size chunks that are only ever appended to.
+ * Removing an item leaves a tombstone (an empty slot) behind it, so the
+ * position of every other item stays the same.  A position is the number
+ * of the item's slot, counted across chunks, so chunk and slot within it
+ * are position / CHECKPOINT_CHUNK_SIZE and position % CHECKPOINT_CHUNK_SIZE.
+ * Iterators skip over tombstones.
+ *
+ * Chunks of a list that won't change any more may be spilled to a file and
+ * released.  Chunks are normally read back ahead of the TAP cursors by the
+ * spilled chunk loader, but an iterator that runs into a spilled chunk reads
+ * it back itself.  If that read fails the chunk comes back empty and the
+ * list is flagged, so the cursors that need it can be dropped.
+ */
+class CheckpointItemList {
+public:
+
+    class iterator {
+    public:
+        iterator() : list(NULL), items(NULL), n(0) { }
+
+        queued_item &operator *() const {
+            return items[n % CHECKPOINT_CHUNK_SIZE];
+        }
+
+        queued_item *operator ->() const {
+            return &items[n % CHECKPOINT_CHUNK_SIZE];
+        }
+
+        /**
+         * Move to the next item, or to end() if there is none.
+         */
+        iterator &operator ++() {
+            do {
+                if (++n >= list->numSlots) {
+                    items = NULL;
+                    break;
+                }
+                if (n % CHECKPOINT_CHUNK_SIZE == 0) {
+                    items = list->chunkAt(n / CHECKPOINT_CHUNK_SIZE)->items;
+                }
+            } while (!items[n % CHECKPOINT_CHUNK_SIZE]);
+            return *this;
+        }
+
+        /**
+         * Move to the previous item.  There must be one.
+         */
+        iterator &operator --() {
+            do {
+                assert(n > 0);
+                --n;
+                if (n % CHECKPOINT_CHUNK_SIZE == CHECKPOINT_CHUNK_SIZE - 1 ||
+                    items == NULL) {
+                    items = list->chunkAt(n / CHECKPOINT_CHUNK_SIZE)->items;
+                }
+            } while (!items[n % CHECKPOINT_CHUNK_SIZE]);
+            return *this;
+        }
+
+        bool operator ==(const iterator &other) const {
+            return n == other.n;
+        }
+
+        bool operator !=(const iterator &other) const {
+            return n != other.n;
+        }
+
+        uint32_t position() const {
+            return static_cast<uint32_t>(n);
+        }
+
+    private:
+        friend class CheckpointItemList;
+
+        iterator(CheckpointItemList *l, size_t slot) : list(l), items(NULL), n(slot) {
+            if (n < list->numSlots) {
+                items = list->chunkAt(n / CHECKPOINT_CHUNK_SIZE)->items;
+            }
+        }
+
+        CheckpointItemList *list;
+        queued_item        *items; // The chunk holding slot n, if any.
+        size_t              n;
+    };
+
+    CheckpointItemList() : numSlots(0), numLive(0), numResident(0), generation(0),
+                           readFailed(false) { }
+
+    ~CheckpointItemList() {
+        clear();
+    }
+
+    /**
+     * Return an iterator to the first item, or end() if the list is empty.
+     */
+    iterator begin() {
+        iterator it(this, 0);
+        if (numSlots > 0 && !*it) {
+            ++it;
+        }
+        return it;
+    }
+
+    iterator end() {
+        return at(numSlots);
+    }
+
+    /**
+     * Return an iterator to the item at a given position.
+     */
+    iterator at(size_t pos) {
+        return iterator(this, pos);
+    }
+
+    /**
+     * Return the last item.  The list must not be empty.
+     */
+    queued_item &back() {
+        return *(--end());
+    }
+
+    void push_back(const queued_item &qi) {
+        if (numSlots == chunks.size() * CHECKPOINT_CHUNK_SIZE) {
+            chunks.push_back(new Chunk);
+            ++numResident;
+        }
+        chunkAt(numSlots / CHECKPOINT_CHUNK_SIZE)->items[numSlots % CHECKPOINT_CHUNK_SIZE] = qi;
+        ++numSlots;
+        ++numLive;
+    }
+
+    /**
+     * Remove the last item, along with any tombstones in front of it.
+     */
+    void pop_back() {
+        assert(numLive > 0);
+        back().reset();
+        --numLive;
+        while (numSlots > 0 && !*(at(numSlots - 1))) {
+            --numSlots;
+        }
+        while (chunks.size() * CHECKPOINT_CHUNK_SIZE >= numSlots + CHECKPOINT_CHUNK_SIZE) {
+            if (chunks.back()) {
+                delete chunks.back();
+                --numResident;
+            }
+            chunks.pop_back();
+        }
+        if (spilled.size() > chunks.size()) {
+            spilled.resize(chunks.size());
+        }
+    }
+
+    /**
+     * Remove the item at a given position, leaving a tombstone in its slot.
+     */
+    void erase(const iterator &it) {
+        assert(*it);
+        (*it).reset();
+        --numLive;
+    }
+
+    /**
+     * Exchange the contents of this list with another one.  The spill file
+     * goes along with the chunks spilled to it, so records dropped with a
+     * list go away with its file rather than being left behind in a file
+     * that new chunks are appended to.
+     */
+    void swap(CheckpointItemList &other) {
+        chunks.swap(other.chunks);
+        spilled.swap(other.spilled);
+        std::swap(spillFile, other.spillFile);
+        std::swap(numSlots, other.numSlots);
+        std::swap(numLive, other.numLive);
+        std::swap(numResident, other.numResident);
+        std::swap(readFailed, other.readFailed);
+        ++generation;
+        ++other.generation;
+    }
+
+    void clear() {
+        std::vector<Chunk*>::iterator it = chunks.begin();
+        for (; it != chunks.end(); ++it) {
+            delete *it;
+        }
+        chunks.clear();
+        spilled.clear();
+        spillFile.reset();
+        numSlots = numLive = numResident = 0;
+        readFailed = false;
+        ++generation;
+    }
+
+    size_t getNumChunks() const {
+        return chunks.size();
+    }
+
+    size_t getNumSlots() const {
+        return numSlots;
+    }
+
+    /**
+     * Return a number that changes whenever the chunks of this list are
+     * replaced, to tell whether a chunk taken out earlier is still the same.
+     */
+    uint64_t getGeneration() const {
+        return generation;
+    }
+
+    bool hasSpillFile() const {
+        return spillFile.get() != NULL;
+    }
+
+    const RCPtr<CheckpointSpillFile> &getSpillFile() const {
+        return spillFile;
+    }
+
+    /**
+     * Return true if the chunk holding a given position is in memory.
+     */
+    bool isResident(size_t pos) const {
+        return chunks[pos / CHECKPOINT_CHUNK_SIZE] != NULL;
+    }
+
+    /**
+     * Return true if the slot at a given position holds an item.  The chunk
+     * holding it must be in memory.
+     */
+    bool isLive(size_t pos) const {
+        return chunks[pos / CHECKPOINT_CHUNK_SIZE]->items[pos % CHECKPOINT_CHUNK_SIZE];
+    }
+
+    /**
+     * Return true if a chunk in memory holds any item.
+     */
+    bool hasItems(size_t c) const;
+
+    /**
+     * Return true if a chunk is already in the spill file.
+     */
+    bool isSpilled(size_t c) const {
+        return c < spilled.size() && spilled[c].length > 0;
+    }
+
+    /**
+     * Encode a chunk in memory for the spill file.
+     * @return the number of items in it
+     */
+    size_t encodeChunk(size_t c, std::string &data) const;
+
+    /**
+     * Release a chunk that is already in the spill file.  No iterator may be
+     * left pointing into it.
+     */
+    void releaseChunk(size_t c);
+
+    /**
+     * Release a chunk that was just written to the given spill file.  The
+     * list must not change once its chunks are spilled, and no iterator may
+     * be left pointing into the chunk.
+     */
+    void releaseChunk(size_t c, const RCPtr<CheckpointSpillFile> &file,
+                      const spilled_chunk &where);
+
+    /**
+     * Return where a spilled chunk that isn't in memory is in the spill
+     * file, to read it back without holding the checkpoint lock.
+     * @return false if the chunk is in memory
+     */
+    bool getSpilledChunk(size_t c, spilled_chunk &where) const {
+        if (chunks[c] != NULL) {
+            return false;
+        }
+        where = spilled[c];
+        return true;
+    }
+
+    /**
+     * Put the items of a chunk read back from the spill file in place,
+     * unless it was read back in the meantime.
+     */
+    void installChunk(size_t c, const std::vector<queued_item> &items);
+
+    /**
+     * Return true if a spilled chunk of this list couldn't be read back, in
+     * which case it was put back without its items.
+     */
+    bool hasReadFailed() const {
+        return readFailed;
+    }
+
+    void setReadFailed() {
+        readFailed = true;
+    }
+
+    /**
+     * Return the number of items in the list, not counting tombstones.
+     */
+    size_t size() const {
+        return numLive;
+    }
+
+    size_t getNumTombstones() const {
+        return numSlots - numLive;
+    }
+
+    /**
+     * Return the memory used by the chunks of this list.
+     */
+    size_t memorySize() const {
+        return chunks.capacity() * sizeof(Chunk*) +
+            spilled.capacity() * sizeof(spilled_chunk) + numResident * sizeof(Chunk);
+    }
+
+private:
+    struct Chunk {
+        queued_item items[CHECKPOINT_CHUNK_SIZE];
+    };
+
+    Chunk *chunkAt(size_t c) {
+        Chunk *chunk = chunks[c];
+        return chunk ? chunk : load(c);
+    }
+
+    /**
+     * Read a spilled chunk back from the spill file with the checkpoint lock
+     * held, for the iterators that get to one before the loader does.
+     */
+    Chunk *load(size_t c);
+
+    std::vector<Chunk*>        chunks;  // NULL for chunks that are spilled.
+    std::vector<spilled_chunk> spilled; // Empty until a chunk is spilled.
+    RCPtr<CheckpointSpillFile> spillFile;
+    size_t                     numSlots;
+    size_t                     numLive;
+    size_t                     numResident;
+    uint64_t                   generation;
+    bool                       readFailed;
+
+    DISALLOW_COPY_AND_ASSIGN(CheckpointItemList);
+};
+
 /**
  * A checkpoint index entry.
  */
 struct index_entry {
-    std::list<queued_item>::iterator position;
+    uint32_t hash_tag;    // Folded hash of the key; also picks the home slot.
+    uint32_t position;    // Position of the item in the CheckpointItemList.
     uint64_t mutation_id;
 };
 
 /**
- * The checkpoint index maps a key to a checkpoint index_entry.
+ * The checkpoint index maps a key to the index_entry of the latest item
+ * for it in a checkpoint.
+ *
+ * It is an open addressing table with linear probing over a flat array of
+ * entries, looked up by the key's hash.  Keys are not stored: entries whose
+ * hash tags match are told apart by the key of the item they point to, so
+ * an entry costs sizeof(index_entry) and no allocation of its own.
  */
-typedef unordered_map<std::string, index_entry> checkpoint_index;
+class CheckpointKeyIndex {
+public:
+    CheckpointKeyIndex() : entries(NULL), mask(0), numEntries(0) { }
+
+    ~CheckpointKeyIndex() {
+        delete[] entries;
+    }
+
+    /**
+     * Find the entry for a key.
+     *
+     * @param key the key to look for
+     * @param nkey the length of the key
+     * @param h the hash64() of the key
+     * @param items the item list the entries point into
+     * @param load false to match entries whose items are spilled on the
+     *             hash tag alone rather than reading them back, for callers
+     *             that can live with an occasional false match
+     * @return the entry, or NULL if the key isn't indexed
+     */
+    index_entry *find(const char *key, size_t nkey, uint64_t h, CheckpointItemList &items,
+                      bool load = true) {
+        if (numEntries == 0) {
+            return NULL;
+        }
+        uint32_t tag = hashTag(h);
+        for (size_t i = tag & mask; entries[i].position != EMPTY; i = (i + 1) & mask) {
+            if (entries[i].hash_tag == tag &&
+                ((!load && !items.isResident(entries[i].position)) ||
+                 (*items.at(entries[i].position))->hasKey(key, nkey))) {
+                return &entries[i];
+            }
+        }
+        return NULL;
+    }
+
+    index_entry *find(const std::string &key, uint64_t h, CheckpointItemList &items,
+                      bool load = true) {
+        return find(key.data(), key.size(), h, items, load);
+    }
+
+    /**
+     * Add an entry for a key that isn't indexed yet.  This may move the
+     * other entries, so pointers to them must not be held across it.
+     */
+    void insert(uint64_t h, uint32_t position, uint64_t mutationId) {
+        assert(position != EMPTY);
+        if ((numEntries + 1) * 4 > capacity() * 3) {
+            grow();
+        }
+        index_entry entry = {hashTag(h), position, mutationId};
+        place(entry);
+        ++numEntries;
+    }
+
+    /**
+     * Remove an entry returned by find().
+     */
+    void erase(index_entry *entry) {
+        // Shift the entries that follow in the same run back into the
+        // hole, unless that would move one in front of its home slot.
+        size_t hole = entry - entries;
+        size_t i = hole;
+        while (true) {
+            i = (i + 1) & mask;
+            if (entries[i].position == EMPTY) {
+                break;
+            }
+            size_t home = entries[i].hash_tag & mask;
+            if (((i - home) & mask) >= ((i - hole) & mask)) {
+                entries[hole] = entries[i];
+                hole = i;
+            }
+        }
+        entries[hole].position = EMPTY;
+        --numEntries;
+    }
+
+    size_t size() const {
+        return numEntries;
+    }
+
+    /**
+     * Return the memory used by the entry array.
+     */
+    size_t memorySize() const {
+        return capacity() * sizeof(index_entry);
+    }
+
+private:
+    static const uint32_t EMPTY = 0xffffffff; // position of an unused entry
+    static const size_t MIN_CAPACITY = 16;
+
+    static uint32_t hashTag(uint64_t h) {
+        return static_cast<uint32_t>(h ^ (h >> 32));
+    }
+
+    size_t capacity() const {
+        return entries == NULL ? 0 : mask + 1;
+    }
+
+    void place(const index_entry &entry) {
+        size_t i = entry.hash_tag & mask;
+        while (entries[i].position != EMPTY) {
+            i = (i + 1) & mask;
+        }
+        entries[i] = entry;
+    }
+
+    void grow() {
+        size_t oldCapacity = capacity();
+        index_entry *old = entries;
+        size_t newCapacity = oldCapacity == 0 ? MIN_CAPACITY : oldCapacity * 2;
+        entries = new index_entry[newCapacity];
+        mask = newCapacity - 1;
+        for (size_t i = 0; i < newCapacity; ++i) {
+            entries[i].position = EMPTY;
+        }
+        for (size_t i = 0; i < oldCapacity; ++i) {
+            if (old[i].position != EMPTY) {
+                place(old[i]);
+            }
+        }
+        delete[] old;
+    }
+
+    index_entry *entries;
+    size_t       mask;
+    size_t       numEntries;
+
+    DISALLOW_COPY_AND_ASSIGN(CheckpointKeyIndex);
+};
 
 class Checkpoint;
 class CheckpointManager;
@@ -63,7 +633,7 @@ public:
 
     CheckpointCursor(const std::string &n,
                      std::list<Checkpoint*>::iterator checkpoint,
-                     std::list<queued_item>::iterator pos,
+                     CheckpointItemList::iterator pos,
                      size_t os = 0, bool isClosedCheckpointOnly = false,
                      uint64_t openChkId = 1) :
         name(n), currentCheckpoint(checkpoint), currentPos(pos),
@@ -73,7 +643,7 @@ public:
 private:
     std::string                      name;
     std::list<Checkpoint*>::iterator currentCheckpoint;
-    std::list<queued_item>::iterator currentPos;
+    CheckpointItemList::iterator     currentPos;
     Atomic<size_t>                   offset;
     bool                             closedCheckpointOnly;
     uint64_t                         openChkIdAtRegistration;
@@ -94,7 +664,8 @@ class Checkpoint {
 public:
     Checkpoint(EPStats &st, uint64_t id, uint16_t vbid, checkpoint_state state = opened) :
         stats(st), checkpointId(id), vbucketId(vbid), creationTime(ep_real_time()),
-        checkpointState(state), numItems(0), memOverhead(0) {
+        checkpointState(state), numItems(0), containerOverhead(0),
+        memOverhead(0) {
         stats.memOverhead.incr(memorySize());
         assert(stats.memOverhead.get() < GIGANTOR);
     }
@@ -189,24 +760,22 @@ public:
     queue_dirty_t queueDirty(const queued_item &qi, CheckpointManager *checkpointManager);
 
 
-    std::list<queued_item>::iterator begin() {
+    CheckpointItemList::iterator begin() {
         return toWrite.begin();
     }
 
-    std::list<queued_item>::iterator end() {
+    CheckpointItemList::iterator end() {
         return toWrite.end();
     }
 
-    std::list<queued_item>::reverse_iterator rbegin() {
-        return toWrite.rbegin();
-    }
-
-    std::list<queued_item>::reverse_iterator rend() {
-        return toWrite.rend();
-    }
-
     bool keyExists(const std::string &key);
 
+    /**
+     * Get the position of the latest item for a given key in this checkpoint.
+     * @return false if the key isn't in this checkpoint
+     */
+    bool getKeyPosition(const std::string &key, uint64_t h, uint32_t &pos);
+
     /**
      * Return the memory overhead of this checkpoint instance, except for the memory used by
      * all the items belonging to this checkpoint. The memory overhead of those items is
@@ -221,18 +790,130 @@ public:
      * Merge the previous checkpoint into the this checkpoint by adding the items from
      * the previous checkpoint, which don't exist in this checkpoint.
      * @param pPrevCheckpoint pointer to the previous checkpoint.
+     * @param checkpointManager the checkpoint manager to which this checkpoint belongs
      * @return the number of items added from the previous checkpoint.
      */
-    size_t mergePrevCheckpoint(Checkpoint *pPrevCheckpoint);
+    size_t mergePrevCheckpoint(Checkpoint *pPrevCheckpoint,
+                               CheckpointManager *checkpointManager);
 
     /**
      * Get the mutation id for a given key in this checkpoint
      * @param key a key to retrieve its mutation id
+     * @param nkey the length of the key
+     * @param h the hash64() of the key
+     * @param load false not to read spilled items back; a spilled item with
+     *             a matching hash tag then counts as the newest mutation
      * @return the mutation id for a given key
      */
-    uint64_t getMutationIdForKey(const std::string &key);
+    uint64_t getMutationIdForKey(const char *key, size_t nkey, uint64_t h, bool load = true);
+
+    uint64_t getMutationIdForKey(const std::string &key, uint64_t h, bool load = true) {
+        return getMutationIdForKey(key.data(), key.size(), h, load);
+    }
+
+    /**
+     * Return the number of tombstones left in this checkpoint's item list by
+     * items that were superseded by later mutations of the same key.
+     */
+    size_t getNumTombstones() const {
+        return toWrite.getNumTombstones();
+    }
+
+    /**
+     * Start spilling the chunks of this closed checkpoint, except for the
+     * pinned ones.  Chunks that are already in the spill file are released
+     * right away, the others are encoded for the caller to write out.
+     * @param pinned the chunks the cursors in this checkpoint are about to
+     *               walk through
+     * @param writes the chunks to write out are added to it
+     * @return the number of chunks released
+     */
+    size_t prepareSpill(const std::set<size_t> &pinned, std::vector<spill_io> &writes);
+
+    /**
+     * Release a chunk written out for prepareSpill(), unless the chunk
+     * changed or got pinned in the meantime.
+     * @return true if it was released
+     */
+    bool completeSpill(const spill_io &write, const std::set<size_t> &pinned);
+
+    /**
+     * Take out a chunk that has to be read back from the spill file.
+     * @return false if it is in memory
+     */
+    bool prepareLoad(size_t c, spill_io &read);
+
+    /**
+     * Put a chunk read back for prepareLoad() in place, unless the chunk
+     * changed in the meantime.
+     * @param items the items read back, or empty if the read failed
+     */
+    void completeLoad(const spill_io &read, const std::vector<queued_item> &items);
+
+    size_t getNumChunks() const {
+        return toWrite.getNumChunks();
+    }
+
+    size_t getNumSlots() const {
+        return toWrite.getNumSlots();
+    }
+
+    bool isResident(size_t pos) const {
+        return toWrite.isResident(pos);
+    }
+
+    bool isLive(size_t pos) const {
+        return toWrite.isLive(pos);
+    }
+
+    bool hasItems(size_t c) const {
+        return toWrite.hasItems(c);
+    }
+
+    bool hasReadFailed() const {
+        return toWrite.hasReadFailed();
+    }
+
+    /**
+     * Account for the spilled chunks that were read back since the last
+     * time the memory overhead of this checkpoint was updated.
+     */
+    void updateSpilledOverhead() {
+        if (toWrite.hasSpillFile()) {
+            updateContainerOverhead();
+        }
+    }
 
 private:
+    index_entry *findKey(const std::string &key, uint64_t h) {
+        return keyIndex.find(key, h, toWrite);
+    }
+
+    index_entry *findKey(const QueuedItem &qi) {
+        return keyIndex.find(qi.getKeyBytes(), qi.getKeyLen(), qi.getKeyHash(), toWrite);
+    }
+
+    /**
+     * Copy the items of this checkpoint into a new list without tombstones,
+     * with the given items inserted right after the checkpoint_start item,
+     * and repoint the key index and the cursors in this checkpoint at the
+     * new list.
+     */
+    void rebuild(CheckpointManager *checkpointManager,
+                 const std::vector<std::pair<queued_item, uint64_t> > &inserts);
+
+    /**
+     * Return the memory used by the item list and the key index.
+     */
+    size_t containerSize() const {
+        return toWrite.memorySize() + keyIndex.memorySize();
+    }
+
+    /**
+     * Account for the change in containerSize() since it was last accounted.
+     */
+    void updateContainerOverhead();
+
     EPStats                       &stats;
     uint64_t                       checkpointId;
     uint16_t                       vbucketId;
@@ -240,9 +921,11 @@ private:
     checkpoint_state               checkpointState;
     size_t                         numItems;
     std::set<std::string>          cursors; // List of cursors with their unique names.
-    // List is used for queueing mutations as vector incurs shift operations for deduplication.
-    std::list<queued_item>         toWrite;
-    checkpoint_index               keyIndex;
+    // Deduplication leaves tombstones rather than shifting items, so the
+    // positions held by cursors and the key index stay put.
+    CheckpointItemList             toWrite;
+    CheckpointKeyIndex             keyIndex;
+    size_t                         containerOverhead; // containerSize() as last accounted.
     size_t                         memOverhead;
 };
 
@@ -262,8 +945,10 @@ public:
         mutationCounter(0), persistenceCursor("persistence"),
         isCollapsedCheckpoint(false),
         checkpointExtension(false),
-        pCursorPreCheckpointId(0)
+        pCursorPreCheckpointId(0), chunkLoadRequested(false), stagedVBucket(NULL),
+        appending(false)
     {
+        oldestQueuedForPersistence.set(NOTHING_QUEUED);
         addNewCheckpoint(checkpointId);
         registerPersistenceCursor();
     }
@@ -280,6 +965,7 @@ public:
 
     void setOpenCheckpointId(uint64_t id) {
         LockHolder lh(queueLock);
+        mergeStagedItems_UNLOCKED();
         setOpenCheckpointId_UNLOCKED(id);
     }
 
@@ -293,6 +979,25 @@ public:
     size_t removeClosedUnrefCheckpoints(const RCPtr<VBucket> &vbucket,
                                         bool &newOpenCheckpointCreated);
 
+    /**
+     * Spill the closed checkpoints that the persistence cursor is done with
+     * but TAP cursors still need, while memory usage is above the low water
+     * mark.  The chunks are picked with the checkpoint lock held and written
+     * without it, so this is meant for an IO dispatcher.
+     * @return the number of chunks released
+     */
+    size_t spillClosedCheckpoints();
+
+    /**
+     * Read back the spilled chunks that the TAP cursors are about to walk
+     * through.  The reads are done without the checkpoint lock, so this is
+     * meant for an IO dispatcher.  TAP cursors that need a chunk that
+     * couldn't be read are removed.
+     * @param failed the names of the removed TAP cursors are added to it
+     * @return the number of chunks read back
+     */
+    size_t loadSpilledChunks(std::vector<std::string> &failed);
+
     /**
      * Register the new cursor for a given TAP connection
      * @param name the name of a given TAP connection
@@ -322,15 +1027,32 @@ public:
 
     size_t getNumOfTAPCursors();
 
+    /**
+     * Check if a TAP cursor already took the latest item for a given key.
+     * Once the item is gone from the checkpoints, every cursor took it.
+     * @param name the name of the TAP cursor
+     * @param key the key of the item
+     * @return true if the cursor exists and is past the item
+     */
+    bool isTAPCursorPastKey(const std::string &name, const std::string &key);
+
     std::list<std::string> getTAPCursorNames();
 
     bool tapCursorExists(const std::string &name);
 
     /**
      * Queue an item to be written to persistent layer.
+     *
+     * If another writer is already appending to this vbucket's checkpoint,
+     * the item is staged for that writer, or whoever takes the checkpoint
+     * lock next, to append in the order it was staged, instead of waiting
+     * for the lock.
+     *
      * @param item the item to be persisted.
      * @param vbucket the vbucket that a new item is pushed into.
      * @return true if an item queued increases the size of persistence queue by 1.
+     * A staged item is assumed to; if it turns out not to when it is
+     * appended, its queueing stats are rolled back on the vbucket then.
      */
     bool queueDirty(const queued_item &qi, const RCPtr<VBucket> &vbucket);
 
@@ -358,6 +1080,34 @@ public:
      */
     void getAllItemsForTAPConnection(const std::string &name, std::vector<queued_item> &items);
 
+    /**
+     * Return a bounded batch of the items, which need to be persisted, to the flusher.
+     * The persistence cursor is left right behind the last item returned, so that
+     * the next call continues from there. At least one item is returned if there is
+     * any, whatever the limits are.
+     * @param items the array that the items to be persisted are appended to.
+     * @param maxItems the maximum number of items to be returned.
+     * @param maxBytes the maximum number of bytes of items to be returned.
+     * @return true if the batch was cut short by the limits and more items remain.
+     */
+    bool getItemsForPersistence(std::vector<queued_item> &items,
+                                size_t maxItems, size_t maxBytes);
+
+    /**
+     * Return a bounded batch of mutations to a given TAP cursor since its current
+     * position. The batch stays within the cursor's current checkpoint and stops in
+     * front of checkpoint meta items and the last mutation of the checkpoint, which
+     * are left to nextItem so that the TAP connection can track checkpoint boundaries.
+     * At least one mutation is returned if there is any, whatever the limits are.
+     * @param name the name of a given TAP connection.
+     * @param items the array that the mutations are appended to.
+     * @param maxItems the maximum number of items to be returned.
+     * @param maxBytes the maximum number of bytes of items to be returned.
+     * @return true if the batch was cut short by the limits.
+     */
+    bool getItemsForTAPConnection(const std::string &name, std::vector<queued_item> &items,
+                                  size_t maxItems, size_t maxBytes);
+
     /**
      * Return the total number of items that belong to this checkpoint manager.
      */
@@ -378,11 +1128,21 @@ public:
 
     size_t getNumItemsForPersistence() {
         LockHolder lh(queueLock);
+        mergeStagedItems_UNLOCKED();
         return getNumItemsForPersistence_UNLOCKED();
     }
 
     size_t getNumItemsForTAPConnection(const std::string &name);
 
+    /**
+     * Get when the oldest mutation the persistence cursor hasn't visited
+     * yet was queued.  This doesn't take the lock, and may still report a
+     * mutation that was just visited or deduplicated to a later time.
+     *
+     * @return false if the persistence cursor visited every mutation
+     */
+    bool getOldestQueuedTimeForPersistence(rel_time_t &queued);
+
     /**
      * Return true if a given key was already visited by all the cursors
      * and is eligible for eviction.
@@ -464,9 +1224,11 @@ private:
 
     queued_item nextItemFromOpenedCheckpoint(CheckpointCursor &cursor, bool &isLastMutationItem);
 
-    void getAllItemsFromCurrentPosition(CheckpointCursor &cursor,
-                                        uint64_t barrier,
-                                        std::vector<queued_item> &items);
+    bool getItemsFromCurrentPosition(CheckpointCursor &cursor,
+                                     uint64_t barrier,
+                                     std::vector<queued_item> &items,
+                                     size_t maxItems = std::numeric_limits<size_t>::max(),
+                                     size_t maxBytes = std::numeric_limits<size_t>::max());
 
     bool moveCursorToNextCheckpoint(CheckpointCursor &cursor);
 
@@ -483,6 +1245,7 @@ private:
 
     uint64_t checkOpenCheckpoint(bool forceCreation, bool timeBound) {
         LockHolder lh(queueLock);
+        mergeStagedItems_UNLOCKED();
         return checkOpenCheckpoint_UNLOCKED(forceCreation, timeBound);
     }
 
@@ -513,8 +1276,45 @@ private:
 
     void collapseClosedCheckpoints(std::list<Checkpoint*> &collapsedChks);
 
+    /**
+     * Return true if the next items after a TAP cursor position can be
+     * reached without reading spilled chunks back.  Otherwise, or if the
+     * chunks after those are spilled, ask for them to be read back.
+     */
+    bool isTAPCursorLoaded_UNLOCKED(std::list<Checkpoint*>::iterator chk, size_t pos);
+
+    void requestChunkLoad_UNLOCKED();
+
+    /**
+     * Get the chunks of a checkpoint that the TAP cursors in it are about to
+     * walk through, which aren't to be spilled.
+     */
+    void getPinnedChunks_UNLOCKED(std::list<Checkpoint*>::iterator it,
+                                  std::set<size_t> &pinned);
+
+    /**
+     * Return the closed checkpoint with a given id that the persistence
+     * cursor is done with, or NULL if there is none.
+     */
+    std::list<Checkpoint*>::iterator findSpillableCheckpoint_UNLOCKED(uint64_t id);
+
     void resetCursors();
 
+    /**
+     * Look for the oldest mutation after the persistence cursor again,
+     * once the cursor moved.
+     */
+    void updateOldestQueuedForPersistence_UNLOCKED();
+
+    bool queueDirty_UNLOCKED(const queued_item &qi, const RCPtr<VBucket> &vbucket);
+
+    /**
+     * Append the staged items to the open checkpoint.  Every public function
+     * that looks at the checkpoints calls this first, so that staging is
+     * invisible to readers.
+     */
+    void mergeStagedItems_UNLOCKED();
+
     static queued_item createCheckpointItem(uint64_t id, uint16_t vbid,
                                             enum queue_operation checkpoint_op);
 
@@ -532,6 +1332,26 @@ private:
     uint64_t                 lastClosedCheckpointId;
     uint64_t                 pCursorPreCheckpointId;
     std::map<const std::string, CheckpointCursor> tapCursors;
+
+    // Held by a spill pass throughout, so that only one writes at a time.
+    Mutex                    spillLock;
+    // Set once the listener was told about chunks to read back, until the
+    // next call to loadSpilledChunks().
+    bool                     chunkLoadRequested;
+
+    // Items queued while another writer was appending to the checkpoint.
+    SpinLock                 stagingLock;
+    std::vector<queued_item> staged;
+    std::vector<queued_item> stagedBatch; // The batch being merged, kept for its capacity.
+    // The vbucket the staged items were queued for.  It owns this checkpoint
+    // manager, so a plain pointer can't outlive it.
+    VBucket                 *stagedVBucket;
+    Atomic<size_t>           numStaged;
+    Atomic<bool>             appending;
+
+    // When the oldest mutation after the persistence cursor was queued,
+    // kept up to date as mutations are queued and taken by the flusher.
+    Atomic<rel_time_t>       oldestQueuedForPersistence;
 };
 
 /**
@@ -546,7 +1366,8 @@ public:
           maxCheckpoints(DEFAULT_MAX_CHECKPOINTS),
           inconsistentSlaveCheckpoint (false),
           itemNumBasedNewCheckpoint(true),
-          keepClosedCheckpoints(false)
+          keepClosedCheckpoints(false),
+          chunkLoadListener(NULL)
     { /* empty */ }
 
     CheckpointConfig(EventuallyPersistentEngine &e);
@@ -575,6 +1396,26 @@ public:
         return keepClosedCheckpoints;
     }
 
+    bool canSpillClosedCheckpoints() const {
+        return !spillPath.empty();
+    }
+
+    const std::string &getSpillPath() const {
+        return spillPath;
+    }
+
+    /**
+     * Set the listener told about spilled chunks TAP cursors wait for.  With
+     * none, the cursors read the chunks back themselves.
+     */
+    void setSpilledChunkLoadListener(SpilledChunkLoadListener *l) {
+        chunkLoadListener = l;
+    }
+
+    SpilledChunkLoadListener *getSpilledChunkLoadListener() const {
+        return chunkLoadListener;
+    }
+
 protected:
     friend class CheckpointConfigChangeListener;
     friend class EventuallyPersistentEngine;
@@ -599,6 +1440,10 @@ protected:
         keepClosedCheckpoints = value;
     }
 
+    void setSpillPath(const std::string &path) {
+        spillPath = path;
+    }
+
     static void addConfigChangeListener(EventuallyPersistentEngine &engine);
 
 private:
@@ -617,6 +1462,9 @@ private:
     // Flag indicating if closed checkpoints should be kept in memory if the current memory usage
     // below the high water mark.
     bool keepClosedCheckpoints;
+    // Path that files of spilled checkpoints are named after. Spilling is off if it is empty.
+    std::string spillPath;
+    SpilledChunkLoadListener *chunkLoadListener;
 };
 
 #endif /* CHECKPOINT_HH */
@@ -54,6 +54,29 @@ private:
     bool                      *stateFinalizer;
 };
 
+/**
+ * Spill the closed checkpoints of each vbucket that only TAP cursors need.
+ */
+class CheckpointSpillVisitor : public VBucketVisitor {
+public:
+
+    CheckpointSpillVisitor(bool *sfin) : stateFinalizer(sfin) {}
+
+    bool visitBucket(RCPtr<VBucket> &vb) {
+        vb->checkpointManager.spillClosedCheckpoints();
+        return false;
+    }
+
+    void complete() {
+        if (stateFinalizer) {
+            *stateFinalizer = true;
+        }
+    }
+
+private:
+    bool *stateFinalizer;
+};
+
 bool ClosedUnrefCheckpointRemover::callback(Dispatcher &d, TaskId t) {
     if (available) {
         ++stats.checkpointRemoverRuns;
@@ -65,3 +88,38 @@ bool ClosedUnrefCheckpointRemover::callback(Dispatcher &d, TaskId t) {
     d.snooze(t, sleepTime);
     return true;
 }
+
+bool ClosedCheckpointSpiller::callback(Dispatcher &d, TaskId t) {
+    CheckpointConfig &config = store->getEPEngine().getCheckpointConfig();
+    if (available && config.canSpillClosedCheckpoints()) {
+        available = false;
+        shared_ptr<CheckpointSpillVisitor> pv(new CheckpointSpillVisitor(&available));
+        store->visit(pv, "Checkpoint Spiller", &d, Priority::CheckpointSpillerPriority);
+    }
+    d.snooze(t, sleepTime);
+    return true;
+}
+
+bool SpilledChunkLoader::callback(Dispatcher &d, TaskId t) {
+    (void)d; (void)t;
+    RCPtr<VBucket> vb = store->getVBucket(vbid);
+    if (!vb) {
+        return false;
+    }
+    std::vector<std::string> failed;
+    vb->checkpointManager.loadSpilledChunks(failed);
+    EventuallyPersistentEngine &engine = store->getEPEngine();
+    std::vector<std::string>::iterator it = failed.begin();
+    for (; it != failed.end(); ++it) {
+        DisconnectTapOperation tapop;
+        engine.getTapConnMap().performTapOp(*it, tapop, static_cast<void*>(NULL));
+    }
+    engine.notifyNotificationThread();
+    return false;
+}
+
+void SpilledChunkLoadScheduler::chunkLoadNeeded(uint16_t vbid) {
+    shared_ptr<DispatcherCallback> cb(new SpilledChunkLoader(store, vbid));
+    store->getTapDispatcher()->schedule(cb, NULL, Priority::SpilledChunkLoaderPriority,
+                                        0, false);
+}
@@ -8,6 +8,7 @@
 #include "common.hh"
 #include "stats.hh"
 #include "dispatcher.hh"
+#include "checkpoint.hh"
 
 class EventuallyPersistentStore;
 
@@ -39,4 +40,67 @@ private:
     bool                       available;
 };
 
+/**
+ * Dispatcher job that spills the closed checkpoints only TAP cursors still
+ * need to disk.  It runs on the TAP dispatcher, so that the writes hold up
+ * neither the checkpoint lock nor the non-IO jobs.
+ */
+class ClosedCheckpointSpiller : public DispatcherCallback {
+public:
+
+    ClosedCheckpointSpiller(EventuallyPersistentStore *s, size_t interval) :
+        store(s), sleepTime(interval), available(true) {}
+
+    bool callback(Dispatcher &d, TaskId t);
+
+    std::string description() {
+        return std::string("Spilling closed checkpoints to disk");
+    }
+
+private:
+    EventuallyPersistentStore *store;
+    size_t                     sleepTime;
+    bool                       available;
+};
+
+/**
+ * Dispatcher job that reads back the spilled checkpoint chunks the TAP
+ * cursors of a vbucket are about to walk through, then wakes up the paused
+ * TAP connections.  Connections whose cursors were dropped because a chunk
+ * couldn't be read are disconnected, to be backfilled when they come back.
+ */
+class SpilledChunkLoader : public DispatcherCallback {
+public:
+
+    SpilledChunkLoader(EventuallyPersistentStore *s, uint16_t vb) :
+        store(s), vbid(vb) {}
+
+    bool callback(Dispatcher &d, TaskId t);
+
+    std::string description() {
+        std::stringstream ss;
+        ss << "Reading back spilled checkpoint items for vbucket " << vbid;
+        return ss.str();
+    }
+
+private:
+    EventuallyPersistentStore *store;
+    uint16_t                   vbid;
+};
+
+/**
+ * Schedules a SpilledChunkLoader on the TAP dispatcher whenever a TAP cursor
+ * runs into spilled checkpoint chunks.
+ */
+class SpilledChunkLoadScheduler : public SpilledChunkLoadListener {
+public:
+
+    SpilledChunkLoadScheduler(EventuallyPersistentStore *s) : store(s) {}
+
+    void chunkLoadNeeded(uint16_t vbid);
+
+private:
+    EventuallyPersistentStore *store;
+};
+
 #endif /* CHECKPOINT_REMOVER_HH */
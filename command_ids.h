@@ -162,6 +162,22 @@
  */
 #define CMD_CHANGE_VB_FILTER 0xb0
 
+/**
+ * Command to block until a mutation is persisted and/or acked by a
+ * number of replication TAP streams.
+ */
+#define CMD_WAIT_FOR_DURABILITY 0xb1
+
+/**
+ * Command to get a batch of keys from one vbucket.
+ *
+ * The body is a series of keys, each preceded by its length as a
+ * 16-bit integer in network byte order.  Every key found comes back in
+ * a response of its own, with its flags as extras, and the batch ends
+ * with a response without a key.  Keys that aren't found are left out.
+ */
+#define CMD_GET_MULTI 0xb2
+
 
 /**
  * TAP OPAQUE command list
@@ -287,4 +303,28 @@ typedef union {
 } protocol_binary_request_notify_vbucket_update;
 typedef protocol_binary_response_no_extras protocol_binary_response_notify_vbucket_update;
 
+/**
+ * The CMD_WAIT_FOR_DURABILITY request carries the key of the mutation
+ * to wait for, and its CAS in the header (0 for the current one).  The
+ * response carries the CAS of the item waited for and in its body:
+ *
+ *   uint16_t whether the item is persisted
+ *   uint16_t the number of replication TAP streams that acked the item
+ *
+ * The status is ETMPFAIL if the timeout expired first.
+ */
+#define DURABILITY_PERSIST 0x01
+
+typedef union {
+    struct {
+        protocol_binary_request_header header;
+        struct {
+            uint32_t timeout;   // milliseconds
+            uint16_t replicas;  // replication TAP streams to wait for
+            uint16_t flags;     // DURABILITY_PERSIST to wait for the disk
+        } body;
+    } message;
+    uint8_t bytes[sizeof(protocol_binary_request_header) + 8];
+} protocol_binary_request_wait_for_durability;
+
 #endif /* EP_ENGINE_COMMAND_IDS_H */
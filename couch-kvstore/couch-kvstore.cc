@@ -230,9 +230,10 @@ struct LoadResponseCtx {
     EventuallyPersistentEngine *engine;
 };
 
-CouchRequest::CouchRequest(const Item &it, int rev, CouchRequestCallback &cb, bool del) :
+CouchRequest::CouchRequest(const Item &it, int rev, uint64_t gen,
+                           CouchRequestCallback &cb, bool del) :
     value(it.getValue()), valuelen(it.getNBytes()),
-    vbucketId(it.getVBucketId()), fileRevNum(rev),
+    vbucketId(it.getVBucketId()), fileRevNum(rev), generation(gen),
     key(it.getKey()), deleteItem(del)
 {
     bool isjson = false;
@@ -277,8 +278,9 @@ CouchKVStore::CouchKVStore(EventuallyPersistentEngine &theEngine,
     epStats(theEngine.getEpStats()),
     configuration(theEngine.getConfiguration()),
     dbname(configuration.getDbname()),
-    couchNotifier(NULL), pendingCommitCnt(0),
-    intransaction(false)
+    couchNotifier(NULL), files(new CouchKVStoreFiles()),
+    dbFileMap(files->dbFileMap), cachedVBStates(files->cachedVBStates),
+    pendingCommitCnt(0), intransaction(false)
 {
     open();
     statCollectingFileOps = getCouchstoreStatsOps(&st.fsStats);
@@ -289,11 +291,11 @@ CouchKVStore::CouchKVStore(const CouchKVStore &copyFrom) :
     epStats(copyFrom.epStats),
     configuration(copyFrom.configuration),
     dbname(copyFrom.dbname),
-    couchNotifier(NULL),
+    couchNotifier(NULL), files(copyFrom.files),
+    dbFileMap(files->dbFileMap), cachedVBStates(files->cachedVBStates),
     pendingCommitCnt(0), intransaction(false)
 {
     open();
-    dbFileMap = copyFrom.dbFileMap;
     statCollectingFileOps = getCouchstoreStatsOps(&st.fsStats);
 }
 
@@ -303,15 +305,19 @@ void CouchKVStore::reset()
     // TODO CouchKVStore::flush() when couchstore api ready
     RememberingCallback<bool> cb;
 
+    // Keep every other writer out of the files while they go away.
+    MultiLockHolder vblh(files->getVBucketLocks(),
+                         files->getNumVBucketLocks());
     couchNotifier->flush(cb);
     cb.waitForValue();
 
+    LockHolder lh(files->mutex);
     vbucket_map_t::iterator itor = cachedVBStates.begin();
     for (; itor != cachedVBStates.end(); ++itor) {
         uint16_t vbucket = itor->first;
         itor->second.checkpointId = 0;
         itor->second.maxDeletedSeqno = 0;
-        updateDbFileMap(vbucket, 1, true);
+        dbFileMap.insert(std::pair<uint16_t, int>(vbucket, 1));
     }
 }
 
@@ -334,7 +340,9 @@ void CouchKVStore::set(const Item &itm, Callback<mutation_result> &cb)
     }
 
     // each req will be de-allocated after commit
-    CouchRequest *req = new CouchRequest(itm, fileRev, requestcb, deleteItem);
+    CouchRequest *req = new CouchRequest(itm, fileRev,
+                                         files->getGeneration(itm.getVBucketId()),
+                                         requestcb, deleteItem);
     queueItem(req);
 }
 
@@ -506,6 +514,7 @@ void CouchKVStore::del(const Item &itm,
         requestcb.delCb = &cb;
         // each req will be de-allocated after commit
         CouchRequest *req = new CouchRequest(itm, dbFileRev(dbFile),
+                                             files->getGeneration(itm.getVBucketId()),
                                              requestcb, true);
         queueItem(req);
     } else {
@@ -525,32 +534,30 @@ bool CouchKVStore::delVBucket(uint16_t vbucket)
     assert(couchNotifier);
     RememberingCallback<bool> cb;
 
+    LockHolder vblh(files->getVBucketLock(vbucket));
     couchNotifier->delVBucket(vbucket, cb);
     cb.waitForValue();
 
+    // Whatever another writer still has queued for the vbucket is gone
+    // with it.
+    files->nextGeneration(vbucket);
+    LockHolder lh(files->mutex);
     cachedVBStates.erase(vbucket);
+    lh.unlock();
     updateDbFileMap(vbucket, 1, false);
     return cb.val;
 }
 
 vbucket_map_t CouchKVStore::listPersistedVbuckets()
 {
-    std::vector<std::string> files;
-
-    if (dbFileMap.empty()) {
-        // warmup, first discover db files from local directory
-        discoverDbFiles(dbname, files);
-        populateFileNameMap(files);
-    }
-
-    if (!cachedVBStates.empty()) {
-        cachedVBStates.clear();
-    }
+    std::map<uint16_t, int> filemap;
+    getDbFileMap(filemap);
 
+    vbucket_map_t states;
     Db *db = NULL;
     couchstore_error_t errorCode;
-    std::map<uint16_t, int>::iterator itr = dbFileMap.begin();
-    for (; itr != dbFileMap.end(); itr++) {
+    std::map<uint16_t, int>::iterator itr = filemap.begin();
+    for (; itr != filemap.end(); itr++) {
         errorCode = openDB(itr->first, itr->second, &db, 0);
         if (errorCode != COUCHSTORE_SUCCESS) {
             std::stringstream rev, vbid;
@@ -569,14 +576,17 @@ vbucket_map_t CouchKVStore::listPersistedVbuckets()
             /* read state of VBucket from db file */
             readVBState(db, vbID, vb_state);
             /* insert populated state to the array to return to the caller */
-            cachedVBStates[vbID] = vb_state;
+            states[vbID] = vb_state;
             /* update stat */
             ++st.numLoadedVb;
             closeDatabaseHandle(db);
         }
         db = NULL;
     }
-    return cachedVBStates;
+
+    LockHolder lh(files->mutex);
+    cachedVBStates = states;
+    return states;
 }
 
 void CouchKVStore::getPersistedStats(std::map<std::string, std::string> &stats)
@@ -629,6 +639,7 @@ bool CouchKVStore::snapshotVBuckets(const vbucket_map_t &m)
     for (iter = m.rbegin(); iter != m.rend(); ++iter) {
         uint16_t vbucketId = iter->first;
         vbucket_state vbstate = iter->second;
+        LockHolder lh(files->mutex);
         vbucket_map_t::iterator it =
             cachedVBStates.find(vbucketId);
         bool state_changed = true;
@@ -648,6 +659,7 @@ bool CouchKVStore::snapshotVBuckets(const vbucket_map_t &m)
         } else {
             cachedVBStates[vbucketId] = vbstate;
         }
+        lh.unlock();
 
         success = setVBucketState(vbucketId, vbstate, state_changed, false);
         if (!success) {
@@ -740,11 +752,18 @@ bool CouchKVStore::setVBucketState(uint16_t vbucketId, vbucket_state vbstate,
     id << vbucketId;
     dbFileName = dbname + "/" + id.str() + ".couch";
 
+    LockHolder vblh(files->getVBucketLock(vbucketId));
     if (newfile) {
         fileRev = 1; // create a db file with rev = 1
     } else {
+        LockHolder lh(files->mutex);
         mapItr = dbFileMap.find(vbucketId);
-        if (mapItr == dbFileMap.end()) {
+        bool found = mapItr != dbFileMap.end();
+        if (found) {
+            fileRev = mapItr->second;
+        }
+        lh.unlock();
+        if (!found) {
             rev = checkNewRevNum(dbFileName, true);
             if (rev == 0) {
                 fileRev = 1;
@@ -752,8 +771,6 @@ bool CouchKVStore::setVBucketState(uint16_t vbucketId, vbucket_state vbstate,
             } else {
                 fileRev = rev;
             }
-        } else {
-            fileRev = mapItr->second;
         }
     }
 
@@ -849,8 +866,11 @@ void CouchKVStore::dumpDeleted(uint16_t vb,  shared_ptr<Callback<GetValue> > cb)
 
 StorageProperties CouchKVStore::getStorageProperties()
 {
+    // Each writer is a newWriter() over the same files, and the files of
+    // a vbucket take one writer at a time.
     size_t concurrency(10);
-    StorageProperties rv(concurrency, concurrency - 1, 1, true, true,
+    size_t writers(4);
+    StorageProperties rv(concurrency, concurrency - 1, writers, true, true,
                          true, true);
     return rv;
 }
@@ -937,36 +957,36 @@ void CouchKVStore::loadDB(shared_ptr<Callback<GetValue> > cb, bool keysOnly,
                           std::vector<uint16_t> *vbids,
                           couchstore_docinfos_options options)
 {
-    std::vector<std::string> files = std::vector<std::string>();
-    std::map<uint16_t, int> &filemap = dbFileMap;
-    std::map<uint16_t, int> vbmap;
+    std::map<uint16_t, int> filemap;
     std::vector< std::pair<uint16_t, int> > vbuckets;
     std::vector< std::pair<uint16_t, int> > replicaVbuckets;
     bool loadingData = !vbids && !keysOnly;
 
-    if (dbFileMap.empty()) {
-        // warmup, first discover db files from local directory
-        discoverDbFiles(dbname, files);
-        populateFileNameMap(files);
-    }
+    getDbFileMap(filemap);
 
     if (vbids) {
         // get entries for given vbucket(s) from dbFileMap
         std::string dirname = dbname;
-        getFileNameMap(vbids, dirname, vbmap);
-        filemap = vbmap;
+        filemap.clear();
+        getFileNameMap(vbids, dirname, filemap);
     }
 
     // order vbuckets data loading by using vbucket states
-    if (loadingData && cachedVBStates.empty()) {
-        listPersistedVbuckets();
+    vbucket_map_t vbstates;
+    if (loadingData) {
+        LockHolder lh(files->mutex);
+        vbstates = cachedVBStates;
+        lh.unlock();
+        if (vbstates.empty()) {
+            vbstates = listPersistedVbuckets();
+        }
     }
 
     std::map<uint16_t, int>::iterator fitr = filemap.begin();
     for (; fitr != filemap.end(); fitr++) {
         if (loadingData) {
-            vbucket_map_t::const_iterator vsit = cachedVBStates.find(fitr->first);
-            if (vsit != cachedVBStates.end()) {
+            vbucket_map_t::const_iterator vsit = vbstates.find(fitr->first);
+            if (vsit != vbstates.end()) {
                 vbucket_state vbs = vsit->second;
                 // ignore loading dead vbuckets during warmup
                 if (vbs.state == vbucket_state_active) {
@@ -1074,8 +1094,10 @@ bool CouchKVStore::getDbFile(uint16_t vbucketId,
     fileName << dbname << "/" << vbucketId << ".couch";
     std::map<uint16_t, int>::iterator itr;
 
+    LockHolder lh(files->mutex);
     itr = dbFileMap.find(vbucketId);
     if (itr == dbFileMap.end()) {
+        lh.unlock();
         dbFileName = fileName.str();
         int rev = checkNewRevNum(dbFileName, true);
         if (rev > 0) {
@@ -1131,6 +1153,7 @@ int CouchKVStore::checkNewRevNum(std::string &dbFileName, bool newFile)
 void CouchKVStore::updateDbFileMap(uint16_t vbucketId, int newFileRev,
                                    bool insertImmediately)
 {
+    LockHolder lh(files->mutex);
     if (insertImmediately) {
         dbFileMap.insert(std::pair<uint16_t, int>(vbucketId, newFileRev));
         return;
@@ -1220,8 +1243,12 @@ void CouchKVStore::getFileNameMap(std::vector<uint16_t> *vbids,
 
     for (vbidItr = vbids->begin(); vbidItr != vbids->end(); vbidItr++) {
         std::string dbFileName = getDBFileName(dirname, *vbidItr);
+        LockHolder lh(files->mutex);
         dbFileItr = dbFileMap.find(*vbidItr);
-        if (dbFileItr == dbFileMap.end()) {
+        bool found = dbFileItr != dbFileMap.end();
+        int rev = found ? dbFileItr->second : 0;
+        lh.unlock();
+        if (!found) {
             int rev = checkNewRevNum(dbFileName, true);
             if (rev > 0) {
                 filemap.insert(std::pair<uint16_t, int>(*vbidItr, rev));
@@ -1231,12 +1258,27 @@ void CouchKVStore::getFileNameMap(std::vector<uint16_t> *vbids,
                                  dbFileName.c_str());
             }
         } else {
-            filemap.insert(std::pair<uint16_t, int>(dbFileItr->first,
-                                                    dbFileItr->second));
+            filemap.insert(std::pair<uint16_t, int>(*vbidItr, rev));
         }
     }
 }
 
+/**
+ * Get a copy of the file revision of each vbucket, looking the files up in
+ * the data directory the first time round.
+ */
+void CouchKVStore::getDbFileMap(std::map<uint16_t, int> &filemap)
+{
+    LockHolder lh(files->mutex);
+    if (dbFileMap.empty()) {
+        std::vector<std::string> filenames;
+        discoverDbFiles(dbname, filenames);
+        populateFileNameMap(filenames);
+    }
+    filemap = dbFileMap;
+}
+
+// Called with files->mutex held.
 void CouchKVStore::populateFileNameMap(std::vector<std::string> &filenames)
 {
     std::vector<std::string>::iterator fileItr;
@@ -1298,13 +1340,14 @@ couchstore_error_t CouchKVStore::fetchDoc(Db *db, DocInfo *docinfo,
     memcpy(&itemFlags, (metadata.buf) + 12, 4);
     itemFlags = ntohl(itemFlags);
 
-    if (metaOnly) {
-        // we should allow a metadata disk fetch for deleted items only
-        assert(docinfo->deleted);
+    // Under full eviction a metadata fetch can also be for a live item
+    // that was dropped from memory, that one is read back in full.
+    if (metaOnly && docinfo->deleted) {
         it = new Item(docinfo->id.buf, (size_t)docinfo->id.size,
                       docinfo->size, itemFlags, (time_t)exptime, cas);
         it->setSeqno(docinfo->rev_seq);
         docValue = GetValue(it);
+        docValue.setPartial();
 
         // update ep-engine IO stats
         ++epStats.io_num_read;
@@ -1322,7 +1365,8 @@ couchstore_error_t CouchKVStore::fetchDoc(Db *db, DocInfo *docinfo,
                 valuePtr = doc->data.buf;
                 it = new Item(docinfo->id.buf, (size_t)docinfo->id.size,
                         itemFlags, (time_t)exptime, valuePtr, valuelen,
-                        cas, -1, vbId);
+                        cas, docinfo->db_seq, vbId);
+                it->setSeqno(docinfo->rev_seq);
                 docValue = GetValue(it);
                 couchstore_free_document(doc);
 
@@ -1434,24 +1478,41 @@ bool CouchKVStore::commit2couchstore(void)
         return success;
     }
 
-    committedReqs = new CouchRequest *[pendingCommitCnt];
-    docs = new Doc *[pendingCommitCnt];
-    docinfos = new DocInfo *[pendingCommitCnt];
+    size_t numReqs = pendingCommitCnt;
+    committedReqs = new CouchRequest *[numReqs];
+    docs = new Doc *[numReqs];
+    docinfos = new DocInfo *[numReqs];
 
     assert(pendingReqsQ[0]);
     vbucket2flush = pendingReqsQ[0]->getVBucketId();
     fileRev = pendingReqsQ[0]->getRevNum();
-    for (reqIndex = 0; pendingCommitCnt > 0; ++reqIndex, --pendingCommitCnt) {
-        req = pendingReqsQ[reqIndex];
+
+    // Other writers may write to the same file, and the vbucket may have
+    // been deleted since the requests were queued, in which case they
+    // would bring its file back.
+    LockHolder vblh(files->getVBucketLock(vbucket2flush));
+    uint64_t generation = files->getGeneration(vbucket2flush);
+    size_t numDropped = 0;
+    for (reqIndex = 0; pendingCommitCnt > 0; --pendingCommitCnt) {
+        req = pendingReqsQ[reqIndex + numDropped];
         assert(req);
+        assert(vbucket2flush == req->getVBucketId());
+        if (req->getGeneration() != generation) {
+            committedReqs[numReqs - ++numDropped] = req;
+            continue;
+        }
         committedReqs[reqIndex] = req;
         docs[reqIndex] = req->getDbDoc();
         docinfos[reqIndex] = req->getDbDocInfo();
-        assert(vbucket2flush == req->getVBucketId());
+        ++reqIndex;
     }
 
     // flush all
-    errCode = saveDocs(vbucket2flush, fileRev, docs, docinfos, reqIndex);
+    errCode = COUCHSTORE_SUCCESS;
+    if (reqIndex > 0) {
+        errCode = saveDocs(vbucket2flush, fileRev, docs, docinfos, reqIndex);
+    }
+    vblh.unlock();
     if (errCode) {
         getLogger()->log(EXTENSION_LOG_WARNING, NULL,
                 "Warning: commit failed, cannot save CouchDB docs "
@@ -1459,11 +1520,18 @@ bool CouchKVStore::commit2couchstore(void)
         ++epStats.commitFailed;
     }
     commitCallback(committedReqs, reqIndex, errCode);
+    if (numDropped > 0) {
+        getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                         "Dropped %ld writes to deleted vbucket %d\n",
+                         numDropped, vbucket2flush);
+        commitCallback(committedReqs + reqIndex, numDropped,
+                       COUCHSTORE_SUCCESS);
+    }
 
     // clean up
     pendingReqsQ.clear();
-    while (reqIndex--) {
-        delete committedReqs[reqIndex];
+    for (size_t i = 0; i < numReqs; ++i) {
+        delete committedReqs[i];
     }
     delete [] committedReqs;
     delete [] docs;
@@ -1501,11 +1569,14 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, int rev, Doc **docs,
             // update max_deleted_seq in the local doc (vbstate)
             // before save docs for the given vBucket
             if (max > 0) {
+                LockHolder lh(files->mutex);
                 vbucket_map_t::iterator it =
                     cachedVBStates.find(vbid);
                 if (it != cachedVBStates.end() && it->second.maxDeletedSeqno < max) {
                     it->second.maxDeletedSeqno = max;
-                    errCode = saveVBState(db, it->second);
+                    vbucket_state vbstate = it->second;
+                    lh.unlock();
+                    errCode = saveVBState(db, vbstate);
                     if (errCode != COUCHSTORE_SUCCESS) {
                         getLogger()->log(EXTENSION_LOG_WARNING, NULL,
                                          "Warning: failed to save local doc for, "
@@ -1593,6 +1664,7 @@ void CouchKVStore::remVBucketFromDbFileMap(uint16_t vbucketId)
 {
     std::map<uint16_t, int>::iterator itr;
 
+    LockHolder lh(files->mutex);
     itr = dbFileMap.find(vbucketId);
     if (itr != dbFileMap.end()) {
         dbFileMap.erase(itr);
@@ -1813,18 +1885,13 @@ bool CouchKVStore::getEstimatedItemCount(size_t &items)
 {
     Db *db = NULL;
     couchstore_error_t errCode;
-    std::vector<std::string> files;
+    std::map<uint16_t, int> filemap;
 
     items = 0;
+    getDbFileMap(filemap);
 
-    if (dbFileMap.empty()) {
-        // first scan all db files from data directory
-        discoverDbFiles(dbname, files);
-        populateFileNameMap(files);
-    }
-
-    std::map<uint16_t, int>::iterator fitr = dbFileMap.begin();
-    for (; fitr != dbFileMap.end(); ++fitr) {
+    std::map<uint16_t, int>::iterator fitr = filemap.begin();
+    for (; fitr != filemap.end(); ++fitr) {
         errCode = openDB(fitr->first, fitr->second, &db, 0);
         if (errCode == COUCHSTORE_SUCCESS) {
             DbInfo info;
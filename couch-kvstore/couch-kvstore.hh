@@ -7,6 +7,7 @@
 #include "histo.hh"
 #include "stats.hh"
 #include "configuration.hh"
+#include "locks.hh"
 #include "couch-kvstore/couch-notifier.hh"
 #include "couch-kvstore/couch-fs-stats.hh"
 
@@ -80,7 +81,8 @@ const size_t COUCHSTORE_METADATA_SIZE(2 * sizeof(uint32_t) + sizeof(uint64_t));
 class CouchRequest
 {
 public:
-    CouchRequest(const Item &it, int rev, CouchRequestCallback &cb, bool del);
+    CouchRequest(const Item &it, int rev, uint64_t gen,
+                 CouchRequestCallback &cb, bool del);
 
     uint16_t getVBucketId(void) {
         return vbucketId;
@@ -88,6 +90,9 @@ public:
     int getRevNum(void) {
         return fileRevNum;
     }
+    uint64_t getGeneration(void) {
+        return generation;
+    }
     Doc *getDbDoc(void) {
         if (deleteItem) {
             return NULL;
@@ -127,6 +132,7 @@ private :
     uint8_t meta[COUCHSTORE_METADATA_SIZE];
     uint16_t vbucketId;
     int fileRevNum;
+    uint64_t generation;
     std::string key;
     Doc dbDoc;
     DocInfo dbDocInfo;
@@ -137,6 +143,75 @@ private :
     hrtime_t start;
 };
 
+/**
+ * What the read-write CouchKVStore instances of an engine share, so that
+ * each flusher can write its own vbuckets through an instance of its own:
+ * the file revision and the cached state of each vbucket, and how many
+ * times each vbucket was deleted.
+ *
+ * A couchstore file takes a single writer at a time, so whoever writes
+ * to the file of a vbucket holds its lock from opening the file to
+ * closing it.  There is one lock per writer, and the vbuckets are
+ * striped over them the same way the flushers split the vbuckets
+ * between them, so flushers don't contend for them.
+ */
+class CouchKVStoreFiles : public RCValue {
+public:
+    CouchKVStoreFiles() : vbLocks(new Mutex[1]), numVBLocks(1) { }
+
+    ~CouchKVStoreFiles() {
+        delete []vbLocks;
+    }
+
+    /**
+     * Set the number of writers, before any of them writes anything.
+     */
+    void setNumWriters(size_t n) {
+        assert(n > 0);
+        delete []vbLocks;
+        vbLocks = new Mutex[n];
+        numVBLocks = n;
+    }
+
+    Mutex &getVBucketLock(uint16_t vbid) {
+        return vbLocks[vbid % numVBLocks];
+    }
+
+    Mutex *getVBucketLocks() {
+        return vbLocks;
+    }
+
+    size_t getNumVBucketLocks() {
+        return numVBLocks;
+    }
+
+    /**
+     * Get the number of times a vbucket was deleted, which tells the
+     * requests queued for an earlier incarnation of it apart.
+     */
+    uint64_t getGeneration(uint16_t vbid) {
+        LockHolder lh(mutex);
+        return generations[vbid];
+    }
+
+    void nextGeneration(uint16_t vbid) {
+        LockHolder lh(mutex);
+        ++generations[vbid];
+    }
+
+    // Guards everything but the vbucket locks.
+    Mutex mutex;
+    std::map<uint16_t, int> dbFileMap;
+    vbucket_map_t cachedVBStates;
+
+private:
+    std::map<uint16_t, uint64_t> generations;
+    Mutex *vbLocks;
+    size_t numVBLocks;
+
+    DISALLOW_COPY_AND_ASSIGN(CouchKVStoreFiles);
+};
+
 /**
  * Couchstore kv-store
  */
@@ -148,6 +223,11 @@ public:
      */
     CouchKVStore(EventuallyPersistentEngine &theEngine,
                  bool read_only = false);
+
+    /**
+     * Build another connection to the same files, sharing their
+     * revisions and the vbucket states with the one copied.
+     */
     CouchKVStore(const CouchKVStore &from);
 
     /**
@@ -193,6 +273,20 @@ public:
      */
     StorageProperties getStorageProperties(void);
 
+    /**
+     * Overrides newWriter().
+     */
+    KVStore *newWriter(void) {
+        return new CouchKVStore(*this);
+    }
+
+    /**
+     * Overrides setNumWriters().
+     */
+    void setNumWriters(size_t n) {
+        files->setNumWriters(n);
+    }
+
     /**
      * Overrides set().
      */
@@ -304,6 +398,7 @@ private:
 
     int checkNewRevNum(std::string &dbname, bool newFile = false);
 
+    void getDbFileMap(std::map<uint16_t, int> &filemap);
     void populateFileNameMap(std::vector<std::string> &filenames);
     void getFileNameMap(std::vector<uint16_t> *vbids, std::string &dirname,
                         std::map<uint16_t, int> &filemap);
@@ -325,7 +420,11 @@ private:
     Configuration &configuration;
     const std::string dbname;
     CouchNotifier *couchNotifier;
-    std::map<uint16_t, int>dbFileMap;
+    RCPtr<CouchKVStoreFiles> files;
+    // Guarded by files->mutex.
+    std::map<uint16_t, int> &dbFileMap;
+    /* vbucket state cache, guarded by files->mutex */
+    vbucket_map_t &cachedVBStates;
     std::vector<CouchRequest *> pendingReqsQ;
     size_t pendingCommitCnt;
     bool intransaction;
@@ -333,8 +432,6 @@ private:
     /* all stats */
     CouchKVStoreStats   st;
     couch_file_ops statCollectingFileOps;
-    /* vbucket state cache*/
-    vbucket_map_t cachedVBStates;
 };
 
 #endif /* COUCHSTORE_KVSTORE_H */
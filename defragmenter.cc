@@ -0,0 +1,109 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <map>
+#include <string>
+
+#include "defragmenter.hh"
+#include "ep.hh"
+#include "ep_engine.h"
+#include "memory_tracker.hh"
+#include "stored-value.hh"
+
+/**
+ * Visit every vbucket, compacting the StoredValue slabs of its hash
+ * table and moving the values that have been around for a while.
+ *
+ * No more than maxBytesPerSec are moved in any one second; once the
+ * budget is spent the rest of the current hash table is skipped and
+ * the visitor pauses until the next second starts.
+ */
+class DefragmentVisitor : public VBucketVisitor {
+public:
+
+    DefragmentVisitor(EPStats &st, size_t age, size_t maxBytes,
+                      size_t slabUsage, bool *sfin) :
+        stats(st), ageThreshold(static_cast<uint8_t>(age)),
+        maxBytesPerSec(maxBytes), slabUsagePcnt(slabUsage),
+        windowStart(gethrtime()), windowBytes(0), stateFinalizer(sfin) {}
+
+    bool visitBucket(RCPtr<VBucket> &vb) {
+        if (!VBucketVisitor::visitBucket(vb)) {
+            return false;
+        }
+        size_t moved = 0;
+        size_t released = vb->ht.defragmentValues(slabUsagePcnt, moved);
+        stats.defragSlabBytesReleased.incr(released);
+        account(moved);
+        return shouldContinue();
+    }
+
+    void visit(StoredValue *v) {
+        size_t moved = v->defragmentValue(ageThreshold);
+        if (moved > 0) {
+            ++stats.defragValuesMoved;
+            account(moved);
+        }
+    }
+
+    bool shouldContinue() {
+        return maxBytesPerSec == 0 || windowBytes < maxBytesPerSec;
+    }
+
+    bool pauseVisitor() {
+        if (gethrtime() - windowStart >= 1000000000) {
+            windowStart = gethrtime();
+            windowBytes = 0;
+        }
+        return !shouldContinue();
+    }
+
+    void complete() {
+        if (stateFinalizer) {
+            *stateFinalizer = true;
+        }
+    }
+
+private:
+
+    void account(size_t moved) {
+        stats.defragBytesMoved.incr(moved);
+        windowBytes += moved;
+    }
+
+    EPStats  &stats;
+    uint8_t   ageThreshold;
+    size_t    maxBytesPerSec;
+    size_t    slabUsagePcnt;
+    hrtime_t  windowStart;
+    size_t    windowBytes;
+    bool     *stateFinalizer;
+};
+
+bool Defragmenter::callback(Dispatcher &d, TaskId t) {
+    if (available) {
+        ++stats.defragRuns;
+
+        std::map<std::string, size_t> alloc_stats;
+        MemoryTracker::getInstance()->getAllocatorStats(alloc_stats);
+        size_t heap = alloc_stats["total_heap_bytes"];
+        if (heap > 0) {
+            stats.defragFragmentation.set(
+                static_cast<double>(alloc_stats["total_fragmentation_bytes"]) /
+                static_cast<double>(heap));
+        }
+
+        Configuration &config = store.getEPEngine().getConfiguration();
+        available = false;
+        shared_ptr<DefragmentVisitor>
+            pv(new DefragmentVisitor(stats, config.getDefragAgeThreshold(),
+                                     config.getDefragBytesPerSec(),
+                                     config.getDefragSlabUsagePcnt(),
+                                     &available));
+        store.visit(pv, "Defragmenter", &d, Priority::DefragmenterPriority,
+                    true, 1.0);
+    }
+    d.snooze(t, sleepTime);
+    return true;
+}
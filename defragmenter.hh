@@ -0,0 +1,44 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef DEFRAGMENTER_HH
+#define DEFRAGMENTER_HH 1
+
+#include "config.h"
+
+#include "dispatcher.hh"
+
+class EventuallyPersistentStore;
+class EPStats;
+
+/**
+ * Dispatcher job that periodically moves long lived values and
+ * StoredValues to fresh allocations, so the memory they were pinning
+ * in mostly empty pages and slabs can be given back.
+ */
+class Defragmenter : public DispatcherCallback {
+public:
+
+    /**
+     * Construct a Defragmenter.
+     *
+     * @param s the store (where we'll visit)
+     * @param st the stats
+     * @param stime number of seconds to wait between runs
+     */
+    Defragmenter(EventuallyPersistentStore *s, EPStats &st, size_t stime) :
+        store(*s), stats(st), sleepTime(static_cast<double>(stime)),
+        available(true) {}
+
+    bool callback(Dispatcher &d, TaskId t);
+
+    std::string description() {
+        return std::string("Defragmenting memory.");
+    }
+
+private:
+    EventuallyPersistentStore &store;
+    EPStats                   &stats;
+    double                     sleepTime;
+    bool                       available;
+};
+
+#endif // DEFRAGMENTER_HH
@@ -0,0 +1,363 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+
+#include <algorithm>
+
+#include "durability.hh"
+#include "ep.hh"
+#include "ep_engine.h"
+#include "tapconnection.hh"
+#include "tapconnmap.hh"
+
+/**
+ * Where a replication stream is with a waited for mutation.
+ */
+struct ReplicaState {
+    ReplicaState(const std::string &n, tap_key_state st, uint32_t s) :
+        name(n), state(st), seqno(s) {}
+
+    std::string name;
+    tap_key_state state;
+    uint32_t seqno;
+};
+
+/**
+ * Find out how far each replication stream got with a mutation.
+ */
+class ReplicaStateCollector {
+public:
+    ReplicaStateCollector(uint16_t vb, const std::string &k,
+                          std::vector<ReplicaState> &s) :
+        vbucket(vb), key(k), states(s) {}
+
+    void operator() (TapConnection *tc) {
+        TapProducer *tp = dynamic_cast<TapProducer*>(tc);
+        if (tp && tp->isReplicating()) {
+            uint32_t seqno = 0;
+            tap_key_state st = tp->getKeyState(vbucket, key, seqno);
+            if (st != tap_key_pending) {
+                states.push_back(ReplicaState(tp->getName(), st, seqno));
+            }
+        }
+    }
+
+private:
+    uint16_t vbucket;
+    const std::string &key;
+    std::vector<ReplicaState> &states;
+};
+
+/**
+ * A waiter to look up in the store without holding the monitor's mutex.
+ */
+struct PersistCheck {
+    PersistCheck(DurabilityWaiter *w) :
+        waiter(w), vbucket(w->vbucket), key(w->key), cas(w->cas),
+        persisted(false) {}
+
+    DurabilityWaiter *waiter;
+    uint16_t vbucket;
+    std::string key;
+    uint64_t cas;
+    bool persisted;
+};
+
+DurabilityMonitor::~DurabilityMonitor() {
+    std::map<const void*, DurabilityWaiter*>::iterator it;
+    for (it = byCookie.begin(); it != byCookie.end(); ++it) {
+        delete it->second;
+    }
+}
+
+bool DurabilityMonitor::isPersisted(const std::string &key, uint16_t vbucket,
+                                    uint64_t cas, TransactionContext *txnCtx) {
+    key_stats kstats;
+    ENGINE_ERROR_CODE rv = store.getKeyStats(key, vbucket, kstats, true);
+    if (rv == ENGINE_KEY_ENOENT) {
+        // Full eviction only drops clean items from memory.
+        return store.isEvicted(key, vbucket) && !txnCtx->hasPendingWrites();
+    } else if (rv != ENGINE_SUCCESS) {
+        return false;
+    }
+    // A clean item may have been written by a transaction that hasn't
+    // committed yet, in which case its commit comes back to us.
+    return !kstats.dirty && kstats.cas >= cas && !txnCtx->hasPendingWrites();
+}
+
+void DurabilityMonitor::setPersisted_UNLOCKED(DurabilityWaiter *w) {
+    if (!w->persisted) {
+        w->persisted = true;
+        stats.persistWaitHisto.add((gethrtime() - w->start) / 1000);
+    }
+}
+
+void DurabilityMonitor::setAcked_UNLOCKED(DurabilityWaiter *w,
+                                          const std::string &name) {
+    w->sentBy.erase(name);
+    if (w->replicated < w->replicas && w->ackedBy.insert(name).second) {
+        ++w->replicated;
+        if (w->replicated == w->replicas) {
+            stats.replicationWaitHisto.add((gethrtime() - w->start) / 1000);
+        }
+    }
+}
+
+bool DurabilityMonitor::isWaiting_UNLOCKED(DurabilityWaiter *w) {
+    std::map<uint16_t, std::list<DurabilityWaiter*> >::iterator mit =
+        waiting.find(w->vbucket);
+    return mit != waiting.end() &&
+        std::find(mit->second.begin(), mit->second.end(), w) != mit->second.end();
+}
+
+void DurabilityMonitor::remove_UNLOCKED(DurabilityWaiter *w) {
+    std::map<uint16_t, std::list<DurabilityWaiter*> >::iterator mit =
+        waiting.find(w->vbucket);
+    if (mit != waiting.end()) {
+        mit->second.remove(w);
+        if (mit->second.empty()) {
+            waiting.erase(mit);
+        }
+    }
+}
+
+bool DurabilityMonitor::add(DurabilityWaiter *w) {
+    ++stats.durabilityWaits;
+    w->txnCtx = &store.getTransactionContext(w->vbucket);
+
+    // The waiter is in place before the lookups, so that any commit or
+    // message sent after them reaches it.
+    LockHolder lh(mutex);
+    waiting[w->vbucket].push_back(w);
+    byCookie[w->cookie] = w;
+    ++numWaiters;
+    if (w->replicas > 0) {
+        ++numReplicaWaiters;
+    }
+    lh.unlock();
+
+    // The connection is in here, so the waiter can't be claimed or
+    // cancelled until it's back.
+    bool persisted = w->persist && isPersisted(w->key, w->vbucket, w->cas, w->txnCtx);
+    std::vector<ReplicaState> states;
+    if (w->replicas > 0) {
+        ReplicaStateCollector collector(w->vbucket, w->key, states);
+        engine.getTapConnMap().each(collector);
+    }
+
+    lh.lock();
+    if (w->done) {
+        // Finished while we looked, the connection is being notified.
+        return false;
+    }
+    if (persisted) {
+        setPersisted_UNLOCKED(w);
+    }
+    std::vector<ReplicaState>::iterator sit;
+    for (sit = states.begin(); sit != states.end(); ++sit) {
+        if (sit->state == tap_key_acked) {
+            setAcked_UNLOCKED(w, sit->name);
+        } else if (w->ackedBy.find(sit->name) == w->ackedBy.end() &&
+                   w->sentBy.find(sit->name) == w->sentBy.end()) {
+            // Unless the stream sent it again since.
+            w->sentBy[sit->name] = sit->seqno;
+        }
+    }
+    if (!w->isSatisfied()) {
+        return false;
+    }
+
+    // Satisfied already, the connection doesn't block.
+    remove_UNLOCKED(w);
+    byCookie.erase(w->cookie);
+    --numWaiters;
+    if (w->replicas > 0) {
+        --numReplicaWaiters;
+    }
+    return true;
+}
+
+DurabilityWaiter *DurabilityMonitor::claim(const void *cookie) {
+    LockHolder lh(mutex);
+    std::map<const void*, DurabilityWaiter*>::iterator it = byCookie.find(cookie);
+    if (it == byCookie.end() || !it->second->done) {
+        return NULL;
+    }
+    DurabilityWaiter *w = it->second;
+    byCookie.erase(it);
+    return w;
+}
+
+void DurabilityMonitor::cancel(const void *cookie) {
+    LockHolder lh(mutex);
+    std::map<const void*, DurabilityWaiter*>::iterator it = byCookie.find(cookie);
+    if (it == byCookie.end()) {
+        return;
+    }
+    DurabilityWaiter *w = it->second;
+    byCookie.erase(it);
+    if (!w->done) {
+        remove_UNLOCKED(w);
+        --numWaiters;
+        if (w->replicas > 0) {
+            --numReplicaWaiters;
+        }
+    }
+    delete w;
+}
+
+void DurabilityMonitor::committed(TransactionContext *ctx) {
+    if (numWaiters.get() == 0) {
+        return;
+    }
+
+    // Only the vbuckets persisted through the transaction matter.
+    std::vector<PersistCheck> checks;
+    LockHolder lh(mutex);
+    std::map<uint16_t, std::list<DurabilityWaiter*> >::iterator mit;
+    for (mit = waiting.begin(); mit != waiting.end(); ++mit) {
+        if (&store.getTransactionContext(mit->first) != ctx) {
+            continue;
+        }
+        std::list<DurabilityWaiter*>::iterator it = mit->second.begin();
+        for (; it != mit->second.end(); ++it) {
+            if ((*it)->persist && !(*it)->persisted) {
+                checks.push_back(PersistCheck(*it));
+            }
+        }
+    }
+    lh.unlock();
+    if (checks.empty()) {
+        return;
+    }
+
+    std::vector<PersistCheck>::iterator cit;
+    for (cit = checks.begin(); cit != checks.end(); ++cit) {
+        cit->persisted = isPersisted(cit->key, cit->vbucket, cit->cas, ctx);
+    }
+
+    std::vector<const void*> toNotify;
+    lh.lock();
+    for (cit = checks.begin(); cit != checks.end(); ++cit) {
+        DurabilityWaiter *w = cit->waiter;
+        // A waiter that went away may have left its address to another
+        // one, which only counts if it waits for the same mutation.
+        if (!cit->persisted || !isWaiting_UNLOCKED(w) ||
+            w->key != cit->key || w->cas != cit->cas) {
+            continue;
+        }
+        setPersisted_UNLOCKED(w);
+        if (w->isSatisfied()) {
+            remove_UNLOCKED(w);
+            finish_UNLOCKED(w, ENGINE_SUCCESS, toNotify);
+        }
+    }
+    lh.unlock();
+    notify(toNotify);
+}
+
+void DurabilityMonitor::sent(const std::string &name, uint16_t vbid,
+                             const std::string &key, uint32_t seqno) {
+    if (numReplicaWaiters.get() == 0) {
+        return;
+    }
+    LockHolder lh(mutex);
+    std::map<uint16_t, std::list<DurabilityWaiter*> >::iterator mit = waiting.find(vbid);
+    if (mit == waiting.end()) {
+        return;
+    }
+    std::list<DurabilityWaiter*>::iterator it = mit->second.begin();
+    for (; it != mit->second.end(); ++it) {
+        DurabilityWaiter *w = *it;
+        if (w->replicated < w->replicas && w->key == key &&
+            w->ackedBy.find(name) == w->ackedBy.end()) {
+            // Sent again after a nack or a reconnect, it's the new
+            // message that has to be acked.
+            w->sentBy[name] = seqno;
+        }
+    }
+}
+
+void DurabilityMonitor::acked(const std::string &name, uint32_t seqno) {
+    if (numReplicaWaiters.get() == 0) {
+        return;
+    }
+    std::vector<const void*> toNotify;
+    LockHolder lh(mutex);
+    std::map<uint16_t, std::list<DurabilityWaiter*> >::iterator mit = waiting.begin();
+    while (mit != waiting.end()) {
+        std::list<DurabilityWaiter*>::iterator it = mit->second.begin();
+        while (it != mit->second.end()) {
+            DurabilityWaiter *w = *it;
+            std::map<std::string, uint32_t>::iterator sit = w->sentBy.find(name);
+            if (sit != w->sentBy.end() && sit->second <= seqno) {
+                setAcked_UNLOCKED(w, name);
+                if (w->isSatisfied()) {
+                    it = mit->second.erase(it);
+                    finish_UNLOCKED(w, ENGINE_SUCCESS, toNotify);
+                    continue;
+                }
+            }
+            ++it;
+        }
+        if (mit->second.empty()) {
+            waiting.erase(mit++);
+        } else {
+            ++mit;
+        }
+    }
+    lh.unlock();
+    notify(toNotify);
+}
+
+void DurabilityMonitor::expire(hrtime_t now) {
+    if (numWaiters.get() == 0) {
+        return;
+    }
+    std::vector<const void*> toNotify;
+    LockHolder lh(mutex);
+    std::map<uint16_t, std::list<DurabilityWaiter*> >::iterator mit = waiting.begin();
+    while (mit != waiting.end()) {
+        std::list<DurabilityWaiter*>::iterator it = mit->second.begin();
+        while (it != mit->second.end()) {
+            DurabilityWaiter *w = *it;
+            if (now >= w->deadline) {
+                it = mit->second.erase(it);
+                ++stats.durabilityTimeouts;
+                finish_UNLOCKED(w, ENGINE_TMPFAIL, toNotify);
+            } else {
+                ++it;
+            }
+        }
+        if (mit->second.empty()) {
+            waiting.erase(mit++);
+        } else {
+            ++mit;
+        }
+    }
+    lh.unlock();
+    notify(toNotify);
+}
+
+void DurabilityMonitor::finish_UNLOCKED(DurabilityWaiter *w, ENGINE_ERROR_CODE status,
+                                        std::vector<const void*> &toNotify) {
+    w->done = true;
+    w->status = status;
+    --numWaiters;
+    if (w->replicas > 0) {
+        --numReplicaWaiters;
+    }
+    toNotify.push_back(w->cookie);
+}
+
+void DurabilityMonitor::notify(std::vector<const void*> &toNotify) {
+    std::vector<const void*>::iterator it;
+    for (it = toNotify.begin(); it != toNotify.end(); ++it) {
+        engine.notifyIOComplete(*it, ENGINE_SUCCESS);
+    }
+}
+
+bool DurabilityTimeoutChecker::callback(Dispatcher &d, TaskId t) {
+    monitor.expire(gethrtime());
+    d.snooze(t, sleepTime);
+    return true;
+}
@@ -0,0 +1,188 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef DURABILITY_HH
+#define DURABILITY_HH 1
+
+#include "config.h"
+
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <memcached/engine.h>
+
+#include "atomic.hh"
+#include "common.hh"
+#include "dispatcher.hh"
+#include "mutex.hh"
+
+class EventuallyPersistentEngine;
+class EventuallyPersistentStore;
+class EPStats;
+class TransactionContext;
+
+// How often (in seconds) waiters are checked for timeouts.
+const double DURABILITY_TIMEOUT_CHECK_INTERVAL(0.1);
+
+/**
+ * A connection blocked until a mutation is on disk and/or acked by a
+ * number of replication TAP streams.
+ */
+class DurabilityWaiter {
+public:
+
+    DurabilityWaiter(const void *c, uint16_t vb, const std::string &k,
+                     uint64_t cs, bool p, uint16_t r, hrtime_t timeout) :
+        cookie(c), vbucket(vb), key(k), cas(cs), persist(p), replicas(r),
+        start(gethrtime()), deadline(start + timeout), txnCtx(NULL),
+        persisted(false), replicated(0), done(false), status(ENGINE_SUCCESS) {}
+
+    bool isSatisfied() const {
+        return (!persist || persisted) && replicated >= replicas;
+    }
+
+    const void *cookie;
+    uint16_t vbucket;
+    std::string key;
+    uint64_t cas;
+    bool persist;
+    uint16_t replicas;
+    hrtime_t start;
+    hrtime_t deadline;
+    // The transaction context of the flusher persisting the vbucket.
+    TransactionContext *txnCtx;
+
+    // Guarded by the monitor's mutex until the waiter is done.
+    bool persisted;
+    uint16_t replicated;
+    bool done;
+    ENGINE_ERROR_CODE status;
+    // The seqno of the message each replication stream sent the mutation
+    // (or a later one of the key) in, until the stream acks it.
+    std::map<std::string, uint32_t> sentBy;
+    // The replication streams that acked the mutation.
+    std::set<std::string> ackedBy;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(DurabilityWaiter);
+};
+
+/**
+ * Keeps track of the connections waiting for mutations to become
+ * durable, and wakes them up once the flusher committed the mutation,
+ * enough replication TAP streams acked it, or they time out.
+ *
+ * A waiter is satisfied by the mutation it waits for or any later one of
+ * the same key.
+ */
+class DurabilityMonitor {
+public:
+
+    DurabilityMonitor(EventuallyPersistentEngine &e, EventuallyPersistentStore &s,
+                      EPStats &st) :
+        engine(e), store(s), stats(st), numWaiters(0), numReplicaWaiters(0) {}
+
+    ~DurabilityMonitor();
+
+    /**
+     * Start tracking a waiter.
+     *
+     * @return true if the waiter is satisfied already, in which case it
+     *         isn't tracked and the connection shouldn't block
+     */
+    bool add(DurabilityWaiter *w);
+
+    /**
+     * Take the waiter of a connection that was notified.
+     *
+     * @return the waiter, or NULL if the connection has no finished waiter
+     */
+    DurabilityWaiter *claim(const void *cookie);
+
+    /**
+     * Forget the waiter of a connection that went away.
+     */
+    void cancel(const void *cookie);
+
+    /**
+     * Called once a transaction committed.
+     */
+    void committed(TransactionContext *ctx);
+
+    /**
+     * Called when a replication TAP stream sent a mutation.
+     *
+     * @param name the name of the stream
+     * @param vbid the vbucket of the mutation
+     * @param key the key of the mutation
+     * @param seqno the seqno of the message that carried it
+     */
+    void sent(const std::string &name, uint16_t vbid, const std::string &key,
+              uint32_t seqno);
+
+    /**
+     * Called when a replication TAP stream got an ack for all of its
+     * messages up to a seqno.
+     */
+    void acked(const std::string &name, uint32_t seqno);
+
+    /**
+     * Wake up the waiters whose time is up.
+     */
+    void expire(hrtime_t now);
+
+    size_t getNumWaiters() {
+        return numWaiters.get();
+    }
+
+private:
+
+    bool isPersisted(const std::string &key, uint16_t vbucket, uint64_t cas,
+                     TransactionContext *txnCtx);
+    void setPersisted_UNLOCKED(DurabilityWaiter *w);
+    void setAcked_UNLOCKED(DurabilityWaiter *w, const std::string &name);
+    bool isWaiting_UNLOCKED(DurabilityWaiter *w);
+    void remove_UNLOCKED(DurabilityWaiter *w);
+    void finish_UNLOCKED(DurabilityWaiter *w, ENGINE_ERROR_CODE status,
+                         std::vector<const void*> &toNotify);
+    void notify(std::vector<const void*> &toNotify);
+
+    EventuallyPersistentEngine &engine;
+    EventuallyPersistentStore &store;
+    EPStats &stats;
+
+    // Only ever taken last, lookups in the store are made without it.
+    Mutex mutex;
+    // The waiters still waiting, by vbucket.  A vbucket without waiters
+    // has no entry.
+    std::map<uint16_t, std::list<DurabilityWaiter*> > waiting;
+    // All the waiters not yet claimed by their connection.
+    std::map<const void*, DurabilityWaiter*> byCookie;
+    Atomic<size_t> numWaiters;
+    Atomic<size_t> numReplicaWaiters;
+
+    DISALLOW_COPY_AND_ASSIGN(DurabilityMonitor);
+};
+
+/**
+ * Dispatcher job that times out durability waiters.
+ */
+class DurabilityTimeoutChecker : public DispatcherCallback {
+public:
+
+    DurabilityTimeoutChecker(DurabilityMonitor &m, double interval) :
+        monitor(m), sleepTime(interval) {}
+
+    bool callback(Dispatcher &d, TaskId t);
+
+    std::string description() {
+        return std::string("Timing out durability waiters.");
+    }
+
+private:
+    DurabilityMonitor &monitor;
+    double sleepTime;
+};
+
+#endif // DURABILITY_HH
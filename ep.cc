@@ -33,6 +33,7 @@
 #include "kvstore.hh"
 #include "ep_engine.h"
 #include "htresizer.hh"
+#include "defragmenter.hh"
 #include "checkpoint_remover.hh"
 #include "invalid_vbtable_remover.hh"
 #include "access_scanner.hh"
@@ -92,6 +93,14 @@ public:
             store.setItemExpiryWindow(value);
         } else if (key.compare("max_txn_size") == 0) {
             store.setTxnSize(value);
+        } else if (key.compare("min_txn_size") == 0) {
+            store.setMinTxnSize(value);
+        } else if (key.compare("txn_commit_target") == 0) {
+            store.setTxnCommitTarget(value);
+        } else if (key.compare("flush_batch_max_bytes") == 0) {
+            store.setFlushBatchMaxBytes(value);
+        } else if (key.compare("visit_chunk_size") == 0) {
+            store.setVisitChunkSize(value);
         } else if (key.compare("exp_pager_stime") == 0) {
             store.setExpiryPagerSleeptime(value);
         } else if (key.compare("alog_sleep_time") == 0) {
@@ -115,6 +124,28 @@ public:
         }
     }
 
+    virtual void booleanValueChanged(const std::string &key, bool value) {
+        if (key.compare("pipelined_flush") == 0) {
+            store.setPipelinedFlush(value);
+        } else if (key.compare("adaptive_txn_size") == 0) {
+            store.setAdaptiveTxnSize(value);
+        } else {
+            getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                             "Failed to change value for unknown variable, %s\n",
+                             key.c_str());
+        }
+    }
+
+    virtual void stringValueChanged(const std::string &key, const char *value) {
+        if (key.compare("flush_order") == 0) {
+            store.setFlushOrder(value);
+        } else {
+            getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                             "Failed to change value for unknown variable, %s\n",
+                             key.c_str());
+        }
+    }
+
 private:
     EventuallyPersistentStore &store;
 };
@@ -292,14 +323,14 @@ EventuallyPersistentStore::EventuallyPersistentStore(EventuallyPersistentEngine
                                                      bool concurrentDB) :
     engine(theEngine), stats(engine.getEpStats()), rwUnderlying(t),
     storageProperties(t->getStorageProperties()), bgFetcher(NULL),
+    chunkLoadScheduler(NULL),
     vbuckets(theEngine.getConfiguration()),
+    durability(theEngine, *this, stats),
     mutationLog(theEngine.getConfiguration().getKlogPath(),
                 theEngine.getConfiguration().getKlogBlockSize()),
     accessLog(engine.getConfiguration().getAlogPath(),
               engine.getConfiguration().getAlogBlockSize()),
-    diskFlushAll(false),
-    tctx(stats, t, mutationLog),
-    bgFetchDelay(0)
+    bgFetchDelay(0), fullEviction(false)
 {
     getLogger()->log(EXTENSION_LOG_INFO, NULL,
                      "Storage props:  c=%ld/r=%ld/rw=%ld\n",
@@ -328,7 +359,34 @@ EventuallyPersistentStore::EventuallyPersistentStore(EventuallyPersistentEngine
         tapDispatcher = roDispatcher;
     }
     nonIODispatcher = new Dispatcher(theEngine, "NONIO_Dispatcher");
-    flusher = new Flusher(this, dispatcher);
+    size_t visitorThreads = theEngine.getConfiguration().getVisitorThreads();
+    for (size_t i = 1; i < visitorThreads; ++i) {
+        visitorDispatchers.push_back(new Dispatcher(theEngine, "VISITOR_Dispatcher"));
+    }
+
+    // Each flusher needs a connection of its own to write through, and
+    // the mutation log has no room for interleaved transactions.
+    size_t numFlushers = std::min(theEngine.getConfiguration().getMaxNumFlushers(),
+                                  storageProperties.maxWriters());
+    if (numFlushers > 1 && theEngine.getConfiguration().getKlogPath() != "") {
+        getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                         "Running a single flusher as the mutation log is enabled\n");
+        numFlushers = 1;
+    }
+    numFlushers = std::max(numFlushers, static_cast<size_t>(1));
+    rwUnderlying->setNumWriters(numFlushers);
+    for (size_t i = 0; i < numFlushers; ++i) {
+        KVStore *kvstore = rwUnderlying;
+        Dispatcher *d = dispatcher;
+        if (i > 0) {
+            kvstore = rwUnderlying->newWriter();
+            d = new Dispatcher(theEngine, "FLUSHER_Dispatcher");
+            flusherDispatchers.push_back(d);
+        }
+        flusherShards.push_back(new FlusherShard(i, stats, kvstore, mutationLog,
+                                                 durability));
+        flushers.push_back(new Flusher(this, d, flusherShards.back()));
+    }
 
     if (multiBGFetchEnabled()) {
         bgFetcher = new BgFetcher(this, roDispatcher, stats);
@@ -338,6 +396,28 @@ EventuallyPersistentStore::EventuallyPersistentStore(EventuallyPersistentEngine
 
     Configuration &config = engine.getConfiguration();
 
+    // Only couchstore looks documents up by key, the others need the
+    // row id that would go away with the item.
+    if (config.getItemEvictionPolicy() == "full_eviction") {
+        if (config.getBackend() == "couchdb") {
+            fullEviction = true;
+        } else {
+            getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                             "Full eviction isn't supported by the %s backend, "
+                             "only ejecting values\n",
+                             config.getBackend().c_str());
+        }
+    }
+
+    // Under full eviction the filters save fetches of missing keys, and
+    // in either mode they save the metadata fetches of getMeta.
+    if (config.isBfilterEnabled()) {
+        VBucket::setBloomFilterSize(config.getBfilterKeyCount(),
+                                    config.getBfilterFpProb());
+    } else {
+        VBucket::setBloomFilterSize(0, config.getBfilterFpProb());
+    }
+
     setItemExpiryWindow(config.getExpiryWindow());
     config.addValueChangedListener("expiry_window",
                                    new EPStoreValueChangeListener(*this));
@@ -346,6 +426,36 @@ EventuallyPersistentStore::EventuallyPersistentStore(EventuallyPersistentEngine
     config.addValueChangedListener("max_txn_size",
                                    new EPStoreValueChangeListener(*this));
 
+    setMinTxnSize(config.getMinTxnSize());
+    config.addValueChangedListener("min_txn_size",
+                                   new EPStoreValueChangeListener(*this));
+
+    setTxnCommitTarget(config.getTxnCommitTarget());
+    config.addValueChangedListener("txn_commit_target",
+                                   new EPStoreValueChangeListener(*this));
+
+    setAdaptiveTxnSize(config.isAdaptiveTxnSize());
+    config.addValueChangedListener("adaptive_txn_size",
+                                   new EPStoreValueChangeListener(*this));
+
+    setFlushBatchMaxBytes(config.getFlushBatchMaxBytes());
+    config.addValueChangedListener("flush_batch_max_bytes",
+                                   new EPStoreValueChangeListener(*this));
+
+    setPipelinedFlush(config.isPipelinedFlush());
+    config.addValueChangedListener("pipelined_flush",
+                                   new EPStoreValueChangeListener(*this));
+
+    if (!setFlushOrder(config.getFlushOrder())) {
+        setFlushOrder("round_robin");
+    }
+    config.addValueChangedListener("flush_order",
+                                   new EPStoreValueChangeListener(*this));
+
+    setVisitChunkSize(config.getVisitChunkSize());
+    config.addValueChangedListener("visit_chunk_size",
+                                   new EPStoreValueChangeListener(*this));
+
     stats.min_data_age.set(config.getMinDataAge());
     config.addValueChangedListener("min_data_age",
                                    new StatsValueChangeListener(stats));
@@ -505,6 +615,14 @@ void EventuallyPersistentStore::initialize() {
     shared_ptr<DispatcherCallback> htr(new HashtableResizer(this));
     nonIODispatcher->schedule(htr, NULL, Priority::HTResizePriority, 10);
 
+    size_t defragSleeptime = config.getDefragStime();
+    if (defragSleeptime > 0) {
+        shared_ptr<DispatcherCallback> defrag(new Defragmenter(this, stats,
+                                                               defragSleeptime));
+        nonIODispatcher->schedule(defrag, NULL, Priority::DefragmenterPriority,
+                                  defragSleeptime);
+    }
+
     size_t checkpointRemoverInterval = config.getChkRemoverStime();
     shared_ptr<DispatcherCallback> chk_cb(new ClosedUnrefCheckpointRemover(this,
                                                                            stats,
@@ -513,6 +631,21 @@ void EventuallyPersistentStore::initialize() {
                               Priority::CheckpointRemoverPriority,
                               checkpointRemoverInterval);
 
+    // Spill files are written and read back on the TAP dispatcher, off the
+    // checkpoint lock.
+    shared_ptr<DispatcherCallback> spill_cb(new ClosedCheckpointSpiller(this,
+                                                                        checkpointRemoverInterval));
+    tapDispatcher->schedule(spill_cb, NULL, Priority::CheckpointSpillerPriority,
+                            checkpointRemoverInterval);
+    chunkLoadScheduler = new SpilledChunkLoadScheduler(this);
+    engine.getCheckpointConfig().setSpilledChunkLoadListener(chunkLoadScheduler);
+
+    shared_ptr<DispatcherCallback> dur_cb(new DurabilityTimeoutChecker(durability,
+                                                                       DURABILITY_TIMEOUT_CHECK_INTERVAL));
+    nonIODispatcher->schedule(dur_cb, NULL,
+                              Priority::DurabilityTimeoutPriority,
+                              DURABILITY_TIMEOUT_CHECK_INTERVAL);
+
     if (mutationLog.isEnabled()) {
         shared_ptr<MutationLogCompactor>
             compactor(new MutationLogCompactor(this, mutationLog, mlogCompactorConfig, stats));
@@ -523,6 +656,7 @@ void EventuallyPersistentStore::initialize() {
 
 EventuallyPersistentStore::~EventuallyPersistentStore() {
     bool forceShutdown = engine.isForceShutdown();
+    engine.getCheckpointConfig().setSpilledChunkLoadListener(NULL);
     stopFlusher();
     stopBgFetcher();
     dispatcher->schedule(shared_ptr<DispatcherCallback>(new StatSnap(&engine, true)),
@@ -539,11 +673,31 @@ EventuallyPersistentStore::~EventuallyPersistentStore() {
         delete tapUnderlying;
     }
     nonIODispatcher->stop(forceShutdown);
+    std::vector<Dispatcher*>::iterator it;
+    for (it = visitorDispatchers.begin(); it != visitorDispatchers.end(); ++it) {
+        (*it)->stop(forceShutdown);
+    }
+    for (it = flusherDispatchers.begin(); it != flusherDispatchers.end(); ++it) {
+        (*it)->stop(forceShutdown);
+    }
 
-    delete flusher;
+    for (size_t i = 0; i < flushers.size(); ++i) {
+        delete flushers[i];
+        if (i > 0) {
+            delete flusherShards[i]->underlying;
+        }
+        delete flusherShards[i];
+    }
     delete bgFetcher;
+    delete chunkLoadScheduler;
     delete dispatcher;
     delete nonIODispatcher;
+    for (it = visitorDispatchers.begin(); it != visitorDispatchers.end(); ++it) {
+        delete *it;
+    }
+    for (it = flusherDispatchers.begin(); it != flusherDispatchers.end(); ++it) {
+        delete *it;
+    }
     delete warmupTask;
 }
 
@@ -555,14 +709,18 @@ void EventuallyPersistentStore::startDispatcher() {
     if (hasSeparateTapDispatcher()) {
         tapDispatcher->start();
     }
+    std::vector<Dispatcher*>::iterator it;
+    for (it = flusherDispatchers.begin(); it != flusherDispatchers.end(); ++it) {
+        (*it)->start();
+    }
 }
 
 void EventuallyPersistentStore::startNonIODispatcher() {
     nonIODispatcher->start();
-}
-
-const Flusher* EventuallyPersistentStore::getFlusher() {
-    return flusher;
+    std::vector<Dispatcher*>::iterator it;
+    for (it = visitorDispatchers.begin(); it != visitorDispatchers.end(); ++it) {
+        (*it)->start();
+    }
 }
 
 Warmup* EventuallyPersistentStore::getWarmup(void) const {
@@ -571,30 +729,116 @@ Warmup* EventuallyPersistentStore::getWarmup(void) const {
 
 
 void EventuallyPersistentStore::startFlusher() {
-    flusher->start();
+    std::vector<Flusher*>::iterator it;
+    for (it = flushers.begin(); it != flushers.end(); ++it) {
+        (*it)->start();
+    }
 }
 
 void EventuallyPersistentStore::stopFlusher() {
-    bool rv = flusher->stop(engine.isForceShutdown());
-    if (rv && !engine.isForceShutdown()) {
-        flusher->wait();
+    // Let all the flushers drain their vbuckets at once.
+    std::vector<bool> stopping;
+    std::vector<Flusher*>::iterator it;
+    for (it = flushers.begin(); it != flushers.end(); ++it) {
+        stopping.push_back((*it)->stop(engine.isForceShutdown()));
+    }
+    for (size_t i = 0; i < flushers.size(); ++i) {
+        if (stopping[i] && !engine.isForceShutdown()) {
+            flushers[i]->wait();
+        }
     }
 }
 
 bool EventuallyPersistentStore::pauseFlusher() {
-    return flusher->pause();
+    bool rv = true;
+    std::vector<Flusher*>::iterator it;
+    for (it = flushers.begin(); it != flushers.end(); ++it) {
+        rv = (*it)->pause() && rv;
+    }
+    return rv;
 }
 
 bool EventuallyPersistentStore::resumeFlusher() {
-    return flusher->resume();
+    bool rv = true;
+    std::vector<Flusher*>::iterator it;
+    for (it = flushers.begin(); it != flushers.end(); ++it) {
+        rv = (*it)->resume() && rv;
+    }
+    return rv;
 }
 
 void EventuallyPersistentStore::wakeUpFlusher() {
-    if (stats.queue_size == 0 && stats.flusher_todo == 0) {
-        flusher->wake();
+    for (size_t i = 0; i < flushers.size(); ++i) {
+        FlusherShard &shard = *flusherShards[i];
+        if (shard.queueSize == 0 && shard.todo == 0) {
+            flushers[i]->wake();
+        }
+    }
+}
+
+void EventuallyPersistentStore::setTxnSize(int to) {
+    std::vector<FlusherShard*>::iterator it;
+    for (it = flusherShards.begin(); it != flusherShards.end(); ++it) {
+        (*it)->txnSizer.setMaxSize(to);
+        (*it)->tctx.setTxnSize((*it)->txnSizer.getSize());
+    }
+}
+
+void EventuallyPersistentStore::setMinTxnSize(size_t to) {
+    std::vector<FlusherShard*>::iterator it;
+    for (it = flusherShards.begin(); it != flusherShards.end(); ++it) {
+        (*it)->txnSizer.setMinSize(to);
+        (*it)->tctx.setTxnSize((*it)->txnSizer.getSize());
     }
 }
 
+void EventuallyPersistentStore::setAdaptiveTxnSize(bool to) {
+    std::vector<FlusherShard*>::iterator it;
+    for (it = flusherShards.begin(); it != flusherShards.end(); ++it) {
+        (*it)->txnSizer.setEnabled(to);
+        (*it)->tctx.setTxnSize((*it)->txnSizer.getSize());
+    }
+}
+
+void EventuallyPersistentStore::setTxnCommitTarget(size_t to) {
+    std::vector<FlusherShard*>::iterator it;
+    for (it = flusherShards.begin(); it != flusherShards.end(); ++it) {
+        (*it)->txnSizer.setCommitTimeTarget(to);
+    }
+}
+
+size_t EventuallyPersistentStore::getNumUncommittedItems() {
+    size_t rv = 0;
+    std::vector<FlusherShard*>::iterator it;
+    for (it = flusherShards.begin(); it != flusherShards.end(); ++it) {
+        rv += (*it)->tctx.getNumUncommittedItems();
+    }
+    return rv;
+}
+
+double EventuallyPersistentStore::getTransactionTimePerItem() {
+    // The flushers persist their items side by side, so their rates add up.
+    double rate = 0;
+    std::vector<FlusherShard*>::iterator it;
+    for (it = flusherShards.begin(); it != flusherShards.end(); ++it) {
+        double t = (*it)->tctx.getTransactionTimePerItem();
+        if (t > 0) {
+            rate += 1 / t;
+        }
+    }
+    return rate > 0 ? 1 / rate : 0;
+}
+
+bool EventuallyPersistentStore::isFlushAllScheduled() {
+    std::vector<FlusherShard*>::iterator it;
+    for (it = flusherShards.begin(); it != flusherShards.end(); ++it) {
+        if ((*it)->diskFlushAll) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void EventuallyPersistentStore::startBgFetcher() {
     if (multiBGFetchEnabled()) {
         getLogger()->log(EXTENSION_LOG_INFO, NULL,
@@ -650,7 +894,7 @@ public:
         if (vb) {
             int bucket_num(0);
             e->incExpirationStat(vb);
-            LockHolder lh = vb->ht.getLockedBucket(vk.second, &bucket_num);
+            VersionedLockHolder lh = vb->ht.getLockedBucket(vk.second, &bucket_num);
             StoredValue *v = vb->ht.unlocked_find(vk.second, bucket_num, true, false);
             if (v && v->isTempItem()) {
                 // This is a temporary item whose background fetch for metadata
@@ -678,18 +922,41 @@ EventuallyPersistentStore::deleteExpiredItems(std::list<std::pair<uint16_t, std:
     std::for_each(keys.begin(), keys.end(), Deleter(this));
 }
 
+size_t
+EventuallyPersistentStore::ejectItems(std::list<std::pair<uint16_t, std::string> > &keys) {
+    size_t ejected = 0;
+    std::list<std::pair<uint16_t, std::string> >::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        RCPtr<VBucket> vb = getVBucket(it->first);
+        if (!vb) {
+            continue;
+        }
+        int bucket_num(0);
+        uint64_t h = vb->ht.hash(it->second);
+        VersionedLockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+        StoredValue *v = vb->ht.unlocked_findHashed(it->second, h, bucket_num,
+                                                    false, false);
+        if (v && vb->ht.unlocked_ejectItem(v, bucket_num)) {
+            ++ejected;
+        }
+    }
+    return ejected;
+}
+
 StoredValue *EventuallyPersistentStore::fetchValidValue(RCPtr<VBucket> &vb,
                                                         const std::string &key,
+                                                        uint64_t h,
                                                         int bucket_num,
                                                         bool wantDeleted,
                                                         bool trackReference) {
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, wantDeleted, trackReference);
+    StoredValue *v = vb->ht.unlocked_findHashed(key, h, bucket_num, wantDeleted,
+                                                trackReference);
     if (v && !v->isDeleted()) { // In the deleted case, we ignore expiration time.
         if (v->isExpired(ep_real_time())) {
             incExpirationStat(vb, false);
             vb->ht.unlocked_softDelete(v, 0);
             queueDirty(vb, key, vb->getId(), queue_op_del, v->getSeqno(),
-                       v->getId());
+                       v->getId(), false, h);
             return NULL;
         }
         v->touch();
@@ -697,6 +964,43 @@ StoredValue *EventuallyPersistentStore::fetchValidValue(RCPtr<VBucket> &vb,
     return v;
 }
 
+ENGINE_ERROR_CODE EventuallyPersistentStore::fetchEvictedKey(RCPtr<VBucket> &vb,
+                                                             const std::string &key,
+                                                             uint64_t h,
+                                                             int bucket_num,
+                                                             const void *cookie) {
+    // Background fetches only complete into active vbuckets.
+    if (vb->getState() != vbucket_state_active) {
+        return ENGINE_KEY_ENOENT;
+    }
+
+    StoredValue *v = vb->ht.unlocked_findHashed(key, h, bucket_num, true, false);
+    if (v && !v->isTempInitialItem()) {
+        // Either deleted, or already looked up and not found on disk.
+        return ENGINE_KEY_ENOENT;
+    }
+
+    if (!v) {
+        if (!vb->maybeKeyExistsOnDisk(h)) {
+            ++stats.bfilterAvoidedFetches;
+            return ENGINE_KEY_ENOENT;
+        }
+        switch (vb->ht.unlocked_addTempDeletedItem(bucket_num, key)) {
+        case ADD_NOMEM:
+            return ENGINE_ENOMEM;
+        case ADD_EXISTS:
+        case ADD_UNDEL:
+            // Since the hashtable bucket is locked, we should never get here
+            abort();
+        case ADD_SUCCESS:
+            break;
+        }
+    }
+    // Every waiting caller needs its own fetch to be notified.
+    bgFetch(key, vb->getId(), -1, cookie, BG_FETCH_METADATA);
+    return ENGINE_EWOULDBLOCK;
+}
+
 protocol_binary_response_status EventuallyPersistentStore::evictKey(const std::string &key,
                                                                     uint16_t vbucket,
                                                                     const char **msg,
@@ -708,8 +1012,9 @@ protocol_binary_response_status EventuallyPersistentStore::evictKey(const std::s
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, force, false);
+    uint64_t h = vb->ht.hash(key);
+    VersionedLockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, h, bucket_num, force, false);
 
     protocol_binary_response_status rv(PROTOCOL_BINARY_RESPONSE_SUCCESS);
 
@@ -718,7 +1023,14 @@ protocol_binary_response_status EventuallyPersistentStore::evictKey(const std::s
         if (force)  {
             v->markClean(NULL);
         }
-        if (v->isResident()) {
+        if (fullEviction) {
+            if (vb->ht.unlocked_ejectItem(v, bucket_num)) {
+                *msg = "Ejected.";
+            } else {
+                *msg = "Can't eject: Dirty, locked or not yet persisted.";
+                rv = PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS;
+            }
+        } else if (v->isResident()) {
             if (v->ejectValue(stats, vb->ht)) {
                 *msg = "Ejected.";
             } else {
@@ -771,6 +1083,17 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::set(const Item &itm,
     case NOT_FOUND:
         if (cas_op) {
             ret = ENGINE_KEY_ENOENT;
+            if (fullEviction) {
+                // The item may only have been ejected, check the disk.
+                int bucket_num(0);
+                uint64_t h = vb->ht.hash(itm.getKey());
+                VersionedLockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+                if (!vb->ht.unlocked_findHashed(itm.getKey(), h, bucket_num,
+                                                false, false)) {
+                    ret = fetchEvictedKey(vb, itm.getKey(), h, bucket_num,
+                                          cookie);
+                }
+            }
             break;
         }
         // FALLTHROUGH
@@ -806,13 +1129,27 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::add(const Item &itm,
         return ENGINE_NOT_STORED;
     }
 
-    switch (vb->ht.add(itm)) {
+    int bucket_num(0);
+    uint64_t h = vb->ht.hash(itm.getKey());
+    VersionedLockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    if (fullEviction &&
+        !vb->ht.unlocked_findHashed(itm.getKey(), h, bucket_num, false, false)) {
+        // Only add once the disk says there's no such item.
+        ENGINE_ERROR_CODE rv = fetchEvictedKey(vb, itm.getKey(), h,
+                                               bucket_num, cookie);
+        if (rv != ENGINE_KEY_ENOENT) {
+            return rv;
+        }
+    }
+
+    switch (vb->ht.unlocked_add(bucket_num, itm, true, true)) {
     case ADD_NOMEM:
         return ENGINE_ENOMEM;
     case ADD_EXISTS:
         return ENGINE_NOT_STORED;
     case ADD_SUCCESS:
     case ADD_UNDEL:
+        lh.unlock();
         queueDirty(vb, itm.getKey(), itm.getVBucketId(), queue_op_set,
                    itm.getSeqno(), -1);
     }
@@ -1089,12 +1426,21 @@ void EventuallyPersistentStore::completeBGFetch(const std::string &key,
     RCPtr<VBucket> vb = getVBucket(vbucket);
     if (vb && vb->getState() == vbucket_state_active) {
         int bucket_num(0);
-        LockHolder hlh = vb->ht.getLockedBucket(key, &bucket_num);
-        StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+        uint64_t h = vb->ht.hash(key);
+        VersionedLockHolder hlh = vb->ht.getLockedBucket(h, &bucket_num);
+        StoredValue *v = fetchValidValue(vb, key, h, bucket_num, true);
         if (BG_FETCH_METADATA == type) {
-            if (v && !v->isResident()) {
-                if (v->unlocked_restoreMeta(gcb.val.getValue(),
-                                            gcb.val.getStatus())) {
+            if (v && v->isTempInitialItem()) {
+                if (status == ENGINE_KEY_ENOENT && vb->hasBloomFilter()
+                    && vb->maybeKeyExistsOnDisk(h)) {
+                    ++stats.bfilterFalsePositives;
+                }
+                if (fullEviction && status == ENGINE_SUCCESS &&
+                    !gcb.val.isPartial()) {
+                    // A live item full eviction dropped from memory.
+                    vb->ht.unlocked_restoreTempItem(v, *gcb.val.getValue());
+                } else if (v->unlocked_restoreMeta(gcb.val.getValue(),
+                                                   gcb.val.getStatus())) {
                     status = ENGINE_SUCCESS;
                 }
             }
@@ -1107,7 +1453,7 @@ void EventuallyPersistentStore::completeBGFetch(const std::string &key,
                     assert(v->isDirty());
                     // exptime mutated, schedule it into new checkpoint
                     queueDirty(vb, key, vbucket, queue_op_set,
-                               v->getSeqno(), v->getId());
+                               v->getSeqno(), v->getId(), false, h);
                 }
             }
         }
@@ -1145,8 +1491,9 @@ void EventuallyPersistentStore::completeBGFetchMulti(uint16_t vbId,
 
         if (vb->getState() == vbucket_state_active) {
             int bucket = 0;
-            LockHolder blh = vb->ht.getLockedBucket(key, &bucket);
-            StoredValue *v = fetchValidValue(vb, key, bucket, true);
+            uint64_t h = vb->ht.hash(key);
+            VersionedLockHolder blh = vb->ht.getLockedBucket(h, &bucket);
+            StoredValue *v = fetchValidValue(vb, key, h, bucket, true);
             if (v && !v->isResident()) {
                 assert(status == ENGINE_SUCCESS);
                 v->unlocked_restoreValue(fetchedValue, stats, vb->ht);
@@ -1155,7 +1502,7 @@ void EventuallyPersistentStore::completeBGFetchMulti(uint16_t vbId,
                     assert(v->isDirty());
                     // exptime mutated, schedule it into new checkpoint
                     queueDirty(vb, key, vbId, queue_op_set, v->getSeqno(),
-                            v->getId());
+                            v->getId(), false, h);
                 }
             }
         }
@@ -1232,9 +1579,17 @@ GetValue EventuallyPersistentStore::getInternal(const std::string &key,
         }
     }
 
+    uint64_t h = vb->ht.hash(key);
+    bool referenced(false);
+    Item *it = vb->ht.optimisticGet(key, h, vbucket, trackReference,
+                                    &referenced);
+    if (it) {
+        return GetValue(it, ENGINE_SUCCESS, it->getId(), false, referenced);
+    }
+
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, false, trackReference);
+    VersionedLockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, h, bucket_num, false, trackReference);
 
     if (v) {
         // If the value is not resident, wait for it...
@@ -1246,15 +1601,153 @@ GetValue EventuallyPersistentStore::getInternal(const std::string &key,
                             v->isReferenced());
         }
 
+        // A cold value the pager compressed is hot again.
+        if (trackReference && v->isCompressed()) {
+            v->decompressValue(stats, vb->ht);
+        }
+
         GetValue rv(v->toItem(v->isLocked(ep_current_time()), vbucket),
                     ENGINE_SUCCESS, v->getId(), false, v->isReferenced());
         return rv;
+    } else if (fullEviction && queueBG) {
+        return GetValue(NULL, fetchEvictedKey(vb, key, h, bucket_num, cookie));
     } else {
         GetValue rv;
         return rv;
     }
 }
 
+/**
+ * Looks up the keys of a getMulti batch that couldn't be served
+ * without the hash table lock.
+ */
+class GetMultiVisitor : public HashTableBatchVisitor {
+public:
+    GetMultiVisitor(EventuallyPersistentStore &s, RCPtr<VBucket> &vbucket,
+                    const std::vector<std::string> &k,
+                    const std::vector<uint64_t> &h,
+                    const std::vector<size_t> &idx,
+                    std::vector<GetValue> &r, bool t, const void *c,
+                    bool fetch) :
+        store(s), vb(vbucket), keys(k), hashes(h), indexes(idx), results(r),
+        trackReference(t), cookie(c), fetchEvicted(fetch) {}
+
+    void visit(size_t index, int bucket_num) {
+        size_t i = indexes[index];
+        StoredValue *v = store.fetchValidValue(vb, keys[i], hashes[index],
+                                               bucket_num, false,
+                                               trackReference);
+        if (!v) {
+            if (fetchEvicted) {
+                results[i] = GetValue(NULL,
+                                      store.fetchEvictedKey(vb, keys[i],
+                                                            hashes[index],
+                                                            bucket_num,
+                                                            cookie));
+            }
+            return;
+        }
+        if (!v->isResident()) {
+            results[i] = GetValue(NULL, ENGINE_EWOULDBLOCK, v->getId(), true,
+                                  v->isReferenced());
+            nonResident.push_back(i);
+        } else {
+            if (trackReference && v->isCompressed()) {
+                v->decompressValue(store.stats, vb->ht);
+            }
+            results[i] = GetValue(v->toItem(v->isLocked(ep_current_time()),
+                                            vb->getId()),
+                                  ENGINE_SUCCESS, v->getId(), false,
+                                  v->isReferenced());
+        }
+    }
+
+    //! Indexes (into keys) of the keys that have to be fetched from disk.
+    std::vector<size_t> nonResident;
+
+private:
+    EventuallyPersistentStore      &store;
+    RCPtr<VBucket>                 &vb;
+    const std::vector<std::string> &keys;
+    const std::vector<uint64_t>    &hashes;
+    const std::vector<size_t>      &indexes;
+    std::vector<GetValue>          &results;
+    bool                            trackReference;
+    const void                     *cookie;
+    bool                            fetchEvicted;
+};
+
+void EventuallyPersistentStore::getMulti(const std::vector<std::string> &keys,
+                                         uint16_t vbucket,
+                                         const void *cookie,
+                                         std::vector<GetValue> &results,
+                                         bool queueBG,
+                                         bool honorStates,
+                                         bool trackReference) {
+    results.assign(keys.size(), GetValue());
+    RCPtr<VBucket> vb = getVBucket(vbucket);
+    ENGINE_ERROR_CODE status = ENGINE_SUCCESS;
+    if (!vb) {
+        status = ENGINE_NOT_MY_VBUCKET;
+    } else if (honorStates && (vb->getState() == vbucket_state_dead ||
+                               vb->getState() == vbucket_state_replica)) {
+        status = ENGINE_NOT_MY_VBUCKET;
+    } else if (honorStates && vb->getState() == vbucket_state_pending) {
+        if (vb->addPendingOp(cookie)) {
+            status = ENGINE_EWOULDBLOCK;
+        }
+    }
+    if (status != ENGINE_SUCCESS) {
+        if (status == ENGINE_NOT_MY_VBUCKET) {
+            stats.numNotMyVBuckets.incr(keys.size());
+        }
+        results.assign(keys.size(), GetValue(NULL, status));
+        return;
+    }
+
+    // Serve what we can without locking, and batch up the rest.
+    std::vector<uint64_t> hashes;
+    std::vector<size_t> indexes;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        uint64_t h = vb->ht.hash(keys[i]);
+        bool referenced(false);
+        Item *it = vb->ht.optimisticGet(keys[i], h, vbucket, trackReference,
+                                        &referenced);
+        if (it) {
+            results[i] = GetValue(it, ENGINE_SUCCESS, it->getId(), false,
+                                  referenced);
+        } else {
+            hashes.push_back(h);
+            indexes.push_back(i);
+        }
+    }
+
+    GetMultiVisitor visitor(*this, vb, keys, hashes, indexes, results,
+                            trackReference, cookie, fullEviction && queueBG);
+    vb->ht.visitMulti(hashes, visitor);
+
+    if (!queueBG || visitor.nonResident.empty()) {
+        return;
+    }
+    if (multiBGFetchEnabled()) {
+        std::vector<VBucketBGFetchItem *> fetches;
+        std::vector<size_t>::iterator it;
+        for (it = visitor.nonResident.begin();
+             it != visitor.nonResident.end(); ++it) {
+            fetches.push_back(new VBucketBGFetchItem(keys[*it],
+                                                     results[*it].getId(),
+                                                     cookie));
+        }
+        vb->queueBGFetchItems(fetches, bgFetcher);
+    } else {
+        std::vector<size_t>::iterator it;
+        for (it = visitor.nonResident.begin();
+             it != visitor.nonResident.end(); ++it) {
+            bgFetch(keys[*it], vbucket, results[*it].getId(), cookie);
+        }
+    }
+}
+
 ENGINE_ERROR_CODE EventuallyPersistentStore::getMetaData(const std::string &key,
                                                          uint16_t vbucket,
                                                          const void *cookie,
@@ -1272,10 +1765,17 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::getMetaData(const std::string &key,
 
     int bucket_num(0);
     flags = 0;
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true);
+    uint64_t h = vb->ht.hash(key);
+    VersionedLockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_findHashed(key, h, bucket_num, true);
 
     if (v) {
+        if (v->isTempInitialItem()) {
+            // Another fetch is already on its way, but that only
+            // notifies the connection that started it.
+            bgFetch(key, vbucket, -1, cookie, BG_FETCH_METADATA);
+            return ENGINE_EWOULDBLOCK;
+        }
         stats.numOpsGetMeta++;
 
         if (v->isTempNonExistentItem()) {
@@ -1306,8 +1806,23 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::getMetaData(const std::string &key,
             // Since the hashtable bucket is locked, we should never get here
             abort();
         case ADD_SUCCESS:
-            bgFetch(key, vbucket, -1, cookie, BG_FETCH_METADATA);
+            break;
         }
+
+        // Persisted deletes go into the Bloom filter too, so a key it
+        // rules out was never on disk and the fetch would only find
+        // nothing.  The temporary item still carries the cas a
+        // following delete or set with meta has to use.
+        if (!vb->maybeKeyExistsOnDisk(h)) {
+            ++stats.bfilterAvoidedFetches;
+            v = vb->ht.unlocked_findHashed(key, h, bucket_num, true, false);
+            assert(v);
+            v->setStoredValueState(StoredValue::state_non_existent_key);
+            stats.numOpsGetMeta++;
+            cas = v->getCas();
+            return ENGINE_KEY_ENOENT;
+        }
+        bgFetch(key, vbucket, -1, cookie, BG_FETCH_METADATA);
         return ENGINE_EWOULDBLOCK;
     }
 }
@@ -1355,6 +1870,17 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::setWithMeta(const Item &itm,
         break;
     case NOT_FOUND:
         ret = ENGINE_KEY_ENOENT;
+        if (fullEviction) {
+            // The item may only have been ejected, check the disk.
+            int bucket_num(0);
+            uint64_t h = vb->ht.hash(itm.getKey());
+            VersionedLockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+            if (!vb->ht.unlocked_findHashed(itm.getKey(), h, bucket_num,
+                                            false, false)) {
+                ret = fetchEvictedKey(vb, itm.getKey(), h, bucket_num,
+                                      cookie);
+            }
+        }
         break;
     }
 
@@ -1387,8 +1913,9 @@ GetValue EventuallyPersistentStore::getAndUpdateTtl(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num);
+    uint64_t h = vb->ht.hash(key);
+    VersionedLockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, h, bucket_num);
 
     if (v) {
         bool exptime_mutated = exptime != v->getExptime() ? true : false;
@@ -1402,7 +1929,7 @@ GetValue EventuallyPersistentStore::getAndUpdateTtl(const std::string &key,
                 // persist the itme in the underlying storage for
                 // mutated exptime
                 queueDirty(vb, key, vbucket, queue_op_set, v->getSeqno(),
-                           v->getId());
+                           v->getId(), false, h);
             }
         } else {
             if (queueBG || exptime_mutated) {
@@ -1419,6 +1946,8 @@ GetValue EventuallyPersistentStore::getAndUpdateTtl(const std::string &key,
         GetValue rv(v->toItem(v->isLocked(ep_current_time()), vbucket),
                     ENGINE_SUCCESS, v->getId());
         return rv;
+    } else if (fullEviction) {
+        return GetValue(NULL, fetchEvictedKey(vb, key, h, bucket_num, cookie));
     } else {
         GetValue rv;
         return rv;
@@ -1436,8 +1965,9 @@ EventuallyPersistentStore::getFromUnderlying(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num);
+    uint64_t h = vb->ht.hash(key);
+    VersionedLockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, h, bucket_num);
 
     if (v) {
         shared_ptr<VKeyStatBGFetchCallback> dcb(new VKeyStatBGFetchCallback(this, key,
@@ -1467,8 +1997,9 @@ bool EventuallyPersistentStore::getLocked(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num);
+    uint64_t h = vb->ht.hash(key);
+    VersionedLockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, h, bucket_num);
 
     if (v) {
 
@@ -1502,6 +2033,15 @@ bool EventuallyPersistentStore::getLocked(const std::string &key,
 
     } else {
         GetValue rv;
+        if (fullEviction && cookie) {
+            ENGINE_ERROR_CODE ec = fetchEvictedKey(vb, key, h, bucket_num,
+                                                   cookie);
+            if (ec != ENGINE_KEY_ENOENT) {
+                rv.setStatus(ec);
+                cb.callback(rv);
+                return false;
+            }
+        }
         cb.callback(rv);
     }
     return true;
@@ -1525,8 +2065,9 @@ StoredValue* EventuallyPersistentStore::getStoredValue(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    return fetchValidValue(vb, key, bucket_num);
+    uint64_t h = vb->ht.hash(key);
+    VersionedLockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    return fetchValidValue(vb, key, h, bucket_num);
 }
 
 ENGINE_ERROR_CODE
@@ -1543,8 +2084,9 @@ EventuallyPersistentStore::unlockKey(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num);
+    uint64_t h = vb->ht.hash(key);
+    VersionedLockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, h, bucket_num);
 
     if (v) {
         if (v->isLocked(currentTime)) {
@@ -1571,8 +2113,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::getKeyStats(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, wantsDeleted);
+    uint64_t h = vb->ht.hash(key);
+    VersionedLockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, h, bucket_num, wantsDeleted);
 
     if (v) {
         kstats.logically_deleted = v->isDeleted();
@@ -1588,6 +2131,19 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::getKeyStats(const std::string &key,
     return ENGINE_KEY_ENOENT;
 }
 
+bool EventuallyPersistentStore::isEvicted(const std::string &key, uint16_t vbucket) {
+    RCPtr<VBucket> vb = getVBucket(vbucket);
+    if (!fullEviction || !vb) {
+        return false;
+    }
+
+    int bucket_num(0);
+    uint64_t h = vb->ht.hash(key);
+    VersionedLockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+    return !vb->ht.unlocked_findHashed(key, h, bucket_num, true, false) &&
+        vb->maybeKeyExistsOnDisk(h);
+}
+
 ENGINE_ERROR_CODE EventuallyPersistentStore::deleteItem(const std::string &key,
                                                         uint64_t cas,
                                                         uint16_t vbucket,
@@ -1615,14 +2171,19 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteItem(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
+    uint64_t h = vb->ht.hash(key);
+    VersionedLockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
     // If use_meta is true (delete_with_meta), we'd like to look for the key
     // with the wantsDeleted flag set to true in case a prior get_meta has
     // created a temporary item for the key.
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, use_meta, false);
+    StoredValue *v = vb->ht.unlocked_findHashed(key, h, bucket_num, use_meta, false);
     if (!v) {
         if (vb->getState() != vbucket_state_active && force) {
-            queueDirty(vb, key, vbucket, queue_op_del, newSeqno, -1);
+            queueDirty(vb, key, vbucket, queue_op_del, newSeqno, -1,
+                       false, h);
+        } else if (fullEviction) {
+            // Bring the item back in before deleting it.
+            return fetchEvictedKey(vb, key, h, bucket_num, cookie);
         }
         return ENGINE_KEY_ENOENT;
     }
@@ -1651,7 +2212,7 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteItem(const std::string &key,
         uint64_t seqnum = v ? v->getSeqno() : 0;
         int64_t rowid = v ? v->getId() : -1;
         lh.unlock();
-        queueDirty(vb, key, vbucket, queue_op_del, seqnum, rowid);
+        queueDirty(vb, key, vbucket, queue_op_del, seqnum, rowid, false, h);
     }
     return rv;
 }
@@ -1667,23 +2228,92 @@ void EventuallyPersistentStore::reset() {
             vb->resetStats();
         }
     }
-    if (diskFlushAll.cas(false, true)) {
-        // Increase the write queue size by 1 as flusher will execute flush_all as a single task.
-        stats.queue_size.set(getWriteQueueSize() + 1);
+    size_t scheduled = 0;
+    std::vector<FlusherShard*>::iterator sit;
+    for (sit = flusherShards.begin(); sit != flusherShards.end(); ++sit) {
+        if ((*sit)->diskFlushAll.cas(false, true)) {
+            ++(*sit)->queueSize;
+            ++scheduled;
+        }
+    }
+    if (scheduled > 0) {
+        // Increase the write queue size by 1 per flusher as each of them will execute
+        // flush_all as a single task.
+        stats.queue_size.set(getWriteQueueSize() + scheduled);
     }
 }
 
-bool EventuallyPersistentStore::diskQueueEmpty() {
-    return !hasItemsForPersistence() && writing.empty() && !diskFlushAll;
+void EventuallyPersistentStore::setFlusherTodo(FlusherShard &shard, size_t todo) {
+    size_t prev = shard.todo.swap(todo);
+    if (todo > prev) {
+        stats.flusher_todo.incr(todo - prev);
+    } else {
+        stats.flusher_todo.decr(prev - todo);
+    }
+}
+
+size_t EventuallyPersistentStore::updateQueueSize(FlusherShard &shard) {
+    shard.queueSize.set(getWriteQueueSize(shard));
+    size_t queue_size = getWriteQueueSize();
+    stats.queue_size.set(queue_size);
+    return queue_size;
+}
+
+bool EventuallyPersistentStore::diskQueueEmpty(FlusherShard &shard) {
+    return !hasItemsForPersistence(shard) && shard.writing->items.empty() &&
+        shard.nextState.get() == next_batch_none && !shard.diskFlushAll;
 }
 
-std::queue<queued_item>* EventuallyPersistentStore::beginFlush() {
+bool EventuallyPersistentStore::readyForFlushAll(FlusherShard &shard) {
+    size_t numFlushers = flusherShards.size();
+    if (numFlushers == 1) {
+        return true;
+    }
+    LockHolder lh(flushAllState.mutex);
+    // One that's past the flush_all already waits for the others to get
+    // there before it counts for the next one.
+    if (!shard.flushAllReady && flushAllState.numDone == 0) {
+        shard.flushAllReady = true;
+        if (++flushAllState.numReady == numFlushers) {
+            lh.unlock();
+            for (size_t i = 0; i < numFlushers; ++i) {
+                if (i != shard.id) {
+                    flushers[i]->wake();
+                }
+            }
+            return true;
+        }
+    }
+    return shard.flushAllReady && flushAllState.numReady == numFlushers;
+}
+
+bool EventuallyPersistentStore::waitingForFlushAll(FlusherShard &shard) {
+    if (!shard.diskFlushAll || flusherShards.size() == 1) {
+        return false;
+    }
+    LockHolder lh(flushAllState.mutex);
+    return !shard.flushAllReady || flushAllState.numReady != flusherShards.size();
+}
+
+std::queue<queued_item>* EventuallyPersistentStore::beginFlush(FlusherShard &shard) {
     std::queue<queued_item> *rv(NULL);
+    std::queue<queued_item> &writing = shard.writing->items;
 
-    if (diskQueueEmpty()) {
+    if (takeNextFlushBatch(shard) && !shard.writing->items.empty()) {
+        ++shard.numPipelined;
+        setFlusherTodo(shard, shard.writing->items.size());
+        size_t queue_size = updateQueueSize(shard);
+        getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
+                         "Flushing %ld items taken ahead with %ld still in queue\n",
+                         shard.writing->items.size(), queue_size);
+        rv = &shard.writing->items;
+    } else if (shard.diskFlushAll && !readyForFlushAll(shard)) {
+        // The other flushers still write what they took before the
+        // flush_all, and wake this one once they're done.
+    } else if (diskQueueEmpty(shard)) {
         // If the persistence queue is empty, reset queue-related stats for each vbucket.
         size_t numOfVBuckets = vbuckets.getSize();
-        for (size_t i = 0; i < numOfVBuckets; ++i) {
+        for (size_t i = shard.id; i < numOfVBuckets; i += flusherShards.size()) {
             assert(i <= std::numeric_limits<uint16_t>::max());
             uint16_t vbid = static_cast<uint16_t>(i);
             RCPtr<VBucket> vb = vbuckets.getBucket(vbid);
@@ -1695,63 +2325,213 @@ std::queue<queued_item>* EventuallyPersistentStore::beginFlush() {
             }
         }
     } else {
-        assert(rwUnderlying);
-        if (diskFlushAll) {
-            queued_item qi(new QueuedItem("", 0xffff, queue_op_flush));
-            writing.push(qi);
-            stats.memOverhead.incr(sizeof(queued_item));
-            assert(stats.memOverhead.get() < GIGANTOR);
-        }
-
-        std::vector<queued_item> item_list;
-        item_list.reserve(getTxnSize());
+        fillFlushBatch(shard, *shard.writing);
 
-        const std::vector<int> vblist = vbuckets.getBucketsSortedByState();
-        std::vector<int>::const_iterator itr;
-        for (itr = vblist.begin(); itr != vblist.end(); ++itr) {
-            uint16_t vbid = static_cast<uint16_t>(*itr);
-            RCPtr<VBucket> vb = vbuckets.getBucket(vbid);
+        setFlusherTodo(shard, writing.size());
+        size_t queue_size = updateQueueSize(shard);
+        getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
+                         "Flushing %ld items with %ld still in queue\n",
+                         writing.size(), queue_size);
+        rv = &writing;
+    }
+    return rv;
+}
 
-            if (!vb) {
-                // Undefined vbucket..
-                continue;
-            }
+/**
+ * Takes the items of a flusher's vbuckets for a batch: all the restore
+ * and backfill items on a vbucket's first turn, then the dirty items of
+ * its checkpoint that fit in what the turn allows.
+ */
+class FlushBatchSource : public FlushSource {
+public:
+    FlushBatchSource(EventuallyPersistentStore &s,
+                     const std::vector<FlushCandidate> &c) :
+        items(c.size()), store(s), vbs(c) {}
+
+    bool take(size_t i, bool firstTurn, size_t maxBytes, size_t &bytes) {
+        uint16_t vbid = vbs[i].vbid;
+        RCPtr<VBucket> vb = store.vbuckets.getBucket(vbid);
+        if (!vb) {
+            // Undefined vbucket..
+            return false;
+        }
 
+        std::vector<queued_item> &vbItems = items[i];
+        size_t numItemsBefore = vbItems.size();
+        if (firstTurn) {
             // Grab all the items from online restore.
-            LockHolder rlh(restore.mutex);
-            std::map<uint16_t, std::vector<queued_item> >::iterator rit = restore.items.find(vbid);
-            if (rit != restore.items.end()) {
-                item_list.insert(item_list.end(), rit->second.begin(), rit->second.end());
+            LockHolder rlh(store.restore.mutex);
+            std::map<uint16_t, std::vector<queued_item> >::iterator rit =
+                store.restore.items.find(vbid);
+            if (rit != store.restore.items.end()) {
+                vbItems.insert(vbItems.end(), rit->second.begin(), rit->second.end());
                 rit->second.clear();
             }
             rlh.unlock();
 
             // Grab all the backfill items if exist.
-            vb->getBackfillItems(item_list);
-            // Get all dirty items from the checkpoint.
-            vb->checkpointManager.getAllItemsForPersistence(item_list);
-            if (item_list.size() > 0) {
-                pushToOutgoingQueue(item_list);
+            vb->getBackfillItems(vbItems);
+        }
+        bytes = 0;
+        std::vector<queued_item>::iterator it = vbItems.begin() + numItemsBefore;
+        for (; it != vbItems.end(); ++it) {
+            bytes += (*it)->size();
+        }
+
+        // Get the dirty items from the checkpoint that fit in the turn.
+        numItemsBefore = vbItems.size();
+        bool hasMore = vb->checkpointManager.getItemsForPersistence(vbItems,
+                                         std::numeric_limits<size_t>::max(),
+                                         maxBytes > bytes ? maxBytes - bytes : 0);
+        for (it = vbItems.begin() + numItemsBefore; it != vbItems.end(); ++it) {
+            bytes += (*it)->size();
+        }
+        return hasMore;
+    }
+
+    std::vector<std::vector<queued_item> > items;
+
+private:
+    EventuallyPersistentStore &store;
+    const std::vector<FlushCandidate> &vbs;
+};
+
+void EventuallyPersistentStore::fillFlushBatch(FlusherShard &shard, FlushBatch &batch) {
+    assert(shard.underlying);
+    assert(batch.items.empty());
+    if (shard.diskFlushAll) {
+        queued_item qi(QueuedItem::New("", 0xffff, queue_op_flush));
+        batch.items.push(qi);
+        stats.memOverhead.incr(sizeof(queued_item));
+        assert(stats.memOverhead.get() < GIGANTOR);
+    }
+
+    // The policy picks the order the vbuckets are drained in, given the
+    // one the last batch ran out of its memory budget at.
+    FlushOrderPolicy *policy = getFlushOrder();
+    std::vector<FlushCandidate> vblist;
+    const std::vector<int> allvbs = vbuckets.getBucketsSortedByState();
+    std::vector<int>::const_iterator vit;
+    for (vit = allvbs.begin(); vit != allvbs.end(); ++vit) {
+        if (static_cast<size_t>(*vit) % flusherShards.size() != shard.id) {
+            continue;
+        }
+        RCPtr<VBucket> vb = vbuckets.getBucket(*vit);
+        if (!vb) {
+            continue;
+        }
+        FlushCandidate c(vb->getId(), vb->getState());
+        if (policy->needsDirtyInfo()) {
+            c.hasDirty = vb->checkpointManager.getOldestQueuedTimeForPersistence(c.oldestDirty);
+            if (!c.hasDirty && vb->getBackfillSize() > 0) {
+                c.hasDirty = true;
+                c.oldestDirty = ep_current_time();
             }
         }
+        vblist.push_back(c);
+    }
+    policy->order(vblist, shard.flushResumeVBucket);
 
-        size_t queue_size = getWriteQueueSize();
-        stats.flusher_todo.set(writing.size());
-        stats.queue_size.set(queue_size);
-        getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
-                         "Flushing %ld items with %ld still in queue\n",
-                         writing.size(), queue_size);
-        rv = &writing;
+    FlushBatchSource source(*this, vblist);
+    shard.flushResumeVBucket = policy->fill(vblist, getFlushBatchMaxBytes(), source);
+
+    // Each vbucket's items are kept together across the turns, so that
+    // the store writes them one vbucket after another.
+    for (size_t i = 0; i < source.items.size(); ++i) {
+        if (!source.items[i].empty()) {
+            pushToOutgoingQueue(shard, batch, source.items[i]);
+        }
+    }
+
+    // Whatever was taken from the checkpoints is on disk once the batch is.
+    batch.persistenceChkIds.clear();
+    size_t numOfVBuckets = vbuckets.getSize();
+    for (size_t i = shard.id; i < numOfVBuckets; i += flusherShards.size()) {
+        assert(i <= std::numeric_limits<uint16_t>::max());
+        uint16_t vbid = static_cast<uint16_t>(i);
+        RCPtr<VBucket> vb = vbuckets.getBucket(vbid);
+        if (vb) {
+            batch.persistenceChkIds[vbid] =
+                vb->checkpointManager.getPersistenceCursorPreChkId();
+        }
     }
-    return rv;
 }
 
-void EventuallyPersistentStore::pushToOutgoingQueue(std::vector<queued_item> &items) {
+/**
+ * Dispatcher job that takes the next batch of a flusher from the
+ * checkpoints.
+ */
+class NextFlushBatchTaker : public DispatcherCallback {
+public:
+    NextFlushBatchTaker(EventuallyPersistentStore *st, FlusherShard &sh) :
+        store(st), shard(sh) { }
+
+    bool callback(Dispatcher &, TaskId) {
+        store->fillNextFlushBatch(shard);
+        return false;
+    }
+
+    std::string description() {
+        std::stringstream ss;
+        ss << "Taking the next batch of flusher " << shard.id;
+        return ss.str();
+    }
+
+private:
+    EventuallyPersistentStore *store;
+    FlusherShard              &shard;
+};
+
+void EventuallyPersistentStore::scheduleNextFlushBatch(FlusherShard &shard) {
+    // A flush_all has to be done before the items queued after it are taken.
+    if (!isPipelinedFlush() || shard.diskFlushAll || !hasItemsForPersistence(shard)) {
+        return;
+    }
+    if (shard.nextState.cas(next_batch_none, next_batch_scheduled)) {
+        shared_ptr<DispatcherCallback> cb(new NextFlushBatchTaker(this, shard));
+        nonIODispatcher->schedule(cb, NULL, Priority::FlusherPriority, 0, false);
+    }
+}
+
+void EventuallyPersistentStore::fillNextFlushBatch(FlusherShard &shard) {
+    if (shard.nextState.cas(next_batch_scheduled, next_batch_taking)) {
+        fillFlushBatch(shard, *shard.next);
+        shard.nextSize.set(shard.next->items.size());
+        updateQueueSize(shard);
+        LockHolder lh(shard.nextReady);
+        shard.nextState.set(next_batch_ready);
+        shard.nextReady.notify();
+    }
+}
+
+bool EventuallyPersistentStore::takeNextFlushBatch(FlusherShard &shard) {
+    if (shard.nextState.get() == next_batch_none) {
+        return false;
+    }
+    // Don't wait for the dispatcher if it hasn't got to the job yet.
+    fillNextFlushBatch(shard);
+    LockHolder lh(shard.nextReady);
+    while (shard.nextState.get() != next_batch_ready) {
+        shard.nextReady.wait();
+    }
+    lh.unlock();
+
+    assert(shard.writing->items.empty());
+    std::swap(shard.writing, shard.next);
+    shard.nextSize.set(0);
+    shard.nextState.set(next_batch_none);
+    return true;
+}
+
+void EventuallyPersistentStore::pushToOutgoingQueue(FlusherShard &shard,
+                                                    FlushBatch &batch,
+                                                    std::vector<queued_item> &items) {
     size_t num_items = 0;
-    rwUnderlying->optimizeWrites(items);
+    std::queue<queued_item> &writing = batch.items;
+    shard.underlying->optimizeWrites(items);
     std::vector<queued_item>::iterator it = items.begin();
     for(; it != items.end(); ++it) {
-        if (writing.empty() || writing.back()->getKey() != (*it)->getKey()) {
+        if (writing.empty() || writing.back()->compareKey(**it) != 0) {
             writing.push(*it);
             ++num_items;
         } else {
@@ -1767,30 +2547,33 @@ void EventuallyPersistentStore::pushToOutgoingQueue(std::vector<queued_item> &it
     assert(stats.memOverhead.get() < GIGANTOR);
 }
 
-void EventuallyPersistentStore::requeueRejectedItems(std::queue<queued_item> *rej) {
+void EventuallyPersistentStore::requeueRejectedItems(FlusherShard &shard,
+                                                     std::queue<queued_item> *rej) {
     size_t queue_size = rej->size();
     // Requeue the rejects.
     while (!rej->empty()) {
-        writing.push(rej->front());
+        shard.writing->items.push(rej->front());
         rej->pop();
     }
     stats.memOverhead.incr(queue_size * sizeof(queued_item));
     assert(stats.memOverhead.get() < GIGANTOR);
-    stats.queue_size.set(getWriteQueueSize());
-    stats.flusher_todo.set(writing.size());
+    updateQueueSize(shard);
+    setFlusherTodo(shard, shard.writing->items.size());
 }
 
-void EventuallyPersistentStore::completeFlush(rel_time_t flush_start) {
-    size_t numOfVBuckets = vbuckets.getSize();
+void EventuallyPersistentStore::completeFlush(FlusherShard &shard, rel_time_t flush_start) {
+    // The persistence cursors may already be further along if the next
+    // batch was taken while this one committed.
+    std::map<uint16_t, uint64_t> &chkIds = shard.writing->persistenceChkIds;
     bool schedule_vb_snapshot = false;
-    for (size_t i = 0; i < numOfVBuckets; ++i) {
-        assert(i <= std::numeric_limits<uint16_t>::max());
-        uint16_t vbid = static_cast<uint16_t>(i);
+    std::map<uint16_t, uint64_t>::iterator it;
+    for (it = chkIds.begin(); it != chkIds.end(); ++it) {
+        uint16_t vbid = it->first;
         RCPtr<VBucket> vb = vbuckets.getBucket(vbid);
         if (!vb || vb->getState() == vbucket_state_dead) {
             continue;
         }
-        uint64_t pcursor_chkid = vb->checkpointManager.getPersistenceCursorPreChkId();
+        uint64_t pcursor_chkid = it->second;
         if (pcursor_chkid > 0 &&
             pcursor_chkid != vbuckets.getPersistenceCheckpointId(vbid)) {
             vbuckets.setPersistenceCheckpointId(vbid, pcursor_chkid);
@@ -1804,8 +2587,8 @@ void EventuallyPersistentStore::completeFlush(rel_time_t flush_start) {
         scheduleVBSnapshot(Priority::VBucketPersistHighPriority);
     }
 
-    stats.flusher_todo.set(writing.size());
-    stats.queue_size.set(getWriteQueueSize());
+    setFlusherTodo(shard, shard.writing->items.size());
+    updateQueueSize(shard);
     rel_time_t complete_time = ep_current_time();
     stats.flushDuration.set(complete_time - flush_start);
     stats.flushDurationHighWat.set(std::max(stats.flushDuration.get(),
@@ -1813,8 +2596,10 @@ void EventuallyPersistentStore::completeFlush(rel_time_t flush_start) {
     stats.cumulativeFlushTime.incr(complete_time - flush_start);
 }
 
-int EventuallyPersistentStore::flushSome(std::queue<queued_item> *q,
+int EventuallyPersistentStore::flushSome(FlusherShard &shard,
+                                         std::queue<queued_item> *q,
                                          std::queue<queued_item> *rejectQueue) {
+    TransactionContext &tctx = shard.tctx;
     if (!tctx.enter()) {
         ++stats.beginFailed;
         getLogger()->log(EXTENSION_LOG_WARNING, NULL,
@@ -1830,12 +2615,20 @@ int EventuallyPersistentStore::flushSome(std::queue<queued_item> *q,
     int oldest = stats.min_data_age;
     int completed(0);
     for (; completed < tsz && !q->empty(); ++completed) {
-        int n = flushOne(q, rejectQueue);
+        int n = flushOne(shard, q, rejectQueue);
         if (n != 0 && n < oldest) {
             oldest = n;
         }
     }
     tctx.commit();
+
+    size_t next = shard.txnSizer.commitDone(completed, tctx.getCommitTime(),
+                                            stats.totalEnqueued.get(),
+                                            stats.totalPersisted.get(),
+                                            gethrtime());
+    if (next != static_cast<size_t>(tsz)) {
+        tctx.setTxnSize(next);
+    }
     return oldest;
 }
 
@@ -1850,13 +2643,31 @@ size_t EventuallyPersistentStore::getWriteQueueSize(void) {
             size += vb->checkpointManager.getNumItemsForPersistence() + vb->getBackfillSize();
         }
     }
+    std::vector<FlusherShard*>::iterator it;
+    for (it = flusherShards.begin(); it != flusherShards.end(); ++it) {
+        size += (*it)->nextSize.get();
+    }
     return size;
 }
 
-bool EventuallyPersistentStore::hasItemsForPersistence(void) {
+size_t EventuallyPersistentStore::getWriteQueueSize(FlusherShard &shard) {
+    size_t size = shard.nextSize.get();
+    size_t numOfVBuckets = vbuckets.getSize();
+    for (size_t i = shard.id; i < numOfVBuckets; i += flusherShards.size()) {
+        assert(i <= std::numeric_limits<uint16_t>::max());
+        uint16_t vbid = static_cast<uint16_t>(i);
+        RCPtr<VBucket> vb = vbuckets.getBucket(vbid);
+        if (vb && (vb->getState() != vbucket_state_dead)) {
+            size += vb->checkpointManager.getNumItemsForPersistence() + vb->getBackfillSize();
+        }
+    }
+    return size;
+}
+
+bool EventuallyPersistentStore::hasItemsForPersistence(FlusherShard &shard) {
     bool hasItems = false;
     size_t numOfVBuckets = vbuckets.getSize();
-    for (size_t i = 0; i < numOfVBuckets; ++i) {
+    for (size_t i = shard.id; i < numOfVBuckets; i += flusherShards.size()) {
         assert(i <= std::numeric_limits<uint16_t>::max());
         uint16_t vbid = static_cast<uint16_t>(i);
         RCPtr<VBucket> vb = vbuckets.getBucket(vbid);
@@ -1902,8 +2713,11 @@ public:
             RCPtr<VBucket> vb = store->getVBucket(queuedItem->getVBucketId());
             if (vb) {
                 int bucket_num(0);
-                LockHolder lh = vb->ht.getLockedBucket(queuedItem->getKey(), &bucket_num);
-                StoredValue *v = store->fetchValidValue(vb, queuedItem->getKey(),
+                uint64_t h = queuedItem->getKeyHash();
+                VersionedLockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+                // Before the item can be marked clean and ejected.
+                vb->addKeyToFilter(h);
+                StoredValue *v = store->fetchValidValue(vb, queuedItem->getKey(), h,
                                                         bucket_num, true, false);
                 if (v && value.second > 0) {
                     mutationLog->newItem(queuedItem->getVBucketId(), queuedItem->getKey(),
@@ -1933,8 +2747,9 @@ public:
             RCPtr<VBucket> vb = store->getVBucket(queuedItem->getVBucketId());
             if (vb && value.first == 0) {
                 int bucket_num(0);
-                LockHolder lh = vb->ht.getLockedBucket(queuedItem->getKey(), &bucket_num);
-                StoredValue *v = store->fetchValidValue(vb, queuedItem->getKey(),
+                uint64_t h = queuedItem->getKeyHash();
+                VersionedLockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+                StoredValue *v = store->fetchValidValue(vb, queuedItem->getKey(), h,
                                                         bucket_num, true, false);
                 if (v) {
                     std::stringstream ss;
@@ -1983,8 +2798,12 @@ public:
             // may now remove it from the hash table.
             if (vb) {
                 int bucket_num(0);
-                LockHolder lh = vb->ht.getLockedBucket(queuedItem->getKey(), &bucket_num);
-                StoredValue *v = store->fetchValidValue(vb, queuedItem->getKey(),
+                uint64_t h = queuedItem->getKeyHash();
+                VersionedLockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+                // The deletion left a tombstone on disk that getMeta
+                // has to be able to find.
+                vb->addKeyToFilter(h);
+                StoredValue *v = store->fetchValidValue(vb, queuedItem->getKey(), h,
                                                         bucket_num, true, false);
                 if (v && v->isDeleted()) {
                     if (store->getEPEngine().isDegradedMode()) {
@@ -2029,25 +2848,45 @@ private:
     DISALLOW_COPY_AND_ASSIGN(PersistenceCallback);
 };
 
-int EventuallyPersistentStore::flushOneDeleteAll() {
-    rwUnderlying->reset();
-    // Log a flush of every known vbucket.
-    std::vector<int> vbs(vbuckets.getBuckets());
-    for (std::vector<int>::iterator it(vbs.begin()); it != vbs.end(); ++it) {
-        mutationLog.deleteAll(static_cast<uint16_t>(*it));
+int EventuallyPersistentStore::flushOneDeleteAll(FlusherShard &shard) {
+    // Every flusher is done with what it took before the flush_all by
+    // now, and the stores of all of them go with the first one's.
+    LockHolder lh(flushAllState.mutex);
+    if (flushAllState.numDone == 0) {
+        shard.underlying->reset();
+        // Log a flush of every known vbucket.
+        std::vector<int> vbs(vbuckets.getBuckets());
+        for (std::vector<int>::iterator it(vbs.begin()); it != vbs.end(); ++it) {
+            mutationLog.deleteAll(static_cast<uint16_t>(*it));
+        }
+        // This is happening in an independent transaction, so we're going
+        // go ahead and commit it out.
+        mutationLog.commit1();
+        mutationLog.commit2();
+    }
+    shard.flushAllReady = false;
+    bool lastOne = ++flushAllState.numDone == flusherShards.size();
+    if (lastOne) {
+        flushAllState.numDone = 0;
+        flushAllState.numReady = 0;
+    }
+    lh.unlock();
+    shard.diskFlushAll.cas(true, false);
+    if (lastOne && flusherShards.size() > 1) {
+        // Some may already wait for the next flush_all.
+        for (size_t i = 0; i < flushers.size(); ++i) {
+            if (i != shard.id) {
+                flushers[i]->wake();
+            }
+        }
     }
-    // This is happening in an independent transaction, so we're going
-    // go ahead and commit it out.
-    mutationLog.commit1();
-    mutationLog.commit2();
-    diskFlushAll.cas(true, false);
     return 1;
 }
 
 // While I actually know whether a delete or set was intended, I'm
 // still a bit better off running the older code that figures it out
 // based on what's in memory.
-int EventuallyPersistentStore::flushOneDelOrSet(const queued_item &qi,
+int EventuallyPersistentStore::flushOneDelOrSet(FlusherShard &shard, const queued_item &qi,
                                            std::queue<queued_item> *rejectQueue) {
 
     RCPtr<VBucket> vb = getVBucket(qi->getVBucketId());
@@ -2056,11 +2895,13 @@ int EventuallyPersistentStore::flushOneDelOrSet(const queued_item &qi,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(qi->getKey(), &bucket_num);
-    StoredValue *v = fetchValidValue(vb, qi->getKey(), bucket_num, true, false);
+    VersionedLockHolder lh = vb->ht.getLockedBucket(qi->getKeyHash(), &bucket_num);
+    StoredValue *v = fetchValidValue(vb, qi->getKey(), qi->getKeyHash(),
+                                     bucket_num, true, false);
 
     size_t itemBytes = qi->size();
     vb->doStatsForFlushing(*qi, itemBytes);
+    vb->doStatsForPersisting(qi->getQueuedTime());
 
     bool found = v != NULL;
     int64_t rowid = found ? v->getId() : -1;
@@ -2148,8 +2989,8 @@ int EventuallyPersistentStore::flushOneDelOrSet(const queued_item &qi,
                 PersistenceCallback *cb;
                 cb = new PersistenceCallback(qi, rejectQueue, this, &mutationLog,
                                              queued, dirtied, &stats, itm.getCas());
-                tctx.addCallback(cb);
-                rwUnderlying->set(itm, *cb);
+                shard.tctx.addCallback(cb);
+                shard.underlying->set(itm, *cb);
                 if (rowid == -1)  {
                     ++vb->opsCreate;
                 } else {
@@ -2165,43 +3006,43 @@ int EventuallyPersistentStore::flushOneDelOrSet(const queued_item &qi,
             cb = new PersistenceCallback(qi, rejectQueue, this, &mutationLog,
                                          queued, dirtied, &stats, 0);
 
-            tctx.addCallback(cb);
-            rwUnderlying->del(itm, rowid, *cb);
+            shard.tctx.addCallback(cb);
+            shard.underlying->del(itm, rowid, *cb);
         }
     }
 
     return ret;
 }
 
-int EventuallyPersistentStore::flushOne(std::queue<queued_item> *q,
+int EventuallyPersistentStore::flushOne(FlusherShard &shard,
+                                        std::queue<queued_item> *q,
                                         std::queue<queued_item> *rejectQueue) {
 
     queued_item qi = q->front();
     q->pop();
     stats.memOverhead.decr(sizeof(queued_item));
-    assert(stats.memOverhead.get() < GIGANTOR);
 
     int rv = 0;
     switch (qi->getOperation()) {
     case queue_op_flush:
-        rv = flushOneDeleteAll();
+        rv = flushOneDeleteAll(shard);
         break;
     case queue_op_set:
         {
             size_t prevRejectCount = rejectQueue->size();
-            rv = flushOneDelOrSet(qi, rejectQueue);
+            rv = flushOneDelOrSet(shard, qi, rejectQueue);
             if (rejectQueue->size() == prevRejectCount) {
                 // flush operation was not rejected
-                tctx.addUncommittedItem(qi);
+                shard.tctx.addUncommittedItem(qi);
             }
         }
         break;
     case queue_op_del:
-        rv = flushOneDelOrSet(qi, rejectQueue);
+        rv = flushOneDelOrSet(shard, qi, rejectQueue);
         break;
     case queue_op_commit:
-        tctx.commit();
-        tctx.enter();
+        shard.tctx.commit();
+        shard.tctx.enter();
         break;
     case queue_op_empty:
         assert(false);
@@ -2209,6 +3050,7 @@ int EventuallyPersistentStore::flushOne(std::queue<queued_item> *q,
     default:
         break;
     }
+    shard.todo--;
     stats.flusher_todo--;
 
     return rv;
@@ -2221,15 +3063,18 @@ void EventuallyPersistentStore::queueDirty(RCPtr<VBucket> &vb,
                                            enum queue_operation op,
                                            uint64_t seqno,
                                            int64_t rowid,
-                                           bool tapBackfill) {
+                                           bool tapBackfill,
+                                           uint64_t keyHash) {
     if (doPersistence) {
         if (vb) {
-            queued_item itm(new QueuedItem(key, vbid, op, rowid, seqno));
+            queued_item itm(QueuedItem::New(key, vbid, op, rowid, seqno, keyHash));
             bool rv = tapBackfill ?
                       vb->queueBackfillItem(itm) : vb->checkpointManager.queueDirty(itm, vb);
             if (rv) {
-                if (++stats.queue_size == 1 && stats.flusher_todo == 0) {
-                    flusher->wake();
+                ++stats.queue_size;
+                FlusherShard &shard = getFlusherShardFor(vbid);
+                if (++shard.queueSize == 1 && shard.todo == 0) {
+                    flushers[shard.id]->wake();
                 }
                 ++stats.totalEnqueued;
                 vb->doStatsForQueueing(*itm, itm->size());
@@ -2248,13 +3093,13 @@ int EventuallyPersistentStore::restoreItem(const Item &itm, enum queue_operation
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
+    VersionedLockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
     LockHolder rlh(restore.mutex);
     if (restore.itemsDeleted.find(key) == restore.itemsDeleted.end() &&
         vb->ht.unlocked_restoreItem(itm, op, bucket_num)) {
 
         lh.unlock();
-        queued_item qi(new QueuedItem(key, vbid, op));
+        queued_item qi(QueuedItem::New(key, vbid, op));
         std::map<uint16_t, std::vector<queued_item> >::iterator it = restore.items.find(vbid);
         if (it != restore.items.end()) {
             it->second.push_back(qi);
@@ -2546,6 +3391,7 @@ void TransactionContext::commit() {
     }
     mutationLog.commit2();
     ++stats.flusherCommits;
+    ++numCommits;
 
     std::list<PersistenceCallback*>::iterator iter;
     for (iter = transactionCallbacks.begin();
@@ -2554,6 +3400,8 @@ void TransactionContext::commit() {
         delete *iter;
     }
     transactionCallbacks.clear();
+    writesPending.set(false);
+    durability.committed(this);
 
     end = gethrtime();
     uint64_t commit_time = (end - start) / 1000000;
@@ -2563,6 +3411,8 @@ void TransactionContext::commit() {
         static_cast<double>(trans_time) / static_cast<double>(numUncommittedItems) : 0;
     stats.commit_time.set(commit_time);
     stats.cumulativeCommitTime.incr(commit_time);
+    commitTime.set(commit_time);
+    cumulativeCommitTime.incr(commit_time);
     intxn = false;
     uncommittedItems.clear();
     numUncommittedItems = 0;
@@ -2573,42 +3423,91 @@ void TransactionContext::addUncommittedItem(const queued_item &qi) {
     ++numUncommittedItems;
 }
 
-VBCBAdaptor::VBCBAdaptor(EventuallyPersistentStore *s,
-                         shared_ptr<VBucketVisitor> v,
-                         const char *l, double sleep) :
-    store(s), visitor(v), label(l), sleepTime(sleep), currentvb(0)
-{
-    const VBucketFilter &vbFilter = visitor->getVBucketFilter();
-    size_t maxSize = store->vbuckets.getSize();
+void EventuallyPersistentStore::visit(const std::vector<shared_ptr<VBucketVisitor> > &visitors,
+                                      const char *lbl, Dispatcher *d,
+                                      const Priority &prio, bool isDaemon,
+                                      double sleepTime,
+                                      VBucketVisitorCursor *cursor) {
+    assert(!visitors.empty());
+    const VBucketFilter &vbFilter = visitors[0]->getVBucketFilter();
+    std::vector<uint16_t> vbs;
+    size_t maxSize = vbuckets.getSize();
     for (size_t i = 0; i < maxSize; ++i) {
         assert(i <= std::numeric_limits<uint16_t>::max());
         uint16_t vbid = static_cast<uint16_t>(i);
-        RCPtr<VBucket> vb = store->vbuckets.getBucket(vbid);
+        RCPtr<VBucket> vb = vbuckets.getBucket(vbid);
         if (vb && vbFilter(vbid)) {
-            vbList.push(vbid);
+            vbs.push_back(vbid);
+        }
+    }
+
+    shared_ptr<VBucketVisitQueue> queue(new VBucketVisitQueue(vbs, visitors.size(),
+                                                              cursor));
+    for (size_t i = 0; i < visitors.size(); ++i) {
+        Dispatcher *wd = d;
+        if (i > 0 && !visitorDispatchers.empty()) {
+            wd = visitorDispatchers[(i - 1) % visitorDispatchers.size()];
         }
+        wd->schedule(shared_ptr<DispatcherCallback>(new VBCBAdaptor(this, visitors[i],
+                                                                    queue, i, lbl,
+                                                                    sleepTime)),
+                     NULL, prio, 0, isDaemon);
     }
 }
 
+VBCBAdaptor::VBCBAdaptor(EventuallyPersistentStore *s,
+                         shared_ptr<VBucketVisitor> v,
+                         shared_ptr<VBucketVisitQueue> q, size_t w,
+                         const char *l, double sleep) :
+    store(s), visitor(v), queue(q), worker(w), label(l), sleepTime(sleep),
+    currentvb(0), haveVBucket(false), chunkSize(s->getVisitChunkSize())
+{
+}
+
+bool VBCBAdaptor::finish() {
+    // Let go of the cursor first, completing may start the next visit.
+    queue->finish();
+    visitor->complete();
+    return false;
+}
+
 bool VBCBAdaptor::callback(Dispatcher & d, TaskId t) {
-    if (!vbList.empty()) {
-        currentvb = vbList.front();
-        RCPtr<VBucket> vb = store->vbuckets.getBucket(currentvb);
-        if (vb) {
-            if (visitor->pauseVisitor()) {
-                d.snooze(t, sleepTime);
-                return true;
-            }
-            if (visitor->visitBucket(vb)) {
-                vb->ht.visit(*visitor);
-            }
+    if (!haveVBucket) {
+        if (!queue->next(worker, currentvb, position)) {
+            return finish();
         }
-        vbList.pop();
+        haveVBucket = true;
+        visiting.reset();
     }
 
-    bool isdone = vbList.empty();
-    if (isdone) {
-        visitor->complete();
+    RCPtr<VBucket> vb = store->vbuckets.getBucket(currentvb);
+    if (vb && visiting && vb.get() != visiting.get()) {
+        // Deleted and recreated while we were part way through it.
+        vb.reset();
     }
-    return !isdone;
+    if (vb) {
+        if (visitor->pauseVisitor()) {
+            d.snooze(t, sleepTime);
+            return true;
+        }
+        if (queue->hasCursor()
+            && (queue->isStopping() || visitor->goalReached())) {
+            queue->stop(worker, position);
+            return finish();
+        }
+        if (visiting || visitor->visitBucket(vb)) {
+            size_t items = 0;
+            position = vb->ht.pauseResumeVisit(*visitor, position,
+                                               chunkSize, items);
+            queue->countChunk(items);
+            if (position != vb->ht.endPosition()) {
+                visiting = vb;
+                return true;
+            }
+        }
+        queue->countVBucket();
+    }
+    haveVBucket = false;
+    visiting.reset();
+    return true;
 }
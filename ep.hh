@@ -44,10 +44,14 @@
 #include "dispatcher.hh"
 #include "vbucket.hh"
 #include "vbucketmap.hh"
+#include "vbucket_visit.hh"
 #include "item_pager.hh"
 #include "mutation_log.hh"
 #include "mutation_log_compactor.hh"
 #include "bgfetcher.hh"
+#include "txnsizer.hh"
+#include "durability.hh"
+#include "flush_order.hh"
 
 #define MAX_BG_FETCH_DELAY 900
 
@@ -99,6 +103,17 @@ public:
         return false;
     }
 
+    /**
+     * Return true if the visit has done what it set out to and can
+     * stop early.
+     *
+     * This is only checked for visits that keep a cursor, which then
+     * points at where the next visit should pick up.
+     */
+    virtual bool goalReached() {
+        return false;
+    }
+
 protected:
     VBucketFilter vBucketFilter;
     RCPtr<VBucket> currentBucket;
@@ -111,6 +126,7 @@ typedef std::list<chunk_range_t>::iterator chunk_range_iterator_t;
 class Flusher;
 class Warmup;
 class TapBGFetchCallback;
+class SpilledChunkLoadScheduler;
 class EventuallyPersistentStore;
 
 class PersistenceCallback;
@@ -122,9 +138,10 @@ class PersistenceCallback;
 class TransactionContext {
 public:
 
-    TransactionContext(EPStats &st, KVStore *ks, MutationLog &log)
-        : stats(st), underlying(ks), mutationLog(log),
-          tranStartTime(0),intxn(false) {}
+    TransactionContext(EPStats &st, KVStore *ks, MutationLog &log,
+                       DurabilityMonitor &dm)
+        : stats(st), underlying(ks), mutationLog(log), durability(dm),
+          writesPending(false), tranStartTime(0),intxn(false) {}
 
     /**
      * Call this whenever entering a transaction.
@@ -167,30 +184,147 @@ public:
     }
 
     void addCallback(PersistenceCallback *cb) {
+        writesPending.set(true);
         transactionCallbacks.push_back(cb);
     }
 
+    /**
+     * True from the first write of a transaction until it's committed.
+     */
+    bool hasPendingWrites() {
+        return writesPending.get();
+    }
+
+    /**
+     * Get the number of transactions committed through this context.
+     */
+    size_t getNumCommits() {
+        return numCommits;
+    }
+
+    /**
+     * Get the milliseconds the most recent commit took.
+     */
+    size_t getCommitTime() {
+        return commitTime;
+    }
+
+    /**
+     * Get the milliseconds all the commits took.
+     */
+    size_t getCumulativeCommitTime() {
+        return cumulativeCommitTime;
+    }
+
 private:
     EPStats &stats;
     KVStore *underlying;
     MutationLog &mutationLog;
+    DurabilityMonitor &durability;
+    Atomic<bool> writesPending;
     Atomic<int> txnSize;
     Atomic<size_t> numUncommittedItems;
     Atomic<double> lastTranTimePerItem;
+    Atomic<size_t> numCommits;
+    Atomic<size_t> commitTime;
+    Atomic<size_t> cumulativeCommitTime;
     hrtime_t tranStartTime;
     bool intxn;
     std::list<queued_item> uncommittedItems;
     std::list<PersistenceCallback*> transactionCallbacks;
 };
 
+/**
+ * The items of a flush batch, and for each vbucket the id of the
+ * checkpoint before its persistence cursor once they were taken, which
+ * is how far the vbucket is on disk when the batch is.
+ */
+struct FlushBatch {
+    std::queue<queued_item> items;
+    std::map<uint16_t, uint64_t> persistenceChkIds;
+};
+
+/**
+ * Where the batch after the one being flushed is at.
+ */
+enum next_flush_batch_state {
+    next_batch_none,            //!< nothing was asked for
+    next_batch_scheduled,       //!< a dispatcher job is to take it
+    next_batch_taking,          //!< the items are being taken
+    next_batch_ready            //!< ready to be flushed
+};
+
+/**
+ * What a flusher persists its vbuckets with.
+ *
+ * With more than one flusher, each one owns the vbuckets whose id modulo
+ * the number of flushers is its id, and writes them through a KVStore
+ * and a transaction of its own.
+ */
+class FlusherShard {
+public:
+
+    FlusherShard(size_t i, EPStats &st, KVStore *ks, MutationLog &log,
+                 DurabilityMonitor &dm)
+        : id(i), underlying(ks), writing(&batches[0]), next(&batches[1]),
+          nextState(next_batch_none), nextSize(0), numPipelined(0),
+          flushResumeVBucket(-1),
+          diskFlushAll(false), flushAllReady(false),
+          tctx(st, ks, log, dm) {}
+
+    const size_t id;
+    KVStore *underlying;
+    FlushBatch batches[2];
+    // The writing batch is used by the flusher thread to keep
+    // track of the objects it works on. It should _not_ be used
+    // by any other threads (because the flusher use it without
+    // locking...  The next batch belongs to whoever moves nextState
+    // to next_batch_taking until it is ready.
+    FlushBatch *writing;
+    FlushBatch *next;
+    Atomic<int> nextState;
+    SyncObject nextReady;
+    // Items in a ready next batch, which still count in ep_queue_size.
+    Atomic<size_t> nextSize;
+    // Batches taken ahead while the one before them was written.
+    Atomic<size_t> numPipelined;
+    // The vbucket the last batch stopped at, if any, so that the next
+    // one carries on from there.
+    int flushResumeVBucket;
+    // Items in the writing queue, which all flushers together count
+    // in ep_flusher_todo.
+    Atomic<size_t> todo;
+    // Items of the flusher's vbuckets waiting to be taken, its share of
+    // ep_queue_size.
+    Atomic<size_t> queueSize;
+    Atomic<bool> diskFlushAll;
+    // Done with what it took before the pending flush_all, guarded by
+    // the store's flushAllState.mutex.
+    bool flushAllReady;
+    TransactionContext tctx;
+    TxnSizer txnSizer;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(FlusherShard);
+};
+
 /**
  * VBucket visitor callback adaptor.
  */
+/**
+ * Dispatcher callback that runs a vbucket visitor over the vbuckets it
+ * takes from a visit's queue, a bounded number of items at a time.
+ *
+ * A visit spread over several workers has one of these, each with its
+ * own visitor, per worker.
+ */
 class VBCBAdaptor : public DispatcherCallback {
 public:
 
     VBCBAdaptor(EventuallyPersistentStore *s,
-                shared_ptr<VBucketVisitor> v, const char *l, double sleep=0);
+                shared_ptr<VBucketVisitor> v,
+                shared_ptr<VBucketVisitQueue> q, size_t w,
+                const char *l, double sleep=0);
 
     std::string description() {
         std::stringstream rv;
@@ -201,12 +335,20 @@ public:
     bool callback(Dispatcher &d, TaskId t);
 
 private:
-    std::queue<uint16_t>        vbList;
-    EventuallyPersistentStore  *store;
-    shared_ptr<VBucketVisitor>  visitor;
-    const char                 *label;
-    double                      sleepTime;
-    uint16_t                    currentvb;
+    EventuallyPersistentStore    *store;
+    shared_ptr<VBucketVisitor>    visitor;
+    shared_ptr<VBucketVisitQueue> queue;
+    size_t                        worker;
+    const char                   *label;
+    double                        sleepTime;
+    uint16_t                      currentvb;
+    bool                          haveVBucket;
+    // Set while currentvb is partly visited.
+    RCPtr<VBucket>                visiting;
+    HashTable::Position           position;
+    size_t                        chunkSize;
+
+    bool finish();
 
     DISALLOW_COPY_AND_ASSIGN(VBCBAdaptor);
 };
@@ -277,6 +419,27 @@ public:
                            vbucket_state_active, trackReference);
     }
 
+    /**
+     * Retrieve a batch of values from one vbucket.
+     *
+     * The result is the same as calling get() for every key, but the
+     * vbucket is only looked up once, each hash table lock is taken
+     * once for the whole batch and the background fetches of all the
+     * non-resident keys are queued together.
+     *
+     * @param keys the keys to fetch
+     * @param vbucket the vbucket from which to retrieve the keys
+     * @param cookie the connection cookie
+     * @param results receives one GetValue per key, in the order of keys
+     * @param queueBG if true, queue background fetches where necessary
+     * @param honorStates if false, fetch the keys regardless of state
+     * @param trackReference true if the lookups count as references
+     */
+    void getMulti(const std::vector<std::string> &keys, uint16_t vbucket,
+                  const void *cookie, std::vector<GetValue> &results,
+                  bool queueBG=true, bool honorStates=true,
+                  bool trackReference=true);
+
     /**
      * Retrieve a value from a vbucket in replica state.
      *
@@ -566,38 +729,170 @@ public:
     void visit(VBucketVisitor &visitor);
 
     /**
-     * Run a vbucket visitor with separate jobs per vbucket.
+     * Run a vbucket visitor with separate jobs per chunk of a vbucket.
      *
      * Note that this is asynchronous.
+     *
+     * @param cursor if given, start where the last visit with it
+     *        stopped and leave it where this one stops
      */
     void visit(shared_ptr<VBucketVisitor> visitor, const char *lbl,
-               Dispatcher *d, const Priority &prio, bool isDaemon=true, double sleepTime=0) {
-        d->schedule(shared_ptr<DispatcherCallback>(new VBCBAdaptor(this, visitor, lbl, sleepTime)),
-                    NULL, prio, 0, isDaemon);
+               Dispatcher *d, const Priority &prio, bool isDaemon=true, double sleepTime=0,
+               VBucketVisitorCursor *cursor=NULL) {
+        std::vector<shared_ptr<VBucketVisitor> > visitors(1, visitor);
+        visit(visitors, lbl, d, prio, isDaemon, sleepTime, cursor);
     }
 
-    int getTxnSize() {
-        return tctx.getTxnSize();
+    /**
+     * Run a vbucket visit spread over several workers, one per
+     * visitor, which take vbuckets in turn.
+     *
+     * The first worker runs on the given dispatcher, the others on the
+     * visitor dispatchers.  Each visitor is completed when its worker
+     * runs out of vbuckets, merging what they found is up to them.
+     * The vbuckets visited are those the first visitor's filter takes.
+     */
+    void visit(const std::vector<shared_ptr<VBucketVisitor> > &visitors,
+               const char *lbl, Dispatcher *d, const Priority &prio,
+               bool isDaemon=true, double sleepTime=0,
+               VBucketVisitorCursor *cursor=NULL);
+
+    /**
+     * Get the number of workers a parallel visit can make use of.
+     */
+    size_t getNumVisitorWorkers() {
+        return visitorDispatchers.size() + 1;
     }
 
-    void setTxnSize(int to) {
-        tctx.setTxnSize(to);
+    const std::vector<Dispatcher*> &getVisitorDispatchers() {
+        return visitorDispatchers;
     }
 
-    size_t getNumUncommittedItems() {
-        return tctx.getNumUncommittedItems();
+    /**
+     * Set the number of items a vbucket visit job visits before giving
+     * the dispatcher back, 0 to visit whole vbuckets.
+     */
+    void setVisitChunkSize(size_t to) {
+        visitChunkSize.set(to);
     }
 
-    double getTransactionTimePerItem() {
-        return tctx.getTransactionTimePerItem();
+    size_t getVisitChunkSize() {
+        return visitChunkSize.get();
+    }
+
+    VBucketVisitorCursor &getItemPagerCursor() {
+        return pager.cursor;
+    }
+
+    VBucketVisitorCursor &getExpiryPagerCursor() {
+        return expiryPager.cursor;
+    }
+
+    VBucketVisitorCursor &getAccessScannerCursor() {
+        return accessScanner.cursor;
+    }
+
+    /**
+     * Set the number of bytes of dirty items a flush batch may take
+     * from the checkpoints before the rest is left to the next batch.
+     */
+    void setFlushBatchMaxBytes(size_t to) {
+        flushBatchMaxBytes.set(to);
+    }
+
+    size_t getFlushBatchMaxBytes() {
+        return flushBatchMaxBytes.get();
+    }
+
+    /**
+     * Set whether the next flush batch is taken from the checkpoints
+     * while the last transaction of the current one commits.
+     */
+    void setPipelinedFlush(bool to) {
+        pipelinedFlush.set(to);
+    }
+
+    bool isPipelinedFlush() {
+        return pipelinedFlush.get();
     }
 
-    const Flusher* getFlusher();
+    /**
+     * Set the policy of the order flush batches drain the vbuckets in.
+     *
+     * @return false if there is no policy of that name
+     */
+    bool setFlushOrder(const std::string &name) {
+        FlushOrderPolicy *policy = FlushOrderPolicy::get(name);
+        if (policy == NULL) {
+            return false;
+        }
+        flushOrder.set(policy);
+        return true;
+    }
+
+    FlushOrderPolicy *getFlushOrder() {
+        return flushOrder.get();
+    }
+
+    void setTxnSize(int to);
+
+    /**
+     * Set the smallest transaction adaptive sizing may pick.
+     */
+    void setMinTxnSize(size_t to);
+
+    /**
+     * Let the flushers size their transactions by how their commits
+     * and the disk write queue are doing, up to max_txn_size.
+     */
+    void setAdaptiveTxnSize(bool to);
+
+    /**
+     * Set the commit time (in milliseconds) adaptive sizing aims for.
+     */
+    void setTxnCommitTarget(size_t to);
+
+    size_t getNumUncommittedItems();
+
+    /**
+     * Get the milliseconds per item it takes the flushers together to
+     * persist a transaction.
+     */
+    double getTransactionTimePerItem();
+
+    size_t getNumFlushers() {
+        return flushers.size();
+    }
+
+    const Flusher* getFlusher(size_t i = 0) {
+        return flushers[i];
+    }
+
+    FlusherShard &getFlusherShard(size_t i) {
+        return *flusherShards[i];
+    }
+
+    /**
+     * Get the transaction context the vbucket is persisted through.
+     */
+    TransactionContext &getTransactionContext(uint16_t vbid) {
+        return getFlusherShardFor(vbid).tctx;
+    }
+
+    DurabilityMonitor &getDurabilityMonitor() {
+        return durability;
+    }
     Warmup* getWarmup(void) const;
 
     ENGINE_ERROR_CODE getKeyStats(const std::string &key, uint16_t vbucket,
                                   key_stats &kstats, bool wantsDeleted=false);
 
+    /**
+     * Check if full eviction dropped a key from memory, which it only
+     * does to clean items.
+     */
+    bool isEvicted(const std::string &key, uint16_t vbucket);
+
     bool getLocked(const std::string &key, uint16_t vbucket,
                    Callback<GetValue> &cb,
                    rel_time_t currentTime, uint32_t lockTimeout,
@@ -640,6 +935,22 @@ public:
 
     void deleteExpiredItems(std::list<std::pair<uint16_t, std::string> > &);
 
+    /**
+     * Drop the given items from memory altogether (full eviction),
+     * skipping any that changed since they were picked.
+     *
+     * @return the number of items ejected
+     */
+    size_t ejectItems(std::list<std::pair<uint16_t, std::string> > &);
+
+    /**
+     * Are whole items, rather than just their values, ejected from
+     * memory?  If so, a key missing from memory may still be on disk.
+     */
+    bool isFullEviction() const {
+        return fullEviction;
+    }
+
     /**
      * Get the memoized storage properties from the DB.kv
      */
@@ -671,9 +982,7 @@ public:
      */
     int restoreItem(const Item &itm, enum queue_operation op);
 
-    bool isFlushAllScheduled() {
-        return diskFlushAll.get();
-    }
+    bool isFlushAllScheduled();
 
     void setItemExpiryWindow(size_t value) {
         itemExpiryWindow = value;
@@ -755,14 +1064,18 @@ private:
 
     RCPtr<VBucket> getVBucket(uint16_t vbid, vbucket_state_t wanted_state);
 
-    /* Queue an item to be written to persistent layer. */
+    /*
+     * Queue an item to be written to persistent layer.  keyHash is
+     * the hash64() of the key when the caller already computed it.
+     */
     void queueDirty(RCPtr<VBucket> &vb,
                     const std::string &key,
                     uint16_t vbid,
                     enum queue_operation op,
                     uint64_t seqno,
                     int64_t rowid,
-                    bool tapBackfill = false);
+                    bool tapBackfill = false,
+                    uint64_t keyHash = 0);
 
     /**
      * Retrieve a StoredValue and invoke a method on it.
@@ -789,8 +1102,9 @@ private:
         }
 
         int bucket_num(0);
-        LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-        StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true);
+        uint64_t h = vb->ht.hash(key);
+        VersionedLockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+        StoredValue *v = vb->ht.unlocked_findHashed(key, h, bucket_num, true);
 
         if (v) {
             std::mem_fun(f)(v, arg);
@@ -798,26 +1112,97 @@ private:
         return v != NULL;
     }
 
-    bool diskQueueEmpty();
+    /**
+     * Get the shard of the flusher that owns a vbucket.
+     */
+    FlusherShard &getFlusherShardFor(uint16_t vbid) {
+        return *flusherShards[vbid % flusherShards.size()];
+    }
 
-    std::queue<queued_item> *beginFlush();
-    void pushToOutgoingQueue(std::vector<queued_item> &items);
-    void requeueRejectedItems(std::queue<queued_item> *rejects);
-    void completeFlush(rel_time_t flush_start);
+    void setFlusherTodo(FlusherShard &shard, size_t todo);
+
+    /**
+     * Recount the items a flusher has yet to take and the ones all of
+     * them have.
+     *
+     * @return the number of items all flushers have yet to take
+     */
+    size_t updateQueueSize(FlusherShard &shard);
+
+    bool diskQueueEmpty(FlusherShard &shard);
+
+    /**
+     * Tell the other flushers this one is done with everything it took
+     * before a pending flush_all.
+     *
+     * @return true once all of them are, and the flush_all can go ahead
+     */
+    bool readyForFlushAll(FlusherShard &shard);
+
+    /**
+     * True if a flusher has a flush_all pending that waits for the
+     * other flushers.
+     */
+    bool waitingForFlushAll(FlusherShard &shard);
 
-    int flushSome(std::queue<queued_item> *q,
+    std::queue<queued_item> *beginFlush(FlusherShard &shard);
+    void fillFlushBatch(FlusherShard &shard, FlushBatch &batch);
+
+    /**
+     * Have a dispatcher job take the next flush batch from the
+     * checkpoints, so that it's ready once the batch being flushed
+     * commits.
+     */
+    void scheduleNextFlushBatch(FlusherShard &shard);
+
+    /**
+     * Take the next flush batch unless someone else already is.
+     */
+    void fillNextFlushBatch(FlusherShard &shard);
+
+    /**
+     * Make the next flush batch, if one was asked for, the writing one.
+     *
+     * @return true if there was a next batch
+     */
+    bool takeNextFlushBatch(FlusherShard &shard);
+
+    void pushToOutgoingQueue(FlusherShard &shard, FlushBatch &batch,
+                             std::vector<queued_item> &items);
+    void requeueRejectedItems(FlusherShard &shard, std::queue<queued_item> *rejects);
+    void completeFlush(FlusherShard &shard, rel_time_t flush_start);
+
+    int flushSome(FlusherShard &shard, std::queue<queued_item> *q,
                   std::queue<queued_item> *rejectQueue);
-    int flushOne(std::queue<queued_item> *q,
+    int flushOne(FlusherShard &shard, std::queue<queued_item> *q,
                  std::queue<queued_item> *rejectQueue);
-    int flushOneDeleteAll(void);
-    int flushOneDelOrSet(const queued_item &qi, std::queue<queued_item> *rejectQueue);
+    int flushOneDeleteAll(FlusherShard &shard);
+    int flushOneDelOrSet(FlusherShard &shard, const queued_item &qi,
+                         std::queue<queued_item> *rejectQueue);
 
     StoredValue *fetchValidValue(RCPtr<VBucket> &vb, const std::string &key,
-                                 int bucket_num, bool wantsDeleted=false, bool trackReference=true);
+                                 uint64_t h, int bucket_num,
+                                 bool wantsDeleted=false, bool trackReference=true);
+
+    /**
+     * Look a key that's missing from memory up on disk (full eviction).
+     *
+     * The key's bucket must already be locked.  A temporary item holds
+     * the key's place until the background fetch completes, after which
+     * it's either the item read back or a marker that there's no such
+     * key.
+     *
+     * @return ENGINE_EWOULDBLOCK if the caller has to wait for the fetch,
+     *         ENGINE_KEY_ENOENT if the key is known not to exist
+     */
+    ENGINE_ERROR_CODE fetchEvictedKey(RCPtr<VBucket> &vb,
+                                      const std::string &key, uint64_t h,
+                                      int bucket_num, const void *cookie);
 
     size_t getWriteQueueSize(void);
+    size_t getWriteQueueSize(FlusherShard &shard);
 
-    bool hasItemsForPersistence(void);
+    bool hasItemsForPersistence(FlusherShard &shard);
 
     GetValue getInternal(const std::string &key, uint16_t vbucket,
                          const void *cookie, bool queueBG,
@@ -827,6 +1212,8 @@ private:
 
     friend class Warmup;
     friend class Flusher;
+    friend class NextFlushBatchTaker;
+    friend class FlushBatchSource;
     friend class BGFetchCallback;
     friend class VKeyStatBGFetchCallback;
     friend class TapBGFetchCallback;
@@ -836,6 +1223,7 @@ private:
     friend class VBCBAdaptor;
     friend class ItemPager;
     friend class PagingVisitor;
+    friend class GetMultiVisitor;
 
     EventuallyPersistentEngine     &engine;
     EPStats                        &stats;
@@ -848,26 +1236,42 @@ private:
     Dispatcher                     *roDispatcher;
     Dispatcher                     *tapDispatcher;
     Dispatcher                     *nonIODispatcher;
-    Flusher                        *flusher;
+    std::vector<Dispatcher*>        visitorDispatchers;
+    // The first flusher runs on the RW dispatcher, the others on
+    // dispatchers of their own.
+    std::vector<Dispatcher*>        flusherDispatchers;
+    std::vector<FlusherShard*>      flusherShards;
+    std::vector<Flusher*>           flushers;
+    // A flush_all wipes the store under all the flushers at once, so it
+    // waits until each of them is done with what it took before.  The
+    // flushers' stores, made by newWriter(), share what's on disk.
+    struct FlushAllState {
+        FlushAllState() : numReady(0), numDone(0) {}
+        Mutex mutex;
+        // Flushers ready for the flush_all.
+        size_t numReady;
+        // Flushers past it, the first of which wiped the store.
+        size_t numDone;
+    } flushAllState;
     BgFetcher                      *bgFetcher;
+    SpilledChunkLoadScheduler      *chunkLoadScheduler;
     Warmup                         *warmupTask;
     VBucketMap                      vbuckets;
     SyncObject                      mutex;
+    DurabilityMonitor               durability;
 
     MutationLog                     mutationLog;
     MutationLogCompactorConfig      mlogCompactorConfig;
     MutationLog                     accessLog;
 
-    // The writing queue is used by the flusher thread to keep
-    // track of the objects it works on. It should _not_ be used
-    // by any other threads (because the flusher use it without
-    // locking...
-    std::queue<queued_item>              writing;
+    // Memory budget of a flush batch.
+    Atomic<size_t>                       flushBatchMaxBytes;
+    Atomic<bool>                         pipelinedFlush;
+    Atomic<FlushOrderPolicy*>            flushOrder;
     Atomic<size_t>                       bgFetchQueue;
-    Atomic<bool>                         diskFlushAll;
-    TransactionContext                   tctx;
     Mutex                                vbsetMutex;
     uint32_t                             bgFetchDelay;
+    bool                                 fullEviction;
     // During restore we're bypassing the checkpoint lists with the
     // objects we're restoring, but we need them to be persisted.
     // This is solved by using a separate list for those objects.
@@ -884,6 +1288,7 @@ private:
         Mutex mutex;
         size_t sleeptime;
         TaskId task;
+        VBucketVisitorCursor cursor;
     } expiryPager;
     struct ALogTask {
         ALogTask() : sleeptime(0), lastTaskRuntime(gethrtime()) {}
@@ -891,6 +1296,7 @@ private:
         size_t sleeptime;
         TaskId task;
         hrtime_t lastTaskRuntime;
+        VBucketVisitorCursor cursor;
     } accessScanner;
     struct ResidentRatio {
         Atomic<size_t> activeRatio;
@@ -899,7 +1305,9 @@ private:
     struct ItemPagerInfo {
         ItemPagerInfo() : biased(true) {}
         bool biased;
+        VBucketVisitorCursor cursor;
     } pager;
+    Atomic<size_t> visitChunkSize;
     size_t itemExpiryWindow;
     size_t vbDelChunkSize;
     size_t vbChunkDelThresholdTime;
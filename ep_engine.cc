@@ -262,6 +262,12 @@ extern "C" {
                 e->getConfiguration().setTapThrottleQueueCap(v);
             } else if (strcmp(keyz, "tap_throttle_cap_pcnt") == 0) {
                 e->getConfiguration().setTapThrottleCapPcnt(v);
+            } else if (strcmp(keyz, "tap_batch_max_bytes") == 0) {
+                char *ptr = NULL;
+                uint64_t bsize = strtoull(valz, &ptr, 10);
+                validate(bsize, static_cast<uint64_t>(0),
+                         std::numeric_limits<uint64_t>::max());
+                e->getConfiguration().setTapBatchMaxBytes((size_t)bsize);
             } else {
                 *msg = "Unknown config param";
                 rv = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
@@ -337,6 +343,34 @@ extern "C" {
                 e->getConfiguration().setQueueAgeCap(v);
             } else if (strcmp(keyz, "max_txn_size") == 0) {
                 e->getConfiguration().setMaxTxnSize(v);
+            } else if (strcmp(keyz, "min_txn_size") == 0) {
+                e->getConfiguration().setMinTxnSize(v);
+            } else if (strcmp(keyz, "txn_commit_target") == 0) {
+                e->getConfiguration().setTxnCommitTarget(v);
+            } else if (strcmp(keyz, "adaptive_txn_size") == 0) {
+                if (strcmp(valz, "true") == 0) {
+                    e->getConfiguration().setAdaptiveTxnSize(true);
+                } else if (strcmp(valz, "false") == 0) {
+                    e->getConfiguration().setAdaptiveTxnSize(false);
+                } else {
+                    throw std::runtime_error("value out of range.");
+                }
+            } else if (strcmp(keyz, "flush_batch_max_bytes") == 0) {
+                char *ptr = NULL;
+                uint64_t bsize = strtoull(valz, &ptr, 10);
+                validate(bsize, static_cast<uint64_t>(0),
+                         std::numeric_limits<uint64_t>::max());
+                e->getConfiguration().setFlushBatchMaxBytes((size_t)bsize);
+            } else if (strcmp(keyz, "flush_order") == 0) {
+                e->getConfiguration().setFlushOrder(valz);
+            } else if (strcmp(keyz, "pipelined_flush") == 0) {
+                if (strcmp(valz, "true") == 0) {
+                    e->getConfiguration().setPipelinedFlush(true);
+                } else if (strcmp(valz, "false") == 0) {
+                    e->getConfiguration().setPipelinedFlush(false);
+                } else {
+                    throw std::runtime_error("value out of range.");
+                }
             } else if (strcmp(keyz, "bg_fetch_delay") == 0) {
                 e->getConfiguration().setBgFetchDelay(v);
             } else if (strcmp(keyz, "flushall_enabled") == 0) {
@@ -421,6 +455,8 @@ extern "C" {
                 e->getConfiguration().setAlogTaskTime(v);
             } else if (strcmp(keyz, "pager_active_vb_pcnt") == 0) {
                 e->getConfiguration().setPagerActiveVbPcnt(v);
+            } else if (strcmp(keyz, "visit_chunk_size") == 0) {
+                e->getConfiguration().setVisitChunkSize(v);
             } else {
                 *msg = "Unknown config param";
                 rv = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
@@ -881,6 +917,10 @@ extern "C" {
             break;
         case CMD_OBSERVE:
             return h->observe(cookie, request, response);
+        case CMD_WAIT_FOR_DURABILITY:
+            return h->waitForDurability(cookie, request, response);
+        case CMD_GET_MULTI:
+            return h->getMultiCmd(cookie, request, response);
         case CMD_DEREGISTER_TAP_CLIENT:
             {
                 rv = h->deregisterTapClient(cookie, request, response);
@@ -1269,6 +1309,14 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
     // Start updating the variables from the config!
     HashTable::setDefaultNumBuckets(configuration.getHtSize());
     HashTable::setDefaultNumLocks(configuration.getHtLocks());
+    HashTable::setDefaultResizeStep(configuration.getHtResizeStep());
+    HashTable::setDefaultInlineValueSize(configuration.getHtInlineValueSize());
+    HashTable::setDefaultOptimisticReads(configuration.isHtOptimisticReads());
+    if (!HashTable::setDefaultLayout(configuration.getHtLayout().c_str())) {
+        getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                         "Unhandled hash table layout: %s",
+                         configuration.getHtLayout().c_str());
+    }
     StoredValue::setMutationMemoryThreshold(configuration.getMutationMemThreshold());
     std::string storedValType = configuration.getStoredValType();
     if (storedValType.length() > 0) {
@@ -1733,6 +1781,13 @@ tap_event_t EventuallyPersistentEngine::walkTapQueue(const void *cookie,
                 connection->seqnoAckRequested = *seqno;
             }
 
+            if ((ret == TAP_MUTATION || ret == TAP_DELETION) &&
+                connection->isReplicating()) {
+                Item *it = static_cast<Item*>(*itm);
+                epstore->getDurabilityMonitor().sent(connection->getName(), *vbucket,
+                                                     it->getKey(), *seqno);
+            }
+
             if (ret == TAP_MUTATION) {
                 if (connection->haveTapFlagByteorderSupport()) {
                     *flags |= TAP_FLAG_NETWORK_BYTE_ORDER;
@@ -2401,6 +2456,47 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     epstats.commit_time, add_stat, cookie);
     add_casted_stat("ep_commit_time_total",
                     epstats.cumulativeCommitTime, add_stat, cookie);
+    add_casted_stat("ep_num_flushers", epstore->getNumFlushers(), add_stat, cookie);
+    add_casted_stat("ep_flush_order", epstore->getFlushOrder()->getName(),
+                    add_stat, cookie);
+    for (size_t i = 0; i < epstore->getNumFlushers(); ++i) {
+        FlusherShard &shard = epstore->getFlusherShard(i);
+        TransactionContext &tctx = shard.tctx;
+        char buf[48];
+        snprintf(buf, sizeof(buf), "ep_flusher_%d_state", static_cast<int>(i));
+        add_casted_stat(buf, epstore->getFlusher(i)->stateName(), add_stat, cookie);
+        snprintf(buf, sizeof(buf), "ep_flusher_%d_todo", static_cast<int>(i));
+        add_casted_stat(buf, shard.todo, add_stat, cookie);
+        snprintf(buf, sizeof(buf), "ep_flusher_%d_commit_num", static_cast<int>(i));
+        add_casted_stat(buf, tctx.getNumCommits(), add_stat, cookie);
+        snprintf(buf, sizeof(buf), "ep_flusher_%d_commit_time", static_cast<int>(i));
+        add_casted_stat(buf, tctx.getCommitTime(), add_stat, cookie);
+        snprintf(buf, sizeof(buf), "ep_flusher_%d_commit_total", static_cast<int>(i));
+        add_casted_stat(buf, tctx.getCumulativeCommitTime(), add_stat, cookie);
+        snprintf(buf, sizeof(buf), "ep_flusher_%d_pipelined", static_cast<int>(i));
+        add_casted_stat(buf, shard.numPipelined, add_stat, cookie);
+
+        TxnSizer &sizer = shard.txnSizer;
+        snprintf(buf, sizeof(buf), "ep_flusher_%d_txn_size", static_cast<int>(i));
+        add_casted_stat(buf, sizer.getSize(), add_stat, cookie);
+        snprintf(buf, sizeof(buf), "ep_flusher_%d_txn_reason", static_cast<int>(i));
+        add_casted_stat(buf, TxnSizer::reasonName(sizer.getReason()), add_stat, cookie);
+        snprintf(buf, sizeof(buf), "ep_flusher_%d_txn_adjusts", static_cast<int>(i));
+        add_casted_stat(buf, sizer.getNumAdjustments(), add_stat, cookie);
+        snprintf(buf, sizeof(buf), "ep_flusher_%d_commit_avg", static_cast<int>(i));
+        add_casted_stat(buf, sizer.getCommitTimeAvg(), add_stat, cookie);
+        snprintf(buf, sizeof(buf), "ep_flusher_%d_fill_rate", static_cast<int>(i));
+        add_casted_stat(buf, sizer.getFillRate(), add_stat, cookie);
+        snprintf(buf, sizeof(buf), "ep_flusher_%d_drain_rate", static_cast<int>(i));
+        add_casted_stat(buf, sizer.getDrainRate(), add_stat, cookie);
+    }
+    add_casted_stat("ep_durability_waits",
+                    epstats.durabilityWaits, add_stat, cookie);
+    add_casted_stat("ep_durability_timeouts",
+                    epstats.durabilityTimeouts, add_stat, cookie);
+    add_casted_stat("ep_durability_waiting",
+                    epstore->getDurabilityMonitor().getNumWaiters(),
+                    add_stat, cookie);
     add_casted_stat("ep_vbucket_del",
                     epstats.vbucketDeletions, add_stat, cookie);
     add_casted_stat("ep_vbucket_del_fail",
@@ -2577,14 +2673,63 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     cookie);
     add_casted_stat("ep_num_expiry_pager_runs", epstats.expiryPagerRuns, add_stat,
                     cookie);
+
+    VBucketVisitorCursor &pagerCursor = epstore->getItemPagerCursor();
+    add_casted_stat("ep_pager_visit_vb", pagerCursor.vbid, add_stat, cookie);
+    add_casted_stat("ep_pager_visit_laps", pagerCursor.laps, add_stat, cookie);
+    add_casted_stat("ep_pager_visit_vbuckets", pagerCursor.vbuckets,
+                    add_stat, cookie);
+    add_casted_stat("ep_pager_visit_items", pagerCursor.items, add_stat, cookie);
+    add_casted_stat("ep_pager_visit_chunks", pagerCursor.chunks,
+                    add_stat, cookie);
+    VBucketVisitorCursor &expiryCursor = epstore->getExpiryPagerCursor();
+    add_casted_stat("ep_expiry_pager_visit_vb", expiryCursor.vbid,
+                    add_stat, cookie);
+    add_casted_stat("ep_expiry_pager_visit_laps", expiryCursor.laps,
+                    add_stat, cookie);
+    add_casted_stat("ep_expiry_pager_visit_vbuckets", expiryCursor.vbuckets,
+                    add_stat, cookie);
+    add_casted_stat("ep_expiry_pager_visit_items", expiryCursor.items,
+                    add_stat, cookie);
+    add_casted_stat("ep_expiry_pager_visit_chunks", expiryCursor.chunks,
+                    add_stat, cookie);
+
     add_casted_stat("ep_num_checkpoint_remover_runs", epstats.checkpointRemoverRuns,
                     add_stat, cookie);
     add_casted_stat("ep_items_rm_from_checkpoints", epstats.itemsRemovedFromCheckpoints,
                     add_stat, cookie);
+    add_casted_stat("ep_chk_spilled_bytes", epstats.chkSpilledBytes,
+                    add_stat, cookie);
+    add_casted_stat("ep_chk_spilled_items", epstats.chkSpilledItems,
+                    add_stat, cookie);
+    add_casted_stat("ep_chk_spill_reads", epstats.chkSpillReads,
+                    add_stat, cookie);
+    add_casted_stat("ep_chk_spill_read_errors", epstats.chkSpillReadErrors,
+                    add_stat, cookie);
+    add_casted_stat("ep_chk_staged_items", epstats.chkStagedItems,
+                    add_stat, cookie);
+    add_casted_stat("ep_queued_item_pool_bytes", queuedItemPool.getNumBytes(),
+                    add_stat, cookie);
     add_casted_stat("ep_num_value_ejects", epstats.numValueEjects, add_stat,
                     cookie);
     add_casted_stat("ep_num_eject_failures", epstats.numFailedEjects, add_stat,
                     cookie);
+    add_casted_stat("ep_num_key_ejects", epstats.numKeyEjects, add_stat,
+                    cookie);
+    add_casted_stat("ep_bfilter_avoided_fetches",
+                    epstats.bfilterAvoidedFetches, add_stat, cookie);
+    add_casted_stat("ep_bfilter_false_positives",
+                    epstats.bfilterFalsePositives, add_stat, cookie);
+    add_casted_stat("ep_bfilter_mem_used", epstats.bfilterMemory, add_stat,
+                    cookie);
+    add_casted_stat("ep_num_value_compressions", epstats.numValueCompressions,
+                    add_stat, cookie);
+    add_casted_stat("ep_num_value_decompressions",
+                    epstats.numValueDecompressions, add_stat, cookie);
+    add_casted_stat("ep_compressed_value_size", epstats.compressedValueSize,
+                    add_stat, cookie);
+    add_casted_stat("ep_compressed_value_raw_size",
+                    epstats.compressedValueRawSize, add_stat, cookie);
     add_casted_stat("ep_num_not_my_vbuckets", epstats.numNotMyVBuckets, add_stat,
                     cookie);
     add_casted_stat("ep_db_cleaner_status",
@@ -2671,6 +2816,15 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     add_stat, cookie);
     add_casted_stat("ep_num_access_scanner_runs", epstats.alogRuns,
                     add_stat, cookie);
+    VBucketVisitorCursor &alogCursor = epstore->getAccessScannerCursor();
+    add_casted_stat("ep_alog_visit_laps", alogCursor.laps,
+                    add_stat, cookie);
+    add_casted_stat("ep_alog_visit_vbuckets", alogCursor.vbuckets,
+                    add_stat, cookie);
+    add_casted_stat("ep_alog_visit_items", alogCursor.items,
+                    add_stat, cookie);
+    add_casted_stat("ep_alog_visit_chunks", alogCursor.chunks,
+                    add_stat, cookie);
 
     char timestr[20];
     struct tm alogTim = *gmtime((time_t *)&epstats.alogTime);
@@ -2720,6 +2874,15 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doMemoryStats(const void *cookie,
     add_casted_stat("ep_mem_high_wat", stats.mem_high_wat, add_stat, cookie);
     add_casted_stat("ep_oom_errors", stats.oom_errors, add_stat, cookie);
     add_casted_stat("ep_tmp_oom_errors", stats.tmp_oom_errors, add_stat, cookie);
+    add_casted_stat("ep_defrag_runs", stats.defragRuns, add_stat, cookie);
+    add_casted_stat("ep_defrag_values_moved", stats.defragValuesMoved,
+                    add_stat, cookie);
+    add_casted_stat("ep_defrag_bytes_moved", stats.defragBytesMoved,
+                    add_stat, cookie);
+    add_casted_stat("ep_defrag_slab_bytes_released",
+                    stats.defragSlabBytesReleased, add_stat, cookie);
+    add_casted_stat("ep_defrag_fragmentation", stats.defragFragmentation,
+                    add_stat, cookie);
     add_casted_stat("ep_mem_tracker_enabled",
                     stats.memoryTrackerEnabled ? "true" : "false",
                     add_stat, cookie);
@@ -2789,6 +2952,9 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doHashStats(const void *cookie,
             add_casted_stat(buf, vb->ht.getSize(), add_stat, cookie);
             snprintf(buf, sizeof(buf), "vb_%d:locks", vbid);
             add_casted_stat(buf, vb->ht.getNumLocks(), add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:layout", vbid);
+            add_casted_stat(buf, HashTable::getLayoutStr(vb->ht.getLayout()),
+                            add_stat, cookie);
             snprintf(buf, sizeof(buf), "vb_%d:min_depth", vbid);
             add_casted_stat(buf, depthVisitor.min == -1 ? 0 : depthVisitor.min,
                             add_stat, cookie);
@@ -2802,10 +2968,27 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doHashStats(const void *cookie,
             add_casted_stat(buf, depthVisitor.size, add_stat, cookie);
             snprintf(buf, sizeof(buf), "vb_%d:resized", vbid);
             add_casted_stat(buf, vb->ht.getNumResizes(), add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:resize_remaining", vbid);
+            add_casted_stat(buf, vb->ht.getResizeRemaining(), add_stat, cookie);
             snprintf(buf, sizeof(buf), "vb_%d:mem_size", vbid);
             add_casted_stat(buf, vb->ht.memSize, add_stat, cookie);
             snprintf(buf, sizeof(buf), "vb_%d:mem_size_counted", vbid);
             add_casted_stat(buf, depthVisitor.memUsed, add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:overflow_mem", vbid);
+            add_casted_stat(buf, vb->ht.getOverflowMemory(), add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:inline_values", vbid);
+            add_casted_stat(buf, vb->ht.getNumInlineValues(), add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:inline_mem_saved", vbid);
+            add_casted_stat(buf, vb->ht.getInlineMemSaved(), add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:slab_mem", vbid);
+            add_casted_stat(buf, vb->ht.getSlabMemory(), add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:slab_free_mem", vbid);
+            add_casted_stat(buf, vb->ht.getSlabFreeMemory(), add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:optimistic_gets", vbid);
+            add_casted_stat(buf, vb->ht.getNumOptimisticGets(), add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:optimistic_conflicts", vbid);
+            add_casted_stat(buf, vb->ht.getNumOptimisticConflicts(),
+                            add_stat, cookie);
 
             return false;
         }
@@ -3218,6 +3401,7 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTimingStats(const void *cookie,
 
     // Regular commands
     add_casted_stat("get_cmd", stats.getCmdHisto, add_stat, cookie);
+    add_casted_stat("get_multi_cmd", stats.getMultiCmdHisto, add_stat, cookie);
     add_casted_stat("arith_cmd", stats.arithCmdHisto, add_stat, cookie);
     add_casted_stat("get_stats_cmd", stats.getStatsCmdHisto, add_stat, cookie);
     // Admin commands
@@ -3230,6 +3414,8 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTimingStats(const void *cookie,
     add_casted_stat("tap_mutation", stats.tapMutationHisto, add_stat, cookie);
     // Misc
     add_casted_stat("notify_io", stats.notifyIOHisto, add_stat, cookie);
+    add_casted_stat("persist_wait", stats.persistWaitHisto, add_stat, cookie);
+    add_casted_stat("replication_wait", stats.replicationWaitHisto, add_stat, cookie);
     add_casted_stat("batch_read", stats.getMultiHisto, add_stat, cookie);
 
     // Disk stats
@@ -3245,6 +3431,20 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTimingStats(const void *cookie,
 
     add_casted_stat("item_alloc_sizes", stats.itemAllocSizeHisto,
                     add_stat, cookie);
+    add_casted_stat("ht_resize_step", stats.htResizeStepHisto,
+                    add_stat, cookie);
+    add_casted_stat("value_compress", stats.valueCompressHisto,
+                    add_stat, cookie);
+    add_casted_stat("value_decompress", stats.valueDecompressHisto,
+                    add_stat, cookie);
+    add_casted_stat("chk_spill_read", stats.chkSpillReadHisto,
+                    add_stat, cookie);
+    size_t compressed = stats.compressedValueSize.get();
+    add_casted_stat("compression_ratio",
+                    compressed > 0 ?
+                    static_cast<double>(stats.compressedValueRawSize.get()) /
+                    static_cast<double>(compressed) : 0.0,
+                    add_stat, cookie);
 
     // Mutation Log
     const MutationLog *mutationLog(epstore->getMutationLog());
@@ -3324,6 +3524,15 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doDispatcherStats(const void *cook
     DispatcherState nds(epstore->getNonIODispatcher()->getDispatcherState());
     doDispatcherStat("nio_dispatcher", nds, cookie, add_stat);
 
+    const std::vector<Dispatcher*> &vds(epstore->getVisitorDispatchers());
+    for (size_t i = 0; i < vds.size(); ++i) {
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "visitor_dispatcher_%d",
+                 static_cast<int>(i));
+        DispatcherState vs(vds[i]->getDispatcherState());
+        doDispatcherStat(prefix, vs, cookie, add_stat);
+    }
+
     return ENGINE_SUCCESS;
 }
 
@@ -3565,6 +3774,179 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::observe(const void* cookie,
                                 cookie);
 }
 
+static ENGINE_ERROR_CODE sendDurabilityResponse(ADD_RESPONSE response,
+                                                const void *cookie,
+                                                uint16_t status, uint64_t cas,
+                                                bool persisted, uint16_t replicated) {
+    uint16_t body[2];
+    body[0] = htons(persisted ? 1 : 0);
+    body[1] = htons(replicated);
+    return sendResponse(response, NULL, 0, NULL, 0, body, sizeof(body),
+                        PROTOCOL_BINARY_RAW_BYTES, status, cas, cookie);
+}
+
+ENGINE_ERROR_CODE
+EventuallyPersistentEngine::waitForDurability(const void* cookie,
+                                              protocol_binary_request_header *request,
+                                              ADD_RESPONSE response) {
+    // Back after being notified?
+    DurabilityMonitor &monitor = epstore->getDurabilityMonitor();
+    DurabilityWaiter *w = monitor.claim(cookie);
+    if (w) {
+        ENGINE_ERROR_CODE rv = sendDurabilityResponse(response, cookie,
+                                                      w->status == ENGINE_SUCCESS ?
+                                                      PROTOCOL_BINARY_RESPONSE_SUCCESS :
+                                                      PROTOCOL_BINARY_RESPONSE_ETMPFAIL,
+                                                      w->cas, w->persisted, w->replicated);
+        delete w;
+        return rv;
+    }
+
+    protocol_binary_request_wait_for_durability *req =
+        reinterpret_cast<protocol_binary_request_wait_for_durability*>(request);
+    uint16_t keylen = ntohs(request->request.keylen);
+    uint32_t timeout = 0;
+    uint16_t replicas = 0;
+    uint16_t flags = 0;
+    if (request->request.extlen == sizeof(req->message.body)) {
+        timeout = ntohl(req->message.body.timeout);
+        replicas = ntohs(req->message.body.replicas);
+        flags = ntohs(req->message.body.flags);
+    }
+    bool persist = (flags & DURABILITY_PERSIST) != 0;
+    if (keylen == 0 || timeout == 0 || (!persist && replicas == 0)) {
+        std::string msg("Invalid packet structure");
+        return sendResponse(response, NULL, 0, NULL, 0, msg.c_str(), msg.length(),
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    std::string key(reinterpret_cast<const char*>(req->bytes) + sizeof(req->bytes),
+                    keylen);
+    uint16_t vbucket = ntohs(request->request.vbucket);
+    uint64_t cas = ntohll(request->request.cas);
+
+    struct key_stats kstats;
+    ENGINE_ERROR_CODE rv = epstore->getKeyStats(key, vbucket, kstats);
+    if (rv == ENGINE_KEY_ENOENT && epstore->isEvicted(key, vbucket)) {
+        // Dropped from memory by full eviction, and so persisted.  Its CAS
+        // would take a disk fetch, so the one asked for is taken as it.
+        kstats.cas = cas;
+        rv = ENGINE_SUCCESS;
+    }
+    if (rv == ENGINE_NOT_MY_VBUCKET) {
+        return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET, 0, cookie);
+    } else if (rv != ENGINE_SUCCESS) {
+        return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0, cookie);
+    } else if (cas != 0 && kstats.cas != cas) {
+        // Only the current version of an item can be waited for.
+        return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, kstats.cas, cookie);
+    }
+
+    w = new DurabilityWaiter(cookie, vbucket, key, kstats.cas, persist, replicas,
+                             static_cast<hrtime_t>(timeout) * 1000000);
+    if (!monitor.add(w)) {
+        return ENGINE_EWOULDBLOCK;
+    }
+    rv = sendDurabilityResponse(response, cookie, PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                                w->cas, w->persisted, w->replicated);
+    delete w;
+    return rv;
+}
+
+ENGINE_ERROR_CODE
+EventuallyPersistentEngine::getMultiCmd(const void* cookie,
+                                        protocol_binary_request_header *request,
+                                        ADD_RESPONSE response) {
+    const char *body = reinterpret_cast<const char*>(request->bytes)
+        + sizeof(request->bytes) + request->request.extlen
+        + ntohs(request->request.keylen);
+    size_t bodylen = ntohl(request->request.bodylen) - request->request.extlen
+        - ntohs(request->request.keylen);
+    uint16_t vbucket = ntohs(request->request.vbucket);
+
+    std::vector<std::string> keys;
+    size_t offset = 0;
+    while (offset + sizeof(uint16_t) <= bodylen) {
+        uint16_t keylen;
+        memcpy(&keylen, body + offset, sizeof(keylen));
+        keylen = ntohs(keylen);
+        offset += sizeof(uint16_t);
+        if (keylen == 0 || offset + keylen > bodylen) {
+            break;
+        }
+        keys.push_back(std::string(body + offset, keylen));
+        offset += keylen;
+    }
+    if (keys.empty() || offset != bodylen) {
+        std::string msg("Invalid packet structure");
+        return sendResponse(response, NULL, 0, NULL, 0, msg.c_str(), msg.length(),
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    std::vector<GetValue> results;
+    getMulti(cookie, keys, vbucket, results);
+
+    // Like get(), come back once the background fetches are done.
+    ENGINE_ERROR_CODE status = ENGINE_SUCCESS;
+    std::vector<GetValue>::iterator it;
+    for (it = results.begin(); it != results.end(); ++it) {
+        if (it->getStatus() == ENGINE_EWOULDBLOCK) {
+            status = ENGINE_EWOULDBLOCK;
+        } else if (it->getStatus() != ENGINE_SUCCESS
+                   && it->getStatus() != ENGINE_KEY_ENOENT
+                   && status == ENGINE_SUCCESS) {
+            status = it->getStatus();
+        }
+    }
+    if (status != ENGINE_SUCCESS) {
+        for (it = results.begin(); it != results.end(); ++it) {
+            delete it->getValue();
+        }
+        if (status == ENGINE_EWOULDBLOCK) {
+            return status;
+        }
+        uint16_t res = PROTOCOL_BINARY_RESPONSE_ETMPFAIL;
+        if (status == ENGINE_NOT_MY_VBUCKET) {
+            res = PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET;
+        }
+        return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES, res, 0, cookie);
+    }
+
+    ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
+    for (size_t i = 0; i < results.size(); ++i) {
+        Item *itm = results[i].getValue();
+        if (itm == NULL) {
+            continue;
+        }
+        uint32_t flags = itm->getFlags();
+        if (rv == ENGINE_SUCCESS) {
+            rv = sendResponse(response, keys[i].data(),
+                              static_cast<uint16_t>(keys[i].length()),
+                              &flags, sizeof(flags),
+                              itm->getData(), itm->getNBytes(),
+                              PROTOCOL_BINARY_RAW_BYTES,
+                              PROTOCOL_BINARY_RESPONSE_SUCCESS, itm->getCas(),
+                              cookie);
+        }
+        delete itm;
+    }
+    if (rv != ENGINE_SUCCESS) {
+        return rv;
+    }
+    return sendResponse(response, NULL, 0, NULL, 0, NULL, 0,
+                        PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
+}
+
 ENGINE_ERROR_CODE EventuallyPersistentEngine::touch(const void *cookie,
                                                     protocol_binary_request_header *request,
                                                     ADD_RESPONSE response)
@@ -260,6 +260,38 @@ public:
         return ret;
     }
 
+    /**
+     * Fetch a batch of keys from one vbucket.
+     *
+     * memcached's engine interface calls get() one key at a time, so
+     * batches come in through CMD_GET_MULTI (see getMultiCmd()).  Every
+     * key that isn't resident comes back with
+     * ENGINE_EWOULDBLOCK and a background fetch queued for it, and the
+     * cookie is notified as each of them completes.
+     *
+     * @param cookie the connection cookie
+     * @param keys the keys to fetch
+     * @param vbucket the vbucket the keys belong to
+     * @param results receives one GetValue per key, in the order of keys
+     */
+    void getMulti(const void* cookie,
+                  const std::vector<std::string> &keys,
+                  uint16_t vbucket,
+                  std::vector<GetValue> &results)
+    {
+        BlockTimer timer(&stats.getMultiCmdHisto);
+        epstore->getMulti(keys, vbucket, cookie, results);
+        if (isDegradedMode()) {
+            std::vector<GetValue>::iterator it;
+            for (it = results.begin(); it != results.end(); ++it) {
+                if (it->getStatus() == ENGINE_KEY_ENOENT ||
+                    it->getStatus() == ENGINE_NOT_MY_VBUCKET) {
+                    it->setStatus(ENGINE_TMPFAIL);
+                }
+            }
+        }
+    }
+
     ENGINE_ERROR_CODE getStats(const void* cookie,
                                const char* stat_key,
                                int nkey,
@@ -444,6 +476,7 @@ public:
 
     void handleDisconnect(const void *cookie) {
         tapConnMap->disconnect(cookie, static_cast<int>(configuration.getTapKeepalive()));
+        epstore->getDurabilityMonitor().cancel(cookie);
     }
 
     protocol_binary_response_status stopFlusher(const char **msg, size_t *msg_size) {
@@ -517,6 +550,14 @@ public:
                               protocol_binary_request_header *request,
                               ADD_RESPONSE response);
 
+    ENGINE_ERROR_CODE waitForDurability(const void* cookie,
+                                        protocol_binary_request_header *request,
+                                        ADD_RESPONSE response);
+
+    ENGINE_ERROR_CODE getMultiCmd(const void* cookie,
+                                  protocol_binary_request_header *request,
+                                  ADD_RESPONSE response);
+
     RCPtr<VBucket> getVBucket(uint16_t vbucket) {
         return epstore->getVBucket(vbucket);
     }
@@ -543,6 +584,10 @@ public:
         return stats;
     }
 
+    QueuedItemPool &getQueuedItemPool() {
+        return queuedItemPool;
+    }
+
     EventuallyPersistentStore* getEpStore() { return epstore; }
 
     TapConnMap &getTapConnMap() { return *tapConnMap; }
@@ -797,6 +842,7 @@ private:
     size_t getlDefaultTimeout;
     size_t getlMaxTimeout;
     EPStats stats;
+    QueuedItemPool queuedItemPool;
     Configuration configuration;
     Atomic<bool> warmingUp;
     Atomic<bool> trafficEnabled;
@@ -436,6 +436,22 @@ static bool add_response_get_meta(const void *key, uint16_t keylen,
                         status, cas, cookie);
 }
 
+//! Values seen by add_response_multi, by key.
+std::map<std::string, std::string> multi_values;
+
+static bool add_response_multi(const void *key, uint16_t keylen,
+                               const void *ext, uint8_t extlen,
+                               const void *body, uint32_t bodylen,
+                               uint8_t datatype, uint16_t status,
+                               uint64_t cas, const void *cookie) {
+    if (keylen > 0 && status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        multi_values[std::string(static_cast<const char*>(key), keylen)] =
+            std::string(static_cast<const char*>(body), bodylen);
+    }
+    return add_response(key, keylen, ext, extlen, body, bodylen, datatype,
+                        status, cas, cookie);
+}
+
 static void encodeExt(char *buffer, uint32_t val) {
     val = htonl(val);
     memcpy(buffer, (char*)&val, sizeof(val));
@@ -653,6 +669,41 @@ static void observe(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
     free(request);
 }
 
+static void wait_for_durability(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                const char *key, bool persist, uint16_t replicas,
+                                uint32_t timeout, uint64_t cas = 0) {
+    protocol_binary_request_wait_for_durability req;
+    req.message.body.timeout = htonl(timeout);
+    req.message.body.replicas = htons(replicas);
+    req.message.body.flags = htons(persist ? DURABILITY_PERSIST : 0);
+    protocol_binary_request_header *pkt;
+    pkt = createPacket(CMD_WAIT_FOR_DURABILITY, 0, cas,
+                       reinterpret_cast<const char*>(&req.message.body),
+                       sizeof(req.message.body), key, strlen(key));
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Wait for durability failed");
+    free(pkt);
+}
+
+static void get_multi(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                      const std::vector<std::string> &keys,
+                      uint16_t vbucket = 0) {
+    std::stringstream body;
+    std::vector<std::string>::const_iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        uint16_t keylen = htons(it->length());
+        body.write((char*) &keylen, sizeof(uint16_t));
+        body.write(it->c_str(), it->length());
+    }
+    multi_values.clear();
+    protocol_binary_request_header *pkt;
+    pkt = createPacket(CMD_GET_MULTI, vbucket, 0, NULL, 0, NULL, 0,
+                       body.str().data(), body.str().length());
+    check(h1->unknown_command(h, NULL, pkt, add_response_multi) == ENGINE_SUCCESS,
+          "Get multi failed");
+    free(pkt);
+}
+
 static void evict_key(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
                       const char *key, uint16_t vbucketId=0,
                       const char *msg = NULL, bool expectError = false) {
@@ -1619,6 +1670,162 @@ static enum test_result test_flush_multiv(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1
     return SUCCESS;
 }
 
+static enum test_result test_parallel_flushers(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    check(get_int_stat(h, h1, "ep_num_flushers") == 4, "Expected four flushers");
+    // Flusher n owns the vbuckets whose id modulo 4 is n.
+    for (int vb = 0; vb < 8; ++vb) {
+        if (vb > 0) {
+            check(set_vbucket_state(h, h1, vb, vbucket_state_active),
+                  "Failed to set vbucket state.");
+        }
+        item *i = NULL;
+        check(store(h, h1, NULL, OPERATION_SET, "key", "somevalue", &i,
+                    0, vb) == ENGINE_SUCCESS, "Failed set.");
+        h1->release(h, NULL, i);
+    }
+    wait_for_flusher_to_settle(h, h1);
+    wait_for_stat_to_be(h, h1, "ep_total_persisted", 8);
+
+    for (int n = 0; n < 4; ++n) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "ep_flusher_%d_commit_num", n);
+        wait_for_stat_change(h, h1, buf, 0);
+        snprintf(buf, sizeof(buf), "ep_flusher_%d_state", n);
+        check(get_str_stat(h, h1, buf) == "running", "Expected a running flusher");
+    }
+
+    // A flush_all waits for every flusher, and what they write after it
+    // stays on disk.
+    check(h1->flush(h, NULL, 0) == ENGINE_SUCCESS, "Failed to flush.");
+    for (int vb = 0; vb < 8; ++vb) {
+        item *i = NULL;
+        check(store(h, h1, NULL, OPERATION_SET, "key2", "somevalue", &i,
+                    0, vb) == ENGINE_SUCCESS, "Failed set.");
+        h1->release(h, NULL, i);
+    }
+    wait_for_flusher_to_settle(h, h1);
+    wait_for_stat_to_be(h, h1, "ep_total_persisted", 16);
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+    check(get_int_stat(h, h1, "ep_num_flushers") == 4, "Expected four flushers");
+    check(get_int_stat(h, h1, "curr_items") == 8,
+          "Expected only the keys set after the flush_all.");
+    for (int vb = 0; vb < 8; ++vb) {
+        check_key_value(h, h1, "key2", "somevalue", 9, vb);
+        check(verify_vb_key(h, h1, "key", vb) == ENGINE_KEY_ENOENT,
+              "Expected the key set before the flush_all to be gone.");
+    }
+    return SUCCESS;
+}
+
+static enum test_result test_pipelined_flush(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    // Small batches, so that the next ones are taken while others commit.
+    // Persistence is stopped while each round is queued, so that the
+    // second round isn't deduplicated into the first and each round is
+    // flushed in many batches.
+    for (int round = 0; round < 2; ++round) {
+        stop_persistence(h, h1);
+        for (int j = 0; j < 200; ++j) {
+            std::stringstream key, val;
+            key << "key" << j;
+            val << "value" << round;
+            item *i = NULL;
+            check(store(h, h1, NULL, OPERATION_SET, key.str().c_str(),
+                        val.str().c_str(), &i) == ENGINE_SUCCESS, "Failed set.");
+            h1->release(h, NULL, i);
+        }
+        start_persistence(h, h1);
+        wait_for_flusher_to_settle(h, h1);
+        wait_for_stat_to_be(h, h1, "ep_total_persisted", 200 * (round + 1));
+    }
+    check(get_int_stat(h, h1, "ep_flusher_0_pipelined") > 0,
+          "Expected batches taken ahead of their flush");
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+
+    for (int j = 0; j < 200; ++j) {
+        std::stringstream key;
+        key << "key" << j;
+        check_key_value(h, h1, key.str().c_str(), "value1", 6);
+    }
+    return SUCCESS;
+}
+
+static enum test_result test_adaptive_txn_size(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    check(get_str_stat(h, h1, "ep_flusher_0_txn_reason") != "static",
+          "Expected adaptive transaction sizing");
+    for (int j = 0; j < 500; ++j) {
+        std::stringstream key;
+        key << "key" << j;
+        item *i = NULL;
+        check(store(h, h1, NULL, OPERATION_SET, key.str().c_str(),
+                    "somevalue", &i) == ENGINE_SUCCESS, "Failed set.");
+        h1->release(h, NULL, i);
+    }
+    wait_for_flusher_to_settle(h, h1);
+    wait_for_stat_to_be(h, h1, "ep_total_persisted", 500);
+
+    int txnSize = get_int_stat(h, h1, "ep_flusher_0_txn_size");
+    check(txnSize >= 10 && txnSize <= 100, "Transaction size out of bounds");
+
+    check(set_param(h, h1, engine_param_flush, "adaptive_txn_size", "false"),
+          "Failed to disable adaptive transaction sizing");
+    check(get_str_stat(h, h1, "ep_flusher_0_txn_reason") == "static",
+          "Expected static transaction sizing");
+    check(get_int_stat(h, h1, "ep_flusher_0_txn_size") == 100,
+          "Expected max_txn_size transactions");
+    return SUCCESS;
+}
+
+static enum test_result test_flush_order(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    check(get_str_stat(h, h1, "ep_flush_order") == "fair_share",
+          "Expected fair share flush ordering");
+    check(set_vbucket_state(h, h1, 1, vbucket_state_active),
+          "Failed to set vbucket state.");
+    // More than a batch's worth in both vbuckets, so they have to share.
+    for (int j = 0; j < 100; ++j) {
+        std::stringstream key;
+        key << "key" << j;
+        for (int vb = 0; vb < 2; ++vb) {
+            item *i = NULL;
+            check(store(h, h1, NULL, OPERATION_SET, key.str().c_str(),
+                        "somevalue", &i, 0, vb) == ENGINE_SUCCESS, "Failed set.");
+            h1->release(h, NULL, i);
+        }
+    }
+    wait_for_flusher_to_settle(h, h1);
+    wait_for_stat_to_be(h, h1, "ep_total_persisted", 200);
+    check(get_int_stat(h, h1, "vb_0:oldest_dirty_age", "vbucket-details") == 0,
+          "Expected nothing left to flush in vb0");
+    check(vals.find("vb_1:persistence_lag_max") != vals.end(),
+          "Expected the persistence lag of vb1");
+
+    check(set_param(h, h1, engine_param_flush, "flush_order", "active_first"),
+          "Failed to set flush order");
+    check(get_str_stat(h, h1, "ep_flush_order") == "active_first",
+          "Expected active first flush ordering");
+    check(!set_param(h, h1, engine_param_flush, "flush_order", "newest_first"),
+          "Set an unknown flush order");
+    check(get_str_stat(h, h1, "ep_flush_order") == "active_first",
+          "Expected the flush order to be unchanged");
+
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "key", "somevalue", &i,
+                0, 1) == ENGINE_SUCCESS, "Failed set.");
+    h1->release(h, NULL, i);
+    wait_for_flusher_to_settle(h, h1);
+    wait_for_stat_to_be(h, h1, "ep_total_persisted", 201);
+    return SUCCESS;
+}
+
 static enum test_result test_flush_restart(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     item *i = NULL;
     // First try to delete something we know to not be there.
@@ -2104,6 +2311,45 @@ static enum test_result test_expiry(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static enum test_result test_expiry_pager_chunked(ENGINE_HANDLE *h,
+                                                  ENGINE_HANDLE_V1 *h1) {
+    const char *data = "some test data here.";
+    for (int j = 0; j < 20; ++j) {
+        char key[32];
+        snprintf(key, sizeof(key), "key%d", j);
+        item *it = NULL;
+        check(h1->allocate(h, NULL, &it, key, strlen(key), strlen(data),
+                           0, 2) == ENGINE_SUCCESS,
+              "Allocation failed.");
+        item_info info;
+        info.nvalue = 1;
+        if (!h1->get_item_info(h, NULL, it, &info)) {
+            abort();
+        }
+        memcpy(info.value[0].iov_base, data, strlen(data));
+        uint64_t cas = 0;
+        check(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS,
+              "Set failed.");
+        h1->release(h, NULL, it);
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    int laps = get_int_stat(h, h1, "ep_expiry_pager_visit_laps");
+    testHarness.time_travel(5);
+    wait_for_stat_to_be(h, h1, "ep_expired_pager", 20);
+    wait_for_stat_change(h, h1, "ep_expiry_pager_visit_laps", laps);
+
+    // One item per chunk, so the vbucket took many slots to get through.
+    check(get_int_stat(h, h1, "ep_expiry_pager_visit_items") >= 20,
+          "Expected the expiry pager to visit every item");
+    check(get_int_stat(h, h1, "ep_expiry_pager_visit_chunks") > 1,
+          "Expected the expiry pager to visit vb 0 in chunks");
+    check(get_int_stat(h, h1, "ep_expiry_pager_visit_vb") == 0,
+          "Expected the next expiry pager run to start in vb 0");
+    check(get_int_stat(h, h1, "curr_items") == 0, "Expected zero curr_items");
+    return SUCCESS;
+}
+
 static enum test_result test_expiry_loader(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     const char *key = "test_expiry_loader";
     const char *data = "some test data here.";
@@ -4396,6 +4642,207 @@ static enum test_result test_value_eviction(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *
     return SUCCESS;
 }
 
+static void evict_item(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                       const char *key, bool expectError = false) {
+    int numItems = get_int_stat(h, h1, "curr_items");
+    int numKeyEjects = get_int_stat(h, h1, "ep_num_key_ejects");
+    protocol_binary_request_header *pkt = createPacket(CMD_EVICT_KEY, 0, 0,
+                                                       NULL, 0, key, strlen(key));
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Failed to evict key.");
+    free(pkt);
+
+    if (expectError) {
+        check(last_status == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS,
+              "Expected exists when evicting key.");
+    } else {
+        check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+              "Expected success evicting key.");
+        check(strcmp(last_body, "Ejected.") == 0, "Expected the key ejected");
+        --numItems;
+        ++numKeyEjects;
+    }
+    checkeq(numItems, get_int_stat(h, h1, "curr_items"),
+            "Incorrect number of items in memory");
+    checkeq(numKeyEjects, get_int_stat(h, h1, "ep_num_key_ejects"),
+            "Incorrect number of ejected keys");
+}
+
+static enum test_result test_full_eviction_get(ENGINE_HANDLE *h,
+                                               ENGINE_HANDLE_V1 *h1) {
+    item *i = NULL;
+    stop_persistence(h, h1);
+    check(store(h, h1, NULL, OPERATION_SET, "k1", "v1", &i) == ENGINE_SUCCESS,
+          "Failed to store an item.");
+    h1->release(h, NULL, i);
+    evict_item(h, h1, "k1", true);
+    start_persistence(h, h1);
+    wait_for_flusher_to_settle(h, h1);
+
+    evict_item(h, h1, "k1");
+    check(get_int_stat(h, h1, "ep_num_non_resident") == 0,
+          "Expected no non-resident items");
+
+    // The key and its metadata come back from disk with the value.
+    check_key_value(h, h1, "k1", "v1", 2);
+    checkeq(1, get_int_stat(h, h1, "curr_items"),
+            "Expected the item back in memory");
+    checkeq(0, get_int_stat(h, h1, "curr_temp_items"),
+            "Expected no temporary items");
+
+    check(verify_key(h, h1, "nokey") == ENGINE_KEY_ENOENT,
+          "Expected a missing key to stay missing");
+
+    // Touching an ejected item brings it back too.
+    evict_item(h, h1, "k1");
+    touch(h, h1, "k1", 0, time(NULL) + 3600);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Failed to touch an ejected item.");
+    checkeq(1, get_int_stat(h, h1, "curr_items"),
+            "Expected the touched item back in memory");
+    return SUCCESS;
+}
+
+static enum test_result test_full_eviction_mutations(ENGINE_HANDLE *h,
+                                                     ENGINE_HANDLE_V1 *h1) {
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "k1", "v1", &i) == ENGINE_SUCCESS,
+          "Failed to store an item.");
+    item_info info;
+    info.nvalue = 1;
+    check(h1->get_item_info(h, NULL, i, &info), "Should be able to get info");
+    h1->release(h, NULL, i);
+    wait_for_flusher_to_settle(h, h1);
+    evict_item(h, h1, "k1");
+
+    // The metadata is read back from disk.
+    ItemMetaData itm_meta;
+    check(get_meta(h, h1, "k1", itm_meta), "Expected to get meta");
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS, "Expected success");
+    check(!last_deleted_flag, "Didn't expect the deleted flag");
+    check(itm_meta.cas == info.cas, "Expected cas to match");
+
+    // Add mustn't resurrect an item that's only on disk.
+    evict_item(h, h1, "k1");
+    check(store(h, h1, NULL, OPERATION_ADD, "k1", "v2", &i) == ENGINE_NOT_STORED,
+          "Expected add of an ejected item to fail.");
+    h1->release(h, NULL, i);
+    check_key_value(h, h1, "k1", "v1", 2);
+
+    // A CAS set has to see the item on disk.
+    evict_item(h, h1, "k1");
+    check(store(h, h1, NULL, OPERATION_SET, "k1", "v3", &i, info.cas) == ENGINE_SUCCESS,
+          "Failed to CAS an ejected item.");
+    h1->release(h, NULL, i);
+    check_key_value(h, h1, "k1", "v3", 2);
+    wait_for_flusher_to_settle(h, h1);
+
+    // Delete of an ejected item deletes it on disk.
+    evict_item(h, h1, "k1");
+    check(h1->remove(h, NULL, "k1", 2, 0, 0) == ENGINE_SUCCESS,
+          "Failed to delete an ejected item.");
+    wait_for_flusher_to_settle(h, h1);
+    check(verify_key(h, h1, "k1") == ENGINE_KEY_ENOENT,
+          "Expected the item to be deleted");
+    check(h1->remove(h, NULL, "nokey", 5, 0, 0) == ENGINE_KEY_ENOENT,
+          "Expected delete of a missing key to fail.");
+    check(store(h, h1, NULL, OPERATION_ADD, "k1", "v4", &i) == ENGINE_SUCCESS,
+          "Failed to add a deleted item.");
+    h1->release(h, NULL, i);
+    check_key_value(h, h1, "k1", "v4", 2);
+    return SUCCESS;
+}
+
+static enum test_result test_full_eviction_bloom_filter(ENGINE_HANDLE *h,
+                                                        ENGINE_HANDLE_V1 *h1) {
+    check(get_int_stat(h, h1, "ep_bfilter_mem_used") > 0,
+          "Expected a Bloom filter for vbucket 0");
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "k1", "v1", &i) == ENGINE_SUCCESS,
+          "Failed to store an item.");
+    h1->release(h, NULL, i);
+    wait_for_flusher_to_settle(h, h1);
+    evict_item(h, h1, "k1");
+
+    // A key that was never written isn't looked for on disk.
+    check(verify_key(h, h1, "nokey") == ENGINE_KEY_ENOENT,
+          "Expected a missing key to stay missing");
+    checkeq(1, get_int_stat(h, h1, "ep_bfilter_avoided_fetches"),
+            "Expected the filter to rule the missing key out");
+    checkeq(0, get_int_stat(h, h1, "curr_temp_items"),
+            "Expected no temporary items");
+
+    // One that was is.
+    check_key_value(h, h1, "k1", "v1", 2);
+    checkeq(1, get_int_stat(h, h1, "ep_bfilter_avoided_fetches"),
+            "Expected the filter to let the ejected key through");
+
+    // Warmup rebuilds the filter from the keys on disk.
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+    evict_item(h, h1, "k1");
+    check_key_value(h, h1, "k1", "v1", 2);
+    check(verify_key(h, h1, "nokey") == ENGINE_KEY_ENOENT,
+          "Expected a missing key to stay missing after warmup");
+    checkeq(1, get_int_stat(h, h1, "ep_bfilter_avoided_fetches"),
+            "Expected the rebuilt filter to rule the missing key out");
+
+    // getMeta doesn't go to disk for a key that was never written, but
+    // still finds the tombstone of one that was deleted.
+    ItemMetaData itm_meta;
+    check(!get_meta(h, h1, "nokey", itm_meta), "Expected get meta to return false");
+    check(last_status == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, "Expected enoent");
+    checkeq(2, get_int_stat(h, h1, "ep_bfilter_avoided_fetches"),
+            "Expected the filter to rule the missing key's metadata out");
+    check(h1->remove(h, NULL, "k1", 2, 0, 0) == ENGINE_SUCCESS,
+          "Delete failed");
+    wait_for_flusher_to_settle(h, h1);
+    wait_for_stat_to_be(h, h1, "curr_items", 0);
+    check(get_meta(h, h1, "k1", itm_meta), "Expected to get meta");
+    check(last_deleted_flag, "Expected deleted flag to be set");
+    checkeq(2, get_int_stat(h, h1, "ep_bfilter_avoided_fetches"),
+            "Expected the filter to let the deleted key through");
+    return SUCCESS;
+}
+
+static enum test_result test_full_eviction_pager(ENGINE_HANDLE *h,
+                                                 ENGINE_HANDLE_V1 *h1) {
+    std::string value(1024, 'x');
+    item *i = NULL;
+    int count = 0;
+    for (; get_int_stat(h, h1, "ep_num_pager_runs") == 0; ++count) {
+        std::stringstream ss;
+        ss << "key-" << count;
+        ENGINE_ERROR_CODE ret = store(h, h1, NULL, OPERATION_SET,
+                                      ss.str().c_str(), value.c_str(), &i);
+        h1->release(h, NULL, i);
+        if (ret == ENGINE_TMPFAIL || ret == ENGINE_ENOMEM) {
+            // Let the flusher catch up so the pager can do its job.
+            wait_for_flusher_to_settle(h, h1);
+            --count;
+        } else {
+            check(ret == ENGINE_SUCCESS, "Failed to store an item.");
+        }
+        check(count < 100000, "The item pager never ran");
+    }
+    wait_for_flusher_to_settle(h, h1);
+    wait_for_stat_change(h, h1, "ep_num_key_ejects", 0);
+
+    // Everything is still there, whether it's in memory or not.
+    check(get_int_stat(h, h1, "curr_items") < count,
+          "Expected items ejected from memory");
+    for (int j = 0; j < count; ++j) {
+        std::stringstream ss;
+        ss << "key-" << j;
+        check(verify_key(h, h1, ss.str().c_str()) == ENGINE_SUCCESS,
+              "Expected every item to be found");
+    }
+    return SUCCESS;
+}
+
 static enum test_result test_mb5172(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     item *i = NULL;
     check(store(h, h1, NULL, OPERATION_SET, "key-1", "value-1", &i, 0, 0)
@@ -6359,6 +6806,111 @@ static enum test_result test_observe_errors(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *
     return SUCCESS;
 }
 
+static enum test_result test_wait_for_durability(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *i = NULL;
+    check(store(h, h1, NULL, OPERATION_SET, "key", "somevalue", &i) == ENGINE_SUCCESS,
+          "Failed set.");
+    item_info info;
+    info.nvalue = 1;
+    check(h1->get_item_info(h, NULL, i, &info), "Failed to get item info.");
+    uint64_t cas = info.cas;
+    h1->release(h, NULL, i);
+
+    wait_for_durability(h, h1, "key", true, 0, 10000);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS, "Expected persisted");
+    check(last_cas == cas, "Expected the cas of the item");
+    check(get_int_stat(h, h1, "ep_durability_waits") == 1, "Expected a wait");
+    check(get_str_stat(h, h1, "key_is_dirty", "key key 0") == "false", "Expected clean");
+
+    // Nothing persists while the flusher is stopped.
+    stop_persistence(h, h1);
+    check(store(h, h1, NULL, OPERATION_SET, "key", "othervalue", &i) == ENGINE_SUCCESS,
+          "Failed set.");
+    h1->release(h, NULL, i);
+    wait_for_durability(h, h1, "key", true, 0, 200);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_ETMPFAIL, "Expected a timeout");
+    check(get_int_stat(h, h1, "ep_durability_timeouts") == 1, "Expected a timeout");
+    check(get_int_stat(h, h1, "ep_durability_waiting") == 0, "Expected no waiters");
+
+    // Without a TAP connection, nothing replicates.
+    start_persistence(h, h1);
+    wait_for_durability(h, h1, "key", false, 1, 200);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_ETMPFAIL, "Expected a timeout");
+
+    // Nor with a TAP stream that isn't a replication stream, whatever it
+    // took from the checkpoints.
+    const void *cookie = testHarness.create_cookie();
+    testHarness.lock_cookie(cookie);
+    std::string name("durability_tap");
+    TAP_ITERATOR iter = h1->get_tap_iterator(h, cookie, name.c_str(),
+                                             name.length(),
+                                             TAP_CONNECT_CHECKPOINT, NULL, 0);
+    check(iter != NULL, "Failed to create a tap iterator");
+    tap_event_t event;
+    do {
+        item *it;
+        void *engine_specific;
+        uint16_t nengine_specific;
+        uint8_t ttl;
+        uint16_t flags;
+        uint32_t seqno;
+        uint16_t vbucket;
+        event = iter(h, cookie, &it, &engine_specific, &nengine_specific,
+                     &ttl, &flags, &seqno, &vbucket);
+        if (event == TAP_MUTATION || event == TAP_DELETION) {
+            h1->release(h, cookie, it);
+        }
+    } while (event != TAP_PAUSE && event != TAP_DISCONNECT);
+    testHarness.unlock_cookie(cookie);
+    wait_for_durability(h, h1, "key", false, 1, 200);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_ETMPFAIL, "Expected a timeout");
+
+    wait_for_durability(h, h1, "key", true, 0, 10000, cas);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, "Expected a cas mismatch");
+    wait_for_durability(h, h1, "nokey", true, 0, 10000);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, "Expected no key");
+    wait_for_durability(h, h1, "key", false, 0, 10000);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_EINVAL, "Expected invalid");
+    return SUCCESS;
+}
+
+static enum test_result test_get_multi(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    std::vector<std::string> keys;
+    for (int j = 0; j < 20; ++j) {
+        std::stringstream ss;
+        ss << "key-" << j;
+        keys.push_back(ss.str());
+        item *i;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(), ss.str().c_str(),
+                    &i) == ENGINE_SUCCESS, "Failed to store a value");
+        h1->release(h, NULL, i);
+    }
+    keys.push_back("nokey");
+
+    get_multi(h, h1, keys);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS, "Expected success");
+    check(last_key == NULL, "Expected the batch to end without a key");
+    checkeq(20, static_cast<int>(multi_values.size()), "Expected all stored keys");
+    for (int j = 0; j < 20; ++j) {
+        check(multi_values[keys[j]] == keys[j], "Wrong value");
+    }
+    check(multi_values.find("nokey") == multi_values.end(), "Expected no missing key");
+
+    // Ejected values are fetched before the batch is answered.
+    wait_for_flusher_to_settle(h, h1);
+    evict_key(h, h1, "key-3", 0, "Ejected.");
+    get_multi(h, h1, keys);
+    checkeq(20, static_cast<int>(multi_values.size()), "Expected all stored keys");
+    check(multi_values["key-3"] == "key-3", "Wrong value for ejected key");
+    check(get_int_stat(h, h1, "ep_bg_fetched") == 1, "Expected a bg fetch");
+
+    get_multi(h, h1, keys, 1);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET,
+          "Expected not my vbucket");
+    check(multi_values.empty(), "Expected no values");
+    return SUCCESS;
+}
+
 static enum test_result test_compact_mutation_log(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
 
     std::vector<std::string> keys;
@@ -6678,6 +7230,18 @@ engine_test_t* get_tests(void) {
                  prepare, cleanup),
         TestCase("flush multi vbuckets", test_flush_multiv,
                  test_setup, teardown, NULL, prepare, cleanup),
+        TestCase("parallel flushers", test_parallel_flushers,
+                 test_setup, teardown, "flushall_enabled=true;max_num_flushers=4",
+                 prepare, cleanup),
+        TestCase("pipelined flush", test_pipelined_flush, test_setup, teardown,
+                 "pipelined_flush=true;max_txn_size=10;flush_batch_max_bytes=1024",
+                 prepare, cleanup),
+        TestCase("adaptive txn size", test_adaptive_txn_size, test_setup, teardown,
+                 "adaptive_txn_size=true;min_txn_size=10;max_txn_size=100",
+                 prepare, cleanup),
+        TestCase("flush order", test_flush_order, test_setup, teardown,
+                 "flush_order=fair_share;flush_batch_max_bytes=1024",
+                 prepare, cleanup),
         TestCase("flush multi vbuckets single mt", test_flush_multiv,
                  test_setup, teardown,
                  "flushall_enabled=true;db_strategy=singleMTDB;max_vbuckets=16;"
@@ -6698,6 +7262,13 @@ engine_test_t* get_tests(void) {
                  "ht_size=7;ht_locks=3", prepare, cleanup),
         TestCase("expiry", test_expiry, test_setup, teardown,
                  NULL, prepare, cleanup),
+        TestCase("expiry pager in chunks", test_expiry_pager_chunked,
+                 test_setup, teardown,
+                 "exp_pager_stime=1;visit_chunk_size=1", prepare, cleanup),
+        TestCase("expiry pager over several threads", test_expiry_pager_chunked,
+                 test_setup, teardown,
+                 "exp_pager_stime=1;visit_chunk_size=1;visitor_threads=4",
+                 prepare, cleanup),
         TestCase("expiry_loader", test_expiry_loader, test_setup,
                  teardown, NULL, prepare, cleanup),
         TestCase("expiry_flush", test_expiry_flush, test_setup,
@@ -6731,6 +7302,10 @@ engine_test_t* get_tests(void) {
                  NULL, prepare, cleanup),
         TestCase("test observe not my vbucket", test_observe_errors, NULL, teardown,
                  NULL, prepare, cleanup),
+        TestCase("wait for durability", test_wait_for_durability, test_setup, teardown,
+                 NULL, prepare, cleanup),
+        TestCase("get multi", test_get_multi, test_setup, teardown,
+                 NULL, prepare, cleanup),
         // Stats tests
         TestCase("stats", test_stats, test_setup, teardown, NULL,
                  prepare, cleanup),
@@ -6756,6 +7331,20 @@ engine_test_t* get_tests(void) {
         // eviction
         TestCase("value eviction", test_value_eviction, test_setup,
                  teardown, NULL, prepare, cleanup),
+        TestCase("full eviction get", test_full_eviction_get, test_setup,
+                 teardown, "item_eviction_policy=full_eviction",
+                 prepare, cleanup),
+        TestCase("full eviction mutations", test_full_eviction_mutations,
+                 test_setup, teardown, "item_eviction_policy=full_eviction",
+                 prepare, cleanup),
+        TestCase("full eviction bloom filter", test_full_eviction_bloom_filter,
+                 test_setup, teardown, "item_eviction_policy=full_eviction",
+                 prepare, cleanup),
+        TestCase("full eviction pager", test_full_eviction_pager, test_setup,
+                 teardown,
+                 "max_size=2097152;compress_cold_values=false;"
+                 "item_eviction_policy=full_eviction",
+                 prepare, cleanup),
         // duplicate items on disk
         TestCase("duplicate items on disk", test_duplicate_items_disk,
                  test_setup, teardown, NULL, prepare, cleanup),
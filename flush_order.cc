@@ -0,0 +1,117 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+#include "flush_order.hh"
+
+#include <algorithm>
+
+static RoundRobinFlushOrder roundRobin;
+static ActiveFirstFlushOrder activeFirst;
+static OldestDirtyFirstFlushOrder oldestDirtyFirst;
+static FairShareFlushOrder fairShare;
+
+FlushOrderPolicy *FlushOrderPolicy::get(const std::string &name) {
+    FlushOrderPolicy *policies[] = { &roundRobin, &activeFirst,
+                                     &oldestDirtyFirst, &fairShare };
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i) {
+        if (name == policies[i]->getName()) {
+            return policies[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Rotate a range of vbuckets so that it starts at a given one, if it
+ * holds it.
+ *
+ * @return true if the range holds the vbucket
+ */
+static bool rotateTo(std::vector<FlushCandidate>::iterator first,
+                     std::vector<FlushCandidate>::iterator last, int vbid) {
+    std::vector<FlushCandidate>::iterator it;
+    for (it = first; it != last; ++it) {
+        if (it->vbid == vbid) {
+            std::rotate(first, it, last);
+            return true;
+        }
+    }
+    return false;
+}
+
+void RoundRobinFlushOrder::order(std::vector<FlushCandidate> &vbs, int resume) {
+    rotateTo(vbs.begin(), vbs.end(), resume);
+}
+
+static bool isActive(const FlushCandidate &c) {
+    return c.state == vbucket_state_active;
+}
+
+void ActiveFirstFlushOrder::order(std::vector<FlushCandidate> &vbs, int resume) {
+    std::vector<FlushCandidate>::iterator others =
+        std::stable_partition(vbs.begin(), vbs.end(), isActive);
+    if (!rotateTo(vbs.begin(), others, resume)) {
+        rotateTo(others, vbs.end(), resume);
+    }
+}
+
+static bool dirtiedEarlier(const FlushCandidate &a, const FlushCandidate &b) {
+    if (a.hasDirty != b.hasDirty) {
+        return a.hasDirty;
+    }
+    return a.hasDirty && a.oldestDirty < b.oldestDirty;
+}
+
+void OldestDirtyFirstFlushOrder::order(std::vector<FlushCandidate> &vbs, int) {
+    // The vbucket that waited longest always goes first, so there is
+    // nothing to resume.
+    std::stable_sort(vbs.begin(), vbs.end(), dirtiedEarlier);
+}
+
+int FlushOrderPolicy::fill(const std::vector<FlushCandidate> &vbs, size_t maxBytes,
+                           FlushSource &source) {
+    size_t numMore = 0;
+    std::vector<FlushCandidate>::const_iterator it;
+    for (it = vbs.begin(); it != vbs.end(); ++it) {
+        if (it->hasDirty) {
+            ++numMore;
+        }
+    }
+
+    std::vector<bool> hasMore(vbs.size(), false);
+    size_t batchBytes = 0;
+    bool firstPass = true;
+    do {
+        size_t share = getShare(maxBytes - batchBytes, numMore);
+        numMore = 0;
+        for (size_t i = 0; i < vbs.size(); ++i) {
+            if (!firstPass && !hasMore[i]) {
+                continue;
+            }
+            if (batchBytes > 0 && batchBytes >= maxBytes) {
+                return vbs[i].vbid;
+            }
+            size_t left = maxBytes - batchBytes;
+            size_t room = std::min(share, left);
+            size_t bytes = 0;
+            hasMore[i] = source.take(i, firstPass, room, bytes);
+            batchBytes += bytes;
+            if (hasMore[i]) {
+                if (room == left) {
+                    // Out of budget rather than out of its share.
+                    return vbs[i].vbid;
+                }
+                ++numMore;
+            }
+        }
+        firstPass = false;
+    } while (numMore > 0 && batchBytes < maxBytes);
+    return -1;
+}
+
+size_t FairShareFlushOrder::getShare(size_t maxBytes, size_t numDirty) {
+    if (numDirty <= 1) {
+        return maxBytes;
+    }
+    return std::max(maxBytes / numDirty, static_cast<size_t>(1));
+}
@@ -0,0 +1,166 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef FLUSH_ORDER_HH
+#define FLUSH_ORDER_HH 1
+
+#include "config.h"
+
+#include <string>
+#include <vector>
+
+#include <memcached/engine.h>
+
+#include "common.hh"
+
+/**
+ * A vbucket a flush batch may take items from.
+ */
+struct FlushCandidate {
+    FlushCandidate(uint16_t id, vbucket_state_t st) :
+        vbid(id), state(st), hasDirty(false), oldestDirty(0) {}
+
+    uint16_t vbid;
+    vbucket_state_t state;
+    // Set only for the policies that need to know.
+    bool hasDirty;
+    rel_time_t oldestDirty;
+};
+
+/**
+ * Where a flush batch takes the items of its vbuckets from.
+ */
+class FlushSource {
+public:
+
+    virtual ~FlushSource() {}
+
+    /**
+     * Take items of a vbucket for the batch.
+     *
+     * @param i the index of the vbucket among the candidates
+     * @param firstTurn true on the vbucket's first turn in the batch
+     * @param maxBytes the bytes the vbucket may take in this turn
+     * @param bytes set to the bytes taken
+     * @return true if the vbucket has items left that didn't fit
+     */
+    virtual bool take(size_t i, bool firstTurn, size_t maxBytes, size_t &bytes) = 0;
+};
+
+/**
+ * Decides in which order a flusher drains its vbuckets into a batch, and
+ * how much of the batch's memory budget each may take before the others
+ * got their turn.
+ */
+class FlushOrderPolicy {
+public:
+
+    virtual ~FlushOrderPolicy() {}
+
+    /**
+     * Put the vbuckets in the order a batch takes items from them.
+     *
+     * @param vbs the vbuckets of a flusher, sorted by state
+     * @param resume the vbucket the last batch ran out of room at, or -1
+     */
+    virtual void order(std::vector<FlushCandidate> &vbs, int resume) = 0;
+
+    /**
+     * Whether order() or getShare() need to know which vbuckets have
+     * items to flush and since when.
+     */
+    virtual bool needsDirtyInfo() {
+        return false;
+    }
+
+    /**
+     * Get the bytes a vbucket may put in a batch in one turn.
+     *
+     * @param maxBytes what is left of the batch's budget
+     * @param numDirty the number of vbuckets with items to flush
+     */
+    virtual size_t getShare(size_t maxBytes, size_t numDirty) {
+        (void)numDirty;
+        return maxBytes;
+    }
+
+    virtual const char *getName() = 0;
+
+    /**
+     * Fill a batch by giving the vbuckets turns in order, each taking up
+     * to its share, until the budget runs out or none has anything left
+     * beyond its share.
+     *
+     * @param vbs the vbuckets as put in order by order()
+     * @param maxBytes the batch's budget
+     * @param source where the vbuckets' items are taken from
+     * @return the vbucket the batch ran out of budget at, or -1
+     */
+    int fill(const std::vector<FlushCandidate> &vbs, size_t maxBytes,
+             FlushSource &source);
+
+    /**
+     * Get the policy of a given name.
+     *
+     * @return the policy, or NULL if there is none of that name
+     */
+    static FlushOrderPolicy *get(const std::string &name);
+};
+
+/**
+ * Start from the vbucket the last batch stopped at, so that none starves.
+ */
+class RoundRobinFlushOrder : public FlushOrderPolicy {
+public:
+    void order(std::vector<FlushCandidate> &vbs, int resume);
+
+    const char *getName() {
+        return "round_robin";
+    }
+};
+
+/**
+ * Drain the active vbuckets before the others.  The active vbuckets take
+ * turns starting batches, and so do the others among themselves.
+ */
+class ActiveFirstFlushOrder : public FlushOrderPolicy {
+public:
+    void order(std::vector<FlushCandidate> &vbs, int resume);
+
+    const char *getName() {
+        return "active_first";
+    }
+};
+
+/**
+ * Drain the vbuckets whose oldest mutation waited longest first.
+ */
+class OldestDirtyFirstFlushOrder : public FlushOrderPolicy {
+public:
+    void order(std::vector<FlushCandidate> &vbs, int resume);
+
+    bool needsDirtyInfo() {
+        return true;
+    }
+
+    const char *getName() {
+        return "oldest_dirty_first";
+    }
+};
+
+/**
+ * Give every vbucket with items to flush an equal share of the batch's
+ * budget, in round robin order.
+ */
+class FairShareFlushOrder : public RoundRobinFlushOrder {
+public:
+    bool needsDirtyInfo() {
+        return true;
+    }
+
+    size_t getShare(size_t maxBytes, size_t numDirty);
+
+    const char *getName() {
+        return "fair_share";
+    }
+};
+
+#endif // FLUSH_ORDER_HH
@@ -201,10 +201,14 @@ bool Flusher::step(Dispatcher &d, TaskId tid) {
 }
 
 void Flusher::completeFlush() {
-    doFlush();
-    while (flushQueue) {
+    // A flush batch only takes as many dirty items as its memory budget
+    // allows, so keep flushing batches until nothing is left.
+    do {
         doFlush();
-    }
+        while (flushQueue) {
+            doFlush();
+        }
+    } while (!store->diskQueueEmpty(*shard));
 }
 
 double Flusher::computeMinSleepTime() {
@@ -215,7 +219,9 @@ double Flusher::computeMinSleepTime() {
     }
 
     if (flushRv + prevFlushRv == 0) {
-        if (!store->diskQueueEmpty()) {
+        // One waiting for the others to get to a flush_all is woken by
+        // the last of them.
+        if (!store->diskQueueEmpty(*shard) && !store->waitingForFlushAll(*shard)) {
             return 0.0;
         }
         minSleepTime = std::min(minSleepTime * 2, 1.0);
@@ -231,7 +237,7 @@ int Flusher::doFlush() {
     // On a fresh entry, flushQueue is null and we need to build one.
     if (!flushQueue) {
         flushRv = store->stats.min_data_age;
-        flushQueue = store->beginFlush();
+        flushQueue = store->beginFlush(*shard);
         if (flushQueue) {
             getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
                              "Beginning a write queue flush.\n");
@@ -243,7 +249,14 @@ int Flusher::doFlush() {
     // Now do the every pass thing.
     if (flushQueue) {
         if (!flushQueue->empty()) {
-            int n = store->flushSome(flushQueue, rejectQueue);
+            // Have the next batch taken from the checkpoints while the
+            // last few transactions of this one commit, so it's ready
+            // even if taking it is slower than a single commit.
+            size_t txnSize = static_cast<size_t>(shard->tctx.getTxnSize());
+            if (flushQueue->size() <= FLUSH_PIPELINE_TXNS * txnSize) {
+                store->scheduleNextFlushBatch(*shard);
+            }
+            int n = store->flushSome(*shard, flushQueue, rejectQueue);
             if (_state == pausing) {
                 transition_state(paused);
             }
@@ -253,9 +266,9 @@ int Flusher::doFlush() {
         if (flushQueue->empty()) {
             if (!rejectQueue->empty()) {
                 // Requeue the rejects.
-                store->requeueRejectedItems(rejectQueue);
+                store->requeueRejectedItems(*shard, rejectQueue);
             } else {
-                store->completeFlush(flushStart);
+                store->completeFlush(*shard, flushStart);
                 getLogger()->log(EXTENSION_LOG_INFO, NULL,
                                  "Completed a flush, age of oldest item was %ds\n",
                                  flushRv);
@@ -19,6 +19,8 @@ enum flusher_state {
 class Flusher;
 
 const double DEFAULT_MIN_SLEEP_TIME = 0.1;
+// How many transactions before the end of a batch the next one is taken.
+const size_t FLUSH_PIPELINE_TXNS = 4;
 
 /**
  * A DispatcherCallback adaptor over Flusher.
@@ -45,12 +47,14 @@ private:
 
 /**
  * Manage persistence of data for an EventuallyPersistentStore.
+ *
+ * Each flusher persists the vbuckets of its FlusherShard.
  */
 class Flusher {
 public:
 
-    Flusher(EventuallyPersistentStore *st, Dispatcher *d) :
-        store(st), _state(initializing), dispatcher(d),
+    Flusher(EventuallyPersistentStore *st, Dispatcher *d, FlusherShard *sh) :
+        store(st), shard(sh), _state(initializing), dispatcher(d),
         flushRv(0), prevFlushRv(0), minSleepTime(0.1),
         flushQueue(NULL), rejectQueue(NULL),
         forceShutdownReceived(false) {
@@ -95,6 +99,7 @@ private:
     const char * stateName(enum flusher_state st) const;
 
     EventuallyPersistentStore   *store;
+    FlusherShard                *shard;
     volatile enum flusher_state  _state;
     Mutex                        taskMutex;
     TaskId                       task;
@@ -17,6 +17,8 @@ public:
     ResizingVisitor() { }
 
     bool visitBucket(RCPtr<VBucket> &vb) {
+        // Moves items a few buckets at a time, so front end
+        // operations are only held up for a single step.
         vb->ht.resize();
         return false;
     }
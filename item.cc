@@ -16,11 +16,45 @@
  */
 #include "item.hh"
 
+#include <vector>
+
+#include "lzcodec.hh"
 #include "tools/cJSON.h"
 
 Atomic<uint64_t> Item::casCounter(1);
 const uint32_t Item::metaDataSize(2 * sizeof(uint32_t) + 2 * sizeof(uint64_t) + 2);
 
+Blob* Blob::NewCompressed(const char *start, const size_t len) {
+    // A compressed blob starts with the length of the original data.
+    size_t cap = len - len / 8;
+    if (cap <= sizeof(uint32_t)) {
+        return NULL;
+    }
+    std::vector<char> buf(cap);
+    uint32_t rawlen = static_cast<uint32_t>(len);
+    std::memcpy(&buf[0], &rawlen, sizeof(rawlen));
+    size_t clen = lzCompress(start, len, &buf[sizeof(rawlen)],
+                             cap - sizeof(rawlen));
+    if (clen == 0) {
+        return NULL;
+    }
+    size_t total_len = sizeof(rawlen) + clen;
+    return new (::operator new(total_len + sizeof(Blob))) Blob(&buf[0],
+                                                               total_len,
+                                                               true);
+}
+
+Blob* Blob::decompress() const {
+    assert(compressed);
+    size_t rawlen = rawLength();
+    Blob *t = New(rawlen);
+    bool ok = lzDecompress(data + sizeof(uint32_t), size - sizeof(uint32_t),
+                           t->data, rawlen);
+    assert(ok);
+    (void)ok;
+    return t;
+}
+
 bool Item::append(const Item &i) {
     assert(value.get() != NULL);
     assert(i.getValue().get() != NULL);
@@ -3,6 +3,7 @@
 #define ITEM_HH
 #include "config.h"
 
+#include <limits>
 #include <string>
 #include <string.h>
 #include <stdio.h>
@@ -62,6 +63,37 @@ public:
         return t;
     }
 
+    /**
+     * Create a new Blob holding a copy of another one, compressed or
+     * not.
+     *
+     * @param other the blob to copy
+     *
+     * @return the new Blob instance
+     */
+    static Blob* New(const Blob &other) {
+        size_t total_len = other.size + sizeof(Blob);
+        return new (::operator new(total_len)) Blob(other.data, other.size,
+                                                    other.compressed);
+    }
+
+    /**
+     * Create a new Blob holding a compressed copy of the given data.
+     *
+     * @param start the beginning of the data to compress
+     * @param len the amount of data to compress
+     *
+     * @return the new Blob instance, or NULL if the data wouldn't
+     *         shrink by at least an eighth
+     */
+    static Blob* NewCompressed(const char *start, const size_t len);
+
+    /**
+     * Create a new uncompressed Blob with the contents of this
+     * compressed one.
+     */
+    Blob* decompress() const;
+
     // Actual accessorish things.
 
     /**
@@ -92,6 +124,43 @@ public:
         return std::string(data, size);
     }
 
+    /**
+     * True if the contents of this Blob are compressed.
+     *
+     * The data of a compressed Blob is only meaningful to decompress().
+     */
+    bool isCompressed() const {
+        return compressed;
+    }
+
+    /**
+     * Get the length of the value held in this Blob once decompressed.
+     */
+    size_t rawLength() const {
+        if (!compressed) {
+            return size;
+        }
+        uint32_t rawlen;
+        std::memcpy(&rawlen, data, sizeof(rawlen));
+        return rawlen;
+    }
+
+    /**
+     * Get the number of defragmenter passes this Blob has survived.
+     */
+    uint8_t getAge() const {
+        return age;
+    }
+
+    /**
+     * Note that this Blob survived another defragmenter pass.
+     */
+    void incrementAge() {
+        if (age < std::numeric_limits<uint8_t>::max()) {
+            ++age;
+        }
+    }
+
     // This is necessary for making C++ happy when I'm doing a
     // placement new on fairly "normal" c++ heap allocations, just
     // with variable-sized objects.
@@ -103,20 +172,22 @@ public:
 
 private:
 
-    explicit Blob(const char *start, const size_t len) :
-        size(static_cast<uint32_t>(len))
+    explicit Blob(const char *start, const size_t len, bool comp = false) :
+        size(static_cast<uint32_t>(len)), age(0), compressed(comp)
     {
         std::memcpy(data, start, len);
         ObjectRegistry::onCreateBlob(this);
     }
 
-    explicit Blob(const size_t len) :
-        size(static_cast<uint32_t>(len))
+    explicit Blob(const size_t len, bool comp = false) :
+        size(static_cast<uint32_t>(len)), age(0), compressed(comp)
     {
         ObjectRegistry::onCreateBlob(this);
     }
 
     const uint32_t size;
+    uint8_t age;
+    const bool compressed;
     char data[1];
 
     DISALLOW_COPY_AND_ASSIGN(Blob);
@@ -16,6 +16,59 @@ static const size_t MAX_PERSISTENCE_QUEUE_SIZE = 1000000;
 
 const bool PagingConfig::phaseConfig[paging_max] = {false, true};
 
+/**
+ * What the PagingVisitors of one pager run did between them.
+ *
+ * A run spread over several workers has a visitor per worker.  They
+ * add what they did as they go, and the run is only over, letting the
+ * pager start the next one, once the last of them completes.
+ */
+class PagingResults {
+public:
+
+    /**
+     * @param visitors the number of visitors in the run
+     * @param sfin set to true once the last of them completes
+     */
+    PagingResults(size_t visitors, Atomic<bool> *sfin) :
+        remaining(visitors), stateFinalizer(sfin) {}
+
+    void add(size_t ejected, size_t attempts, size_t expired) {
+        totalEjected.incr(ejected);
+        totalEjectionAttempts.incr(attempts);
+        totalExpired.incr(expired);
+    }
+
+    /**
+     * Called as each visitor completes.
+     *
+     * @return true for the last one
+     */
+    bool complete() {
+        if (remaining.decr(1) > 0) {
+            return false;
+        }
+        getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                         "Paging run done, %ld of %ld ejection attempts "
+                         "succeeded, %ld expired items purged\n",
+                         totalEjected.get(), totalEjectionAttempts.get(),
+                         totalExpired.get());
+        if (stateFinalizer) {
+            stateFinalizer->set(true);
+        }
+        return true;
+    }
+
+    //! Items whose values were ejected, compressed or expired.
+    Atomic<size_t> totalEjected;
+    Atomic<size_t> totalEjectionAttempts;
+    Atomic<size_t> totalExpired;
+
+private:
+    Atomic<size_t> remaining;
+    Atomic<bool>  *stateFinalizer;
+};
+
 /**
  * As part of the ItemPager, visit all of the objects in memory and
  * eject some within a constrained probability
@@ -31,16 +84,19 @@ public:
      * @param st the stats where we'll track what we've done
      * @param pcnt percentage of objects to attempt to evict (0-1)
      * @param bias active vbuckets eviction probability bias multiplier (0-1)
-     * @param sfin pointer to a bool to be set to true after run completes
+     * @param res the results of the run the visitor is part of
      * @param pause flag indicating if PagingVisitor can pause between vbucket visits
      * @param nru false if ignoring reference bits
      */
     PagingVisitor(EventuallyPersistentStore &s, EPStats &st, double pcnt,
-                  bool *sfin, bool pause = false, double bias = 1, bool nru = true)
+                  shared_ptr<PagingResults> res, bool pause = false,
+                  double bias = 1, bool nru = true)
       : store(s), stats(st), randomEvict(PagingConfig::phaseConfig[0]), percent(pcnt),
-        activeBias(bias), ejected(0), totalEjected(0), totalEjectionAttempts(0),
-        startTime(ep_real_time()), stateFinalizer(sfin), canPause(pause),
-        useNru(nru) {}
+        activeBias(bias), ejected(0), compressed(0), totalEjected(0),
+        totalEjectionAttempts(0), reportedAttempts(0), startTime(ep_real_time()),
+        results(res),
+        canPause(pause), useNru(nru), compressValues(false),
+        compressMinSize(0) {}
 
     void visit(StoredValue *v) {
         // Remember expired objects -- we're going to delete them.
@@ -59,6 +115,21 @@ public:
             1 : static_cast<double>(std::rand()) / static_cast<double>(RAND_MAX);
         if ((useNru && !v->isReferenced()) || percent >= r) {
             ++totalEjectionAttempts;
+            // Compress cold values in memory first, only the ones that
+            // are still cold after that (or don't compress) go to disk.
+            if (compressValues && v->eligibleForCompression()
+                && v->blobLength() >= compressMinSize
+                && v->compressValue(stats, currentBucket->ht)) {
+                ++compressed;
+                return;
+            }
+            // Under full eviction the whole item goes if it's on disk,
+            // it can't be dropped while the visitor holds the lock.
+            if (store.isFullEviction() && v->eligibleForItemEviction()) {
+                evicted.push_back(std::make_pair(currentBucket->getId(),
+                                                 v->getKey()));
+                return;
+            }
             if (!v->eligibleForEviction()) {
                 ++stats.numFailedEjects;
                 return;
@@ -99,21 +170,32 @@ public:
 
     void update() {
         store.deleteExpiredItems(expired);
+        ejected += store.ejectItems(evicted);
 
         if (numEjected() > 0) {
             getLogger()->log(EXTENSION_LOG_INFO, NULL,
                              "Paged out %ld values\n", numEjected());
         }
 
+        if (compressed > 0) {
+            getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                             "Compressed %ld values\n", compressed);
+        }
+
         size_t num_expired = expired.size();
         if (num_expired > 0) {
             getLogger()->log(EXTENSION_LOG_INFO, NULL,
                              "Purged %ld expired items\n", num_expired);
         }
 
-        totalEjected += (ejected + num_expired);
+        totalEjected += (ejected + compressed + num_expired);
+        results->add(ejected + compressed + num_expired,
+                     totalEjectionAttempts - reportedAttempts, num_expired);
+        reportedAttempts = totalEjectionAttempts;
         ejected = 0;
+        compressed = 0;
         expired.clear();
+        evicted.clear();
     }
 
     bool pauseVisitor() {
@@ -121,11 +203,18 @@ public:
         return canPause && queueSize >= MAX_PERSISTENCE_QUEUE_SIZE;
     }
 
+    bool goalReached() {
+        if (percent <= 0) {
+            return false;
+        }
+        // Evicted items are only dropped in batches, count them first.
+        update();
+        return stats.getTotalMemoryUsed() <= stats.mem_low_wat;
+    }
+
     void complete() {
         update();
-        if (stateFinalizer) {
-            *stateFinalizer = true;
-        }
+        results->complete();
     }
 
     /**
@@ -134,8 +223,8 @@ public:
     size_t numEjected() { return ejected; }
 
     /**
-     * Get the total number of items whose values are ejected or removed due to
-     * the expiry time.
+     * Get the total number of items whose values are ejected, compressed
+     * or removed due to the expiry time.
      */
     size_t getTotalEjected() { return totalEjected; }
 
@@ -151,6 +240,15 @@ public:
         }
     }
 
+    /**
+     * Compress values of at least minSize bytes in memory before
+     * resorting to ejecting them.
+     */
+    void configCompression(bool enabled, size_t minSize) {
+        compressValues = enabled;
+        compressMinSize = minSize;
+    }
+
 private:
     void adjustPercent(double prob, vbucket_state_t state) {
         if (state == vbucket_state_replica ||
@@ -166,6 +264,7 @@ private:
     }
 
     std::list<std::pair<uint16_t, std::string> > expired;
+    std::list<std::pair<uint16_t, std::string> > evicted;
 
     EventuallyPersistentStore &store;
     EPStats                   &stats;
@@ -173,12 +272,16 @@ private:
     double                     percent;
     double                     activeBias;
     size_t                     ejected;
+    size_t                     compressed;
     size_t                     totalEjected;
     size_t                     totalEjectionAttempts;
+    size_t                     reportedAttempts;
     time_t                     startTime;
-    bool                      *stateFinalizer;
+    shared_ptr<PagingResults>  results;
     bool                       canPause;
     bool                       useNru;
+    bool                       compressValues;
+    size_t                     compressMinSize;
 };
 
 bool ItemPager::checkAccessScannerTask() {
@@ -225,11 +328,20 @@ bool ItemPager::callback(Dispatcher &d, TaskId t) {
         }
 
         available = false;
-        shared_ptr<PagingVisitor> pv(new PagingVisitor(store, stats, toKill,
-                                                       &available, false, bias, nru));
+        size_t workers = store.getNumVisitorWorkers();
+        shared_ptr<PagingResults> results(new PagingResults(workers, &available));
+        std::vector<shared_ptr<VBucketVisitor> > visitors;
+        for (size_t i = 0; i < workers; ++i) {
+            PagingVisitor *pv = new PagingVisitor(store, stats, toKill, results,
+                                                  false, bias, nru);
+            pv->configPaging(PagingConfig::phaseConfig[phase]);
+            pv->configCompression(cfg.isCompressColdValues(),
+                                  cfg.getCompressMinSize());
+            visitors.push_back(shared_ptr<VBucketVisitor>(pv));
+        }
         std::srand(ep_real_time());
-        pv->configPaging(PagingConfig::phaseConfig[phase]);
-        store.visit(pv, "Item pager", &d, Priority::ItemPagerPriority);
+        store.visit(visitors, "Item pager", &d, Priority::ItemPagerPriority, true, 0,
+                    &store.getItemPagerCursor());
 
         phase = phase + 1;
         if (stats.getTotalMemoryUsed() <= stats.mem_low_wat ||
@@ -239,8 +351,14 @@ bool ItemPager::callback(Dispatcher &d, TaskId t) {
             sleepTime = 5;
         }
 
-        double total_eject_attms = static_cast<double>(pv->getTotalEjectionAttempts());
-        double total_ejected = static_cast<double>(pv->getTotalEjected());
+        // This run has only just been scheduled, judge by the last one.
+        double total_eject_attms = 0;
+        double total_ejected = 0;
+        if (lastRun) {
+            total_eject_attms = static_cast<double>(lastRun->totalEjectionAttempts.get());
+            total_ejected = static_cast<double>(lastRun->totalEjected.get());
+        }
+        lastRun = results;
         double ejection_ratio =
             total_eject_attms > 0 ? total_ejected / total_eject_attms : 0;
 
@@ -270,10 +388,15 @@ bool ExpiredItemPager::callback(Dispatcher &d, TaskId t) {
         ++stats.expiryPagerRuns;
 
         available = false;
-        shared_ptr<PagingVisitor> pv(new PagingVisitor(store, stats,
-                                                       -1, &available, true));
-        store.visit(pv, "Expired item remover", &d, Priority::ItemPagerPriority,
-                    true, 10);
+        size_t workers = store.getNumVisitorWorkers();
+        shared_ptr<PagingResults> results(new PagingResults(workers, &available));
+        std::vector<shared_ptr<VBucketVisitor> > visitors;
+        for (size_t i = 0; i < workers; ++i) {
+            visitors.push_back(shared_ptr<VBucketVisitor>(
+                new PagingVisitor(store, stats, -1, results, true)));
+        }
+        store.visit(visitors, "Expired item remover", &d, Priority::ItemPagerPriority,
+                    true, 10, &store.getExpiryPagerCursor());
     }
     d.snooze(t, sleepTime);
     return true;
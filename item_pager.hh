@@ -6,6 +6,7 @@
 #include <vector>
 #include <list>
 
+#include "atomic.hh"
 #include "common.hh"
 #include "dispatcher.hh"
 #include "stats.hh"
@@ -14,6 +15,7 @@ typedef std::pair<int64_t, int64_t> row_range_t;
 
 // Forward declaration.
 class EventuallyPersistentStore;
+class PagingResults;
 
 /**
  * ItemPager visits replica vbuckets and active vbuckets in one phases.
@@ -55,8 +57,9 @@ private:
 
     EventuallyPersistentStore &store;
     EPStats                   &stats;
-    bool                       available;
+    Atomic<bool>               available;
     short int                  phase;
+    shared_ptr<PagingResults>  lastRun;
 };
 
 /**
@@ -86,7 +89,7 @@ private:
     EventuallyPersistentStore &store;
     EPStats                   &stats;
     double                     sleepTime;
-    bool                       available;
+    Atomic<bool>               available;
 };
 
 #endif /* ITEM_PAGER_HH */
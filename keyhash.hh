@@ -0,0 +1,127 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef KEYHASH_HH
+#define KEYHASH_HH 1
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * A 64-bit key hash in the style of wyhash.
+ *
+ * Keys are consumed eight bytes at a time and folded in with a 64x64
+ * -> 128 bit multiply, so even keys sharing a long common prefix (as
+ * in "user::000123") spread over all of the output bits.  The result
+ * only ever lives in memory, so it doesn't need to be stable across
+ * platforms or releases.
+ */
+namespace keyhash {
+
+    inline uint64_t constant(uint32_t hi, uint32_t lo) {
+        return (static_cast<uint64_t>(hi) << 32) | lo;
+    }
+
+    /**
+     * Multiply a and b, leaving the low half of the product in a and
+     * the high half in b.
+     */
+    inline void mum(uint64_t *a, uint64_t *b) {
+#if defined(__GNUC__) && defined(__SIZEOF_INT128__)
+        __uint128_t r = *a;
+        r *= *b;
+        *a = static_cast<uint64_t>(r);
+        *b = static_cast<uint64_t>(r >> 64);
+#else
+        uint64_t ha = *a >> 32, hb = *b >> 32;
+        uint64_t la = static_cast<uint32_t>(*a), lb = static_cast<uint32_t>(*b);
+        uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+        uint64_t t = rl + (rm0 << 32);
+        uint64_t c = t < rl;
+        uint64_t lo = t + (rm1 << 32);
+        c += lo < t;
+        uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+        *a = lo;
+        *b = hi;
+#endif
+    }
+
+    inline uint64_t mix(uint64_t a, uint64_t b) {
+        mum(&a, &b);
+        return a ^ b;
+    }
+
+    inline uint64_t read8(const uint8_t *p) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    inline uint64_t read4(const uint8_t *p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    inline uint64_t read3(const uint8_t *p, size_t k) {
+        return (static_cast<uint64_t>(p[0]) << 16)
+            | (static_cast<uint64_t>(p[k >> 1]) << 8) | p[k - 1];
+    }
+}
+
+/**
+ * Compute the 64-bit hash of a key.
+ *
+ * @param key the start of the key
+ * @param len the length of the key
+ * @return the hash value
+ */
+inline uint64_t hash64(const char *key, size_t len) {
+    using namespace keyhash;
+    const uint64_t s0 = constant(0x2d358dcc, 0xaa6c78a5);
+    const uint64_t s1 = constant(0x8bb84b93, 0x962eacc9);
+    const uint64_t s2 = constant(0x4b33a62e, 0xd433d4a3);
+    const uint64_t s3 = constant(0x4d5a2da5, 0x1de1aa47);
+
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(key);
+    uint64_t seed = mix(s0, s1);
+    uint64_t a, b;
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t off = (len >> 3) << 2;
+            a = (read4(p) << 32) | read4(p + off);
+            b = (read4(p + len - 4) << 32) | read4(p + len - 4 - off);
+        } else if (len > 0) {
+            a = read3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = mix(read8(p) ^ s1, read8(p + 8) ^ seed);
+                see1 = mix(read8(p + 16) ^ s2, read8(p + 24) ^ see1);
+                see2 = mix(read8(p + 32) ^ s3, read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = mix(read8(p) ^ s1, read8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = read8(p + i - 16);
+        b = read8(p + i - 8);
+    }
+    a ^= s1;
+    b ^= seed;
+    mum(&a, &b);
+    return mix(a ^ s0 ^ len, b ^ s1);
+}
+
+#endif /* KEYHASH_HH */
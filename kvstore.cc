@@ -41,6 +41,11 @@ KVStore *KVStoreFactory::create(EventuallyPersistentEngine &theEngine,
     return ret;
 }
 
+KVStore *KVStore::newWriter() {
+    assert(engine);
+    return KVStoreFactory::create(*engine, false);
+}
+
 struct WarmupCookie {
     WarmupCookie(KVStore *s, Callback<GetValue>&c) :
         store(s), cb(c), engine(s->getEngine()), loaded(0), skipped(0), error(0)
@@ -165,6 +165,22 @@ public:
      */
     virtual StorageProperties getStorageProperties() = 0;
 
+    /**
+     * Create another read-write connection to the same storage for a
+     * flusher of its own.  Only called if the storage properties allow
+     * more than one writer.
+     */
+    virtual KVStore *newWriter();
+
+    /**
+     * Tell the storage how many writers the flushers split the vbuckets
+     * between (by vbucket id modulo the count), before any of them
+     * writes anything.
+     */
+    virtual void setNumWriters(size_t n) {
+        (void)n;
+    }
+
     /**
      * Set an item into the kv store.
      */
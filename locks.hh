@@ -6,6 +6,7 @@
 #include <iostream>
 #include <sstream>
 #include <functional>
+#include <vector>
 
 #include "common.hh"
 #include "mutex.hh"
@@ -17,12 +18,13 @@
  * It is a very bad idea to unlock a lock held by a LockHolder without
  * using the LockHolder::unlock method.
  */
-class LockHolder {
+template <typename M>
+class GenericLockHolder {
 public:
     /**
      * Acquire the lock in the given mutex.
      */
-    LockHolder(Mutex &m) : mutex(m), locked(false) {
+    GenericLockHolder(M &m) : mutex(m), locked(false) {
         lock();
     }
 
@@ -30,14 +32,14 @@ public:
      * Copy constructor hands this lock to the new copy and then
      * consider it released locally (i.e. renders unlock() a noop).
      */
-    LockHolder(const LockHolder& from) : mutex(from.mutex), locked(true) {
-        const_cast<LockHolder*>(&from)->locked = false;
+    GenericLockHolder(const GenericLockHolder& from) : mutex(from.mutex), locked(true) {
+        const_cast<GenericLockHolder*>(&from)->locked = false;
     }
 
     /**
      * Release the lock.
      */
-    ~LockHolder() {
+    ~GenericLockHolder() {
         unlock();
     }
 
@@ -60,16 +62,22 @@ public:
     }
 
 private:
-    Mutex &mutex;
+    M &mutex;
     bool locked;
 
-    void operator=(const LockHolder&);
+    void operator=(const GenericLockHolder&);
 };
 
+typedef GenericLockHolder<Mutex> LockHolder;
+typedef GenericLockHolder<VersionedMutex> VersionedLockHolder;
+
 /**
  * RAII lock holder over multiple locks.
+ *
+ * All of the locks are held or none are.
  */
-class MultiLockHolder {
+template <typename M>
+class GenericMultiLockHolder {
 public:
 
     /**
@@ -78,47 +86,64 @@ public:
      * @param m beginning of an array of locks
      * @param n the number of locks to lock
      */
-    MultiLockHolder(Mutex *m, size_t n) : mutexes(m),
-                                          locked(new bool[n]),
-                                          n_locks(n) {
-        std::fill_n(locked, n_locks, false);
+    GenericMultiLockHolder(M *m, size_t n) : mutexes(m), which(NULL), locked(false),
+                                             n_locks(n) {
         lock();
     }
 
-    ~MultiLockHolder() {
+    /**
+     * Acquire some of a series of locks, in order.
+     *
+     * @param m beginning of an array of locks
+     * @param w which of the locks to lock, kept for as long as the holder
+     */
+    GenericMultiLockHolder(M *m, const std::vector<bool> &w) : mutexes(m), which(&w),
+                                                               locked(false),
+                                                               n_locks(w.size()) {
+        lock();
+    }
+
+    ~GenericMultiLockHolder() {
         unlock();
-        delete[] locked;
     }
 
     /**
      * Relock the series after having manually unlocked it.
      */
     void lock() {
+        assert(!locked);
         for (size_t i = 0; i < n_locks; i++) {
-            assert(!locked[i]);
-            mutexes[i].acquire();
-            locked[i] = true;
+            if (!which || (*which)[i]) {
+                mutexes[i].acquire();
+            }
         }
+        locked = true;
     }
 
     /**
      * Manually unlock the series.
      */
     void unlock() {
-        for (size_t i = 0; i < n_locks; i++) {
-            if (locked[i]) {
-                locked[i] = false;
-                mutexes[i].release();
+        if (locked) {
+            locked = false;
+            for (size_t i = 0; i < n_locks; i++) {
+                if (!which || (*which)[i]) {
+                    mutexes[i].release();
+                }
             }
         }
     }
 
 private:
-    Mutex  *mutexes;
-    bool   *locked;
-    size_t  n_locks;
+    M                       *mutexes;
+    const std::vector<bool> *which;
+    bool                     locked;
+    size_t                   n_locks;
 
-    DISALLOW_COPY_AND_ASSIGN(MultiLockHolder);
+    DISALLOW_COPY_AND_ASSIGN(GenericMultiLockHolder);
 };
 
+typedef GenericMultiLockHolder<Mutex> MultiLockHolder;
+typedef GenericMultiLockHolder<VersionedMutex> MultiVersionedLockHolder;
+
 #endif /* LOCKS_H */
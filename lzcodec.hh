@@ -0,0 +1,182 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LZCODEC_HH
+#define LZCODEC_HH 1
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * A small LZ77 codec using the LZF stream format.
+ *
+ * The stream is a sequence of runs, each starting with a control byte:
+ *
+ *  - 000nnnnn: a literal run of n + 1 bytes follows.
+ *  - lllooooo oooooooo: copy l + 2 bytes starting o + 1 bytes back.
+ *  - 111ooooo LLLLLLLL oooooooo: as above, copying L + 9 bytes.
+ *
+ * It only looks for matches through a small hash table of recent
+ * positions, so it's fast rather than tight.  That's the right trade
+ * for values that get compressed in the background and decompressed
+ * on the front end path.
+ */
+namespace lzcodec {
+
+    static const size_t HASH_LOG = 12;
+    static const size_t MIN_MATCH = 3;
+    static const size_t MAX_LITERAL = 32;
+    static const size_t MAX_OFFSET = 8192;
+    static const size_t MAX_MATCH = 7 + 255 + 2;
+
+    inline uint32_t hash3(const uint8_t *p) {
+        uint32_t v = (static_cast<uint32_t>(p[0]) << 16)
+            | (static_cast<uint32_t>(p[1]) << 8) | p[2];
+        return (v * 2654435761U) >> (32 - HASH_LOG);
+    }
+
+    /**
+     * Write out the literals in [start, end).
+     *
+     * @return the new output position, or NULL if they don't fit
+     */
+    inline uint8_t *literals(const uint8_t *start, const uint8_t *end,
+                             uint8_t *op, const uint8_t *oend) {
+        while (start < end) {
+            size_t n = end - start;
+            if (n > MAX_LITERAL) {
+                n = MAX_LITERAL;
+            }
+            if (static_cast<size_t>(oend - op) < n + 1) {
+                return NULL;
+            }
+            *op++ = static_cast<uint8_t>(n - 1);
+            memcpy(op, start, n);
+            op += n;
+            start += n;
+        }
+        return op;
+    }
+}
+
+/**
+ * Compress a buffer.
+ *
+ * @param in the data to compress
+ * @param len the length of the data
+ * @param out where to put the compressed data
+ * @param cap the space available at out
+ * @return the compressed length, or 0 if it didn't fit in cap
+ */
+inline size_t lzCompress(const char *in, size_t len, char *out, size_t cap) {
+    using namespace lzcodec;
+    const uint8_t *ip = reinterpret_cast<const uint8_t*>(in);
+    const uint8_t *base = ip;
+    const uint8_t *end = ip + len;
+    const uint8_t *lit = ip;
+    uint8_t *op = reinterpret_cast<uint8_t*>(out);
+    const uint8_t *oend = op + cap;
+    uint32_t table[1 << HASH_LOG];
+    memset(table, 0, sizeof(table));
+
+    while (static_cast<size_t>(end - ip) >= MIN_MATCH) {
+        uint32_t h = hash3(ip);
+        const uint8_t *ref = table[h] ? base + table[h] - 1 : NULL;
+        table[h] = static_cast<uint32_t>(ip - base) + 1;
+        if (ref == NULL || static_cast<size_t>(ip - ref) > MAX_OFFSET
+            || memcmp(ref, ip, MIN_MATCH) != 0) {
+            ++ip;
+            continue;
+        }
+
+        size_t maxlen = end - ip;
+        if (maxlen > MAX_MATCH) {
+            maxlen = MAX_MATCH;
+        }
+        size_t mlen = MIN_MATCH;
+        while (mlen < maxlen && ref[mlen] == ip[mlen]) {
+            ++mlen;
+        }
+
+        op = literals(lit, ip, op, oend);
+        if (op == NULL || oend - op < 3) {
+            return 0;
+        }
+        size_t l = mlen - 2;
+        size_t off = ip - ref - 1;
+        if (l < 7) {
+            *op++ = static_cast<uint8_t>((l << 5) | (off >> 8));
+        } else {
+            *op++ = static_cast<uint8_t>((7 << 5) | (off >> 8));
+            *op++ = static_cast<uint8_t>(l - 7);
+        }
+        *op++ = static_cast<uint8_t>(off & 0xff);
+        ip += mlen;
+        lit = ip;
+    }
+
+    op = literals(lit, end, op, oend);
+    if (op == NULL) {
+        return 0;
+    }
+    return op - reinterpret_cast<uint8_t*>(out);
+}
+
+/**
+ * Decompress a buffer produced by lzCompress.
+ *
+ * @param in the compressed data
+ * @param len the length of the compressed data
+ * @param out where to put the original data
+ * @param rawLen the length of the original data
+ * @return false if the input is corrupt or doesn't decompress to
+ *         exactly rawLen bytes
+ */
+inline bool lzDecompress(const char *in, size_t len, char *out, size_t rawLen) {
+    const uint8_t *ip = reinterpret_cast<const uint8_t*>(in);
+    const uint8_t *end = ip + len;
+    uint8_t *op = reinterpret_cast<uint8_t*>(out);
+    uint8_t *ostart = op;
+    uint8_t *oend = op + rawLen;
+
+    while (ip < end) {
+        size_t ctrl = *ip++;
+        if (ctrl < 32) {
+            size_t n = ctrl + 1;
+            if (static_cast<size_t>(end - ip) < n
+                || static_cast<size_t>(oend - op) < n) {
+                return false;
+            }
+            memcpy(op, ip, n);
+            op += n;
+            ip += n;
+            continue;
+        }
+
+        size_t l = ctrl >> 5;
+        if (l == 7) {
+            if (ip == end) {
+                return false;
+            }
+            l += *ip++;
+        }
+        if (ip == end) {
+            return false;
+        }
+        size_t off = ((ctrl & 0x1f) << 8) + *ip++ + 1;
+        size_t n = l + 2;
+        if (static_cast<size_t>(op - ostart) < off
+            || static_cast<size_t>(oend - op) < n) {
+            return false;
+        }
+        // The source may overlap what's being written, copy bytewise.
+        const uint8_t *ref = op - off;
+        for (size_t i = 0; i < n; ++i) {
+            op[i] = ref[i];
+        }
+        op += n;
+    }
+    return op == oend;
+}
+
+#endif /* LZCODEC_HH */
@@ -16,6 +16,7 @@
  */
 #include "config.h"
 #include "mutex.hh"
+#include "atomic.hh"
 
 Mutex::Mutex() : held(false)
 {
@@ -90,3 +91,12 @@ void Mutex::release() {
     EP_MUTEX_RELEASED(this);
 }
 
+void VersionedMutex::acquire() {
+    mutex.acquire();
+    ep_sync_add_and_fetch(&version, 1);
+}
+
+void VersionedMutex::release() {
+    ep_sync_add_and_fetch(&version, 1);
+    mutex.release();
+}
@@ -33,8 +33,9 @@ public:
 protected:
 
     // The holders of locks twiddle these flags.
-    friend class LockHolder;
-    friend class MultiLockHolder;
+    template <typename M> friend class GenericLockHolder;
+    template <typename M> friend class GenericMultiLockHolder;
+    friend class VersionedMutex;
 
     void acquire();
     void release();
@@ -51,4 +52,45 @@ protected:
     DISALLOW_COPY_AND_ASSIGN(Mutex);
 };
 
+/**
+ * A mutex whose version is bumped every time it's acquired or released.
+ *
+ * The version is odd while the lock is held, so a reader that doesn't
+ * take the lock can tell whether anything it guards changed while it
+ * was looking (i.e. use it as a seqlock).
+ */
+class VersionedMutex {
+public:
+    VersionedMutex() : version(0) {}
+
+    /**
+     * Get the current version of this lock.
+     */
+    uint32_t getVersion() const {
+        return version;
+    }
+
+    /**
+     * True if I own this lock.
+     *
+     * Use this only for assertions.
+     */
+    bool ownsLock() {
+        return mutex.ownsLock();
+    }
+
+private:
+
+    template <typename M> friend class GenericLockHolder;
+    template <typename M> friend class GenericMultiLockHolder;
+
+    void acquire();
+    void release();
+
+    Mutex mutex;
+    volatile uint32_t version;
+
+    DISALLOW_COPY_AND_ASSIGN(VersionedMutex);
+};
+
 #endif
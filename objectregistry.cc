@@ -19,6 +19,9 @@
 
 static ThreadLocal<EventuallyPersistentEngine*> *th;
 static ThreadLocal<Atomic<size_t>*> *initial_track;
+// Queued item pool of the threads that don't run on behalf of an engine,
+// like the ones of the unit tests.
+static QueuedItemPool *defaultQueuedItemPool;
 
 /**
  * Object registry link hook for getting the registry thread local
@@ -30,6 +33,7 @@ public:
       if (th == NULL) {
          th = new ThreadLocal<EventuallyPersistentEngine*>();
          initial_track = new ThreadLocal<Atomic<size_t>*>();
+         defaultQueuedItemPool = new QueuedItemPool();
       }
    }
 } install;
@@ -54,7 +58,10 @@ void ObjectRegistry::onCreateBlob(Blob *blob)
        EPStats &stats = engine->getEpStats();
        stats.currentSize.incr(blob->getSize());
        stats.totalValueSize.incr(blob->getSize());
-       assert(stats.currentSize.get() < GIGANTOR);
+       if (blob->isCompressed()) {
+           stats.compressedValueSize.incr(blob->getSize());
+           stats.compressedValueRawSize.incr(blob->rawLength());
+       }
    }
 }
 
@@ -65,7 +72,10 @@ void ObjectRegistry::onDeleteBlob(Blob *blob)
        EPStats &stats = engine->getEpStats();
        stats.currentSize.decr(blob->getSize());
        stats.totalValueSize.decr(blob->getSize());
-       assert(stats.currentSize.get() < GIGANTOR);
+       if (blob->isCompressed()) {
+           stats.compressedValueSize.decr(blob->getSize());
+           stats.compressedValueRawSize.decr(blob->rawLength());
+       }
    }
 }
 
@@ -75,7 +85,6 @@ void ObjectRegistry::onCreateQueuedItem(QueuedItem *qi)
    if (verifyEngine(engine)) {
        EPStats &stats = engine->getEpStats();
        stats.memOverhead.incr(qi->size());
-       assert(stats.memOverhead.get() < GIGANTOR);
    }
 }
 
@@ -85,17 +94,24 @@ void ObjectRegistry::onDeleteQueuedItem(QueuedItem *qi)
    if (verifyEngine(engine)) {
        EPStats &stats = engine->getEpStats();
        stats.memOverhead.decr(qi->size());
-       assert(stats.memOverhead.get() < GIGANTOR);
    }
 }
 
+QueuedItemPool &ObjectRegistry::getQueuedItemPool()
+{
+   EventuallyPersistentEngine *engine = th->get();
+   if (engine) {
+       return engine->getQueuedItemPool();
+   }
+   return *defaultQueuedItemPool;
+}
+
 void ObjectRegistry::onCreateItem(Item *pItem)
 {
    EventuallyPersistentEngine *engine = th->get();
    if (verifyEngine(engine)) {
        EPStats &stats = engine->getEpStats();
        stats.memOverhead.incr(pItem->size() - pItem->getValMemSize());
-       assert(stats.memOverhead.get() < GIGANTOR);
    }
 }
 
@@ -105,7 +121,6 @@ void ObjectRegistry::onDeleteItem(Item *pItem)
    if (verifyEngine(engine)) {
        EPStats &stats = engine->getEpStats();
        stats.memOverhead.decr(pItem->size() - pItem->getValMemSize());
-       assert(stats.memOverhead.get() < GIGANTOR);
    }
 }
 
@@ -20,6 +20,7 @@
 class EventuallyPersistentEngine;
 class Blob;
 class QueuedItem;
+class QueuedItemPool;
 
 class ObjectRegistry {
 public:
@@ -29,6 +30,8 @@ public:
     static void onCreateQueuedItem(QueuedItem *qi);
     static void onDeleteQueuedItem(QueuedItem *qi);
 
+    static QueuedItemPool &getQueuedItemPool();
+
     static void onCreateItem(Item *pItem);
     static void onDeleteItem(Item *pItem);
 
@@ -25,6 +25,8 @@ const Priority Priority::VKeyStatBgFetcherPriority("vkey_stat_bg_fetcher_priorit
 
 // Priorities for TAP dispatcher
 const Priority Priority::TapBgFetcherPriority("tap_bg_fetcher_priority", 1);
+const Priority Priority::SpilledChunkLoaderPriority("spilled_chunk_loader_priority", 1);
+const Priority Priority::CheckpointSpillerPriority("checkpoint_spiller_priority", 6);
 
 // Priorities for Read-Write dispatcher
 const Priority Priority::VBucketPersistHighPriority("vbucket_persist_high_priority", 1);
@@ -40,7 +42,9 @@ const Priority Priority::AccessScannerPriority("access_scanner_priority", 3);
 const Priority Priority::CheckpointRemoverPriority("checkpoint_remover_priority", 6);
 const Priority Priority::TapConnectionReaperPriority("tapconnection_reaper_priority", 6);
 const Priority Priority::VBMemoryDeletionPriority("vb_memory_deletion_priority", 6);
+const Priority Priority::DurabilityTimeoutPriority("durability_timeout_priority", 6);
 const Priority Priority::ItemPagerPriority("item_pager_priority", 7);
 const Priority Priority::BackfillTaskPriority("backfill_task_priority", 8);
 const Priority Priority::HTResizePriority("hashtable_resize_priority", 211);
+const Priority Priority::DefragmenterPriority("defragmenter_priority", 212);
 const Priority Priority::TapResumePriority("tap_resume_priority", 316);
@@ -15,6 +15,8 @@ public:
     static const Priority BgFetcherPriority;
     static const Priority BgFetcherGetMetaPriority;
     static const Priority TapBgFetcherPriority;
+    static const Priority SpilledChunkLoaderPriority;
+    static const Priority CheckpointSpillerPriority;
     static const Priority VKeyStatBgFetcherPriority;
     static const Priority WarmupPriority;
 
@@ -36,6 +38,8 @@ public:
     static const Priority TapResumePriority;
     static const Priority TapConnectionReaperPriority;
     static const Priority HTResizePriority;
+    static const Priority DefragmenterPriority;
+    static const Priority DurabilityTimeoutPriority;
 
     bool operator==(const Priority &other) const {
         return other.getPriorityValue() == this->priority;
@@ -2,8 +2,13 @@
 #ifndef QUEUEDITEM_HH
 #define QUEUEDITEM_HH 1
 
+#include <algorithm>
+#include <cstring>
+#include <new>
+
 #include "common.hh"
 #include "item.hh"
+#include "keyhash.hh"
 #include "stats.hh"
 
 enum queue_operation {
@@ -24,25 +29,150 @@ typedef enum {
     vbucket_del_invalid
 } vbucket_del_result;
 
+// Queued item blocks are rounded up to this many bytes, which is also
+// the step between the pool's size classes.
+#define QUEUED_ITEM_BLOCK_ALIGN 16
+// Blocks larger than this are never pooled.
+#define QUEUED_ITEM_POOL_MAX_BLOCK 512
+// Bytes of free blocks a size class of the pool holds on to at most.
+#define QUEUED_ITEM_POOL_CLASS_BYTES (256 * 1024)
+
+/**
+ * Free lists of the memory blocks queued items are made of, one per size
+ * class, so that the item of a new mutation can reuse the block of one
+ * that was persisted instead of going through the allocator.
+ *
+ * Each engine has a pool of its own, so that a block stays accounted to
+ * the engine that allocated it.  A block goes back to the pool it came
+ * from, even when another engine's thread frees it.
+ */
+class QueuedItemPool {
+public:
+    QueuedItemPool() {
+        for (size_t i = 0; i < NUM_CLASSES; ++i) {
+            classes[i].head = NULL;
+            classes[i].count = 0;
+        }
+    }
+
+    ~QueuedItemPool() {
+        for (size_t i = 0; i < NUM_CLASSES; ++i) {
+            while (classes[i].head) {
+                free_block *b = classes[i].head;
+                classes[i].head = b->next;
+                ::operator delete(b);
+            }
+        }
+    }
+
+    /**
+     * Get a block of the given size, which is a multiple of
+     * QUEUED_ITEM_BLOCK_ALIGN.
+     */
+    void *allocate(size_t size) {
+        if (size <= QUEUED_ITEM_POOL_MAX_BLOCK) {
+            size_class &c = classes[classOf(size)];
+            SpinLockHolder lh(&c.lock);
+            if (c.head) {
+                free_block *b = c.head;
+                c.head = b->next;
+                --c.count;
+                lh.unlock();
+                numBytes.decr(size);
+                return b;
+            }
+        }
+        return ::operator new(size);
+    }
+
+    /**
+     * Give back a block returned by allocate() for the same size.
+     */
+    void release(void *block, size_t size) {
+        if (size <= QUEUED_ITEM_POOL_MAX_BLOCK) {
+            size_class &c = classes[classOf(size)];
+            SpinLockHolder lh(&c.lock);
+            if (c.count * size < QUEUED_ITEM_POOL_CLASS_BYTES) {
+                free_block *b = static_cast<free_block*>(block);
+                b->next = c.head;
+                c.head = b;
+                ++c.count;
+                lh.unlock();
+                numBytes.incr(size);
+                return;
+            }
+        }
+        ::operator delete(block);
+    }
+
+    /**
+     * Get the number of bytes held in free blocks.
+     */
+    size_t getNumBytes() const {
+        return numBytes.get();
+    }
+
+private:
+    static const size_t NUM_CLASSES = QUEUED_ITEM_POOL_MAX_BLOCK / QUEUED_ITEM_BLOCK_ALIGN;
+
+    static size_t classOf(size_t size) {
+        return size / QUEUED_ITEM_BLOCK_ALIGN - 1;
+    }
+
+    struct free_block {
+        free_block *next;
+    };
+
+    struct size_class {
+        SpinLock    lock;
+        free_block *head;
+        size_t      count;
+    };
+
+    size_class     classes[NUM_CLASSES];
+    Atomic<size_t> numBytes;
+
+    DISALLOW_COPY_AND_ASSIGN(QueuedItemPool);
+};
+
 /**
  * Representation of an item queued for persistence or tap.
+ *
+ * The key is kept right behind the item in the same block, and the
+ * blocks come from the engine's QueuedItemPool, so use New() to create
+ * one.
  */
 class QueuedItem : public RCValue {
 public:
-    QueuedItem(const std::string &k, const uint16_t vb,
-               enum queue_operation o, const int64_t rid = -1,
-               const uint64_t seqno = 1)
-        : key(k), rowId(rid), seqNum(seqno), queued(ep_current_time()),
-          op(static_cast<uint16_t>(o)), vbucket(vb)
-    {
-        ObjectRegistry::onCreateQueuedItem(this);
+    /**
+     * @param h the hash64() of the key if the caller already has it,
+     *          0 to have it computed here
+     */
+    static QueuedItem *New(const std::string &k, const uint16_t vb,
+                           enum queue_operation o, const int64_t rid = -1,
+                           const uint64_t seqno = 1, const uint64_t h = 0) {
+        size_t size = blockSize(k.size());
+        QueuedItemPool &pool = ObjectRegistry::getQueuedItemPool();
+        char *block = static_cast<char*>(pool.allocate(size));
+        *reinterpret_cast<size_t*>(block) = size;
+        *reinterpret_cast<QueuedItemPool**>(block + sizeof(uint64_t)) = &pool;
+        return new (block + BLOCK_HEADER_SIZE) QueuedItem(k, vb, o, rid, seqno, h);
+    }
+
+    static void operator delete(void *p) {
+        char *block = static_cast<char*>(p) - BLOCK_HEADER_SIZE;
+        QueuedItemPool *pool = *reinterpret_cast<QueuedItemPool**>(block + sizeof(uint64_t));
+        pool->release(block, *reinterpret_cast<size_t*>(block));
     }
 
     ~QueuedItem() {
         ObjectRegistry::onDeleteQueuedItem(this);
     }
 
-    const std::string &getKey(void) const { return key; }
+    std::string getKey(void) const { return std::string(keybytes, keylen); }
+    const char *getKeyBytes(void) const { return keybytes; }
+    size_t getKeyLen(void) const { return keylen; }
+    uint64_t getKeyHash(void) const { return keyHash; }
     uint16_t getVBucketId(void) const { return vbucket; }
     uint32_t getQueuedTime(void) const { return queued; }
     enum queue_operation getOperation(void) const {
@@ -51,6 +181,25 @@ public:
     int64_t getRowId() const { return rowId; }
     uint64_t getSeqno() const { return seqNum; }
 
+    /**
+     * True if this item is for the given key.
+     */
+    bool hasKey(const char *k, size_t n) const {
+        return n == keylen && std::memcmp(k, keybytes, n) == 0;
+    }
+
+    bool hasKey(const std::string &k) const {
+        return hasKey(k.data(), k.size());
+    }
+
+    /**
+     * Compare the keys of two items the way std::string does.
+     */
+    int compareKey(const QueuedItem &other) const {
+        int rv = std::memcmp(keybytes, other.keybytes, std::min(keylen, other.keylen));
+        return rv != 0 ? rv : static_cast<int>(keylen) - static_cast<int>(other.keylen);
+    }
+
     void setQueuedTime(uint32_t queued_time) {
         queued = queued_time;
     }
@@ -61,20 +210,47 @@ public:
 
     bool operator <(const QueuedItem &other) const {
         return getVBucketId() == other.getVBucketId() ?
-            getKey() < other.getKey() : getVBucketId() < other.getVBucketId();
+            compareKey(other) < 0 : getVBucketId() < other.getVBucketId();
     }
 
+    /**
+     * Get the size of the block this item takes.
+     */
     size_t size() {
-        return sizeof(QueuedItem) + getKey().size();
+        return blockSize(keylen);
     }
 
 private:
-    std::string key;
+    // The block starts with its size and the pool it came from, which lets
+    // operator delete give it back to the right size class of that pool
+    // whichever thread drops the last reference.
+    static const size_t BLOCK_HEADER_SIZE = 2 * sizeof(uint64_t);
+
+    static size_t blockSize(size_t nkey) {
+        size_t size = BLOCK_HEADER_SIZE + sizeof(QueuedItem) + nkey;
+        return (size + QUEUED_ITEM_BLOCK_ALIGN - 1) & ~(QUEUED_ITEM_BLOCK_ALIGN - 1);
+    }
+
+    QueuedItem(const std::string &k, const uint16_t vb,
+               enum queue_operation o, const int64_t rid,
+               const uint64_t seqno, const uint64_t h)
+        : keyHash(h ? h : hash64(k.data(), k.size())), rowId(rid),
+          seqNum(seqno), queued(ep_current_time()),
+          op(static_cast<uint16_t>(o)), vbucket(vb),
+          keylen(static_cast<uint16_t>(k.size()))
+    {
+        std::memcpy(keybytes, k.data(), k.size());
+        ObjectRegistry::onCreateQueuedItem(this);
+    }
+
+    uint64_t keyHash;
     int64_t  rowId;
     uint64_t seqNum;
     uint32_t queued;
     uint16_t op;
     uint16_t vbucket;
+    uint16_t keylen;
+    char     keybytes[1];
 
     DISALLOW_COPY_AND_ASSIGN(QueuedItem);
 };
@@ -88,7 +264,7 @@ class CompareQueuedItemsByKey {
 public:
     CompareQueuedItemsByKey() {}
     bool operator()(const queued_item &i1, const queued_item &i2) {
-        return i1->getKey() < i2->getKey();
+        return i1->compareKey(*i2) < 0;
     }
 };
 
@@ -124,7 +300,7 @@ public:
     CompareQueuedItemsByVBAndKey() {}
     bool operator()(const queued_item &i1, const queued_item &i2) {
         return i1->getVBucketId() == i2->getVBucketId()
-            ? i1->getKey() < i2->getKey()
+            ? i1->compareKey(*i2) < 0
             : i1->getVBucketId() < i2->getVBucketId();
     }
 };
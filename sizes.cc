@@ -72,7 +72,10 @@ int main(int, char **) {
     display("... Bodies Union", sizeof(union stored_value_bodies));
 
     display("Stored Value Factory", sizeof(StoredValueFactory));
+    display("Stored Value Pool", sizeof(StoredValuePool));
     display("Blob", sizeof(Blob));
+    display("... Inline value max", HashTable::getDefaultInlineValueSize());
+    display("... Saved per inline value", sizeof(Blob));
     display("value_t", sizeof(value_t));
     display("HashTable", sizeof(HashTable));
     display("Item", sizeof(Item));
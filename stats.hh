@@ -50,6 +50,17 @@ public:
         return currentSize.get() + memOverhead.get();
     }
 
+    /**
+     * Like getTotalMemoryUsed(), but only sums the sharded counters now
+     * and then, for checks made on every mutation.
+     */
+    size_t getApproxMemoryUsed() {
+        if (memoryTrackerEnabled.get()) {
+            return totalMemory.get();
+        }
+        return currentSize.getApprox() + memOverhead.getApprox();
+    }
+
     //! Whether we're warming up.
     Atomic<bool> warmupComplete;
     //! Number of keys warmed up during key-only loading. 
@@ -139,10 +150,36 @@ public:
     Atomic<size_t> checkpointRemoverRuns;
     //! Number of items removed from closed unreferenced checkpoints.
     Atomic<size_t> itemsRemovedFromCheckpoints;
+    //! Bytes of closed checkpoints currently spilled to disk.
+    Atomic<size_t> chkSpilledBytes;
+    //! Number of checkpoint items written to spill files.
+    Atomic<size_t> chkSpilledItems;
+    //! Number of spilled checkpoint chunks read back for cursors.
+    Atomic<size_t> chkSpillReads;
+    //! Number of spilled checkpoint chunks that couldn't be read back.
+    Atomic<size_t> chkSpillReadErrors;
+    //! Number of items staged by writers that found a checkpoint busy.
+    Atomic<size_t> chkStagedItems;
     //! Number of times a value is ejected
     Atomic<size_t> numValueEjects;
     //! Number of times a value could not be ejected
     Atomic<size_t> numFailedEjects;
+    //! Number of times a whole item was ejected under full eviction
+    Atomic<size_t> numKeyEjects;
+    //! Number of disk lookups skipped because a Bloom filter ruled the key out
+    Atomic<size_t> bfilterAvoidedFetches;
+    //! Number of disk lookups a Bloom filter let through for missing keys
+    Atomic<size_t> bfilterFalsePositives;
+    //! Memory used by the vbuckets' Bloom filters.
+    Atomic<size_t> bfilterMemory;
+    //! Number of times the pager compressed a value in memory
+    Atomic<size_t> numValueCompressions;
+    //! Number of times a compressed value was decompressed on access
+    Atomic<size_t> numValueDecompressions;
+    //! Memory used by compressed values.
+    Atomic<size_t> compressedValueSize;
+    //! Length of the compressed values before they were compressed.
+    Atomic<size_t> compressedValueRawSize;
     //! Number of times "Not my bucket" happened
     Atomic<size_t> numNotMyVBuckets;
     //! Whether the DB cleaner completes cleaning up invalid items with old vb versions
@@ -154,11 +191,11 @@ public:
     //! Number of updated items reverted from hot reload
     Atomic<size_t> numRevertUpdates;
     //! Total size of stored objects.
-    Atomic<size_t> currentSize;
+    ShardedCounter<size_t> currentSize;
     //! Total memory overhead to store values for resident keys.
-    Atomic<size_t> totalValueSize;
+    ShardedCounter<size_t> totalValueSize;
     //! Amount of memory used to track items and what-not.
-    Atomic<size_t> memOverhead;
+    ShardedCounter<size_t> memOverhead;
     //! The total amount of memory used by this bucket (From memory tracking)
     Atomic<size_t> totalMemory;
     //! True if the memory usage tracker is enabled.
@@ -174,6 +211,22 @@ public:
     //! Number of times temporary oom errors encountered while processing operations.
     Atomic<size_t> tmp_oom_errors;
 
+    //! Number of times the defragmenter ran.
+    Atomic<size_t> defragRuns;
+    //! Number of values moved to a new Blob by the defragmenter.
+    Atomic<size_t> defragValuesMoved;
+    //! Bytes of values and StoredValues moved by the defragmenter.
+    Atomic<size_t> defragBytesMoved;
+    //! Bytes of StoredValue slabs given back to the heap by the defragmenter.
+    Atomic<size_t> defragSlabBytesReleased;
+    //! Allocator fragmentation over heap size when the defragmenter last ran.
+    Atomic<double> defragFragmentation;
+
+    //! Number of connections that waited for a mutation to be durable.
+    Atomic<size_t> durabilityWaits;
+    //! Number of durability waits that timed out.
+    Atomic<size_t> durabilityTimeouts;
+
     //! Number of read related io operations
     Atomic<size_t> io_num_read;
     //! Number of write related io operations
@@ -309,6 +362,9 @@ public:
     //! Histogram of get commands.
     Histogram<hrtime_t> getCmdHisto;
 
+    //! Histogram of batched (multi key) get requests.
+    Histogram<hrtime_t> getMultiCmdHisto;
+
     //! Histogram of arithmetic commands.
     Histogram<hrtime_t> arithCmdHisto;
 
@@ -324,6 +380,12 @@ public:
     //! Time spent notifying completion of IO.
     Histogram<hrtime_t> notifyIOHisto;
 
+    //! Time connections waited for mutations to be persisted.
+    Histogram<hrtime_t> persistWaitHisto;
+
+    //! Time connections waited for mutations to be replicated.
+    Histogram<hrtime_t> replicationWaitHisto;
+
     //! Histogram of get_stats commands.
     Histogram<hrtime_t> getStatsCmdHisto;
 
@@ -360,6 +422,18 @@ public:
     //! Historgram of batch reads
     Histogram<hrtime_t> getMultiHisto;
 
+    //! Histogram of the time hash tables are locked per resize step
+    Histogram<hrtime_t> htResizeStepHisto;
+
+    //! Histogram of the time spent compressing a value
+    Histogram<hrtime_t> valueCompressHisto;
+
+    //! Histogram of the time spent decompressing a value
+    Histogram<hrtime_t> valueDecompressHisto;
+
+    //! Histogram of the time spent reading a spilled checkpoint chunk back
+    Histogram<hrtime_t> chkSpillReadHisto;
+
     //! Reset all stats to reasonable values.
     void reset() {
         tooYoung.set(0);
@@ -372,8 +446,17 @@ public:
         pagerRuns.set(0);
         checkpointRemoverRuns.set(0);
         itemsRemovedFromCheckpoints.set(0);
+        chkSpilledItems.set(0);
+        chkSpillReads.set(0);
+        chkSpillReadErrors.set(0);
+        chkStagedItems.set(0);
         numValueEjects.set(0);
         numFailedEjects.set(0);
+        numKeyEjects.set(0);
+        bfilterAvoidedFetches.set(0);
+        bfilterFalsePositives.set(0);
+        numValueCompressions.set(0);
+        numValueDecompressions.set(0);
         numNotMyVBuckets.set(0);
         io_num_read.set(0);
         io_num_write.set(0);
@@ -404,6 +487,12 @@ public:
 
         mlogCompactorRuns.set(0);
         alogRuns.set(0);
+        defragRuns.set(0);
+        defragValuesMoved.set(0);
+        defragBytesMoved.set(0);
+        defragSlabBytesReleased.set(0);
+        durabilityWaits.set(0);
+        durabilityTimeouts.set(0);
 
         pendingOpsHisto.reset();
         bgWaitHisto.reset();
@@ -415,11 +504,14 @@ public:
         setVbucketCmdHisto.reset();
         delVbucketCmdHisto.reset();
         getCmdHisto.reset();
+        getMultiCmdHisto.reset();
         arithCmdHisto.reset();
         tapVbucketResetHisto.reset();
         tapMutationHisto.reset();
         tapVbucketSetHisto.reset();
         notifyIOHisto.reset();
+        persistWaitHisto.reset();
+        replicationWaitHisto.reset();
         getStatsCmdHisto.reset();
         diskInsertHisto.reset();
         diskUpdateHisto.reset();
@@ -433,6 +525,10 @@ public:
         dirtyAgeHisto.reset();
         mlogCompactorHisto.reset();
         getMultiHisto.reset();
+        htResizeStepHisto.reset();
+        valueCompressHisto.reset();
+        valueDecompressHisto.reset();
+        chkSpillReadHisto.reset();
     }
 
     // Used by stats logging infrastructure.
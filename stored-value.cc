@@ -1,7 +1,9 @@
 /* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 #include "config.h"
+#include <algorithm>
 #include <cassert>
 #include <limits>
+#include <map>
 
 #include "stored-value.hh"
 
@@ -11,13 +13,27 @@
 
 size_t HashTable::defaultNumBuckets = DEFAULT_HT_SIZE;
 size_t HashTable::defaultNumLocks = 193;
+size_t HashTable::defaultResizeStep = 1024;
+size_t HashTable::defaultInlineValueSize = 32;
+bool HashTable::defaultOptimisticReads = true;
 enum stored_value_type HashTable::defaultStoredValueType = featured;
+enum hash_table_layout HashTable::defaultLayout = chained;
 double StoredValue::mutation_mem_threshold = 0.9;
 const int64_t StoredValue::state_id_cleared = -1;
 const int64_t StoredValue::state_id_pending = -2;
 const int64_t StoredValue::state_deleted_key = -3;
 const int64_t StoredValue::state_non_existent_key = -4;
 const int64_t StoredValue::state_temp_init = -5;
+const size_t StoredValuePool::CLASS_WIDTH;
+const size_t StoredValuePool::NUM_CLASSES;
+const size_t StoredValuePool::MIN_SLAB_OBJECTS;
+const size_t StoredValuePool::MAX_SLAB_SIZE;
+const size_t StoredValuePool::MAX_STRIPES;
+const size_t StoredValuePool::HEADER_SIZE;
+const size_t EpochReclaimer::RECLAIM_BATCH;
+const int HashTable::OPTIMISTIC_RETRIES;
+const int HashTable::OPTIMISTIC_MAX_DEPTH;
+const size_t HashTable::TAGGED_ITEMS_PER_BUCKET;
 
 static ssize_t prime_size_table[] = {
     3, 7, 13, 23, 47, 97, 193, 383, 769, 1531, 3067, 6143, 12289, 24571, 49157,
@@ -29,15 +45,15 @@ static ssize_t prime_size_table[] = {
 bool StoredValue::ejectValue(EPStats &stats, HashTable &ht) {
     if (eligibleForEviction()) {
         size_t oldsize = size();
-        size_t old_valsize = value->length();
+        size_t old_valsize = blobLength();
         blobval uval;
         uval.len = valLength();
         value_t sp(Blob::New(uval.chlen, sizeof(uval)));
         extra.feature.resident = false;
         timestampEviction();
-        value = sp;
+        assignValue(sp, ht);
         size_t newsize = size();
-        size_t new_valsize = value->length();
+        size_t new_valsize = blobLength();
 
         // ejecting the value may increase the object size....
         if (oldsize < newsize) {
@@ -65,6 +81,81 @@ bool StoredValue::ejectValue(EPStats &stats, HashTable &ht) {
     return false;
 }
 
+bool StoredValue::compressValue(EPStats &stats, HashTable &ht) {
+    if (!eligibleForCompression()) {
+        return false;
+    }
+    hrtime_t start = gethrtime();
+    Blob *compressed = Blob::NewCompressed(value->getData(), value->length());
+    stats.valueCompressHisto.add((gethrtime() - start) / 1000);
+    if (compressed == NULL) {
+        return false;
+    }
+    replaceBlob(value_t(compressed), stats, ht);
+    ++stats.numValueCompressions;
+    return true;
+}
+
+void StoredValue::decompressValue(EPStats &stats, HashTable &ht) {
+    assert(isCompressed());
+    hrtime_t start = gethrtime();
+    value_t raw(value->decompress());
+    stats.valueDecompressHisto.add((gethrtime() - start) / 1000);
+    replaceBlob(raw, stats, ht);
+    ++stats.numValueDecompressions;
+}
+
+void StoredValue::replaceBlob(const value_t &v, EPStats &stats, HashTable &ht) {
+    size_t oldsize = size();
+    size_t old_valsize = blobLength();
+    value = v;
+    size_t newsize = size();
+    size_t new_valsize = blobLength();
+
+    if (oldsize < newsize) {
+        increaseCacheSize(ht, newsize - oldsize);
+    } else if (newsize < oldsize) {
+        reduceCacheSize(ht, oldsize - newsize);
+    }
+    // Add or substract the key/meta data overhead differenece.
+    size_t old_keymeta_overhead = (oldsize - old_valsize);
+    size_t new_keymeta_overhead = (newsize - new_valsize);
+    if (old_keymeta_overhead < new_keymeta_overhead) {
+        increaseCurrentSize(stats, new_keymeta_overhead - old_keymeta_overhead);
+    } else if (new_keymeta_overhead < old_keymeta_overhead) {
+        reduceCurrentSize(stats, old_keymeta_overhead - new_keymeta_overhead);
+    }
+}
+
+void StoredValue::assignValue(const value_t &v, HashTable &ht) {
+    if (v.get() != NULL && inlineCapacity() > 0 && v->length() <= inlineCapacity()) {
+        std::memcpy(inlineBytes(), v->getData(), v->length());
+        if (_isSmall) {
+            extra.small.vallen = static_cast<uint8_t>(v->length());
+        } else {
+            extra.feature.vallen = static_cast<uint8_t>(v->length());
+        }
+        value.reset();
+        if (!_isInline) {
+            markInline(true, ht);
+        }
+    } else {
+        value = v;
+        if (_isInline) {
+            markInline(false, ht);
+        }
+    }
+}
+
+void StoredValue::markInline(bool inl, HashTable &ht) {
+    _isInline = inl;
+    if (inl) {
+        ++ht.numInlineValues;
+    } else {
+        --ht.numInlineValues;
+    }
+}
+
 void StoredValue::referenced(HashTable &ht) {
     if (!_isSmall && extra.feature.nru == false) {
         extra.feature.nru = true;
@@ -105,7 +196,7 @@ bool StoredValue::unlocked_restoreValue(Item *itm, EPStats &stats,
 
     if (!isResident()) {
         size_t oldsize = size();
-        size_t old_valsize = isDeleted() ? 0 : value->length();
+        size_t old_valsize = blobLength();
         if (itm->getValue()->length() != valLength()) {
             if (valLength()) {
                 // generate warning msg only if valLength() > 0, otherwise,
@@ -122,10 +213,10 @@ bool StoredValue::unlocked_restoreValue(Item *itm, EPStats &stats,
         rel_time_t evicted_time(getEvictedTime());
         stats.pagedOutTimeHisto.add(ep_current_time() - evicted_time);
         extra.feature.resident = true;
-        value = itm->getValue();
+        assignValue(itm->getValue(), ht);
 
         size_t newsize = size();
-        size_t new_valsize = value->length();
+        size_t new_valsize = blobLength();
         if (oldsize < newsize) {
             increaseCacheSize(ht, newsize - oldsize);
         } else if (newsize < oldsize) {
@@ -154,17 +245,17 @@ mutation_type_t HashTable::insert(const Item &itm, bool eject, bool partial) {
     assert(itm.getCas() != static_cast<uint64_t>(-1));
 
     int bucket_num(0);
-    LockHolder lh = getLockedBucket(itm.getKey(), &bucket_num);
-    StoredValue *v = unlocked_find(itm.getKey(), bucket_num, true, false);
+    uint64_t h = hash(itm.getKey());
+    VersionedLockHolder lh = getLockedBucket(h, &bucket_num);
+    StoredValue *v = unlocked_findHashed(itm.getKey(), h, bucket_num, true, false);
 
     if (v == NULL) {
-        v = valFact(itm, values[bucket_num], *this);
+        v = unlocked_createValueHashed(itm, h, bucket_num);
         v->markClean(NULL);
         if (partial) {
             v->extra.feature.resident = false;
             ++numNonResidentItems;
         }
-        values[bucket_num] = v;
         ++numItems;
     } else {
         if (partial) {
@@ -258,18 +349,39 @@ HashTableStatVisitor HashTable::clear(bool deactivate) {
         // If not deactivating, assert we're already active.
         assert(isActive());
     }
-    MultiLockHolder mlh(mutexes, n_locks);
+    LockHolder rlh(resizeMutex);
+    MultiVersionedLockHolder mlh(mutexes, n_locks);
     if (deactivate) {
         setActiveState(false);
     }
-    for (int i = 0; i < (int)size; i++) {
-        while (values[i]) {
-            StoredValue *v = values[i];
+    for (int i = 0; i < static_cast<int>(size + oldSize); i++) {
+        if (layout == tagged) {
+            TaggedBucket *bucket = groupFor(i);
+            for (TaggedBucket *g = bucket; g; g = g->overflow) {
+                for (uint32_t m = g->used(); m; m &= m - 1) {
+                    StoredValue *v = g->slots[TaggedBucket::firstSlot(m)];
+                    rv.visit(v);
+                    v->~StoredValue();
+                }
+            }
+            freeOverflowGroups(bucket);
+            memset(bucket, 0, sizeof(TaggedBucket));
+            continue;
+        }
+        StoredValue **head = chainFor(i);
+        while (*head) {
+            StoredValue *v = *head;
             rv.visit(v);
-            values[i] = v->next;
-            delete v;
+            *head = v->next;
+            v->~StoredValue();
         }
     }
+    // The values are all gone, so hand their slabs back in one go.
+    valPool.releaseAll();
+    if (isResizing()) {
+        // Nothing left to migrate.
+        unlocked_finishResize();
+    }
 
     stats.currentSize.decr(rv.memSize - rv.valSize);
     assert(stats.currentSize.get() < GIGANTOR);
@@ -281,66 +393,256 @@ HashTableStatVisitor HashTable::clear(bool deactivate) {
     cacheSize.set(0);
     numReferenced.set(0);
     numReferencedEjects.set(0);
+    numInlineValues.set(0);
 
     return rv;
 }
 
 void HashTable::resize(size_t newSize) {
+    startResize(newSize);
+    while (migrate(defaultResizeStep)) {
+        // Each bucket is moved holding only its own lock and the locks
+        // of the buckets its items move to.
+    }
+}
+
+bool HashTable::startResize(size_t newSize) {
     assert(isActive());
 
     // Due to the way hashing works, we can't fit anything larger than
     // an int.
     if (newSize > static_cast<size_t>(std::numeric_limits<int>::max())) {
-        return;
+        return false;
     }
 
     // Don't resize to the same size, either.
-    if (newSize == size) {
-        return;
+    if (newSize == size || isResizing()) {
+        return false;
+    }
+
+    // Get a place for the new items before taking any locks.
+    void *newBuckets = calloc(newSize, bucketSize());
+    // If we can't allocate memory, don't move stuff around.
+    if (!newBuckets) {
+        return false;
     }
 
-    MultiLockHolder mlh(mutexes, n_locks);
-    if (visitors.get() > 0) {
+    // Swapping the arrays holds every lock, but it's all this does
+    // under them.
+    LockHolder rlh(resizeMutex);
+    MultiVersionedLockHolder mlh(mutexes, n_locks);
+    if (visitors.get() > 0 || isResizing()) {
         // Do not allow a resize while any visitors are actually
         // processing.  The next attempt will have to pick it up.  New
         // visitors cannot start doing meaningful work (we own all
         // locks at this point).
-        return;
-    }
-
-    // Get a place for the new items.
-    StoredValue **newValues = static_cast<StoredValue**>(calloc(newSize,
-                                                                sizeof(StoredValue*)));
-    // If we can't allocate memory, don't move stuff around.
-    if (!newValues) {
-        return;
+        free(newBuckets);
+        return false;
     }
+    hrtime_t start = gethrtime();
 
-    stats.memOverhead.decr(memorySize());
+    stats.memOverhead.decr(bucketMemorySize());
     ++numResizes;
 
-    // Set the new size so all the hashy stuff works.
-    size_t oldSize = size;
+    // The current buckets become the old ones, all of them still to
+    // be migrated.
+    if (layout == tagged) {
+        oldGroups = groups;
+        groups = static_cast<TaggedBucket*>(newBuckets);
+    } else {
+        oldValues = values;
+        values = static_cast<StoredValue**>(newBuckets);
+    }
+    migrated = 0;
+    std::fill(stripeMigrated.begin(), stripeMigrated.end(), 0);
+    oldSize = size;
     size = newSize;
     ep_sync_synchronize();
 
-    // Move existing records into the new space.
-    for (size_t i = 0; i < oldSize; i++) {
-        while (values[i]) {
-            StoredValue *v = values[i];
-            values[i] = v->next;
+    stats.memOverhead.incr(bucketMemorySize());
+    assert(stats.memOverhead.get() < GIGANTOR);
+
+    stats.htResizeStepHisto.add((gethrtime() - start) / 1000);
+    return true;
+}
+
+bool HashTable::migrate(size_t buckets) {
+    if (!isResizing()) {
+        return false;
+    }
+
+    LockHolder rlh(resizeMutex);
+    if (!isResizing()) {
+        return false;
+    }
+    hrtime_t start = gethrtime();
+    size_t budget = std::max(buckets, static_cast<size_t>(1));
+    size_t moved = 0;
+    for (size_t l = 0; l < n_locks && moved < budget; ++l) {
+        if (!migrateStripe(static_cast<int>(l), budget, moved)) {
+            break;
+        }
+    }
+
+    if (migrated == oldSize) {
+        // Dropping the empty old array changes every bucket number past
+        // the new ones, so this takes every lock.
+        MultiVersionedLockHolder mlh(mutexes, n_locks);
+        if (visitors.get() == 0) {
+            unlocked_finishResize();
+        }
+    }
+
+    stats.htResizeStepHisto.add((gethrtime() - start) / 1000);
+    return moved > 0 && isResizing();
+}
+
+bool HashTable::migrateStripe(int lock_num, size_t budget, size_t &moved) {
+    // Only migrators change these, and they hold resizeMutex.
+    if (lock_num + stripeMigrated[lock_num] * n_locks >= oldSize) {
+        return true;
+    }
+
+    VersionedLockHolder lh(mutexes[lock_num]);
+    while (moved < budget) {
+        size_t old_bucket = lock_num + stripeMigrated[lock_num] * n_locks;
+        if (old_bucket >= oldSize) {
+            return true;
+        }
+        if (visitors.get() > 0) {
+            // Visitors expect every item to stay in its bucket while
+            // they walk the table.
+            return false;
+        }
+
+        std::vector<bool> &locks = migrationLocks;
+        locks.assign(n_locks, false);
+        locks[lock_num] = true;
+        if (unlocked_addMigrationLocks(old_bucket, locks)) {
+            // Some of the items move to other stripes, so take their
+            // locks too, in order.
+            lh.unlock();
+            {
+                MultiVersionedLockHolder mlh(mutexes, locks);
+                // Keep going with the locks we have for as long as the
+                // next buckets of the stripe don't need any others.
+                // Items for yet another stripe may also have come in
+                // while no lock was held, so look again in that case.
+                while (moved < budget && old_bucket < oldSize) {
+                    if (visitors.get() > 0) {
+                        return false;
+                    }
+                    migrationNeeded = locks;
+                    if (unlocked_addMigrationLocks(old_bucket,
+                                                   migrationNeeded)) {
+                        break;
+                    }
+                    unlocked_migrateBucket(old_bucket);
+                    ++stripeMigrated[lock_num];
+                    ++migrated;
+                    ++moved;
+                    old_bucket += n_locks;
+                }
+            }
+            lh.lock();
+            continue;
+        }
+
+        // Empty, or all of it stays in this stripe.
+        unlocked_migrateBucket(old_bucket);
+        ++stripeMigrated[lock_num];
+        ++migrated;
+        ++moved;
+    }
+    return true;
+}
+
+bool HashTable::unlocked_addMigrationLocks(size_t old_bucket,
+                                           std::vector<bool> &locks) {
+    bool added = false;
+    if (layout == tagged) {
+        for (TaggedBucket *g = &oldGroups[old_bucket]; g; g = g->overflow) {
+            for (uint32_t m = g->used(); m; m &= m - 1) {
+                StoredValue *v = g->slots[TaggedBucket::firstSlot(m)];
+                uint64_t h = hash(v->getKeyBytes(), v->getKeyLen());
+                int lock_num = mutexForBucket(static_cast<int>(h % size));
+                added = added || !locks[lock_num];
+                locks[lock_num] = true;
+            }
+        }
+        return added;
+    }
+
+    for (StoredValue *v = oldValues[old_bucket]; v; v = v->next) {
+        uint64_t h = hash(v->getKeyBytes(), v->getKeyLen());
+        int lock_num = mutexForBucket(static_cast<int>(h % size));
+        added = added || !locks[lock_num];
+        locks[lock_num] = true;
+    }
+    return added;
+}
 
-            int newBucket = getBucketForHash(hash(v->getKeyBytes(), v->getKeyLen()));
-            v->next = newValues[newBucket];
-            newValues[newBucket] = v;
+void HashTable::unlocked_migrateBucket(size_t old_bucket) {
+    if (layout == tagged) {
+        TaggedBucket *bucket = &oldGroups[old_bucket];
+        for (TaggedBucket *g = bucket; g; g = g->overflow) {
+            for (uint32_t m = g->used(); m; m &= m - 1) {
+                StoredValue *v = g->slots[TaggedBucket::firstSlot(m)];
+                uint64_t h = hash(v->getKeyBytes(), v->getKeyLen());
+                v = unlocked_rehomeValue(v, old_bucket, h % size);
+                linkTagged(&groups[h % size], v, TaggedBucket::tagFor(h));
+            }
         }
+        freeOverflowGroups(bucket);
+        memset(bucket, 0, sizeof(TaggedBucket));
+        return;
+    }
+
+    while (oldValues[old_bucket]) {
+        StoredValue *v = oldValues[old_bucket];
+        oldValues[old_bucket] = v->next;
+
+        uint64_t h = hash(v->getKeyBytes(), v->getKeyLen());
+        int newBucket = static_cast<int>(h % size);
+        v = unlocked_rehomeValue(v, old_bucket, newBucket);
+        v->next = values[newBucket];
+        values[newBucket] = v;
+    }
+}
+
+StoredValue *HashTable::unlocked_rehomeValue(StoredValue *v,
+                                             size_t old_bucket,
+                                             size_t new_bucket) {
+    // Values come from the pool stripe of the lock guarding them, so
+    // follow the value to its new lock.
+    size_t from = old_bucket % n_locks;
+    size_t to = new_bucket % n_locks;
+    if (valPool.sameStripe(from, to)) {
+        return v;
     }
+    return static_cast<StoredValue*>(valPool.relocate(from, to, v,
+                                                      v->allocationSize()));
+}
+
+void HashTable::unlocked_finishResize() {
+    stats.memOverhead.decr(bucketMemorySize());
 
-    // values still points to the old (now empty) table.
-    free(values);
-    values = newValues;
+    // The old arrays are empty by now, but optimistic readers may still
+    // be looking at them.
+    if (oldValues) {
+        reclaimer.retire(oldValues, free);
+    }
+    oldValues = NULL;
+    if (oldGroups) {
+        reclaimer.retire(oldGroups, free);
+    }
+    oldGroups = NULL;
+    oldSize = 0;
+    migrated = 0;
+    std::fill(stripeMigrated.begin(), stripeMigrated.end(), 0);
+    ep_sync_synchronize();
 
-    stats.memOverhead.incr(memorySize());
+    stats.memOverhead.incr(bucketMemorySize());
     assert(stats.memOverhead.get() < GIGANTOR);
 }
 
@@ -358,7 +660,13 @@ static bool isCurrently(size_t size, ssize_t a, ssize_t b) {
 }
 
 void HashTable::resize() {
-    size_t ni = getNumItems();
+    // Called now and then, which is a good time to free what lock free
+    // readers were still holding on to when it was retired.
+    reclaimer.reclaim();
+
+    size_t ni = bucketsForItems(getNumItems());
+    size_t min_size = std::max(bucketsForItems(defaultNumBuckets),
+                               static_cast<size_t>(prime_size_table[0]));
     int i(0);
     size_t new_size(0);
 
@@ -371,9 +679,9 @@ void HashTable::resize() {
     if (prime_size_table[i] == -1) {
         // We're at the end, take the biggest
         new_size = prime_size_table[i-1];
-    } else if (prime_size_table[i] < static_cast<ssize_t>(defaultNumBuckets)) {
+    } else if (i == 0 || prime_size_table[i] < static_cast<ssize_t>(min_size)) {
         // Was going to be smaller than the configured ht_size.
-        new_size = defaultNumBuckets;
+        new_size = min_size;
     } else if (isCurrently(size, prime_size_table[i-1], prime_size_table[i])) {
         // If one of the candidate sizes is the current size, maintain
         // the current size in order to remain stable.
@@ -386,6 +694,29 @@ void HashTable::resize() {
     resize(new_size);
 }
 
+size_t HashTable::unlocked_visitBucket(HashTableVisitor &visitor,
+                                       int bucket_num) {
+    size_t items = 0;
+    if (layout == tagged) {
+        for (TaggedBucket *g = groupFor(bucket_num); g; g = g->overflow) {
+            for (uint32_t m = g->used(); m; m &= m - 1) {
+                visitor.visit(g->slots[TaggedBucket::firstSlot(m)]);
+                ++items;
+            }
+        }
+        return items;
+    }
+    StoredValue *v = *chainFor(bucket_num);
+    assert(v == NULL || bucket_num == getBucketForHash(hash(v->getKeyBytes(),
+                                                            v->getKeyLen())));
+    while (v) {
+        visitor.visit(v);
+        v = v->next;
+        ++items;
+    }
+    return items;
+}
+
 void HashTable::visit(HashTableVisitor &visitor) {
     if ((numItems.get() + numTempItems.get()) == 0 || !isActive()) {
         return;
@@ -394,22 +725,175 @@ void HashTable::visit(HashTableVisitor &visitor) {
     bool aborted = !visitor.shouldContinue();
     size_t visited = 0;
     for (int l = 0; isActive() && !aborted && l < static_cast<int>(n_locks); l++) {
-        LockHolder lh(mutexes[l]);
-        for (int i = l; i < static_cast<int>(size); i+= n_locks) {
+        VersionedLockHolder lh(mutexes[l]);
+        for (int i = firstBucketForLock(l); i < static_cast<int>(size + oldSize);
+             i = nextBucketForLock(i)) {
             assert(l == mutexForBucket(i));
-            StoredValue *v = values[i];
-            assert(v == NULL || i == getBucketForHash(hash(v->getKeyBytes(),
-                                                           v->getKeyLen())));
-            while (v) {
-                visitor.visit(v);
-                v = v->next;
-            }
+            unlocked_visitBucket(visitor, i);
             ++visited;
         }
         lh.unlock();
         aborted = !visitor.shouldContinue();
     }
-    assert(aborted || visited == size);
+    assert(aborted || visited == size + oldSize);
+}
+
+HashTable::Position HashTable::pauseResumeVisit(HashTableVisitor &visitor,
+                                                const Position &start,
+                                                size_t maxItems,
+                                                size_t &visited) {
+    if ((numItems.get() + numTempItems.get()) == 0 || !isActive()) {
+        return endPosition();
+    }
+    VisitorTracker vt(&visitors);
+    size_t items = 0;
+    bool resuming = true;
+    for (int l = start.lock; isActive() && l < static_cast<int>(n_locks); l++) {
+        if (!visitor.shouldContinue()) {
+            break;
+        }
+        VersionedLockHolder lh(mutexes[l]);
+        int i = firstBucketForLock(l);
+        if (resuming) {
+            resuming = false;
+            // Resizes hold every lock, so the layout can't change under
+            // us from here on.  Finishing a resize only drops the old
+            // buckets, which leaves positions in the new ones good.
+            bool valid = start.ht_size == size
+                && (start.old_size == oldSize
+                    || start.hash_bucket < static_cast<int>(size));
+            if (valid) {
+                i = start.hash_bucket;
+            } else if (l != 0) {
+                lh.unlock();
+                l = -1;
+                continue;
+            }
+        }
+        for (; i < static_cast<int>(size + oldSize); i = nextBucketForLock(i)) {
+            if (maxItems != 0 && items >= maxItems) {
+                visited += items;
+                return Position(size, oldSize, l, i);
+            }
+            items += unlocked_visitBucket(visitor, i);
+        }
+    }
+    visited += items;
+    return endPosition();
+}
+
+size_t HashTable::defragmentValues(size_t maxUsage, size_t &moved) {
+    if (!isActive()) {
+        return 0;
+    }
+    bool draining = valPool.startDrain(maxUsage) > 0;
+    if (!draining && numNonResidentItems.get() == 0) {
+        return 0;
+    }
+    VisitorTracker vt(&visitors);
+    for (int l = 0; isActive() && l < static_cast<int>(n_locks); l++) {
+        VersionedLockHolder lh(mutexes[l]);
+        for (int i = firstBucketForLock(l); i < static_cast<int>(size + oldSize);
+             i = nextBucketForLock(i)) {
+            if (layout == tagged) {
+                for (TaggedBucket *g = groupFor(i); g; g = g->overflow) {
+                    for (uint32_t m = g->used(); m; m &= m - 1) {
+                        StoredValue *&v = g->slots[TaggedBucket::firstSlot(m)];
+                        v = unlocked_moveValue(v, l, draining, moved);
+                    }
+                }
+                continue;
+            }
+            for (StoredValue **vp = chainFor(i); *vp; vp = &(*vp)->next) {
+                *vp = unlocked_moveValue(*vp, l, draining, moved);
+            }
+        }
+    }
+    return valPool.releaseDrained();
+}
+
+StoredValue *HashTable::unlocked_moveValue(StoredValue *v, int lock,
+                                           bool draining, size_t &moved) {
+    size_t len = v->allocationSize();
+    if (v->isInline() && !v->isResident()
+        && v->inlineCapacity() >= sizeof(blobval) + sizeof(void*)) {
+        // An ejected inline value only needs room for its length, so
+        // give back the rest of the space reserved for it.
+        size_t oldsize = v->size();
+        size_t newlen = len - v->inlineCapacity() + sizeof(blobval);
+        void *p = valPool.allocate(lock, newlen);
+        std::memcpy(p, v, newlen);
+        StoredValue *nv = static_cast<StoredValue*>(p);
+        nv->extra.feature.valcap = sizeof(blobval);
+        valPool.release(lock, v, len);
+        StoredValue::reduceCacheSize(*this, oldsize - nv->size());
+        StoredValue::reduceCurrentSize(stats, oldsize - nv->size());
+        moved += newlen;
+        return nv;
+    }
+    if (draining && valPool.isDraining(lock, v, len)) {
+        moved += len;
+        return static_cast<StoredValue*>(valPool.relocate(lock, lock, v, len));
+    }
+    return v;
+}
+
+void HashTable::visitMulti(const std::vector<uint64_t> &hashes,
+                           HashTableBatchVisitor &visitor) {
+    if (hashes.empty() || !isActive()) {
+        return;
+    }
+
+    std::vector<std::pair<int, size_t> > order;
+    order.reserve(hashes.size());
+    for (size_t i = 0; i < hashes.size(); ++i) {
+        int lock_num = mutexForBucket(getBucketForHash(hashes[i]));
+        order.push_back(std::make_pair(lock_num, i));
+    }
+    std::sort(order.begin(), order.end());
+
+    // Keys whose bucket moved to another lock after they were sorted.
+    std::vector<size_t> moved;
+    std::vector<int> buckets(hashes.size());
+    size_t start = 0;
+    while (start < order.size()) {
+        int lock_num = order[start].first;
+        size_t end = start;
+        while (end < order.size() && order[end].first == lock_num) {
+            ++end;
+        }
+
+        VersionedLockHolder lh(mutexes[lock_num]);
+        for (size_t i = start; i < end; ++i) {
+            size_t idx = order[i].second;
+            int b = getBucketForHash(hashes[idx]);
+            buckets[idx] = b;
+            if (mutexForBucket(b) != lock_num) {
+                continue;
+            }
+            if (layout == tagged) {
+                __builtin_prefetch(groupFor(b));
+            } else {
+                __builtin_prefetch(*chainFor(b));
+            }
+        }
+        for (size_t i = start; i < end; ++i) {
+            size_t idx = order[i].second;
+            if (mutexForBucket(buckets[idx]) == lock_num) {
+                visitor.visit(idx, buckets[idx]);
+            } else {
+                moved.push_back(idx);
+            }
+        }
+        start = end;
+    }
+
+    std::vector<size_t>::iterator it;
+    for (it = moved.begin(); it != moved.end(); ++it) {
+        int bucket_num(0);
+        VersionedLockHolder lh = getLockedBucket(hashes[*it], &bucket_num);
+        visitor.visit(*it, bucket_num);
+    }
 }
 
 void HashTable::visitDepth(HashTableDepthVisitor &visitor) {
@@ -420,13 +904,25 @@ void HashTable::visitDepth(HashTableDepthVisitor &visitor) {
     VisitorTracker vt(&visitors);
 
     for (int l = 0; l < static_cast<int>(n_locks); l++) {
-        LockHolder lh(mutexes[l]);
-        for (int i = l; i < static_cast<int>(size); i+= n_locks) {
+        VersionedLockHolder lh(mutexes[l]);
+        for (int i = firstBucketForLock(l); i < static_cast<int>(size + oldSize);
+             i = nextBucketForLock(i)) {
             size_t depth = 0;
-            StoredValue *p = values[i];
+            size_t mem(0);
+            if (layout == tagged) {
+                for (TaggedBucket *g = groupFor(i); g; g = g->overflow) {
+                    for (uint32_t m = g->used(); m; m &= m - 1) {
+                        depth++;
+                        mem += g->slots[TaggedBucket::firstSlot(m)]->size();
+                    }
+                }
+                visitor.visit(i, depth, mem);
+                ++visited;
+                continue;
+            }
+            StoredValue *p = *chainFor(i);
             assert(p == NULL || i == getBucketForHash(hash(p->getKeyBytes(),
                                                            p->getKeyLen())));
-            size_t mem(0);
             while (p) {
                 depth++;
                 mem += p->size();
@@ -437,7 +933,7 @@ void HashTable::visitDepth(HashTableDepthVisitor &visitor) {
         }
     }
 
-    assert(visited == size);
+    assert(visited == size + oldSize);
 }
 
 bool HashTable::setDefaultStorageValueType(const char *t) {
@@ -470,11 +966,393 @@ const char* HashTable::getDefaultStorageValueTypeStr() {
     return rv;
 }
 
+void HashTable::setDefaultResizeStep(size_t to) {
+    if (to != 0) {
+        defaultResizeStep = to;
+    }
+}
+
+size_t HashTable::getDefaultResizeStep() {
+    return defaultResizeStep;
+}
+
+void HashTable::setDefaultInlineValueSize(size_t to) {
+    defaultInlineValueSize = std::min(to, static_cast<size_t>(UCHAR_MAX));
+}
+
+size_t HashTable::getDefaultInlineValueSize() {
+    return defaultInlineValueSize;
+}
+
+void HashTable::setDefaultOptimisticReads(bool to) {
+    defaultOptimisticReads = to;
+}
+
+bool HashTable::getDefaultOptimisticReads() {
+    return defaultOptimisticReads;
+}
+
+Item *HashTable::optimisticGet(const std::string &key, uint64_t h,
+                               uint16_t vbucket, bool trackReference,
+                               bool *referenced) {
+    if (!defaultOptimisticReads || !isActive()) {
+        return NULL;
+    }
+
+    EpochReclaimer::enter();
+    Item *rv = NULL;
+    for (int attempt = 0; attempt < OPTIMISTIC_RETRIES; ++attempt) {
+        // Moving a bucket holds its lock and the locks of the buckets
+        // its items go to, and swapping the bucket arrays holds every
+        // lock, so if the version of the lock guarding our bucket
+        // doesn't change while we read the table layout, the layout is
+        // consistent.
+        size_t sz = size;
+        size_t osz = oldSize;
+        bool old = osz != 0 && !isMigrated(h % osz);
+        int lock_num = static_cast<int>((old ? h % osz : h % sz) % n_locks);
+
+        uint32_t version = mutexes[lock_num].getVersion();
+        if (version & 1) {
+            ++numOptimisticConflicts;
+            continue;
+        }
+        ep_sync_synchronize();
+        sz = size;
+        osz = oldSize;
+        old = osz != 0 && !isMigrated(h % osz);
+        StoredValue **vals = values;
+        StoredValue **ovals = oldValues;
+        TaggedBucket *grps = groups;
+        TaggedBucket *ogrps = oldGroups;
+        ep_sync_synchronize();
+        if (mutexes[lock_num].getVersion() != version) {
+            ++numOptimisticConflicts;
+            continue;
+        }
+        size_t b = old ? h % osz : h % sz;
+        if (static_cast<int>(b % n_locks) != lock_num) {
+            continue;
+        }
+
+        // Find the key.  What we see may be torn by a concurrent
+        // writer, but it's all slab or bucket memory that's only freed
+        // through the reclaimer, so it can't go away while we're
+        // inside, and the version check below throws away anything
+        // inconsistent.
+        StoredValue *v = NULL;
+        int depth = 0;
+        if (layout == tagged) {
+            uint8_t tag = TaggedBucket::tagFor(h);
+            TaggedBucket *g = old ? &ogrps[b] : &grps[b];
+            for (; g && !v && depth < OPTIMISTIC_MAX_DEPTH; g = g->overflow) {
+                for (uint32_t m = g->match(tag); m && !v; m &= m - 1) {
+                    StoredValue *sv = g->slots[TaggedBucket::firstSlot(m)];
+                    if (sv && sv->hasKey(key)) {
+                        v = sv;
+                    }
+                }
+                ++depth;
+            }
+        } else {
+            StoredValue *sv = old ? ovals[b] : vals[b];
+            for (; sv && !v && depth < OPTIMISTIC_MAX_DEPTH; sv = sv->next) {
+                if (sv->hasKey(key)) {
+                    v = sv;
+                }
+                ++depth;
+            }
+        }
+        if (v == NULL) {
+            // Misses are left to the locked path.
+            break;
+        }
+
+        // Only a value that can be copied out without writing to the
+        // StoredValue will do.
+        bool usable = v->isInline() && v->isResident() && !v->isDeleted()
+            && !v->isTempItem() && !v->isExpired(ep_real_time())
+            && !v->needsTouch()
+            && (v->_isSmall || !v->extra.feature.locked);
+        bool nru = v->isReferenced();
+        if (trackReference && !v->_isSmall && !nru) {
+            usable = false;
+        }
+
+        char data[std::numeric_limits<uint8_t>::max()];
+        size_t len = 0;
+        uint32_t flags = 0;
+        time_t exptime = 0;
+        uint64_t cas = 0, seqno = 0;
+        int64_t id = 0;
+        if (usable) {
+            len = v->inlineLen();
+            std::memcpy(data, v->inlineBytes(), len);
+            flags = v->getFlags();
+            exptime = v->getExptime();
+            cas = v->getCas();
+            seqno = v->getSeqno();
+            id = v->getId();
+        }
+
+        ep_sync_synchronize();
+        if (mutexes[lock_num].getVersion() != version) {
+            ++numOptimisticConflicts;
+            continue;
+        }
+        if (usable) {
+            rv = new Item(key.data(), static_cast<uint16_t>(key.length()),
+                          flags, exptime, data, len, cas, id, vbucket, seqno);
+            *referenced = nru;
+            ++numOptimisticGets;
+        }
+        break;
+    }
+    EpochReclaimer::leave();
+    return rv;
+}
+
+Atomic<uint64_t> EpochReclaimer::epoch(1);
+EpochReclaimer::Reader * volatile EpochReclaimer::readers(NULL);
+Mutex EpochReclaimer::readersMutex;
+ThreadLocal<EpochReclaimer::Reader*> EpochReclaimer::threadReader(
+    EpochReclaimer::releaseReader);
+
+EpochReclaimer::Reader *EpochReclaimer::reader() {
+    Reader *r = threadReader.get();
+    if (r) {
+        return r;
+    }
+
+    LockHolder lh(readersMutex);
+    for (r = readers; r && r->inUse; r = r->next) {
+        // Look for a reader left behind by a thread that exited.
+    }
+    if (r == NULL) {
+        void *p = NULL;
+        if (posix_memalign(&p, sizeof(Reader), sizeof(Reader)) != 0) {
+            throw std::bad_alloc();
+        }
+        r = static_cast<Reader*>(p);
+        r->epoch = 0;
+        r->next = readers;
+        r->inUse = true;
+        ep_sync_synchronize();
+        readers = r;
+    }
+    r->inUse = true;
+    threadReader.set(r);
+    return r;
+}
+
+void EpochReclaimer::releaseReader(void *p) {
+    Reader *r = static_cast<Reader*>(p);
+    r->epoch = 0;
+    ep_sync_synchronize();
+    r->inUse = false;
+}
+
+void EpochReclaimer::enter() {
+    Reader *r = reader();
+    r->epoch = epoch.get();
+    // Publish the epoch before reading anything it protects.
+    ep_sync_synchronize();
+}
+
+void EpochReclaimer::leave() {
+    Reader *r = reader();
+    ep_sync_synchronize();
+    r->epoch = 0;
+}
+
+uint64_t EpochReclaimer::oldestReader() {
+    uint64_t rv = std::numeric_limits<uint64_t>::max();
+    for (Reader *r = readers; r; r = r->next) {
+        uint64_t e = r->epoch;
+        if (e != 0 && e < rv) {
+            rv = e;
+        }
+    }
+    return rv;
+}
+
+void EpochReclaimer::retire(void *p, Release release) {
+    {
+        LockHolder lh(mutex);
+        retired.push_back(Retired(p, release, epoch.incr(1) + 1));
+        if (retired.size() < reclaimAt) {
+            return;
+        }
+    }
+    reclaim();
+}
+
+size_t EpochReclaimer::reclaim() {
+    std::vector<Retired> done;
+    {
+        LockHolder lh(mutex);
+        if (retired.empty()) {
+            return 0;
+        }
+        // Readers that started at or after the epoch something was
+        // retired in can't have seen it.
+        uint64_t oldest = oldestReader();
+        std::vector<Retired>::iterator keep = retired.begin();
+        std::vector<Retired>::iterator it;
+        for (it = retired.begin(); it != retired.end(); ++it) {
+            if (it->epoch <= oldest) {
+                done.push_back(*it);
+            } else {
+                *keep++ = *it;
+            }
+        }
+        retired.erase(keep, retired.end());
+        // Leave what's still in use alone until the list has doubled,
+        // so retiring stays cheap while a reader is slow.
+        reclaimAt = std::max(RECLAIM_BATCH, retired.size() * 2);
+    }
+    std::vector<Retired>::iterator it;
+    for (it = done.begin(); it != done.end(); ++it) {
+        it->release(it->p);
+    }
+    return done.size();
+}
+
+void EpochReclaimer::drain() {
+    uint64_t e = epoch.incr(1) + 1;
+    while (oldestReader() < e) {
+        sched_yield();
+    }
+    reclaim();
+    assert(getNumRetired() == 0);
+}
+
+size_t EpochReclaimer::getNumRetired() {
+    LockHolder lh(mutex);
+    return retired.size();
+}
+
+bool HashTable::setDefaultLayout(const char *l) {
+    bool rv = false;
+    if (l && strcmp(l, "chained") == 0) {
+        setDefaultLayout(chained);
+        rv = true;
+    } else if (l && strcmp(l, "tagged") == 0) {
+        setDefaultLayout(tagged);
+        rv = true;
+    }
+    return rv;
+}
+
+void HashTable::setDefaultLayout(enum hash_table_layout l) {
+    defaultLayout = l;
+}
+
+enum hash_table_layout HashTable::getDefaultLayout() {
+    return defaultLayout;
+}
+
+const char* HashTable::getLayoutStr(enum hash_table_layout l) {
+    const char *rv = "unknown";
+    switch(l) {
+    case chained: rv = "chained"; break;
+    case tagged: rv = "tagged"; break;
+    default: abort();
+    }
+    return rv;
+}
+
+StoredValue *HashTable::unlocked_findTagged(const std::string &key,
+                                            uint64_t h,
+                                            int bucket_num,
+                                            TaggedBucket **group,
+                                            int *slot) {
+    uint8_t tag = TaggedBucket::tagFor(h);
+    for (TaggedBucket *g = groupFor(bucket_num); g; g = g->overflow) {
+        for (uint32_t m = g->match(tag); m; m &= m - 1) {
+            int i = TaggedBucket::firstSlot(m);
+            if (g->slots[i]->hasKey(key)) {
+                if (group) {
+                    *group = g;
+                    *slot = i;
+                }
+                return g->slots[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+bool HashTable::unlocked_delTagged(const std::string &key, int bucket_num) {
+    TaggedBucket *g(NULL);
+    int slot(0);
+    StoredValue *v = unlocked_findTagged(key, hash(key), bucket_num, &g, &slot);
+    if (!v || (!v->isDeleted() && v->isLocked(ep_current_time()))) {
+        return false;
+    }
+
+    g->tags[slot] = 0;
+    g->slots[slot] = NULL;
+
+    // Give back overflow groups as they drain.
+    TaggedBucket *bucket = groupFor(bucket_num);
+    if (g != bucket && g->used() == 0) {
+        TaggedBucket *prev = bucket;
+        while (prev->overflow != g) {
+            prev = prev->overflow;
+        }
+        prev->overflow = g->overflow;
+        overflowMemory.decr(sizeof(TaggedBucket));
+        stats.memOverhead.decr(sizeof(TaggedBucket));
+        reclaimer.retire(g, free);
+    }
+
+    unlocked_destroyValue(v, bucket_num);
+    return true;
+}
+
+void HashTable::linkTagged(TaggedBucket *g, StoredValue *v, uint8_t tag) {
+    uint32_t m = g->match(0);
+    while (m == 0) {
+        if (!g->overflow) {
+            g->overflow = newOverflowGroup();
+        }
+        g = g->overflow;
+        m = g->match(0);
+    }
+    int i = TaggedBucket::firstSlot(m);
+    g->tags[i] = tag;
+    g->slots[i] = v;
+}
+
+TaggedBucket *HashTable::newOverflowGroup() {
+    TaggedBucket *g = static_cast<TaggedBucket*>(calloc(1, sizeof(TaggedBucket)));
+    if (!g) {
+        throw std::bad_alloc();
+    }
+    overflowMemory.incr(sizeof(TaggedBucket));
+    stats.memOverhead.incr(sizeof(TaggedBucket));
+    return g;
+}
+
+void HashTable::freeOverflowGroups(TaggedBucket *bucket) {
+    TaggedBucket *g = bucket->overflow;
+    bucket->overflow = NULL;
+    while (g) {
+        TaggedBucket *next = g->overflow;
+        overflowMemory.decr(sizeof(TaggedBucket));
+        stats.memOverhead.decr(sizeof(TaggedBucket));
+        reclaimer.retire(g, free);
+        g = next;
+    }
+}
+
 add_type_t HashTable::unlocked_add(int &bucket_num,
                                    const Item &val,
                                    bool isDirty,
                                    bool storeVal) {
-    StoredValue *v = unlocked_find(val.getKey(), bucket_num, true);
+    uint64_t h = layout == tagged ? hash(val.getKey()) : 0;
+    StoredValue *v = unlocked_findHashed(val.getKey(), h, bucket_num, true);
     add_type_t rv = ADD_SUCCESS;
     if (v && !v->isDeleted() && !v->isExpired(ep_real_time())) {
         rv = ADD_EXISTS;
@@ -486,6 +1364,11 @@ add_type_t HashTable::unlocked_add(int &bucket_num,
         }
         if (v) {
             rv = (v->isDeleted() || v->isExpired(ep_real_time())) ? ADD_UNDEL : ADD_SUCCESS;
+            if (v->isTempItem()) {
+                v->clearId();
+                --numTempItems;
+                ++numItems;
+            }
             v->setValue(itm, stats, *this, false);
             if (isDirty) {
                 v->markDirty();
@@ -493,8 +1376,7 @@ add_type_t HashTable::unlocked_add(int &bucket_num,
                 v->markClean(NULL);
             }
         } else {
-            v = valFact(itm, values[bucket_num], *this, isDirty);
-            values[bucket_num] = v;
+            v = unlocked_createValueHashed(itm, h, bucket_num, isDirty);
 
             if (v->isTempItem()) {
                 ++numTempItems;
@@ -515,7 +1397,7 @@ add_type_t HashTable::unlocked_add(int &bucket_num,
             v->ejectValue(stats, *this);
         }
         if (v->isTempItem()) {
-            v->resetValue();
+            v->resetValue(*this);
         } else {
             v->referenced(*this);
         }
@@ -524,6 +1406,39 @@ add_type_t HashTable::unlocked_add(int &bucket_num,
     return rv;
 }
 
+bool HashTable::unlocked_ejectItem(StoredValue *v, int bucket_num) {
+    assert(isActive());
+    if (!v->eligibleForItemEviction()) {
+        ++stats.numFailedEjects;
+        return false;
+    }
+    if (!v->isResident()) {
+        --numNonResidentItems;
+    }
+    v->isReferenced(true, this);
+    // A later setWithMeta of the key has to beat what was ejected just
+    // like it would have to beat a delete.
+    updateMaxDeletedSeqno(v->getSeqno());
+    bool deleted = unlocked_del(v->getKey(), bucket_num);
+    assert(deleted);
+    ++stats.numKeyEjects;
+    return true;
+}
+
+void HashTable::unlocked_restoreTempItem(StoredValue *v, Item &itm) {
+    assert(isActive());
+    assert(v->isTempInitialItem());
+    --numTempItems;
+    ++numItems;
+    v->setValue(itm, stats, *this, true);
+    if (itm.getId() > 0) {
+        v->setId(itm.getId());
+    } else {
+        v->clearId();
+    }
+    v->markClean(NULL);
+}
+
 add_type_t HashTable::unlocked_addTempDeletedItem(int &bucket_num,
                                                   const std::string &key) {
 
@@ -544,31 +1459,26 @@ void StoredValue::setMutationMemoryThreshold(double memThreshold) {
     }
 }
 
+// The sizes below are sharded counters updated on every mutation, so
+// they aren't read back here; summing them would pull in the cache
+// lines the sharding keeps apart.
+
 void StoredValue::increaseCacheSize(HashTable &ht, size_t by) {
     ht.cacheSize.incr(by);
-    assert(ht.cacheSize.get() < GIGANTOR);
     ht.memSize.incr(by);
-    assert(ht.memSize.get() < GIGANTOR);
 }
 
 void StoredValue::reduceCacheSize(HashTable &ht, size_t by) {
     ht.cacheSize.decr(by);
-    assert(ht.cacheSize.get() < GIGANTOR);
     ht.memSize.decr(by);
-    assert(ht.memSize.get() < GIGANTOR);
 }
 
 void StoredValue::increaseCurrentSize(EPStats &st, size_t by) {
     st.currentSize.incr(by);
-    assert(st.currentSize.get() < GIGANTOR);
 }
 
 void StoredValue::reduceCurrentSize(EPStats &st, size_t by) {
-    size_t val;
-    do {
-        val = st.currentSize.get();
-        assert(val >= by);
-    } while (!st.currentSize.cas(val, val - by));;
+    st.currentSize.decr(by);
 }
 
 void StoredValue::increaseMetaDataSize(HashTable &ht, size_t by) {
@@ -585,15 +1495,296 @@ void StoredValue::reduceMetaDataSize(HashTable &ht, size_t by) {
  * Is there enough space for this thing?
  */
 bool StoredValue::hasAvailableSpace(EPStats &st, const Item &itm) {
-    double newSize = static_cast<double>(st.getTotalMemoryUsed() +
+    double newSize = static_cast<double>(st.getApproxMemoryUsed() +
                                          sizeof(StoredValue) + itm.getNKey());
     double maxSize=  static_cast<double>(st.getMaxDataSize()) * mutation_mem_threshold;
     return newSize <= maxSize;
 }
 
+static void releaseSlab(void *p) {
+    ::operator delete(p);
+}
+
+StoredValuePool::StoredValuePool(EPStats &st, EpochReclaimer &r,
+                                 size_t locks) :
+    stats(st), reclaimer(r),
+    numStripes(std::max(std::min(locks, MAX_STRIPES), static_cast<size_t>(1))),
+    stripes(new Stripe[numStripes]) {
+}
+
+void *StoredValuePool::allocate(size_t lock, size_t len) {
+    size_t c = classFor(len);
+    if (c >= NUM_CLASSES) {
+        return ::operator new(len);
+    }
+
+    Stripe &st = stripeFor(lock);
+    SpinLockHolder lh(&st.lock);
+    SizeClass &sc = st.classes[c];
+    Slab *slab = sc.partial;
+    if (slab == NULL) {
+        slab = newSlab(st, c);
+    }
+    void *p = slab->freelist;
+    slab->freelist = *static_cast<void**>(p);
+    if (++slab->live == slab->objects) {
+        unlinkPartial(sc, slab);
+    }
+    st.allocated.incr(accounted(len));
+    stats.memOverhead.decr(accounted(len));
+    return p;
+}
+
+void StoredValuePool::release(size_t lock, void *p, size_t len) {
+    size_t c = classFor(len);
+    if (c >= NUM_CLASSES) {
+        ::operator delete(p);
+        return;
+    }
+
+    Stripe &st = stripeFor(lock);
+    SpinLockHolder lh(&st.lock);
+    SizeClass &sc = st.classes[c];
+    Slab *slab = slabFor(st, p);
+    assert(slab && slab->cls == c);
+    *static_cast<void**>(p) = slab->freelist;
+    slab->freelist = p;
+    if (slab->live-- == slab->objects && !slab->draining) {
+        linkPartial(sc, slab);
+    }
+    st.allocated.decr(accounted(len));
+    stats.memOverhead.incr(accounted(len));
+
+    // Give back empty slabs, but keep one around so a class going back
+    // and forth between empty and in use doesn't keep allocating.
+    if (slab->live == 0 && (slab->draining || sc.numSlabs > 1)) {
+        if (slab->draining) {
+            st.drained += slab->size;
+        } else {
+            unlinkPartial(sc, slab);
+        }
+        freeSlab(st, slab);
+    }
+}
+
+void StoredValuePool::linkPartial(SizeClass &sc, Slab *slab) {
+    slab->prev = NULL;
+    slab->next = sc.partial;
+    if (sc.partial) {
+        sc.partial->prev = slab;
+    }
+    sc.partial = slab;
+}
+
+void StoredValuePool::unlinkPartial(SizeClass &sc, Slab *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        sc.partial = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev = slab->next = NULL;
+}
+
+StoredValuePool::Slab *StoredValuePool::slabFor(Stripe &st, const void *p) {
+    const char *cp = static_cast<const char*>(p);
+    std::vector<Slab*>::iterator it;
+    it = std::upper_bound(st.slabs.begin(), st.slabs.end(),
+                          reinterpret_cast<Slab*>(const_cast<char*>(cp)));
+    if (it == st.slabs.begin()) {
+        return NULL;
+    }
+    --it;
+    if (cp < reinterpret_cast<const char*>(*it) + (*it)->size) {
+        return *it;
+    }
+    return NULL;
+}
+
+size_t StoredValuePool::getSlabMemory() {
+    size_t rv = 0;
+    for (size_t i = 0; i < numStripes; ++i) {
+        rv += stripes[i].slabMemory;
+    }
+    return rv;
+}
+
+size_t StoredValuePool::getFreeMemory() {
+    size_t rv = 0;
+    for (size_t i = 0; i < numStripes; ++i) {
+        rv += stripes[i].slabMemory - stripes[i].allocated;
+    }
+    return rv;
+}
+
+size_t StoredValuePool::startDrain(size_t maxUsage) {
+    size_t rv = 0;
+    for (size_t i = 0; i < numStripes; ++i) {
+        Stripe &st = stripes[i];
+        SpinLockHolder lh(&st.lock);
+        st.drained = 0;
+        for (size_t c = 0; c < NUM_CLASSES; ++c) {
+            SizeClass &sc = st.classes[c];
+            if (sc.numSlabs < 2) {
+                continue;
+            }
+
+            // Emptiest first.
+            std::vector<std::pair<uint32_t, Slab*> > byUse;
+            size_t totalFree = 0;
+            std::vector<Slab*>::iterator it;
+            for (it = st.slabs.begin(); it != st.slabs.end(); ++it) {
+                Slab *slab = *it;
+                if (slab->cls != c || slab->draining) {
+                    continue;
+                }
+                totalFree += slab->objects - slab->live;
+                if (slab->live * 100 <= maxUsage * slab->objects) {
+                    byUse.push_back(std::make_pair(slab->live, slab));
+                }
+            }
+            std::sort(byUse.begin(), byUse.end());
+
+            size_t toMove = 0;
+            std::vector<std::pair<uint32_t, Slab*> >::iterator bit;
+            for (bit = byUse.begin(); bit != byUse.end(); ++bit) {
+                Slab *slab = bit->second;
+                size_t free = slab->objects - slab->live;
+                // The objects to move must fit in what's left.
+                if (toMove + slab->live > totalFree - free) {
+                    break;
+                }
+                toMove += slab->live;
+                totalFree -= free;
+                if (slab->live < slab->objects) {
+                    unlinkPartial(sc, slab);
+                }
+                if (slab->live == 0) {
+                    st.drained += slab->size;
+                    freeSlab(st, slab);
+                } else {
+                    slab->draining = true;
+                    ++rv;
+                }
+            }
+        }
+    }
+    return rv;
+}
+
+bool StoredValuePool::isDraining(size_t lock, const void *p, size_t len) {
+    if (classFor(len) >= NUM_CLASSES) {
+        return false;
+    }
+    Stripe &st = stripeFor(lock);
+    SpinLockHolder lh(&st.lock);
+    Slab *slab = slabFor(st, p);
+    return slab && slab->draining;
+}
+
+void *StoredValuePool::relocate(size_t from, size_t to, void *p, size_t len) {
+    void *np = allocate(to, len);
+    std::memcpy(np, p, len);
+    release(from, p, len);
+    return np;
+}
+
+size_t StoredValuePool::releaseDrained() {
+    size_t rv = 0;
+    for (size_t i = 0; i < numStripes; ++i) {
+        Stripe &st = stripes[i];
+        SpinLockHolder lh(&st.lock);
+        std::vector<Slab*>::iterator it;
+        for (it = st.slabs.begin(); it != st.slabs.end(); ++it) {
+            Slab *slab = *it;
+            if (slab->draining) {
+                // Something kept an object from moving out.
+                slab->draining = false;
+                if (slab->live < slab->objects) {
+                    linkPartial(st.classes[slab->cls], slab);
+                }
+            }
+        }
+        rv += st.drained;
+        st.drained = 0;
+    }
+    return rv;
+}
+
+StoredValuePool::Slab *StoredValuePool::newSlab(Stripe &st, size_t c) {
+    SizeClass &sc = st.classes[c];
+    size_t objsize = (c + 1) * CLASS_WIDTH;
+    size_t nobjs = std::max(static_cast<size_t>(sc.nextObjects),
+                            MIN_SLAB_OBJECTS);
+    if (nobjs * objsize > MAX_SLAB_SIZE) {
+        nobjs = std::max(MAX_SLAB_SIZE / objsize, MIN_SLAB_OBJECTS);
+    } else {
+        sc.nextObjects = static_cast<uint32_t>(nobjs * 2);
+    }
+
+    // Objects start after the header, which keeps them aligned.  The
+    // tail is padded by the largest object size so a lock free reader
+    // looking at a stale object near the end can't run off the slab.
+    size_t slabsize = HEADER_SIZE + nobjs * objsize + NUM_CLASSES * CLASS_WIDTH;
+    Slab *slab = static_cast<Slab*>(::operator new(slabsize));
+    slab->size = static_cast<uint32_t>(slabsize);
+    slab->objects = static_cast<uint32_t>(nobjs);
+    slab->live = 0;
+    slab->cls = static_cast<uint8_t>(c);
+    slab->draining = false;
+    slab->freelist = NULL;
+    char *objs = reinterpret_cast<char*>(slab) + HEADER_SIZE;
+    for (size_t i = nobjs; i > 0; --i) {
+        void *p = objs + (i - 1) * objsize;
+        *static_cast<void**>(p) = slab->freelist;
+        slab->freelist = p;
+    }
+    linkPartial(sc, slab);
+    ++sc.numSlabs;
+    st.slabs.insert(std::upper_bound(st.slabs.begin(), st.slabs.end(), slab),
+                    slab);
+
+    st.slabMemory.incr(slabsize);
+    stats.memOverhead.incr(slabsize);
+    return slab;
+}
+
+void StoredValuePool::freeSlab(Stripe &st, Slab *slab) {
+    SizeClass &sc = st.classes[slab->cls];
+    --sc.numSlabs;
+    if (sc.numSlabs == 0) {
+        sc.nextObjects = 0;
+    }
+    st.slabs.erase(std::lower_bound(st.slabs.begin(), st.slabs.end(), slab));
+    st.slabMemory.decr(slab->size);
+    stats.memOverhead.decr(slab->size);
+    reclaimer.retire(slab, releaseSlab);
+}
+
+void StoredValuePool::releaseAll() {
+    for (size_t i = 0; i < numStripes; ++i) {
+        Stripe &st = stripes[i];
+        SpinLockHolder lh(&st.lock);
+        std::vector<Slab*>::iterator it;
+        for (it = st.slabs.begin(); it != st.slabs.end(); ++it) {
+            reclaimer.retire(*it, releaseSlab);
+        }
+        st.slabs.clear();
+        memset(st.classes, 0, sizeof(st.classes));
+        // Whatever was handed out has already been accounted for by
+        // the StoredValues themselves.
+        stats.memOverhead.decr(st.slabMemory - st.allocated);
+        st.slabMemory.set(0);
+        st.allocated.set(0);
+        st.drained = 0;
+    }
+}
+
 Item* StoredValue::toItem(bool lck, uint16_t vbucket) const {
     return new Item(getKey(), getFlags(), getExptime(),
-                    value,
+                    getValue(),
                     lck ? static_cast<uint64_t>(-1) : getCas(),
                     id, vbucket, getSeqno());
 }
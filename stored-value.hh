@@ -5,6 +5,7 @@
 #include <climits>
 #include <cstring>
 #include <algorithm>
+#include <limits>
 
 #include "common.hh"
 #include "item.hh"
@@ -12,6 +13,8 @@
 #include "stats.hh"
 #include "histo.hh"
 #include "queueditem.hh"
+#include "tagged_bucket.hh"
+#include "keyhash.hh"
 
 extern "C" {
     extern rel_time_t (*ep_current_time)();
@@ -29,6 +32,8 @@ class StoredValueFactory;
  * StoredValue "small" data storage.
  */
 struct small_data {
+    uint8_t valcap;             //!< Bytes reserved for an inline value.
+    uint8_t vallen;             //!< Length of the inline value.
     uint8_t keylen;             //!< Length of the key.
     char    keybytes[1];        //!< The key itself.
 };
@@ -44,6 +49,8 @@ struct feature_data {
     bool       locked : 1;      //!< True if this item is locked
     bool       resident : 1;    //!< True if this object's value is in memory.
     bool       nru : 1;         //!< True if referenced since last sweep
+    uint8_t    valcap;          //!< Bytes reserved for an inline value
+    uint8_t    vallen;          //!< Length of the inline value
     uint8_t    keylen;          //!< Length of the key
     char       keybytes[1];     //!< The key itself.
 };
@@ -83,6 +90,15 @@ public:
         }
     }
 
+    /**
+     * True if touch() would update the "last used" time.
+     */
+    bool needsTouch() const {
+        // Only the low 29 bits of the timestamp fit in dirtiness.
+        uint32_t now = (ep_current_time() >> 2) & ((1 << 29) - 1);
+        return isResident() && !isDirty() && dirtiness != now;
+    }
+
     bool isReferenced(bool reset=false, HashTable *ht=NULL);
 
     void referenced(HashTable &ht);
@@ -139,7 +155,21 @@ public:
     }
 
     bool eligibleForEviction() {
-        return isResident() && isClean() && !isDeleted() && !_isSmall;
+        // An ejected inline value keeps its length where the value was,
+        // so it must have room for that.
+        return isResident() && isClean() && !isDeleted() && !_isSmall
+            && (!_isInline || inlineCapacity() >= sizeof(blobval));
+    }
+
+    /**
+     * Can this item be dropped from memory altogether (full eviction)?
+     *
+     * Only when everything about it, metadata included, can be read
+     * back from disk.
+     */
+    bool eligibleForItemEviction() {
+        return isClean() && hasId() && !isDeleted() && !isTempItem()
+            && !isLocked(ep_current_time());
     }
 
     /**
@@ -197,11 +227,109 @@ public:
 
     /**
      * Get this item's value.
+     *
+     * A value stored inline is copied out to a Blob the first time it's
+     * asked for, and the copy is kept for the readers after that until
+     * the value changes or is ejected.  A compressed value is copied
+     * out decompressed every time.
+     *
+     * The caller must hold the lock for this value's bucket.
      */
-    const value_t &getValue() const {
+    value_t getValue() const {
+        if (_isInline) {
+            if (value.get() == NULL) {
+                value.reset(Blob::New(inlineBytes(), inlineLen()));
+            }
+            return value;
+        }
+        if (value.get() && value->isCompressed()) {
+            return value_t(value->decompress());
+        }
         return value;
     }
 
+    /**
+     * True if this item's value is held compressed in memory.
+     */
+    bool isCompressed() const {
+        return !_isInline && value.get() && value->isCompressed();
+    }
+
+    bool eligibleForCompression() {
+        return isResident() && !isDeleted() && !_isInline
+            && !value->isCompressed();
+    }
+
+    /**
+     * Compress this item's value in memory.
+     *
+     * @param stats the global stat instance
+     * @param ht the hashtable that contains this StoredValue instance
+     * @return true if the value was compressed, false if it's not
+     *         eligible or didn't compress well enough
+     */
+    bool compressValue(EPStats &stats, HashTable &ht);
+
+    /**
+     * Replace a compressed value with its decompressed contents.
+     *
+     * @param stats the global stat instance
+     * @param ht the hashtable that contains this StoredValue instance
+     */
+    void decompressValue(EPStats &stats, HashTable &ht);
+
+    /**
+     * True if this item's value is stored inline after the key.
+     */
+    bool isInline() const {
+        return _isInline;
+    }
+
+    /**
+     * Move a long lived value to a fresh allocation.
+     *
+     * Values that have been seen by fewer than the given number of
+     * defragmenter passes only get older.  Older ones are copied to a
+     * new Blob, so the allocator can place them next to other recent
+     * allocations and give back the pages the old one was keeping.
+     *
+     * The caller must hold the lock for this value's bucket.
+     *
+     * @param ageThreshold the number of passes a value must survive
+     * @return the number of bytes moved
+     */
+    size_t defragmentValue(uint8_t ageThreshold) {
+        if (_isInline || !isResident() || value.get() == NULL) {
+            return 0;
+        }
+        if (value->getAge() < ageThreshold) {
+            value->incrementAge();
+            return 0;
+        }
+        value_t moved(Blob::New(*value));
+        value = moved;
+        return moved->getSize();
+    }
+
+    /**
+     * Get the number of bytes reserved for an inline value.
+     */
+    size_t inlineCapacity() const {
+        if (_isSmall) {
+            return extra.small.valcap;
+        } else {
+            return extra.feature.valcap;
+        }
+    }
+
+    /**
+     * Get the length of the value held in a separate Blob (zero if
+     * the value is inline or deleted).
+     */
+    size_t blobLength() const {
+        return !_isInline && value.get() ? value->length() : 0;
+    }
+
     /**
      * Get the expiration time of this item.
      *
@@ -249,8 +377,8 @@ public:
     void setValue(Item &itm, EPStats &stats, HashTable &ht, bool preserveSeqno) {
         size_t currSize = size();
         reduceCacheSize(ht, currSize);
-        reduceCurrentSize(stats, isDeleted() ? currSize : currSize - value->length());
-        value = itm.getValue();
+        reduceCurrentSize(stats, currSize - blobLength());
+        assignValue(itm.getValue(), ht);
         setResident();
         flags = itm.getFlags();
         if (!_isSmall) {
@@ -266,15 +394,20 @@ public:
         markDirty();
         size_t newSize = size();
         increaseCacheSize(ht, newSize);
-        increaseCurrentSize(stats, newSize - value->length());
+        increaseCurrentSize(stats, newSize - blobLength());
     }
 
     /**
      * Reset the value of this item.
+     *
+     * @param ht the hashtable that contains this StoredValue instance
      */
-    void resetValue() {
+    void resetValue(HashTable &ht) {
         assert(!isDeleted());
         value.reset();
+        if (_isInline) {
+            markInline(false, ht);
+        }
         // item no longer resident once reset the value
         if (!_isSmall) {
             extra.feature.resident = false;
@@ -285,16 +418,16 @@ public:
         if (isDeleted()) {
             return 0;
         } else if (isResident()) {
-            return value->length();
+            return residentLength();
         } else {
             // This is a special case for two phase warmup as an item's value size
             // is not known during the first phase warmup.
-            if (value->length() == 0) {
+            if (residentLength() == 0) {
                 return 0;
             }
             blobval uval;
-            assert(value->length() == sizeof(uval));
-            std::memcpy(uval.chlen, value->getData(), sizeof(uval));
+            assert(residentLength() == sizeof(uval));
+            std::memcpy(uval.chlen, residentData(), sizeof(uval));
             return static_cast<size_t>(uval.len);
         }
     }
@@ -511,16 +644,18 @@ public:
         // This differs from valLength in that it reports the
         // *resident* length instead of the length of the actual value
         // as it existed.
-        size_t vallen = isDeleted() ? 0 : value->length();
+        // An inline value is covered by the capacity reserved after the key.
+        size_t vallen = blobLength();
         size_t valign = 0;
         if (vallen % sizeof(void*) != 0) {
             valign = sizeof(void*) - vallen % sizeof(void*);
         }
+        size_t keyval = getKeyLen() + inlineCapacity();
         size_t kalign = 0;
-        if (getKeyLen() % sizeof(void*) != 0) {
-            kalign = sizeof(void*) - getKeyLen() % sizeof(void*);
+        if (keyval % sizeof(void*) != 0) {
+            kalign = sizeof(void*) - keyval % sizeof(void*);
         }
-        return sizeOf(_isSmall) + getKeyLen() + vallen + valign + kalign;
+        return sizeOf(_isSmall) + keyval + vallen + valign + kalign;
     }
 
     size_t metaDataSize() {
@@ -560,7 +695,7 @@ public:
      * True if this object is logically deleted.
      */
     bool isDeleted() const {
-        return value.get() == NULL;
+        return value.get() == NULL && !_isInline;
     }
 
     /**
@@ -572,9 +707,9 @@ public:
         }
 
         size_t oldsize = size();
-        size_t old_valsize = value->length();
+        size_t old_valsize = blobLength();
 
-        resetValue();
+        resetValue(ht);
         markDirty();
         if (!isMetaDelete) {
             setCas(getCas() + 1);
@@ -664,14 +799,18 @@ public:
 private:
 
     StoredValue(const Item &itm, StoredValue *n, EPStats &stats, HashTable &ht,
-                bool setDirty = true, bool small = false) :
-        value(itm.getValue()), next(n), id(itm.getId()),
-        dirtiness(0), _isSmall(small), flags(itm.getFlags())
+                bool setDirty = true, bool small = false, uint8_t valcap = 0) :
+        value(), next(n), id(itm.getId()),
+        dirtiness(0), _isInline(false), _isSmall(small), flags(itm.getFlags())
     {
 
         if (_isSmall) {
+            extra.small.valcap = valcap;
+            extra.small.vallen = 0;
             extra.small.keylen = itm.getKey().length();
         } else {
+            extra.feature.valcap = valcap;
+            extra.feature.vallen = 0;
             extra.feature.cas = itm.getCas();
             extra.feature.exptime = itm.getExptime();
             extra.feature.locked = false;
@@ -680,6 +819,7 @@ private:
             extra.feature.keylen = itm.getKey().length();
             extra.feature.seqno = itm.getSeqno();
         }
+        assignValue(itm.getValue(), ht);
 
         if (setDirty) {
             markDirty();
@@ -689,9 +829,56 @@ private:
 
         increaseMetaDataSize(ht, metaDataSize());
         increaseCacheSize(ht, size());
-        increaseCurrentSize(stats, size() - value->length());
+        increaseCurrentSize(stats, size() - blobLength());
+    }
+
+    /**
+     * Get the number of bytes this StoredValue was allocated with.
+     */
+    size_t allocationSize() const {
+        return sizeOf(_isSmall) + getKeyLen() + inlineCapacity();
+    }
+
+    /**
+     * Get the start of the inline value, just past the key.
+     */
+    char *inlineBytes() const {
+        return const_cast<char*>(getKeyBytes()) + getKeyLen();
+    }
+
+    uint8_t inlineLen() const {
+        if (_isSmall) {
+            return extra.small.vallen;
+        } else {
+            return extra.feature.vallen;
+        }
+    }
+
+    /**
+     * Get the value bytes currently held in memory, wherever they live.
+     */
+    const char *residentData() const {
+        return _isInline ? inlineBytes() : value->getData();
     }
 
+    size_t residentLength() const {
+        return _isInline ? inlineLen() : value->rawLength();
+    }
+
+    /**
+     * Store the given value, inline if it fits in the reserved
+     * capacity and in a shared Blob otherwise.
+     */
+    void assignValue(const value_t &v, HashTable &ht);
+
+    void markInline(bool inl, HashTable &ht);
+
+    /**
+     * Swap the Blob holding this item's value for another one holding
+     * the same value, adjusting the memory accounting.
+     */
+    void replaceBlob(const value_t &v, EPStats &stats, HashTable &ht);
+
     void setResident() {
         if (!_isSmall) {
             extra.feature.resident = true;
@@ -706,10 +893,12 @@ private:
     friend class HashTable;
     friend class StoredValueFactory;
 
-    value_t            value;          // 16 bytes
+    // The value, or the copy getValue() hands out of an inline one.
+    mutable value_t    value;          // 16 bytes
     StoredValue        *next;          // 8 bytes
     int64_t            id;             // 8 bytes
-    uint32_t           dirtiness : 30; // 30 bits -+
+    uint32_t           dirtiness : 29; // 29 bits -+
+    bool               _isInline :  1; // 1 bit    |
     bool               _isSmall  :  1; // 1 bit    | 4 bytes
     bool               _isDirty  :  1; // 1 bit  --+
     uint32_t           flags;          // 4 bytes
@@ -777,6 +966,25 @@ public:
     virtual bool shouldContinue() { return true; }
 };
 
+/**
+ * Visitor for a batch of keys looked up with HashTable::visitMulti.
+ */
+class HashTableBatchVisitor {
+public:
+    virtual ~HashTableBatchVisitor() {}
+
+    /**
+     * Visit one key of the batch.
+     *
+     * This is called with the lock of the key's bucket held, so the
+     * unlocked_* methods of the hash table may be used on it.
+     *
+     * @param index the index of the key in the batch
+     * @param bucket_num the (locked) bucket the key belongs to
+     */
+    virtual void visit(size_t index, int bucket_num) = 0;
+};
+
 /**
  * Hash table visitor that reports the depth of each hashtable bucket.
  */
@@ -834,7 +1042,7 @@ public:
     void visit(StoredValue *v) {
         ++numTotal;
         memSize += v->size();
-        valSize += v->isDeleted() ? 0 : v->getValue()->length();
+        valSize += v->blobLength();
 
         if (v->isResident()) {
             cacheSize += v->size();
@@ -884,6 +1092,311 @@ enum stored_value_type {
     featured                    //!< Full featured stored values.
 };
 
+/**
+ * Layouts of the hash table buckets.
+ */
+enum hash_table_layout {
+    chained,                    //!< Each bucket is a linked list of values.
+    tagged                      //!< Each bucket is a group of tagged slots.
+};
+
+/**
+ * Deferred freeing of memory that lock free readers may be looking at.
+ *
+ * A reader brackets its lock free reads with enter() and leave().
+ * These publish the epoch the read started in, in a cache line owned
+ * by the calling thread, so readers never write to shared memory.
+ * Writers unlink what they want to free and pass it to retire(), which
+ * stamps it with a new epoch.  It's freed once every reader still
+ * inside started at or after that epoch.
+ */
+class EpochReclaimer {
+public:
+    typedef void (*Release)(void *p);
+
+    //! Retired pieces of memory to collect before trying to free them.
+    static const size_t RECLAIM_BATCH = 64;
+
+    EpochReclaimer() : reclaimAt(RECLAIM_BATCH) {}
+
+    ~EpochReclaimer() {
+        drain();
+    }
+
+    /**
+     * Start reading without locks on the calling thread.
+     *
+     * Not reentrant: a thread reads one structure at a time.
+     */
+    static void enter();
+
+    /**
+     * Done reading without locks on the calling thread.
+     */
+    static void leave();
+
+    /**
+     * Free the given memory once no reader can be looking at it.
+     *
+     * It must already be unreachable for readers that start now.
+     * Retired memory is freed in batches, by this or by reclaim().
+     */
+    void retire(void *p, Release release);
+
+    /**
+     * Free what no reader can be looking at anymore.
+     *
+     * Never waits for readers.
+     *
+     * @return the number of pieces of memory freed
+     */
+    size_t reclaim();
+
+    /**
+     * Wait for the readers currently inside to leave and free
+     * everything retired.
+     */
+    void drain();
+
+    /**
+     * Get the number of retired pieces of memory not yet freed.
+     */
+    size_t getNumRetired();
+
+private:
+
+    //! A reader thread's epoch, 0 while it's not reading.
+    struct Reader {
+        volatile uint64_t epoch;
+        Reader           *next;
+        volatile bool     inUse;
+    } __attribute__((aligned(64)));
+
+    struct Retired {
+        Retired(void *ptr, Release r, uint64_t e) :
+            p(ptr), release(r), epoch(e) {}
+        void    *p;
+        Release  release;
+        uint64_t epoch;
+    };
+
+    static Reader *reader();
+    static void releaseReader(void *r);
+    static uint64_t oldestReader();
+
+    static Atomic<uint64_t>      epoch;
+    static Reader * volatile     readers;
+    static Mutex                 readersMutex;
+    static ThreadLocal<Reader*>  threadReader;
+
+    Mutex                mutex;
+    std::vector<Retired> retired;
+    size_t               reclaimAt;
+
+    DISALLOW_COPY_AND_ASSIGN(EpochReclaimer);
+};
+
+/**
+ * Size-class slab allocator for the StoredValue instances of a hash
+ * table.
+ *
+ * Allocations are rounded up to a multiple of CLASS_WIDTH and carved
+ * out of slabs holding objects of a single size class, so items of
+ * similar size share memory instead of scattering variable sized
+ * chunks over the heap.
+ *
+ * The pool is split in stripes, each with its own lock, slabs and
+ * freelists.  The hash table lock guarding an object picks its stripe,
+ * so writers to different parts of the table rarely meet here.  Every
+ * slab keeps its own freelist, and a slab whose objects are all free
+ * is given back to the heap (through the reclaimer, since lock free
+ * readers may still look at it), except for the last one of its class
+ * in the stripe.
+ *
+ * Slab memory that isn't handed out is accounted to the memOverhead
+ * stat; the rest is accounted through StoredValue::size() like any
+ * other StoredValue.
+ */
+class StoredValuePool {
+public:
+    //! Granularity of the size classes.
+    static const size_t CLASS_WIDTH = 16;
+    //! Number of size classes, larger objects come from the heap.
+    static const size_t NUM_CLASSES = 40;
+    //! Objects in the first slab of a class, doubling after that.
+    static const size_t MIN_SLAB_OBJECTS = 8;
+    //! Upper bound of the slab size once it's doubled a few times.
+    static const size_t MAX_SLAB_SIZE = 64 * 1024;
+    //! Most stripes a pool is split in, whatever the number of locks.
+    static const size_t MAX_STRIPES = 8;
+
+    /**
+     * @param st the global stats
+     * @param r where to retire slabs lock free readers may be looking at
+     * @param locks the number of locks of the hash table
+     */
+    StoredValuePool(EPStats &st, EpochReclaimer &r, size_t locks);
+
+    ~StoredValuePool() {
+        releaseAll();
+        delete []stripes;
+    }
+
+    /**
+     * Allocate memory for an object of the given size.
+     *
+     * @param lock the hash table lock guarding the object
+     * @param len the size of the object
+     */
+    void *allocate(size_t lock, size_t len);
+
+    /**
+     * Give back an object allocated with the given size.
+     *
+     * @param lock the hash table lock guarding the object
+     * @param p the object
+     * @param len the size of the object
+     */
+    void release(size_t lock, void *p, size_t len);
+
+    /**
+     * True if objects guarded by the two locks come from the same
+     * stripe, i.e. an object moving from one to the other can stay
+     * where it is.
+     */
+    bool sameStripe(size_t lock1, size_t lock2) const {
+        return lock1 % numStripes == lock2 % numStripes;
+    }
+
+    /**
+     * Give all slabs back to the heap, once lock free readers are done
+     * with them.
+     *
+     * Every object allocated from this pool must already be destroyed.
+     */
+    void releaseAll();
+
+    /**
+     * Get the memory held in slabs.
+     */
+    size_t getSlabMemory();
+
+    /**
+     * Get the slab memory not currently handed out.
+     */
+    size_t getFreeMemory();
+
+    /**
+     * Stop allocating from slabs that are mostly free.
+     *
+     * Slabs using at most the given percentage of their objects are
+     * picked, emptiest first, as long as the rest of their size class
+     * has room for the objects still in them.  The objects still
+     * living in them can then be moved elsewhere with relocate(), and
+     * each slab is given back once its last object moved out.
+     *
+     * startDrain(), relocate() and releaseDrained() must only be
+     * called from one thread at a time.
+     *
+     * @param maxUsage the percentage of a slab in use to drain it at
+     * @return the number of slabs being drained
+     */
+    size_t startDrain(size_t maxUsage);
+
+    /**
+     * True if the given object lives in a slab being drained.
+     */
+    bool isDraining(size_t lock, const void *p, size_t len);
+
+    /**
+     * Move an object, out of a slab being drained or into the stripe
+     * of another lock.
+     *
+     * @param from the hash table lock guarding the object now
+     * @param to the hash table lock that will guard the moved object
+     * @param p the object
+     * @param len the size of the object
+     * @return the new location of the object
+     */
+    void *relocate(size_t from, size_t to, void *p, size_t len);
+
+    /**
+     * Finish draining, putting slabs that couldn't be emptied back in
+     * use.
+     *
+     * @return the number of bytes given back since startDrain()
+     */
+    size_t releaseDrained();
+
+private:
+
+    /**
+     * Header at the start of every slab.
+     */
+    struct Slab {
+        //! Neighbours in the list of slabs of the class with free objects.
+        Slab     *prev;
+        Slab     *next;
+        void     *freelist;
+        uint32_t  size;
+        uint32_t  objects;
+        uint32_t  live;
+        uint8_t   cls;
+        bool      draining;
+    };
+
+    struct SizeClass {
+        //! Slabs with free objects, the ones to allocate from.
+        Slab    *partial;
+        uint32_t nextObjects;
+        uint32_t numSlabs;
+    };
+
+    struct Stripe {
+        Stripe() : slabMemory(0), allocated(0), drained(0) {
+            memset(classes, 0, sizeof(classes));
+        }
+
+        SpinLock            lock;
+        SizeClass           classes[NUM_CLASSES];
+        //! Every slab of the stripe, sorted by address.
+        std::vector<Slab*>  slabs;
+        Atomic<size_t>      slabMemory;
+        Atomic<size_t>      allocated;
+        //! Bytes given back by drained slabs since startDrain().
+        size_t              drained;
+    };
+
+    //! Room for the slab header, keeping the objects aligned.
+    static const size_t HEADER_SIZE =
+        (sizeof(Slab) + CLASS_WIDTH - 1) & ~(CLASS_WIDTH - 1);
+
+    static size_t classFor(size_t len) {
+        return (len - 1) / CLASS_WIDTH;
+    }
+
+    static size_t accounted(size_t len) {
+        return (len + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    }
+
+    Stripe &stripeFor(size_t lock) {
+        return stripes[lock % numStripes];
+    }
+
+    Slab *newSlab(Stripe &st, size_t c);
+    void freeSlab(Stripe &st, Slab *slab);
+    static Slab *slabFor(Stripe &st, const void *p);
+    static void linkPartial(SizeClass &sc, Slab *slab);
+    static void unlinkPartial(SizeClass &sc, Slab *slab);
+
+    EPStats            &stats;
+    EpochReclaimer     &reclaimer;
+    size_t              numStripes;
+    Stripe             *stripes;
+
+    DISALLOW_COPY_AND_ASSIGN(StoredValuePool);
+};
+
 /**
  * Creator of StoredValue instances.
  */
@@ -892,8 +1405,15 @@ public:
 
     /**
      * Create a new StoredValueFactory of the given type.
+     *
+     * @param s the global stats
+     * @param t the type of StoredValues to create
+     * @param inl values up to this many bytes are stored inline
+     * @param p the pool to allocate from (NULL to use the heap)
      */
-    StoredValueFactory(EPStats &s, enum stored_value_type t = featured) : stats(&s),type(t) { }
+    StoredValueFactory(EPStats &s, enum stored_value_type t = featured,
+                       size_t inl = 0, StoredValuePool *p = NULL) :
+        stats(&s), type(t), inlineMax(inl), pool(p) { }
 
     /**
      * Create a new StoredValue with the given item.
@@ -901,34 +1421,53 @@ public:
      * @param itm the item the StoredValue should contain
      * @param n the the top of the hash bucket into which this will be inserted
      * @param ht the hashtable that will contain the StoredValue instance created
+     * @param lock the hash table lock that will guard it
      * @param setDirty if true, mark this item as dirty after creating it
      */
     StoredValue *operator ()(const Item &itm, StoredValue *n, HashTable &ht,
-                             bool setDirty = true) {
+                             size_t lock, bool setDirty = true) {
         switch(type) {
         case small:
-            return newStoredValue(itm, n, ht, setDirty, true);
+            return newStoredValue(itm, n, ht, lock, setDirty, true);
             break;
         case featured:
-            return newStoredValue(itm, n, ht, setDirty, false);
+            return newStoredValue(itm, n, ht, lock, setDirty, false);
             break;
         default:
             abort();
         };
     }
 
+    /**
+     * Destroy a StoredValue created by this factory.
+     *
+     * @param v the StoredValue
+     * @param lock the hash table lock guarding it
+     */
+    void destroy(StoredValue *v, size_t lock) {
+        size_t len = v->allocationSize();
+        v->~StoredValue();
+        if (pool) {
+            pool->release(lock, v, len);
+        } else {
+            ::operator delete(v);
+        }
+    }
+
 private:
 
     StoredValue* newStoredValue(const Item &itm, StoredValue *n, HashTable &ht,
-                                bool setDirty, bool small) {
+                                size_t lock, bool setDirty, bool small) {
         size_t base = StoredValue::sizeOf(small);
 
         const std::string &key = itm.getKey();
         assert(key.length() < 256);
-        size_t len = key.length() + base;
+        uint8_t valcap = inlineCapacity(itm);
+        size_t len = key.length() + base + valcap;
 
-        StoredValue *t = new (::operator new(len))
-            StoredValue(itm, n, *stats, ht, setDirty, small);
+        StoredValue *t = new (pool ? pool->allocate(lock, len)
+                                   : ::operator new(len))
+            StoredValue(itm, n, *stats, ht, setDirty, small, valcap);
         if (small) {
             std::memcpy(t->extra.small.keybytes, key.data(), key.length());
         } else {
@@ -938,8 +1477,32 @@ private:
         return t;
     }
 
+    /**
+     * Get the number of bytes to reserve for storing the item's value
+     * inline, or zero if it goes in a Blob.
+     */
+    uint8_t inlineCapacity(const Item &itm) {
+        const value_t &val = itm.getValue();
+        if (val.get() == NULL || val->length() > inlineMax) {
+            return 0;
+        }
+        // Pad up to the pointer boundary the allocation is rounded
+        // to anyway, leaving some room for the value to grow.
+        size_t used = itm.getKey().length() + val->length();
+        size_t cap = val->length() +
+            (sizeof(void*) - used % sizeof(void*)) % sizeof(void*);
+        if (cap == 0) {
+            cap = sizeof(void*);
+        } else if (cap > std::numeric_limits<uint8_t>::max()) {
+            cap = val->length();
+        }
+        return static_cast<uint8_t>(cap);
+    }
+
     EPStats                *stats;
     enum stored_value_type  type;
+    size_t                  inlineMax;
+    StoredValuePool        *pool;
 
 };
 
@@ -958,15 +1521,33 @@ public:
      * @param t the type of StoredValues this hash table will contain
      */
     HashTable(EPStats &st, size_t s = 0, size_t l = 0,
-              enum stored_value_type t = featured) : stats(st), valFact(st, t) {
-        size = HashTable::getNumBuckets(s);
+              enum stored_value_type t = featured) : stats(st), valFact(st, t),
+                                                     valPool(st, reclaimer,
+                                                             HashTable::getNumLocks(l)) {
+        layout = getDefaultLayout();
+        // The configured size counts chains, a tagged bucket holds a
+        // whole group of items.
+        size = s != 0 ? s : std::max(bucketsForItems(HashTable::getNumBuckets()),
+                                     static_cast<size_t>(1));
         n_locks = HashTable::getNumLocks(l);
-        valFact = StoredValueFactory(st, getDefaultStorageValueType());
+        valFact = StoredValueFactory(st, getDefaultStorageValueType(),
+                                     getDefaultInlineValueSize(), &valPool);
         assert(size > 0);
         assert(n_locks > 0);
         assert(visitors == 0);
-        values = static_cast<StoredValue**>(calloc(size, sizeof(StoredValue*)));
-        mutexes = new Mutex[n_locks];
+        values = NULL;
+        groups = NULL;
+        oldValues = NULL;
+        oldGroups = NULL;
+        oldSize = 0;
+        migrated = 0;
+        stripeMigrated.resize(n_locks, 0);
+        if (layout == tagged) {
+            groups = static_cast<TaggedBucket*>(calloc(size, sizeof(TaggedBucket)));
+        } else {
+            values = static_cast<StoredValue**>(calloc(size, sizeof(StoredValue*)));
+        }
+        mutexes = new VersionedMutex[n_locks];
         activeState = true;
     }
 
@@ -976,17 +1557,52 @@ public:
         while (visitors > 0) {
             usleep(100);
         }
+        // ...and for lock free readers.
+        reclaimer.drain();
         delete []mutexes;
         free(values);
         values = NULL;
+        free(groups);
+        groups = NULL;
+        free(oldValues);
+        free(oldGroups);
     }
 
     size_t memorySize() {
-        return sizeof(HashTable)
-            + (size * sizeof(StoredValue*))
-            + (n_locks * sizeof(Mutex));
+        return bucketMemorySize() + overflowMemory.get();
     }
 
+    /**
+     * Get the bucket layout used by this hash table.
+     */
+    enum hash_table_layout getLayout(void) { return layout; }
+
+    /**
+     * Get the memory used by overflow groups of a tagged hash table.
+     */
+    size_t getOverflowMemory(void) { return overflowMemory; }
+
+    /**
+     * Get the number of values stored inline in their StoredValue.
+     */
+    size_t getNumInlineValues(void) { return numInlineValues; }
+
+    /**
+     * Get the memory saved by storing values inline, i.e. the Blob
+     * headers that didn't need to be allocated.
+     */
+    size_t getInlineMemSaved(void) { return numInlineValues * sizeof(Blob); }
+
+    /**
+     * Get the memory held in StoredValue slabs.
+     */
+    size_t getSlabMemory(void) { return valPool.getSlabMemory(); }
+
+    /**
+     * Get the slab memory on freelists waiting for reuse.
+     */
+    size_t getSlabFreeMemory(void) { return valPool.getFreeMemory(); }
+
     /**
      * Get the number of hash table buckets this hash table has.
      */
@@ -1053,9 +1669,51 @@ public:
 
     /**
      * Resize to the specified size.
+     *
+     * The items are moved over to the new buckets one old bucket at a
+     * time (see migrate()), holding only the locks of that bucket and
+     * of the buckets its items move to, so other users of the table
+     * only ever wait for a single bucket to be moved.  A resize that
+     * could not be finished (e.g. because the table is being visited)
+     * is picked up by the next call.
      */
     void resize(size_t to);
 
+    /**
+     * Begin an incremental resize to the specified size.
+     *
+     * Until the resize is complete the old and the new bucket arrays
+     * coexist and lookups consult whichever holds the key's bucket.
+     *
+     * @return true if a resize was started
+     */
+    bool startResize(size_t to);
+
+    /**
+     * Move up to the given number of buckets from the old bucket
+     * array to the new one, completing the resize once all of them
+     * have been moved.  Each bucket is moved under its own lock and
+     * the locks of the buckets its items move to.
+     *
+     * @param buckets the maximum number of old buckets to migrate
+     * @return true if there is more to migrate and progress was made
+     */
+    bool migrate(size_t buckets);
+
+    /**
+     * Is there an incremental resize in progress?
+     */
+    bool isResizing() { return oldSize != 0; }
+
+    /**
+     * Get the number of old buckets still waiting to be migrated by
+     * the resize in progress.
+     */
+    size_t getResizeRemaining() {
+        LockHolder lh(resizeMutex);
+        return oldSize - migrated;
+    }
+
     /**
      * Find the item with the given key.
      *
@@ -1065,10 +1723,40 @@ public:
     StoredValue *find(std::string &key, bool trackReference=true) {
         assert(isActive());
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(key, &bucket_num);
-        return unlocked_find(key, bucket_num, false, trackReference);
+        uint64_t h = hash(key);
+        VersionedLockHolder lh = getLockedBucket(h, &bucket_num);
+        return unlocked_findHashed(key, h, bucket_num, false, trackReference);
     }
 
+    /**
+     * Try to fetch an item without taking its bucket lock.
+     *
+     * The bucket is read under the version of its lock and the read is
+     * retried if a writer got in the way.  Only resident values stored
+     * inline can be copied out this way, and only when the lookup
+     * doesn't need to update the StoredValue (expire it, touch it, mark
+     * it referenced, ...).  Everything else is left to the locked path.
+     *
+     * @param key the key to find
+     * @param h the hash of the key
+     * @param vbucket the vbucket of the new item
+     * @param trackReference true if the lookup counts as a reference
+     * @param referenced output parameter receiving the item's NRU bit
+     * @return a new Item, or NULL if the caller must take the lock
+     */
+    Item *optimisticGet(const std::string &key, uint64_t h, uint16_t vbucket,
+                        bool trackReference, bool *referenced);
+
+    /**
+     * Get the number of lookups served by optimisticGet.
+     */
+    size_t getNumOptimisticGets(void) { return numOptimisticGets; }
+
+    /**
+     * Get the number of optimistic reads that had to be retried.
+     */
+    size_t getNumOptimisticConflicts(void) { return numOptimisticConflicts; }
+
     /**
      * Add an item from online restore.
      *
@@ -1083,9 +1771,8 @@ public:
             return false;
         }
 
-        StoredValue *v = valFact(itm, values[bucket_num], *this);
+        StoredValue *v = unlocked_createValue(itm, bucket_num);
         assert(v);
-        values[bucket_num] = v;
         ++numItems;
         if (op == queue_op_del) {
             unlocked_softDelete(v, itm.getCas());
@@ -1131,9 +1818,10 @@ public:
 
         mutation_type_t rv = NOT_FOUND;
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(val.getKey(), &bucket_num);
-        StoredValue *v = unlocked_find(val.getKey(), bucket_num, true,
-                                       trackReference);
+        uint64_t h = hash(val.getKey());
+        VersionedLockHolder lh = getLockedBucket(h, &bucket_num);
+        StoredValue *v = unlocked_findHashed(val.getKey(), h, bucket_num, true,
+                                             trackReference);
 
         /*
          * prior to checking for the lock, we should check if this object
@@ -1191,8 +1879,7 @@ public:
             if (!hasMetaData) {
                 itm.setCas();
             }
-            v = valFact(itm, values[bucket_num], *this);
-            values[bucket_num] = v;
+            v = unlocked_createValueHashed(itm, h, bucket_num);
             ++numItems;
             if (trackReference && !v->isTempItem()) {
                 v->referenced(*this);
@@ -1236,7 +1923,7 @@ public:
     add_type_t add(const Item &val, bool isDirty = true, bool storeVal = true) {
         assert(isActive());
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(val.getKey(), &bucket_num);
+        VersionedLockHolder lh = getLockedBucket(val.getKey(), &bucket_num);
         return unlocked_add(bucket_num, val, isDirty, storeVal);
     }
 
@@ -1279,8 +1966,9 @@ public:
                                int64_t &row_id) {
         assert(isActive());
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(key, &bucket_num);
-        StoredValue *v = unlocked_find(key, bucket_num, false, false);
+        uint64_t h = hash(key);
+        VersionedLockHolder lh = getLockedBucket(h, &bucket_num);
+        StoredValue *v = unlocked_findHashed(key, h, bucket_num, false, false);
         if (v) {
             row_id = v->getId();
         }
@@ -1362,19 +2050,43 @@ public:
      */
     StoredValue *unlocked_find(const std::string &key, int bucket_num,
                                bool wantsDeleted=false, bool trackReference=true) {
-        StoredValue *v = values[bucket_num];
-        while (v) {
-            if (v->hasKey(key)) {
-                if (trackReference && !v->isDeleted()) {
-                    v->referenced(*this);
-                }
-                if (wantsDeleted || !v->isDeleted()) {
-                    return v;
-                } else {
-                    return NULL;
-                }
+        // Only the tagged layout needs the hash once the bucket is known.
+        uint64_t h = layout == tagged ? hash(key) : 0;
+        return unlocked_findHashed(key, h, bucket_num, wantsDeleted, trackReference);
+    }
+
+    /**
+     * Find a StoredValue within a bucket, reusing the hash of the key
+     * already computed to locate the bucket.
+     *
+     * @param key the key to find
+     * @param h the hash of the key
+     * @param bucket_num the bucket number
+     * @param wantsDeleted whether a deleted value needs to be returned
+     *                     or not
+     * @param trackReference whether to track the reference or not
+     * @return a pointer to a StoredValue -- NULL if not found
+     */
+    StoredValue *unlocked_findHashed(const std::string &key, uint64_t h, int bucket_num,
+                                     bool wantsDeleted=false,
+                                     bool trackReference=true) {
+        StoredValue *v = NULL;
+        if (layout == tagged) {
+            v = unlocked_findTagged(key, h, bucket_num, NULL, NULL);
+        } else {
+            v = *chainFor(bucket_num);
+            while (v && !v->hasKey(key)) {
+                v = v->next;
+            }
+        }
+
+        if (v) {
+            if (trackReference && !v->isDeleted()) {
+                v->referenced(*this);
+            }
+            if (wantsDeleted || !v->isDeleted()) {
+                return v;
             }
-            v = v->next;
         }
         return NULL;
     }
@@ -1387,15 +2099,9 @@ public:
      *
      * @return the hash value
      */
-    inline int hash(const char *str, const size_t len) {
+    inline uint64_t hash(const char *str, const size_t len) {
         assert(isActive());
-        int h=5381;
-
-        for(size_t i=0; i < len; i++) {
-            h = ((h << 5) + h) ^ str[i];
-        }
-
-        return h;
+        return hash64(str, len);
     }
 
     /**
@@ -1404,7 +2110,7 @@ public:
      * @param s the string
      * @return the hash value
      */
-    inline int hash(const std::string &s) {
+    inline uint64_t hash(const std::string &s) {
         return hash(s.data(), s.length());
     }
 
@@ -1414,14 +2120,16 @@ public:
      *
      * @param h the input hash
      * @param bucket output parameter to receive a bucket
-     * @return a locked LockHolder
+     * @return a locked VersionedLockHolder
      */
-    inline LockHolder getLockedBucket(int h, int *bucket) {
+    inline VersionedLockHolder getLockedBucket(uint64_t h, int *bucket) {
         while (true) {
             assert(isActive());
             *bucket = getBucketForHash(h);
-            LockHolder rv(mutexes[mutexForBucket(*bucket)]);
-            if (*bucket == getBucketForHash(h)) {
+            int lock_num = mutexForBucket(*bucket);
+            VersionedLockHolder rv(mutexes[lock_num]);
+            if (*bucket == getBucketForHash(h)
+                && lock_num == mutexForBucket(*bucket)) {
                 return rv;
             }
         }
@@ -1434,9 +2142,9 @@ public:
      * @param s the start of the key
      * @param n the size of the key
      * @param bucket output parameter to receive a bucket
-     * @return a locked LockHolder
+     * @return a locked VersionedLockHolder
      */
-    inline LockHolder getLockedBucket(const char *s, size_t n, int *bucket) {
+    inline VersionedLockHolder getLockedBucket(const char *s, size_t n, int *bucket) {
         return getLockedBucket(hash(s, n), bucket);
     }
 
@@ -1446,9 +2154,9 @@ public:
      *
      * @param s the key
      * @param bucket output parameter to receive a bucket
-     * @return a locked LockHolder
+     * @return a locked VersionedLockHolder
      */
-    inline LockHolder getLockedBucket(const std::string &s, int *bucket) {
+    inline VersionedLockHolder getLockedBucket(const std::string &s, int *bucket) {
         return getLockedBucket(hash(s.data(), s.size()), bucket);
     }
 
@@ -1463,7 +2171,12 @@ public:
      */
     bool unlocked_del(const std::string &key, int bucket_num) {
         assert(isActive());
-        StoredValue *v = values[bucket_num];
+        if (layout == tagged) {
+            return unlocked_delTagged(key, bucket_num);
+        }
+
+        StoredValue **head = chainFor(bucket_num);
+        StoredValue *v = *head;
 
         // Special case empty bucket.
         if (!v) {
@@ -1476,18 +2189,8 @@ public:
                 return false;
             }
 
-            values[bucket_num] = v->next;
-            size_t currSize = v->size();
-            StoredValue::reduceCacheSize(*this, currSize);
-            StoredValue::reduceCurrentSize(stats, v->isDeleted() ? currSize
-                                           : currSize - v->getValue()->length());
-            StoredValue::reduceMetaDataSize(*this, v->metaDataSize());
-            if (v->isTempItem()) {
-                --numTempItems;
-            } else {
-                --numItems;
-            }
-            delete v;
+            *head = v->next;
+            unlocked_destroyValue(v, bucket_num);
             return true;
         }
 
@@ -1499,17 +2202,7 @@ public:
                 }
 
                 v->next = v->next->next;
-                size_t currSize = tmp->size();
-                StoredValue::reduceCacheSize(*this, currSize);
-                StoredValue::reduceCurrentSize(stats, tmp->isDeleted() ? currSize
-                                               : currSize - tmp->getValue()->length());
-                StoredValue::reduceMetaDataSize(*this, tmp->metaDataSize());
-                if (tmp->isTempItem()) {
-                    --numTempItems;
-                } else {
-                    --numItems;
-                }
-                delete tmp;
+                unlocked_destroyValue(tmp, bucket_num);
                 return true;
             } else {
                 v = v->next;
@@ -1519,6 +2212,26 @@ public:
         return false;
     }
 
+    /**
+     * Drop an item from memory altogether, leaving only the copy on
+     * disk (full eviction).  The bucket must already be locked.
+     *
+     * @param v the item to eject, freed on success
+     * @param bucket_num the bucket the item is in
+     * @return true if the item was ejected
+     */
+    bool unlocked_ejectItem(StoredValue *v, int bucket_num);
+
+    /**
+     * Turn the temporary item created for a key missing from memory
+     * into the item read back from disk.  The bucket must already be
+     * locked.
+     *
+     * @param v the temporary item
+     * @param itm the item as stored on disk
+     */
+    void unlocked_restoreTempItem(StoredValue *v, Item &itm);
+
     /**
      * Delete the item with the given key.
      *
@@ -1528,7 +2241,7 @@ public:
     bool del(const std::string &key) {
         assert(isActive());
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(key, &bucket_num);
+        VersionedLockHolder lh = getLockedBucket(key, &bucket_num);
         return unlocked_del(key, bucket_num);
     }
 
@@ -1537,11 +2250,99 @@ public:
      */
     void visit(HashTableVisitor &visitor);
 
+    /**
+     * A place in the hash table a visit can be resumed from.
+     *
+     * A position is only good for the bucket layout it was taken in.
+     * If the table is resized in between, resuming from it starts the
+     * visit over from the beginning.
+     */
+    class Position {
+    public:
+        //! The start of the table.
+        Position() : ht_size(0), old_size(0), lock(0), hash_bucket(0) {}
+
+        bool operator==(const Position &other) const {
+            return ht_size == other.ht_size && old_size == other.old_size
+                && lock == other.lock && hash_bucket == other.hash_bucket;
+        }
+
+        bool operator!=(const Position &other) const {
+            return !(*this == other);
+        }
+
+        int getLock() const { return lock; }
+        int getBucket() const { return hash_bucket; }
+
+    private:
+        Position(size_t s, size_t o, int l, int b) :
+            ht_size(s), old_size(o), lock(l), hash_bucket(b) {}
+
+        size_t ht_size;
+        size_t old_size;
+        int    lock;
+        int    hash_bucket;
+
+        friend class HashTable;
+    };
+
+    /**
+     * Visit the items of the table from the given position on, and
+     * stop at the first bucket boundary after maxItems of them.
+     *
+     * @param visitor the visitor
+     * @param start where to start, Position() for the beginning
+     * @param maxItems the number of items to visit before pausing, 0
+     *        to visit the rest of the table
+     * @param visited incremented by the number of items visited
+     * @return where to resume, or endPosition() if the visit is done
+     *         or the visitor asked to stop
+     */
+    Position pauseResumeVisit(HashTableVisitor &visitor, const Position &start,
+                              size_t maxItems, size_t &visited);
+
+    /**
+     * Get the position pauseResumeVisit returns once it's been
+     * through the whole table.
+     */
+    Position endPosition() const {
+        return Position(size, oldSize, n_locks, 0);
+    }
+
     /**
      * Visit all items within this call with a depth visitor.
      */
     void visitDepth(HashTableDepthVisitor &visitor);
 
+    /**
+     * Visit the buckets of a batch of keys.
+     *
+     * The keys are grouped by the lock covering their bucket so every
+     * lock is taken once for the whole batch, and the buckets of a
+     * group are prefetched before the first one is visited.  Keys are
+     * not visited in the order given.
+     *
+     * @param hashes the hashes of the keys in the batch
+     * @param visitor called once for each key with its bucket locked
+     */
+    void visitMulti(const std::vector<uint64_t> &hashes,
+                    HashTableBatchVisitor &visitor);
+
+    /**
+     * Compact the StoredValue slabs of this hash table.
+     *
+     * Slabs using no more than the given percentage of their space
+     * are drained by moving their StoredValues to the other slabs one
+     * lock at a time, and then given back to the heap.  StoredValues
+     * whose inline value was ejected are moved to a smaller allocation
+     * on the way.
+     *
+     * @param maxUsage the percentage of a slab in use to drain it at
+     * @param moved incremented by the bytes of StoredValues moved
+     * @return the number of bytes of slabs given back to the heap
+     */
+    size_t defragmentValues(size_t maxUsage, size_t &moved);
+
     /**
      * Get the number of buckets that should be used for initialization.
      *
@@ -1590,6 +2391,61 @@ public:
      */
     static const char* getDefaultStorageValueTypeStr();
 
+    /**
+     * Set the default bucket layout by name.
+     *
+     * @param l either "chained" or "tagged"
+     *
+     * @return true if the layout was recognized
+     */
+    static bool setDefaultLayout(const char *l);
+
+    /**
+     * Set the default bucket layout by enum value.
+     */
+    static void setDefaultLayout(enum hash_table_layout);
+
+    /**
+     * Get the default bucket layout.
+     */
+    static enum hash_table_layout getDefaultLayout();
+
+    /**
+     * Get the name of the given bucket layout.
+     */
+    static const char* getLayoutStr(enum hash_table_layout);
+
+    /**
+     * Set the number of buckets moved per incremental resize step.
+     */
+    static void setDefaultResizeStep(size_t to);
+
+    /**
+     * Get the number of buckets moved per incremental resize step.
+     */
+    static size_t getDefaultResizeStep();
+
+    /**
+     * Set the largest value stored inline in a StoredValue (0 to
+     * always use a separate Blob).
+     */
+    static void setDefaultInlineValueSize(size_t to);
+
+    /**
+     * Get the largest value stored inline in a StoredValue.
+     */
+    static size_t getDefaultInlineValueSize();
+
+    /**
+     * Enable or disable lock free reads in optimisticGet.
+     */
+    static void setDefaultOptimisticReads(bool to);
+
+    /**
+     * True if optimisticGet may read without taking a lock.
+     */
+    static bool getDefaultOptimisticReads();
+
     /**
      * Get the max deleted seqno seen so far.
      */
@@ -1616,10 +2472,12 @@ public:
     Atomic<size_t>       numEjects;
     Atomic<size_t>       numReferenced;
     Atomic<size_t>       numReferencedEjects;
+    //! Values currently stored inline in their StoredValue.
+    Atomic<size_t>       numInlineValues;
     //! Memory consumed by items in this hashtable.
-    Atomic<size_t>       memSize;
+    ShardedCounter<size_t> memSize;
     //! Cache size.
-    Atomic<size_t>       cacheSize;
+    ShardedCounter<size_t> cacheSize;
     //! Meta-data size.
     Atomic<size_t>       metaDataMemory;
 
@@ -1629,27 +2487,201 @@ private:
 
     size_t               size;
     size_t               n_locks;
+    enum hash_table_layout layout;
     StoredValue        **values;
-    Mutex               *mutexes;
+    TaggedBucket        *groups;
+    // The bucket array being migrated away from by a resize.
+    size_t               oldSize;
+    size_t               migrated;
+    // How many of the old buckets of each lock's stripe were migrated,
+    // changed only under that lock.
+    std::vector<size_t>  stripeMigrated;
+    StoredValue        **oldValues;
+    TaggedBucket        *oldGroups;
+    VersionedMutex      *mutexes;
+    //! Held by whoever moves buckets of a resize along.
+    Mutex                resizeMutex;
+    //! The locks the bucket being migrated needs (under resizeMutex).
+    std::vector<bool>    migrationLocks;
+    std::vector<bool>    migrationNeeded;
     EPStats&             stats;
     StoredValueFactory   valFact;
+    //! Frees what optimisticGet may still be looking at.
+    EpochReclaimer       reclaimer;
+    StoredValuePool      valPool;
     Atomic<size_t>       visitors;
-    Atomic<size_t>       numItems;
+    ShardedCounter<size_t> numItems;
     Atomic<size_t>       numResizes;
     Atomic<size_t>       numTempItems;
+    //! Memory used by the overflow groups of a tagged table.
+    Atomic<size_t>       overflowMemory;
     bool                 activeState;
 
     static size_t                 defaultNumBuckets;
     static size_t                 defaultNumLocks;
     static enum stored_value_type defaultStoredValueType;
+    static enum hash_table_layout defaultLayout;
+    static size_t                 defaultResizeStep;
+    static size_t                 defaultInlineValueSize;
+    static bool                   defaultOptimisticReads;
+
+    //! Number of times an optimistic read is attempted before giving up.
+    static const int              OPTIMISTIC_RETRIES = 3;
+    //! Longest chain an optimistic read will follow.
+    static const int              OPTIMISTIC_MAX_DEPTH = 64;
+    //! Items a tagged bucket is sized for, 3/4 of its slots.
+    static const size_t           TAGGED_ITEMS_PER_BUCKET = TaggedBucket::SLOTS * 3 / 4;
+
+    ShardedCounter<size_t> numOptimisticGets;
+    Atomic<size_t>       numOptimisticConflicts;
+
+    size_t bucketSize() {
+        return layout == tagged ? sizeof(TaggedBucket) : sizeof(StoredValue*);
+    }
+
+    /**
+     * Get the number of buckets to hold the given number of items at
+     * the layout's load factor.
+     */
+    size_t bucketsForItems(size_t n) {
+        return layout == tagged ? n / TAGGED_ITEMS_PER_BUCKET : n;
+    }
 
-    int getBucketForHash(int h) {
-        return abs(h % static_cast<int>(size));
+    size_t bucketMemorySize() {
+        return sizeof(HashTable)
+            + ((size + oldSize) * bucketSize())
+            + (n_locks * sizeof(VersionedMutex));
+    }
+
+    /*
+     * While a resize is in progress, bucket numbers at or above size
+     * refer to buckets of the old array (offset by size).
+     */
+    StoredValue **chainFor(int bucket_num) {
+        if (bucket_num >= static_cast<int>(size)) {
+            return &oldValues[bucket_num - size];
+        }
+        return &values[bucket_num];
+    }
+
+    TaggedBucket *groupFor(int bucket_num) {
+        if (bucket_num >= static_cast<int>(size)) {
+            return &oldGroups[bucket_num - size];
+        }
+        return &groups[bucket_num];
+    }
+
+    /*
+     * Walk all the buckets (new, then old) guarded by a given lock.
+     */
+    int firstBucketForLock(int lock_num) {
+        if (lock_num < static_cast<int>(size)) {
+            return lock_num;
+        }
+        return size + lock_num;
+    }
+
+    int nextBucketForLock(int bucket_num) {
+        int next = bucket_num + n_locks;
+        if (bucket_num < static_cast<int>(size)
+            && next >= static_cast<int>(size)) {
+            next = size + mutexForBucket(bucket_num);
+        }
+        return next;
+    }
+
+    /**
+     * Create a new StoredValue for the given item and link it into
+     * the given (locked) bucket.
+     */
+    StoredValue *unlocked_createValue(const Item &itm, int bucket_num,
+                                      bool setDirty = true) {
+        uint64_t h = layout == tagged ? hash(itm.getKey()) : 0;
+        return unlocked_createValueHashed(itm, h, bucket_num, setDirty);
+    }
+
+    StoredValue *unlocked_createValueHashed(const Item &itm, uint64_t h,
+                                            int bucket_num, bool setDirty = true) {
+        size_t lock = mutexForBucket(bucket_num);
+        if (layout == tagged) {
+            StoredValue *v = valFact(itm, NULL, *this, lock, setDirty);
+            linkTagged(groupFor(bucket_num), v, TaggedBucket::tagFor(h));
+            return v;
+        }
+        StoredValue **head = chainFor(bucket_num);
+        StoredValue *v = valFact(itm, *head, *this, lock, setDirty);
+        *head = v;
+        return v;
+    }
+
+    /**
+     * Account for the removal of a value already unlinked from the
+     * given bucket and free it.
+     */
+    void unlocked_destroyValue(StoredValue *v, int bucket_num) {
+        size_t currSize = v->size();
+        StoredValue::reduceCacheSize(*this, currSize);
+        StoredValue::reduceCurrentSize(stats, currSize - v->blobLength());
+        StoredValue::reduceMetaDataSize(*this, v->metaDataSize());
+        if (v->isInline()) {
+            --numInlineValues;
+        }
+        if (v->isTempItem()) {
+            --numTempItems;
+        } else {
+            --numItems;
+        }
+        valFact.destroy(v, mutexForBucket(bucket_num));
+    }
+
+    StoredValue *unlocked_findTagged(const std::string &key, uint64_t h,
+                                     int bucket_num, TaggedBucket **group,
+                                     int *slot);
+    bool unlocked_delTagged(const std::string &key, int bucket_num);
+    void linkTagged(TaggedBucket *bucket, StoredValue *v, uint8_t tag);
+    TaggedBucket *newOverflowGroup();
+    void freeOverflowGroups(TaggedBucket *bucket);
+    size_t unlocked_visitBucket(HashTableVisitor &visitor, int bucket_num);
+    StoredValue *unlocked_moveValue(StoredValue *v, int lock, bool draining,
+                                    size_t &moved);
+    StoredValue *unlocked_rehomeValue(StoredValue *v, size_t old_bucket,
+                                      size_t new_bucket);
+    bool migrateStripe(int lock_num, size_t budget, size_t &moved);
+    bool unlocked_addMigrationLocks(size_t old_bucket, std::vector<bool> &locks);
+    void unlocked_migrateBucket(size_t old_bucket);
+    void unlocked_finishResize();
+
+    /**
+     * Get the bucket currently holding the given hash, which is in
+     * the old bucket array if a resize hasn't migrated it yet.
+     */
+    int getBucketForHash(uint64_t h) {
+        // This is also used without a lock to pick the lock to take, so
+        // don't let a resize finishing in between zero the divisor.
+        size_t osz = oldSize;
+        if (osz != 0) {
+            int old_bucket = static_cast<int>(h % osz);
+            if (!isMigrated(old_bucket)) {
+                return size + old_bucket;
+            }
+        }
+        return static_cast<int>(h % size);
+    }
+
+    /**
+     * Has the given old bucket been moved to the new array yet?  The
+     * old buckets of each lock's stripe are moved in order.
+     */
+    bool isMigrated(size_t old_bucket) {
+        return old_bucket / n_locks < stripeMigrated[old_bucket % n_locks];
     }
 
     inline int mutexForBucket(int bucket_num) {
         assert(isActive());
         assert(bucket_num >= 0);
+        if (bucket_num >= static_cast<int>(size)) {
+            bucket_num -= size;
+        }
         int lock_num = bucket_num % static_cast<int>(n_locks);
         assert(lock_num < static_cast<int>(n_locks));
         assert(lock_num >= 0);
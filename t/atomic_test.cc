@@ -61,9 +61,53 @@ static void testSetIfBigger() {
     assert(x.get() == 924);
 }
 
+class ShardedCounterTest : public Generator<int> {
+public:
+
+    int operator()() {
+        for (size_t j = 0; j < numIterations; j++) {
+            ++counter;
+            counter += 3;
+            counter.decr(2);
+        }
+        return 0;
+    }
+
+    size_t latest(void) { return counter.get(); }
+
+private:
+    ShardedCounter<size_t> counter;
+};
+
+static void testShardedCounter() {
+    ShardedCounterTest gen;
+    getCompletedThreads<int>(numThreads, &gen);
+    assert(gen.latest() == 2 * numThreads * numIterations);
+
+    ShardedCounter<size_t> x(5);
+    assert(x.get() == 5);
+    --x;
+    x -= 4;
+    assert(x.get() == 0);
+    x = 42;
+    assert(x == 42);
+
+    // The approximation catches up within a bounded number of reads.
+    assert(x.getApprox() == 42);
+    x += 8;
+    bool caughtUp = false;
+    for (uint32_t i = 0; i < ShardedCounter<size_t>::APPROX_READS; ++i) {
+        caughtUp = caughtUp || x.getApprox() == 50;
+    }
+    assert(caughtUp);
+    x = 7;
+    assert(x.getApprox() == 7);
+}
+
 int main() {
     alarm(60);
     testAtomicInt();
     testSetIfLess();
     testSetIfBigger();
+    testShardedCounter();
 }
@@ -0,0 +1,82 @@
+#include "config.h"
+
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "bloomfilter.hh"
+#include "keyhash.hh"
+
+static uint64_t keyHash(const char *prefix, size_t i) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%s%06d", prefix, static_cast<int>(i));
+    return hash64(buf, strlen(buf));
+}
+
+static void testSizing() {
+    BloomFilter bf(10000, 0.01);
+    // -n ln(p) / ln(2)^2 bits and (m / n) ln(2) hashes.
+    assert(bf.getNumBits() >= 95850 && bf.getNumBits() <= 95860);
+    assert(bf.getNumHashes() == 7);
+    assert(bf.getNumBitsSet() == 0);
+    assert(bf.getFalsePositiveProb() == 0.0);
+    assert(bf.memorySize() >= bf.getNumBits() / 8);
+
+    BloomFilter tiny(0, 0.4);
+    assert(tiny.getNumHashes() >= 1);
+    tiny.addKey(keyHash("key", 0));
+    assert(tiny.maybeKeyExists(keyHash("key", 0)));
+}
+
+static void testNoFalseNegatives() {
+    BloomFilter bf(10000, 0.01);
+    for (size_t i = 0; i < 10000; ++i) {
+        bf.addKey(keyHash("user::", i));
+    }
+    for (size_t i = 0; i < 10000; ++i) {
+        assert(bf.maybeKeyExists(keyHash("user::", i)));
+    }
+
+    // Adding a key again doesn't change anything.
+    size_t set = bf.getNumBitsSet();
+    bf.addKey(keyHash("user::", 42));
+    assert(bf.getNumBitsSet() == set);
+}
+
+static void testFalsePositiveRate() {
+    BloomFilter bf(10000, 0.01);
+    for (size_t i = 0; i < 10000; ++i) {
+        bf.addKey(keyHash("user::", i));
+    }
+
+    size_t fp(0);
+    const size_t probes(100000);
+    for (size_t i = 0; i < probes; ++i) {
+        if (bf.maybeKeyExists(keyHash("missing::", i))) {
+            ++fp;
+        }
+    }
+    double rate = static_cast<double>(fp) / probes;
+    assert(rate < 0.02);
+
+    // The estimate from the fill should be in the same ballpark.
+    double estimate = bf.getFalsePositiveProb();
+    assert(estimate > 0.005 && estimate < 0.02);
+
+    // Overfilling degrades the filter instead of breaking it.
+    for (size_t i = 10000; i < 40000; ++i) {
+        bf.addKey(keyHash("user::", i));
+    }
+    assert(bf.getFalsePositiveProb() > 0.1);
+    for (size_t i = 0; i < 40000; ++i) {
+        assert(bf.maybeKeyExists(keyHash("user::", i)));
+    }
+}
+
+int main() {
+    testSizing();
+    testNoFalseNegatives();
+    testFalsePositiveRate();
+    return 0;
+}
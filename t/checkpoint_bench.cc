@@ -0,0 +1,102 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cassert>
+#include <sstream>
+#include <vector>
+
+#include <checkpoint.hh>
+#include <queueditem.hh>
+#include <stats.hh>
+#include <vbucket.hh>
+
+/*
+ * Measures what a checkpoint costs to fill and to walk.
+ *
+ * A single open checkpoint is filled with mutations of distinct keys,
+ * then every key is mutated again so that each of them is deduplicated
+ * against the earlier mutation.  After each round the persistence
+ * cursor takes all the items in one go and a TAP cursor walks them one
+ * at a time, the way the flusher and a TAP producer do.
+ *
+ * usage: checkpoint_bench [items] [rounds]
+ */
+
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return 0;
+    }
+
+    rel_time_t (*ep_current_time)() = basic_current_time;
+
+    time_t ep_real_time() {
+        return time(NULL);
+    }
+}
+
+EPStats global_stats;
+CheckpointConfig checkpoint_config;
+
+static double msSince(hrtime_t start) {
+    return static_cast<double>(gethrtime() - start) / 1000000.0;
+}
+
+static void report(const char *what, double ms, size_t items) {
+    printf("%-22s%12.1f%16.0f\n", what, ms,
+           static_cast<double>(items) / (ms / 1000.0));
+}
+
+int main(int argc, char **argv) {
+    putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
+    size_t numItems = argc > 1 ? atoi(argv[1]) : 500000;
+    size_t rounds = argc > 2 ? atoi(argv[2]) : 3;
+
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < numItems; ++i) {
+        std::stringstream ss;
+        ss << "key_" << i;
+        keys.push_back(ss.str());
+    }
+
+    // A replica vbucket only gets a new checkpoint when its master says
+    // so, so all the items stay in the one open checkpoint.
+    RCPtr<VBucket> vb(new VBucket(0, vbucket_state_replica, global_stats,
+                                  checkpoint_config));
+    CheckpointManager cm(global_stats, 0, checkpoint_config, 1);
+    cm.registerTAPCursor("tap");
+    size_t baseOverhead = global_stats.memOverhead.get();
+
+    printf("%d items\n\n", static_cast<int>(numItems));
+    printf("%-22s%12s%16s\n", "", "time (ms)", "items/s");
+    for (size_t r = 0; r < rounds; ++r) {
+        hrtime_t start = gethrtime();
+        for (size_t i = 0; i < numItems; ++i) {
+            queued_item qi(QueuedItem::New(keys[i], 0, queue_op_set));
+            cm.queueDirty(qi, vb);
+        }
+        report(r == 0 ? "queue new keys" : "queue existing keys",
+               msSince(start), numItems);
+
+        std::vector<queued_item> items;
+        start = gethrtime();
+        cm.getAllItemsForPersistence(items);
+        report("persistence cursor", msSince(start), items.size());
+
+        size_t walked = 0;
+        bool isLastItem;
+        start = gethrtime();
+        while (cm.nextItem("tap", isLastItem)->getOperation() != queue_op_empty) {
+            ++walked;
+        }
+        report("tap cursor", msSince(start), walked);
+        assert(walked == items.size());
+    }
+
+    size_t overhead = global_stats.memOverhead.get() - baseOverhead;
+    printf("\ncheckpoint overhead: %d bytes, %.1f bytes per item\n",
+           static_cast<int>(overhead),
+           static_cast<double>(overhead) / static_cast<double>(numItems));
+    return 0;
+}
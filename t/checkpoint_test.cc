@@ -4,6 +4,7 @@
 #include <signal.h>
 
 #include <vector>
+#include <map>
 #include <set>
 #include <algorithm>
 
@@ -16,6 +17,7 @@
 #define NUM_TAP_THREADS 3
 #define NUM_SET_THREADS 4
 #define NUM_ITEMS 50000
+#define NUM_STAGING_KEYS 20000
 
 EPStats global_stats;
 CheckpointConfig checkpoint_config;
@@ -27,11 +29,14 @@ struct thread_args {
     CheckpointManager *checkpoint_manager;
     int *counter;
     std::string name;
+    EPStats *stats;
 };
 
+static rel_time_t current_time = 0;
+
 extern "C" {
 static rel_time_t basic_current_time(void) {
-    return 0;
+    return current_time;
 }
 
 rel_time_t (*ep_current_time)() = basic_current_time;
@@ -134,12 +139,504 @@ static void *launch_set_thread(void *arg) {
     for (i = 0; i < NUM_ITEMS; ++i) {
         std::stringstream key;
         key << "key-" << i;
-        queued_item qi(new QueuedItem (key.str(), 0, queue_op_set));
+        queued_item qi(QueuedItem::New(key.str(), 0, queue_op_set));
         args->checkpoint_manager->queueDirty(qi, args->vbucket);
     }
 
     return NULL;
 }
+
+static void *launch_staging_writer_thread(void *arg) {
+    struct thread_args *args = static_cast<struct thread_args *>(arg);
+    for (int i = 0; i < NUM_STAGING_KEYS + NUM_STAGING_KEYS / 2; ++i) {
+        std::stringstream key;
+        key << args->name << "-" << (i % NUM_STAGING_KEYS);
+        queued_item qi(QueuedItem::New(key.str(), args->vbucket->getId(), queue_op_set));
+        if (args->checkpoint_manager->queueDirty(qi, args->vbucket)) {
+            ++args->stats->totalEnqueued;
+            args->vbucket->doStatsForQueueing(*qi, qi->size());
+        }
+    }
+    return NULL;
+}
+}
+
+static void queueKey(CheckpointManager &cm, RCPtr<VBucket> &vb, const std::string &key) {
+    queued_item qi(QueuedItem::New(key, vb->getId(), queue_op_set));
+    cm.queueDirty(qi, vb);
+}
+
+static std::string nextKey(CheckpointManager &cm, const std::string &name) {
+    bool isLastItem = false;
+    queued_item qi = cm.nextItem(name, isLastItem);
+    switch (qi->getOperation()) {
+    case queue_op_checkpoint_start:
+        return "<start>";
+    case queue_op_checkpoint_end:
+        return "<end>";
+    case queue_op_empty:
+        return "<empty>";
+    default:
+        return qi->getKey();
+    }
+}
+
+static void testDedupLeavesCursorsInPlace() {
+    EPStats stats;
+    RCPtr<VBucket> vb(new VBucket(1, vbucket_state_active, stats, checkpoint_config));
+    CheckpointManager cm(stats, 1, checkpoint_config, 1);
+    cm.registerTAPCursor("tap");
+
+    queueKey(cm, vb, "a");
+    queueKey(cm, vb, "b");
+    queueKey(cm, vb, "c");
+    assert(nextKey(cm, "tap") == "<start>");
+    assert(nextKey(cm, "tap") == "a");
+
+    // The cursor was on the superseded item, so it's now behind the new one.
+    queueKey(cm, vb, "a");
+    assert(cm.getNumItemsForTAPConnection("tap") == 3);
+    assert(nextKey(cm, "tap") == "b");
+    assert(nextKey(cm, "tap") == "c");
+    assert(nextKey(cm, "tap") == "a");
+    assert(nextKey(cm, "tap") == "<empty>");
+
+    std::vector<queued_item> items;
+    cm.getAllItemsForPersistence(items);
+    assert(items.size() == 4);
+    assert(items[1]->getKey() == "b");
+    assert(items[3]->getKey() == "a");
+}
+
+static void testTAPCursorsPastKey() {
+    EPStats stats;
+    RCPtr<VBucket> vb(new VBucket(1, vbucket_state_active, stats, checkpoint_config));
+    CheckpointManager cm(stats, 1, checkpoint_config, 1);
+    cm.registerTAPCursor("slow");
+    cm.registerTAPCursor("fast");
+
+    queueKey(cm, vb, "a");
+    queueKey(cm, vb, "b");
+    assert(!cm.isTAPCursorPastKey("fast", "a"));
+    assert(nextKey(cm, "fast") == "<start>");
+    assert(nextKey(cm, "fast") == "a");
+    assert(cm.isTAPCursorPastKey("fast", "a"));
+    assert(!cm.isTAPCursorPastKey("slow", "a"));
+    assert(!cm.isTAPCursorPastKey("fast", "b"));
+    assert(!cm.isTAPCursorPastKey("none", "a"));
+
+    // A new mutation of the key hasn't been taken by anyone yet.
+    queueKey(cm, vb, "a");
+    assert(!cm.isTAPCursorPastKey("fast", "a"));
+
+    // Cursors in a later checkpoint are past everything before it.
+    assert(nextKey(cm, "fast") == "b");
+    assert(nextKey(cm, "fast") == "a");
+    cm.createNewCheckpoint();
+    queueKey(cm, vb, "c");
+    assert(nextKey(cm, "fast") == "<end>");
+    assert(nextKey(cm, "fast") == "<start>");
+    assert(cm.isTAPCursorPastKey("fast", "b"));
+    assert(!cm.isTAPCursorPastKey("slow", "b"));
+    assert(!cm.isTAPCursorPastKey("fast", "c"));
+    // A key that's in no checkpoint was taken long ago.
+    assert(cm.isTAPCursorPastKey("slow", "z"));
+}
+
+static void testHotKeyCompaction() {
+    EPStats stats;
+    RCPtr<VBucket> vb(new VBucket(2, vbucket_state_active, stats, checkpoint_config));
+    CheckpointManager cm(stats, 2, checkpoint_config, 1);
+    cm.registerTAPCursor("tap");
+
+    for (int i = 0; i < 10; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        queueKey(cm, vb, key.str());
+    }
+    queueKey(cm, vb, "hot");
+    assert(nextKey(cm, "tap") == "<start>");
+    for (int i = 0; i < 5; ++i) {
+        nextKey(cm, "tap");
+    }
+
+    // Superseding the same key over and over must not grow the checkpoint
+    // by a tombstone every time.
+    size_t overhead = stats.memOverhead.get();
+    for (int i = 0; i < 100 * CHECKPOINT_CHUNK_SIZE; ++i) {
+        queueKey(cm, vb, "hot");
+    }
+    assert(stats.memOverhead.get() <
+           overhead + 2 * CHECKPOINT_CHUNK_SIZE * sizeof(queued_item));
+
+    // The cursor and the key index still point at the right items.
+    assert(nextKey(cm, "tap") == "key-5");
+    queueKey(cm, vb, "key-2");
+    assert(nextKey(cm, "tap") == "key-6");
+    assert(nextKey(cm, "tap") == "key-7");
+    assert(nextKey(cm, "tap") == "key-8");
+    assert(nextKey(cm, "tap") == "key-9");
+    assert(nextKey(cm, "tap") == "hot");
+    assert(nextKey(cm, "tap") == "key-2");
+    assert(nextKey(cm, "tap") == "<empty>");
+    assert(cm.getNumItems() == 12);
+}
+
+static void testKeyIndexCollisions() {
+    CheckpointItemList items;
+    CheckpointKeyIndex index;
+    std::vector<std::string> keys;
+    for (int i = 0; i < 100; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        keys.push_back(key.str());
+        items.push_back(queued_item(QueuedItem::New(key.str(), 0, queue_op_set)));
+        // Every key gets the same hash, so all of them share one probe run.
+        index.insert(42, i, i + 1);
+    }
+    assert(index.size() == 100);
+    assert(index.memorySize() >= 100 * sizeof(index_entry));
+    for (int i = 0; i < 100; ++i) {
+        index_entry *entry = index.find(keys[i], 42, items);
+        assert(entry && entry->position == static_cast<uint32_t>(i));
+        assert(entry->mutation_id == static_cast<uint64_t>(i + 1));
+    }
+    assert(index.find("key-100", 42, items) == NULL);
+    assert(index.find("key-1", 43, items) == NULL);
+
+    // Erasing from the middle of the run leaves the rest reachable.
+    for (int i = 0; i < 100; i += 3) {
+        index.erase(index.find(keys[i], 42, items));
+    }
+    for (int i = 0; i < 100; ++i) {
+        assert((index.find(keys[i], 42, items) == NULL) == (i % 3 == 0));
+    }
+    assert(index.size() == 66);
+}
+
+static void testCollapseKeepsCursorsInPlace() {
+    EPStats stats;
+    RCPtr<VBucket> vb(new VBucket(3, vbucket_state_replica, stats, checkpoint_config));
+    CheckpointManager cm(stats, 3, checkpoint_config, 1);
+    cm.registerTAPCursor("slow");
+    cm.registerTAPCursor("fast");
+
+    queueKey(cm, vb, "a");
+    queueKey(cm, vb, "b");
+    cm.createNewCheckpoint();
+    queueKey(cm, vb, "b");
+    queueKey(cm, vb, "c");
+    cm.createNewCheckpoint();
+    queueKey(cm, vb, "d");
+    assert(cm.getNumCheckpoints() == 3);
+
+    const char *fastKeys[] = {"<start>", "a", "b", "<end>", "<start>", "b"};
+    for (size_t i = 0; i < sizeof(fastKeys) / sizeof(fastKeys[0]); ++i) {
+        assert(nextKey(cm, "fast") == fastKeys[i]);
+    }
+
+    // The slow cursor keeps the first checkpoint around, so it gets
+    // collapsed into the second one.
+    bool newCheckpointCreated;
+    cm.removeClosedUnrefCheckpoints(vb, newCheckpointCreated);
+    assert(cm.getNumCheckpoints() == 2);
+    assert(cm.getNumItems() == 7);
+
+    const char *restKeys[] = {"c", "<end>", "<start>", "d", "<empty>"};
+    for (size_t i = 0; i < sizeof(restKeys) / sizeof(restKeys[0]); ++i) {
+        assert(nextKey(cm, "fast") == restKeys[i]);
+    }
+    const char *slowKeys[] = {"<start>", "a", "b", "c", "<end>", "<start>", "d", "<empty>"};
+    for (size_t i = 0; i < sizeof(slowKeys) / sizeof(slowKeys[0]); ++i) {
+        assert(nextKey(cm, "slow") == slowKeys[i]);
+    }
+}
+
+class SpillingCheckpointConfig : public CheckpointConfig {
+public:
+    SpillingCheckpointConfig(const std::string &path) {
+        setSpillPath(path);
+    }
+};
+
+class CountingLoadListener : public SpilledChunkLoadListener {
+public:
+    CountingLoadListener() : requests(0), pending(false) { }
+
+    void chunkLoadNeeded(uint16_t) {
+        ++requests;
+        pending = true;
+    }
+
+    size_t requests;
+    bool pending;
+};
+
+/**
+ * Get the next key for a TAP cursor, running the loader the way the
+ * loader task would whenever the cursor asked for chunks to be read back.
+ */
+static std::string nextLoadedKey(CheckpointManager &cm, EPStats &stats,
+                                 const std::string &name,
+                                 CountingLoadListener &listener) {
+    size_t reads = stats.chkSpillReads.get();
+    std::string key = nextKey(cm, name);
+    // The cursor never reads chunks back itself, it waits for the loader.
+    assert(stats.chkSpillReads.get() == reads);
+    if (listener.pending) {
+        listener.pending = false;
+        std::vector<std::string> failed;
+        cm.loadSpilledChunks(failed);
+        assert(failed.empty());
+        if (key == "<empty>") {
+            key = nextKey(cm, name);
+        }
+    }
+    return key;
+}
+
+static void testSpillClosedCheckpoint() {
+    EPStats stats;
+    stats.mem_low_wat.set(0);
+    SpillingCheckpointConfig config("/tmp/checkpoint_test_spill");
+    CountingLoadListener listener;
+    config.setSpilledChunkLoadListener(&listener);
+    RCPtr<VBucket> vb(new VBucket(4, vbucket_state_replica, stats, config));
+    CheckpointManager cm(stats, 4, config, 1);
+    cm.registerTAPCursor("slow");
+
+    const int numKeys = 10 * CHECKPOINT_CHUNK_SIZE;
+    for (int i = 0; i < numKeys; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        queueKey(cm, vb, key.str());
+    }
+    cm.createNewCheckpoint();
+    queueKey(cm, vb, "open");
+    assert(nextKey(cm, "slow") == "<start>");
+    assert(nextKey(cm, "slow") == "key-0");
+
+    // Only the TAP cursor still needs the closed checkpoint once the
+    // persistence cursor is past it, so it goes to disk.  The remover
+    // leaves that to the spiller.
+    std::vector<queued_item> items;
+    cm.getAllItemsForPersistence(items);
+    size_t overhead = stats.memOverhead.get();
+    bool newCheckpointCreated;
+    cm.removeClosedUnrefCheckpoints(vb, newCheckpointCreated);
+    assert(cm.getNumCheckpoints() == 2);
+    assert(stats.chkSpilledBytes.get() == 0);
+    assert(cm.spillClosedCheckpoints() > 0);
+    assert(stats.chkSpilledBytes.get() > 0);
+    assert(stats.chkSpilledItems.get() > static_cast<size_t>(numKeys / 2));
+    assert(stats.memOverhead.get() <
+           overhead - numKeys / 2 * sizeof(queued_item));
+    assert(stats.chkSpillReads.get() == 0);
+    // Eviction checks don't read anything back.
+    cm.eligibleForEviction("key-1000");
+    assert(stats.chkSpillReads.get() == 0);
+
+    for (int i = 1; i < numKeys; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        assert(nextLoadedKey(cm, stats, "slow", listener) == key.str());
+    }
+    assert(listener.requests > 0);
+    assert(stats.chkSpillReads.get() >= listener.requests);
+    assert(stats.chkSpillReadErrors.get() == 0);
+
+    // The chunks pinned for the cursor the first time round go out now.
+    cm.spillClosedCheckpoints();
+    size_t spilledBytes = stats.chkSpilledBytes.get();
+
+    const char *restKeys[] = {"<end>", "<start>", "open", "<empty>"};
+    for (size_t i = 0; i < sizeof(restKeys) / sizeof(restKeys[0]); ++i) {
+        assert(nextLoadedKey(cm, stats, "slow", listener) == restKeys[i]);
+    }
+
+    // Chunks that were read back are released again without being written
+    // out a second time.
+    assert(cm.spillClosedCheckpoints() > 0);
+    assert(stats.chkSpilledBytes.get() == spilledBytes);
+
+    // The spill file goes away with the checkpoint.
+    cm.removeClosedUnrefCheckpoints(vb, newCheckpointCreated);
+    assert(cm.getNumCheckpoints() == 1);
+    assert(stats.chkSpilledBytes.get() == 0);
+}
+
+static void testBoundedDrains() {
+    EPStats stats;
+    RCPtr<VBucket> vb(new VBucket(6, vbucket_state_active, stats, checkpoint_config));
+    CheckpointManager cm(stats, 6, checkpoint_config, 1);
+    cm.registerTAPCursor("tap");
+    const size_t unlimited = std::numeric_limits<size_t>::max();
+
+    for (int i = 0; i < 10; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        queueKey(cm, vb, key.str());
+    }
+    cm.createNewCheckpoint();
+    queueKey(cm, vb, "open");
+
+    // Each flusher batch carries on where the last one stopped.
+    std::vector<queued_item> items;
+    size_t numItems = cm.getNumItemsForPersistence();
+    assert(cm.getItemsForPersistence(items, 4, unlimited));
+    assert(items.size() == 4);
+    assert(items[1]->getKey() == "key-0");
+    assert(cm.getNumItemsForPersistence() == numItems - 4);
+    assert(cm.getPersistenceCursorPreChkId() == 0);
+    // A batch takes one item even if that alone is over the byte limit.
+    assert(cm.getItemsForPersistence(items, unlimited, 1));
+    assert(items.size() == 5);
+    assert(items[4]->getKey() == "key-3");
+    while (cm.getItemsForPersistence(items, 4, unlimited)) {
+        assert(cm.getNumItemsForPersistence() == numItems - items.size());
+    }
+    assert(items.size() == numItems);
+    assert(items.back()->getKey() == "open");
+    assert(cm.getNumItemsForPersistence() == 0);
+    assert(cm.getPersistenceCursorPreChkId() == 1);
+
+    // TAP batches stop in front of checkpoint meta items and the last
+    // mutation of a checkpoint, which nextItem flags as such.
+    std::vector<queued_item> batch;
+    assert(!cm.getItemsForTAPConnection("tap", batch, unlimited, unlimited));
+    assert(batch.empty());
+    assert(nextKey(cm, "tap") == "<start>");
+    assert(cm.getItemsForTAPConnection("tap", batch, 5, unlimited));
+    assert(batch.size() == 5);
+    assert(batch[0]->getKey() == "key-0");
+    assert(!cm.getItemsForTAPConnection("tap", batch, unlimited, unlimited));
+    assert(batch.size() == 9);
+    assert(batch[8]->getKey() == "key-8");
+    bool isLastItem = false;
+    assert(cm.nextItem("tap", isLastItem)->getKey() == "key-9");
+    assert(isLastItem);
+    assert(nextKey(cm, "tap") == "<end>");
+    assert(nextKey(cm, "tap") == "<start>");
+    assert(!cm.getItemsForTAPConnection("tap", batch, unlimited, unlimited));
+    assert(batch.size() == 9);
+    assert(nextKey(cm, "tap") == "open");
+    assert(nextKey(cm, "tap") == "<empty>");
+    assert(cm.getNumItemsForTAPConnection("tap") == 0);
+}
+
+static void testOldestQueuedForPersistence() {
+    EPStats stats;
+    RCPtr<VBucket> vb(new VBucket(8, vbucket_state_active, stats, checkpoint_config));
+    CheckpointManager cm(stats, 8, checkpoint_config, 1);
+    const size_t unlimited = std::numeric_limits<size_t>::max();
+    rel_time_t queued = 0;
+    assert(!cm.getOldestQueuedTimeForPersistence(queued));
+
+    current_time = 10;
+    queueKey(cm, vb, "a");
+    current_time = 20;
+    queueKey(cm, vb, "b");
+    queueKey(cm, vb, "c");
+    assert(cm.getOldestQueuedTimeForPersistence(queued));
+    assert(queued == 10);
+
+    // A bounded batch leaves the next mutation as the oldest...
+    std::vector<queued_item> items;
+    assert(cm.getItemsForPersistence(items, 2, unlimited));
+    assert(cm.getOldestQueuedTimeForPersistence(queued));
+    assert(queued == 20);
+
+    // ...and taking all of them leaves nothing, until the next mutation.
+    assert(!cm.getItemsForPersistence(items, unlimited, unlimited));
+    assert(!cm.getOldestQueuedTimeForPersistence(queued));
+    current_time = 30;
+    queueKey(cm, vb, "a");
+    assert(cm.getOldestQueuedTimeForPersistence(queued));
+    assert(queued == 30);
+
+    cm.clear(vbucket_state_active);
+    assert(!cm.getOldestQueuedTimeForPersistence(queued));
+    current_time = 0;
+}
+
+static void testQueuedItemPool() {
+    // A released block is handed out again for the same size class.
+    QueuedItemPool pool;
+    void *a = pool.allocate(64);
+    pool.release(a, 64);
+    assert(pool.getNumBytes() == 64);
+    assert(pool.allocate(80) != a);
+    assert(pool.allocate(64) == a);
+    assert(pool.getNumBytes() == 0);
+    pool.release(a, 64);
+
+    // The key lives in the item's own block.
+    queued_item x(QueuedItem::New("abc", 0, queue_op_set));
+    queued_item y(QueuedItem::New("abcd", 0, queue_op_set));
+    assert(x->getKey() == "abc");
+    assert(x->getKeyLen() == 3);
+    assert(x->hasKey("abc") && !x->hasKey("abcd"));
+    assert(x->compareKey(*y) < 0 && y->compareKey(*x) > 0);
+    assert(x->compareKey(*x) == 0);
+    assert(x->size() % QUEUED_ITEM_BLOCK_ALIGN == 0);
+    assert(x->size() >= sizeof(QueuedItem) + 3);
+
+    // An item's block goes back to the pool it was allocated from.
+    QueuedItemPool &owner = ObjectRegistry::getQueuedItemPool();
+    size_t freeBytes = owner.getNumBytes();
+    size_t blockSize = x->size();
+    x.reset();
+    assert(owner.getNumBytes() == freeBytes + blockSize);
+}
+
+static void testConcurrentWritersKeepOrder() {
+    EPStats stats;
+    RCPtr<VBucket> vb(new VBucket(5, vbucket_state_replica, stats, checkpoint_config));
+    CheckpointManager cm(stats, 5, checkpoint_config, 1);
+
+    struct thread_args args[NUM_SET_THREADS];
+    pthread_t threads[NUM_SET_THREADS];
+    for (int i = 0; i < NUM_SET_THREADS; ++i) {
+        std::stringstream name;
+        name << "w" << i;
+        args[i].checkpoint_manager = &cm;
+        args[i].vbucket = vb;
+        args[i].name = name.str();
+        args[i].stats = &stats;
+        int rc = pthread_create(&threads[i], NULL, launch_staging_writer_thread, &args[i]);
+        assert(rc == 0);
+    }
+    for (int i = 0; i < NUM_SET_THREADS; ++i) {
+        int rc = pthread_join(threads[i], NULL);
+        assert(rc == 0);
+    }
+
+    // Whether or not their items were staged, every writer's keys come out
+    // deduplicated and in the order that writer queued them in.
+    std::vector<queued_item> items;
+    cm.getAllItemsForPersistence(items);
+    std::map<std::string, int> next;
+    size_t numMutations = 0;
+    std::vector<queued_item>::iterator it = items.begin();
+    for (; it != items.end(); ++it) {
+        if ((*it)->getOperation() != queue_op_set) {
+            continue;
+        }
+        ++numMutations;
+        const std::string &key = (*it)->getKey();
+        size_t dash = key.find('-');
+        std::string writer = key.substr(0, dash);
+        int n = atoi(key.c_str() + dash + 1);
+        if (next.find(writer) == next.end()) {
+            next[writer] = NUM_STAGING_KEYS / 2;
+        }
+        assert(n == next[writer]);
+        next[writer] = (n + 1) % NUM_STAGING_KEYS;
+    }
+    assert(numMutations == NUM_SET_THREADS * NUM_STAGING_KEYS);
+    // Staged duplicates had their queueing stats rolled back.
+    assert(vb->dirtyQueueSize.get() == numMutations);
+    assert(stats.totalEnqueued.get() == numMutations);
 }
 
 int main(int argc, char **argv) {
@@ -148,6 +645,17 @@ int main(int argc, char **argv) {
 
     HashTable::setDefaultNumBuckets(5);
     HashTable::setDefaultNumLocks(1);
+
+    testDedupLeavesCursorsInPlace();
+    testTAPCursorsPastKey();
+    testHotKeyCompaction();
+    testKeyIndexCollisions();
+    testCollapseKeepsCursorsInPlace();
+    testSpillClosedCheckpoint();
+    testBoundedDrains();
+    testOldestQueuedForPersistence();
+    testQueuedItemPool();
+    testConcurrentWritersKeepOrder();
     RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_active, global_stats, checkpoint_config));
 
     CheckpointManager *checkpoint_manager = new CheckpointManager(global_stats, 0,
@@ -221,7 +729,7 @@ int main(int argc, char **argv) {
     }
 
     // Push the flush command into the queue so that all other threads can be terminated.
-    queued_item qi(new QueuedItem ("flush", 0xffff, queue_op_flush));
+    queued_item qi(QueuedItem::New("flush", 0xffff, queue_op_flush));
     checkpoint_manager->queueDirty(qi, vbucket);
 
     rc = pthread_join(persistence_thread, NULL);
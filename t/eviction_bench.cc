@@ -0,0 +1,128 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cassert>
+#include <sstream>
+#include <vector>
+
+#include <item.hh>
+#include <stats.hh>
+#include <stored-value.hh>
+
+/*
+ * Compares how much of a data set stays resident with value-only and
+ * full eviction as the memory available to it shrinks.
+ *
+ * A hash table is filled with clean, persisted items, which are then
+ * ejected in insertion order until the item memory fits the budget.
+ * Value-only eviction can't get below the memory every key and its
+ * metadata take, full eviction drops whole items so the resident
+ * ratio falls in proportion to the budget instead.
+ *
+ * usage: eviction_bench [items] [value size]
+ */
+
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return 0;
+    }
+
+    rel_time_t (*ep_current_time)() = basic_current_time;
+
+    time_t ep_real_time() {
+        return time(NULL);
+    }
+}
+
+EPStats global_stats;
+
+static void fill(HashTable &ht, const std::vector<std::string> &keys,
+                 size_t valueSize) {
+    std::string val(valueSize, 'v');
+    for (size_t i = 0; i < keys.size(); ++i) {
+        Item itm(keys[i], 0, 0, val.c_str(), val.length());
+        int64_t row_id = -1;
+        ht.set(itm, row_id);
+
+        int bucket_num(0);
+        VersionedLockHolder lh = ht.getLockedBucket(keys[i], &bucket_num);
+        StoredValue *v = ht.unlocked_find(keys[i], bucket_num, false, false);
+        assert(v);
+        v->markClean(NULL);
+        v->setId(i + 1);
+    }
+}
+
+/**
+ * Eject until the items fit in budget bytes.
+ *
+ * @return the fraction of the items still resident
+ */
+static double eject(HashTable &ht, const std::vector<std::string> &keys,
+                    size_t budget, bool fullEviction) {
+    for (size_t i = 0; i < keys.size() && ht.getItemMemory() > budget; ++i) {
+        int bucket_num(0);
+        VersionedLockHolder lh = ht.getLockedBucket(keys[i], &bucket_num);
+        StoredValue *v = ht.unlocked_find(keys[i], bucket_num, false, false);
+        if (fullEviction) {
+            ht.unlocked_ejectItem(v, bucket_num);
+        } else {
+            v->ejectValue(global_stats, ht);
+        }
+    }
+    size_t resident = ht.getNumItems() - ht.getNumNonResidentItems();
+    return static_cast<double>(resident) / static_cast<double>(keys.size());
+}
+
+static void run(const std::vector<std::string> &keys, size_t valueSize,
+                size_t full, size_t pcnt, bool fullEviction,
+                double *ratio, size_t *memory) {
+    HashTable ht(global_stats, 196613, 47);
+    fill(ht, keys, valueSize);
+    *ratio = eject(ht, keys, full * pcnt / 100, fullEviction);
+    *memory = ht.getItemMemory();
+    ht.clear();
+}
+
+int main(int argc, char **argv) {
+    putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
+    size_t numItems = argc > 1 ? atoi(argv[1]) : 1000000;
+    size_t valueSize = argc > 2 ? atoi(argv[2]) : 64;
+
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < numItems; ++i) {
+        std::stringstream ss;
+        ss << "user::" << i;
+        keys.push_back(ss.str());
+    }
+
+    size_t full(0);
+    {
+        HashTable ht(global_stats, 196613, 47);
+        fill(ht, keys, valueSize);
+        full = ht.getItemMemory();
+        ht.clear();
+    }
+
+    printf("%d items of %d bytes, %d bytes of item memory\n\n",
+           static_cast<int>(numItems), static_cast<int>(valueSize),
+           static_cast<int>(full));
+    printf("%-8s%-27s%s\n", "budget", "value_only", "full_eviction");
+    static const size_t budgets[] = { 100, 80, 60, 40, 20, 10, 5 };
+    for (size_t i = 0; i < sizeof(budgets) / sizeof(budgets[0]); ++i) {
+        double valueRatio, fullRatio;
+        size_t valueMemory, fullMemory;
+        run(keys, valueSize, full, budgets[i], false, &valueRatio,
+            &valueMemory);
+        run(keys, valueSize, full, budgets[i], true, &fullRatio, &fullMemory);
+        printf("%6d%%  %6.1f%% res %10d B%s  %6.1f%% res %10d B\n",
+               static_cast<int>(budgets[i]), valueRatio * 100.0,
+               static_cast<int>(valueMemory),
+               valueMemory > full * budgets[i] / 100 ? "*" : " ",
+               fullRatio * 100.0, static_cast<int>(fullMemory));
+    }
+    printf("\n* doesn't fit in the budget\n");
+    return 0;
+}
@@ -0,0 +1,235 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+
+#include <string.h>
+
+#include <vector>
+
+#include "flush_order.hh"
+
+#undef NDEBUG
+#include <assert.h>
+
+static std::vector<FlushCandidate> candidates() {
+    std::vector<FlushCandidate> vbs;
+    vbs.push_back(FlushCandidate(0, vbucket_state_replica));
+    vbs.push_back(FlushCandidate(1, vbucket_state_active));
+    vbs.push_back(FlushCandidate(2, vbucket_state_replica));
+    vbs.push_back(FlushCandidate(3, vbucket_state_active));
+    return vbs;
+}
+
+static void assertOrder(const std::vector<FlushCandidate> &vbs,
+                        int a, int b, int c, int d) {
+    assert(vbs.size() == 4);
+    assert(vbs[0].vbid == a);
+    assert(vbs[1].vbid == b);
+    assert(vbs[2].vbid == c);
+    assert(vbs[3].vbid == d);
+}
+
+static void testLookup() {
+    const char *names[] = { "round_robin", "active_first",
+                            "oldest_dirty_first", "fair_share" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        FlushOrderPolicy *p = FlushOrderPolicy::get(names[i]);
+        assert(p);
+        assert(strcmp(p->getName(), names[i]) == 0);
+    }
+    assert(FlushOrderPolicy::get("newest_first") == NULL);
+}
+
+static void testRoundRobin() {
+    FlushOrderPolicy *p = FlushOrderPolicy::get("round_robin");
+    assert(!p->needsDirtyInfo());
+    std::vector<FlushCandidate> vbs = candidates();
+    p->order(vbs, -1);
+    assertOrder(vbs, 0, 1, 2, 3);
+    p->order(vbs, 2);
+    assertOrder(vbs, 2, 3, 0, 1);
+    assert(p->getShare(1000, 4) == 1000);
+}
+
+static void testActiveFirst() {
+    FlushOrderPolicy *p = FlushOrderPolicy::get("active_first");
+    std::vector<FlushCandidate> vbs = candidates();
+    p->order(vbs, -1);
+    assertOrder(vbs, 1, 3, 0, 2);
+
+    // Resuming at an active vbucket rotates the active ones only...
+    vbs = candidates();
+    p->order(vbs, 3);
+    assertOrder(vbs, 3, 1, 0, 2);
+
+    // ...and resuming at a replica keeps the active ones first.
+    vbs = candidates();
+    p->order(vbs, 2);
+    assertOrder(vbs, 1, 3, 2, 0);
+}
+
+static void testOldestDirtyFirst() {
+    FlushOrderPolicy *p = FlushOrderPolicy::get("oldest_dirty_first");
+    assert(p->needsDirtyInfo());
+    std::vector<FlushCandidate> vbs = candidates();
+    vbs[1].hasDirty = true;
+    vbs[1].oldestDirty = 30;
+    vbs[2].hasDirty = true;
+    vbs[2].oldestDirty = 10;
+    vbs[3].hasDirty = true;
+    vbs[3].oldestDirty = 20;
+    p->order(vbs, 1);
+    assertOrder(vbs, 2, 3, 1, 0);
+}
+
+static void testFairShare() {
+    FlushOrderPolicy *p = FlushOrderPolicy::get("fair_share");
+    assert(p->needsDirtyInfo());
+    std::vector<FlushCandidate> vbs = candidates();
+    p->order(vbs, 1);
+    assertOrder(vbs, 1, 2, 3, 0);
+    assert(p->getShare(1000, 0) == 1000);
+    assert(p->getShare(1000, 1) == 1000);
+    assert(p->getShare(1000, 4) == 250);
+    // Never a share too small to take anything.
+    assert(p->getShare(3, 4) == 1);
+}
+
+/**
+ * Vbuckets with a number of bytes dirty each, taken in items of a given
+ * size, that remembers whose turn it was.
+ */
+class FakeFlushSource : public FlushSource {
+public:
+    FakeFlushSource(size_t s) : itemSize(s) {}
+
+    void add(size_t bytes) {
+        dirty.push_back(bytes);
+    }
+
+    bool take(size_t i, bool firstTurn, size_t maxBytes, size_t &bytes) {
+        (void)firstTurn;
+        turns.push_back(i);
+        // At least one item, whatever the limit is.
+        bytes = 0;
+        while (dirty[i] > 0 && (bytes == 0 || bytes < maxBytes)) {
+            bytes += itemSize;
+            dirty[i] -= itemSize;
+        }
+        return dirty[i] > 0;
+    }
+
+    size_t itemSize;
+    std::vector<size_t> dirty;
+    std::vector<size_t> turns;
+};
+
+static std::vector<FlushCandidate> dirtyCandidates() {
+    std::vector<FlushCandidate> vbs = candidates();
+    for (size_t i = 0; i < vbs.size(); ++i) {
+        vbs[i].hasDirty = true;
+    }
+    return vbs;
+}
+
+static void testFillOneTurnEach() {
+    FlushOrderPolicy *p = FlushOrderPolicy::get("round_robin");
+    std::vector<FlushCandidate> vbs = dirtyCandidates();
+    FakeFlushSource source(10);
+    source.add(100);
+    source.add(200);
+    source.add(0);
+    source.add(50);
+    assert(p->fill(vbs, 1000, source) == -1);
+    assert(source.turns.size() == 4);
+    for (size_t i = 0; i < 4; ++i) {
+        assert(source.turns[i] == i);
+        assert(source.dirty[i] == 0);
+    }
+}
+
+static void testFillOutOfBudget() {
+    FlushOrderPolicy *p = FlushOrderPolicy::get("round_robin");
+    std::vector<FlushCandidate> vbs = dirtyCandidates();
+    FakeFlushSource source(10);
+    source.add(100);
+    source.add(200);
+    source.add(100);
+    source.add(100);
+    // The second vbucket runs out of the budget, the next batch resumes
+    // at it.
+    assert(p->fill(vbs, 150, source) == 1);
+    assert(source.turns.size() == 2);
+    assert(source.dirty[0] == 0);
+    assert(source.dirty[1] == 150);
+    assert(source.dirty[2] == 100);
+
+    // Ran out right at a vbucket's end, the next one is where to resume.
+    FakeFlushSource exact(10);
+    exact.add(100);
+    exact.add(100);
+    exact.add(100);
+    exact.add(100);
+    assert(p->fill(vbs, 100, exact) == 1);
+    assert(exact.turns.size() == 1);
+}
+
+static void testFillSharesOverPasses() {
+    FlushOrderPolicy *p = FlushOrderPolicy::get("fair_share");
+    std::vector<FlushCandidate> vbs = dirtyCandidates();
+    FakeFlushSource source(10);
+    source.add(20);
+    source.add(300);
+    source.add(20);
+    source.add(300);
+    // First pass: 100 bytes each, two of them take only 20.  Second pass:
+    // the two left get half of the remaining 160 each, and the last one
+    // runs out of the budget.
+    assert(p->fill(vbs, 400, source) == 3);
+    size_t expected[] = { 0, 1, 2, 3, 1, 3 };
+    assert(source.turns.size() == sizeof(expected) / sizeof(expected[0]));
+    for (size_t i = 0; i < source.turns.size(); ++i) {
+        assert(source.turns[i] == expected[i]);
+    }
+    assert(source.dirty[0] == 0);
+    assert(source.dirty[1] == 120);
+    assert(source.dirty[2] == 0);
+    assert(source.dirty[3] == 120);
+}
+
+static void testFillSharesUntilNothingLeft() {
+    FlushOrderPolicy *p = FlushOrderPolicy::get("fair_share");
+    std::vector<FlushCandidate> vbs = dirtyCandidates();
+    vbs[2].hasDirty = false;
+    FakeFlushSource source(10);
+    source.add(500);
+    source.add(30);
+    source.add(0);
+    source.add(40);
+    // Three dirty vbuckets share 1000, the first one needs a second turn
+    // to take all of its 500.
+    assert(p->fill(vbs, 1000, source) == -1);
+    size_t expected[] = { 0, 1, 2, 3, 0 };
+    assert(source.turns.size() == sizeof(expected) / sizeof(expected[0]));
+    for (size_t i = 0; i < source.turns.size(); ++i) {
+        assert(source.turns[i] == expected[i]);
+    }
+    for (size_t i = 0; i < 4; ++i) {
+        assert(source.dirty[i] == 0);
+    }
+}
+
+int main(int argc, char **argv) {
+    (void)argc; (void)argv;
+
+    testLookup();
+    testRoundRobin();
+    testActiveFirst();
+    testOldestDirtyFirst();
+    testFairShare();
+    testFillOneTurnEach();
+    testFillOutOfBudget();
+    testFillSharesOverPasses();
+    testFillSharesUntilNothingLeft();
+
+    return 0;
+}
@@ -1,10 +1,13 @@
 #include "config.h"
 
 #include <signal.h>
+#include <math.h>
 
 #include <limits>
+#include <map>
 #include <cassert>
 #include <algorithm>
+#include <sstream>
 
 #include <ep.hh>
 #include <item.hh>
@@ -272,6 +275,56 @@ static void testResize() {
     verifyFound(h, keys);
 }
 
+static void testIncrementalResize() {
+    HashTable h(global_stats, 5, 3);
+
+    std::vector<std::string> keys = generateKeys(5000);
+    storeMany(h, keys);
+
+    assert(h.startResize(6143));
+    assert(h.isResizing());
+    assert(h.getSize() == 6143);
+    assert(h.getResizeRemaining() == 5);
+    assert(!h.startResize(769));
+
+    // Everything is found and counted while spread over both arrays.
+    assert(h.migrate(2));
+    assert(h.getResizeRemaining() == 3);
+    verifyFound(h, keys);
+    assert(count(h) == 5000);
+
+    // Changes go to whichever array holds the key's bucket.
+    std::vector<std::string> more = generateKeys(6000, 5000);
+    storeMany(h, more);
+    for (int i = 0; i < 5000; i += 2) {
+        assert(h.del(keys[i]));
+    }
+    assert(count(h) == 3500);
+
+    assert(!h.migrate(100));
+    assert(!h.isResizing());
+    assert(h.getResizeRemaining() == 0);
+    verifyFound(h, more);
+    for (int i = 1; i < 5000; i += 2) {
+        assert(h.find(keys[i]));
+        assert(!h.find(keys[i - 1]));
+    }
+
+    // A resize in progress is finished off by the next one.
+    assert(h.startResize(769));
+    h.resize(12289);
+    assert(!h.isResizing());
+    assert(h.getSize() == 769);
+    verifyFound(h, more);
+    assert(count(h) == 3500);
+
+    // Clearing the table completes the migration.
+    assert(h.startResize(3067));
+    h.clear();
+    assert(!h.isResizing());
+    assert(count(h) == 0);
+}
+
 class AccessGenerator : public Generator<bool> {
 public:
 
@@ -326,7 +379,8 @@ static void testAutoResize() {
     verifyFound(h, keys);
 
     h.resize();
-    assert(h.getSize() == 6143);
+    // A tagged bucket is sized for a group of items.
+    assert(h.getSize() == (h.getLayout() == tagged ? 383 : 6143));
     verifyFound(h, keys);
 }
 
@@ -556,11 +610,796 @@ static void testSizeStatsEjectFlush() {
     free(someval);
 }
 
-int main() {
-    putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
-    global_stats.setMaxDataSize(64*1024*1024);
-    HashTable::setDefaultNumBuckets(3);
-    alarm(60);
+static void testInlineValues() {
+    global_stats.reset();
+    HashTable ht(global_stats, 5, 1);
+    size_t initialSize = global_stats.currentSize.get();
+    int64_t row_id = -1;
+
+    std::string k("somekey");
+    std::string small("small");
+    Item i(k, 0, 0, small.c_str(), small.length());
+    assert(ht.set(i, row_id) == WAS_CLEAN);
+
+    StoredValue *v(ht.find(k));
+    assert(v);
+    assert(v->isInline());
+    assert(!v->isDeleted());
+    assert(v->blobLength() == 0);
+    assert(v->valLength() == small.length());
+    assert(v->getValue()->to_s() == small);
+    assert(ht.getNumInlineValues() == 1);
+    assert(ht.getInlineMemSaved() == sizeof(Blob));
+    size_t inlineSize = v->size();
+
+    // Sharing the value with an Item copies it out once, leaving it
+    // inline, and the readers after that share the copy.
+    Item *itm = v->toItem(false, 0);
+    assert(itm->getValue()->to_s() == small);
+    Item *itm2 = v->toItem(false, 0);
+    assert(itm2->getValue().get() == itm->getValue().get());
+    delete itm;
+    delete itm2;
+    assert(v->isInline());
+    assert(v->blobLength() == 0);
+    assert(v->size() == inlineSize);
+
+    // A value too big for the reserved space moves out to a Blob...
+    std::string big(HashTable::getDefaultInlineValueSize() + 1, 'x');
+    Item bi(k, 0, 0, big.c_str(), big.length());
+    assert(ht.set(bi, row_id) == WAS_DIRTY);
+    assert(!v->isInline());
+    assert(v->blobLength() == big.length());
+    assert(v->getValue()->to_s() == big);
+    assert(ht.getNumInlineValues() == 0);
+
+    // ... and moves back once it fits again.
+    Item i2(k, 0, 0, small.c_str(), small.length());
+    assert(ht.set(i2, row_id) == WAS_DIRTY);
+    assert(v->isInline());
+    assert(v->size() == inlineSize);
+    assert(ht.getNumInlineValues() == 1);
+
+    v->markClean(NULL);
+    assert(ht.softDelete(k, 0, row_id) == WAS_CLEAN);
+    assert(v->isDeleted());
+    assert(!v->isInline());
+    assert(ht.getNumInlineValues() == 0);
+
+    Item i3(k, 0, 0, small.c_str(), small.length());
+    assert(ht.set(i3, row_id) == WAS_DIRTY);
+    assert(ht.getNumInlineValues() == 1);
+    ht.del(k);
+    assert(ht.getNumInlineValues() == 0);
+
+    // An ejected inline value keeps its length where the value was...
+    std::string medium(HashTable::getDefaultInlineValueSize(), 'm');
+    Item i5(k, 0, 0, medium.c_str(), medium.length());
+    assert(ht.set(i5, row_id) == WAS_CLEAN);
+    v = ht.find(k);
+    assert(v->isInline());
+    size_t mediumSize = v->size();
+    v->markClean(NULL);
+    assert(v->eligibleForEviction());
+    assert(v->ejectValue(global_stats, ht));
+    assert(!v->isResident());
+    assert(v->valLength() == medium.length());
+    assert(v->size() == mediumSize);
+
+    // ... until the defragmenter gives back the rest of its space.
+    size_t moved = 0;
+    ht.defragmentValues(100, moved);
+    assert(moved > 0);
+    v = ht.find(k);
+    assert(v->size() < mediumSize);
+    assert(v->valLength() == medium.length());
+    assert(v->unlocked_restoreValue(&i5, global_stats, ht));
+    assert(v->isResident());
+    assert(v->getValue()->to_s() == medium);
+    ht.del(k);
+
+    Item i4(k, 0, 0, small.c_str(), small.length());
+    assert(ht.set(i4, row_id) == WAS_CLEAN);
+    ht.clear();
+    assert(ht.getNumInlineValues() == 0);
+
+    assert(ht.memSize.get() == 0);
+    assert(ht.cacheSize.get() == 0);
+    assert(initialSize == global_stats.currentSize.get());
+}
+
+static void testSlabPool() {
+    global_stats.reset();
+    size_t initialOverhead = global_stats.memOverhead.get();
+    HashTable h(global_stats, 5, 3);
+    assert(h.getSlabMemory() == 0);
+
+    std::vector<std::string> keys = generateKeys(1000);
+    storeMany(h, keys);
+    size_t slabMem = h.getSlabMemory();
+    assert(slabMem > 0);
+    assert(h.getSlabFreeMemory() < slabMem);
+    assert(global_stats.memOverhead.get() - initialOverhead
+           == h.getSlabFreeMemory() + h.getOverflowMemory());
+
+    // Freed values are reused before any more slabs are allocated.
+    std::vector<std::string> half;
+    for (size_t i = 0; i < keys.size(); i += 2) {
+        assert(h.del(keys[i]));
+        half.push_back(keys[i]);
+    }
+    assert(h.getSlabMemory() == slabMem);
+    storeMany(h, half);
+    assert(h.getSlabMemory() == slabMem);
+    verifyFound(h, keys);
+
+    // Slabs are given back as they empty.
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        assert(h.del(*it));
+    }
+    assert(h.getSlabMemory() < slabMem);
+    assert(h.getSlabFreeMemory() == h.getSlabMemory());
+    assert(global_stats.memOverhead.get() - initialOverhead
+           == h.getSlabFreeMemory() + h.getOverflowMemory());
+    storeMany(h, keys);
+    verifyFound(h, keys);
+
+    // Values follow their lock to its pool stripe on a resize.
+    size_t inUse = h.getSlabMemory() - h.getSlabFreeMemory();
+    h.resize(97);
+    verifyFound(h, keys);
+    assert(h.getSlabMemory() - h.getSlabFreeMemory() == inUse);
+    h.resize(5);
+    verifyFound(h, keys);
+    assert(h.getSlabMemory() - h.getSlabFreeMemory() == inUse);
+
+    h.clear();
+    assert(count(h) == 0);
+    assert(h.getSlabMemory() == 0);
+    assert(global_stats.memOverhead.get() == initialOverhead);
+}
+
+class AgingVisitor : public HashTableVisitor {
+public:
+    AgingVisitor(uint8_t t) : threshold(t), moved(0) {}
+
+    void visit(StoredValue *v) {
+        moved += v->defragmentValue(threshold);
+    }
+
+    uint8_t threshold;
+    size_t  moved;
+};
+
+static void testDefragment() {
+    global_stats.reset();
+    size_t initialOverhead = global_stats.memOverhead.get();
+    HashTable h(global_stats, 5, 3);
+
+    std::vector<std::string> keys = generateKeys(5000);
+    storeMany(h, keys);
+    size_t slabMem = h.getSlabMemory();
+
+    // Leave every tenth item, spread over all the slabs.
+    std::vector<std::string> kept;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (i % 10 == 0) {
+            kept.push_back(keys[i]);
+        } else {
+            assert(h.del(keys[i]));
+        }
+    }
+    // Only slabs that emptied completely are gone by now.
+    size_t remaining = h.getSlabMemory();
+    assert(remaining <= slabMem);
+
+    size_t moved = 0;
+    size_t released = h.defragmentValues(50, moved);
+    assert(released > 0);
+    assert(moved > 0);
+    assert(h.getSlabMemory() == remaining - released);
+    assert(global_stats.memOverhead.get() - initialOverhead
+           == h.getSlabFreeMemory() + h.getOverflowMemory());
+    verifyFound(h, kept);
+    assert(count(h) == static_cast<int>(kept.size()));
+
+    // Nothing left worth draining.
+    moved = 0;
+    assert(h.defragmentValues(0, moved) == 0);
+    verifyFound(h, kept);
+
+    h.clear();
+    assert(h.getSlabMemory() == 0);
+    assert(global_stats.memOverhead.get() == initialOverhead);
+
+    // Blobs are moved once they're old enough.
+    HashTable h2(global_stats, 5, 1);
+    std::string k("a_big_one");
+    std::string val(200, 'x');
+    Item i(k, 0, 0, val.c_str(), val.length());
+    int64_t row_id = -1;
+    h2.set(i, row_id);
+    const Blob *before = h2.find(k)->getValue().get();
+
+    AgingVisitor av(2);
+    h2.visit(av);
+    h2.visit(av);
+    assert(av.moved == 0);
+    assert(h2.find(k)->getValue().get() == before);
+    h2.visit(av);
+    assert(av.moved == val.length() + sizeof(Blob));
+    assert(h2.find(k)->getValue().get() != before);
+    assert(h2.find(k)->getValue()->to_s() == val);
+}
+
+static void testBlobCompression() {
+    // Long runs, matches further back than the window and bytes that
+    // don't repeat at all.
+    std::string data;
+    for (int i = 0; i < 20000; ++i) {
+        data.append(1, static_cast<char>('a' + (i / 700) % 26));
+    }
+    for (int i = 0; i < 5000; ++i) {
+        std::stringstream ss;
+        ss << "{\"id\":" << i << ",\"name\":\"user" << (i * 7919) % 10007 << "\"}";
+        data.append(ss.str());
+    }
+    Blob *c = Blob::NewCompressed(data.data(), data.length());
+    assert(c);
+    assert(c->isCompressed());
+    assert(c->rawLength() == data.length());
+    assert(c->length() < data.length() / 2);
+    Blob *d = c->decompress();
+    assert(!d->isCompressed());
+    assert(d->to_s() == data);
+    delete d;
+    delete c;
+
+    std::string noise;
+    for (int i = 0; i < 1000; ++i) {
+        noise.append(1, static_cast<char>((i * 2654435761U) >> 24));
+    }
+    assert(Blob::NewCompressed(noise.data(), noise.length()) == NULL);
+}
+
+static void testCompressValue() {
+    global_stats.reset();
+    HashTable h(global_stats, 5, 1);
+    std::string k("cold");
+    std::string val(1000, 'c');
+    Item i(k, 0, 0, val.c_str(), val.length());
+    int64_t row_id = -1;
+    h.set(i, row_id);
+
+    StoredValue *v = h.find(k);
+    size_t before = h.memSize.get();
+    v->markClean(NULL);
+    assert(v->compressValue(global_stats, h));
+    assert(v->isCompressed());
+    assert(!v->compressValue(global_stats, h));
+    assert(h.memSize.get() < before);
+    assert(v->valLength() == val.length());
+    assert(v->getValue()->to_s() == val);
+
+    // Compressed values can still be ejected.
+    assert(v->ejectValue(global_stats, h));
+    assert(v->valLength() == val.length());
+    Item back(k, 0, 0, val.c_str(), val.length());
+    assert(v->unlocked_restoreValue(&back, global_stats, h));
+
+    assert(v->compressValue(global_stats, h));
+    v->decompressValue(global_stats, h);
+    assert(!v->isCompressed());
+    assert(h.memSize.get() == before);
+    assert(v->getValue()->to_s() == val);
+    assert(global_stats.numValueCompressions.get() == 2);
+    assert(global_stats.numValueDecompressions.get() == 1);
+    h.clear();
+}
+
+static void testEjectItem() {
+    global_stats.reset();
+    HashTable h(global_stats, 5, 1);
+    std::string k("evictme");
+    std::string val(100, 'e');
+    Item i(k, 0, 0, val.c_str(), val.length());
+    int64_t row_id = -1;
+    h.set(i, row_id);
+
+    int bucket_num(0);
+    VersionedLockHolder lh = h.getLockedBucket(k, &bucket_num);
+    StoredValue *v = h.unlocked_find(k, bucket_num, false, false);
+    // Dirty, and then clean but never persisted.
+    assert(!h.unlocked_ejectItem(v, bucket_num));
+    v->markClean(NULL);
+    assert(!h.unlocked_ejectItem(v, bucket_num));
+    v->setId(7);
+    assert(v->ejectValue(global_stats, h));
+    assert(h.getNumNonResidentItems() == 1);
+    assert(h.unlocked_ejectItem(v, bucket_num));
+    assert(h.unlocked_find(k, bucket_num, true, false) == NULL);
+    assert(h.getNumItems() == 0);
+    assert(h.getNumNonResidentItems() == 0);
+    assert(h.memSize.get() == 0);
+    assert(global_stats.numKeyEjects.get() == 1);
+
+    // Read back in through a temporary item.
+    assert(h.unlocked_addTempDeletedItem(bucket_num, k) == ADD_SUCCESS);
+    v = h.unlocked_find(k, bucket_num, true, false);
+    assert(v && v->isTempInitialItem());
+    Item back(k, 0, 0, val.c_str(), val.length(), 42, 7);
+    h.unlocked_restoreTempItem(v, back);
+    assert(h.getNumItems() == 1);
+    assert(h.getNumTempItems() == 0);
+    v = h.unlocked_find(k, bucket_num, false, false);
+    assert(v && v->isResident() && v->isClean());
+    assert(v->getId() == 7 && v->getCas() == 42);
+    assert(v->getValue()->to_s() == val);
+    lh.unlock();
+    h.clear();
+}
+
+class BatchChecker : public HashTableBatchVisitor {
+public:
+    BatchChecker(HashTable &h, const std::vector<std::string> &k) :
+        ht(h), keys(k), seen(k.size(), 0) {}
+
+    void visit(size_t index, int bucket_num) {
+        ++seen[index];
+        StoredValue *v = ht.unlocked_findHashed(keys[index], ht.hash(keys[index]),
+                                                bucket_num, false, false);
+        assert(v);
+        assert(v->getValue()->to_s() == keys[index]);
+    }
+
+    HashTable                      &ht;
+    const std::vector<std::string> &keys;
+    std::vector<int>                seen;
+};
+
+static void testVisitMulti() {
+    HashTable h(global_stats, 5, 3);
+    std::vector<std::string> keys = generateKeys(500);
+    storeMany(h, keys);
+
+    std::vector<uint64_t> hashes;
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        hashes.push_back(h.hash(*it));
+    }
+
+    BatchChecker c(h, keys);
+    h.visitMulti(hashes, c);
+    assert(std::count(c.seen.begin(), c.seen.end(), 1) == 500);
+
+    // The same while a resize is half way through.
+    assert(h.startResize(1031));
+    assert(h.migrate(2));
+    BatchChecker c2(h, keys);
+    h.visitMulti(hashes, c2);
+    assert(std::count(c2.seen.begin(), c2.seen.end(), 1) == 500);
+}
+
+static void testOptimisticGet() {
+    HashTable h(global_stats, 5, 1);
+    int64_t row_id = -1;
+    bool nru(false);
+
+    std::string k("optkey");
+    std::string small("small");
+    uint64_t hk = h.hash(k);
+    assert(h.optimisticGet(k, hk, 0, false, &nru) == NULL);
+
+    Item i(k, 3, 0, small.c_str(), small.length());
+    assert(h.set(i, row_id) == WAS_CLEAN);
+    StoredValue *v = h.find(k);
+    assert(v);
+    if (HashTable::getDefaultInlineValueSize() == 0) {
+        // Only inline values can be copied out without the lock.
+        assert(h.optimisticGet(k, hk, 0, false, &nru) == NULL);
+        return;
+    }
+    assert(v->isInline());
+
+    Item *itm = h.optimisticGet(k, hk, 7, false, &nru);
+    assert(itm);
+    assert(itm->getKey() == k);
+    assert(itm->getValue()->to_s() == small);
+    assert(itm->getFlags() == 3);
+    assert(itm->getCas() == v->getCas());
+    assert(itm->getVBucketId() == 7);
+    assert(nru == v->isReferenced());
+    delete itm;
+    assert(h.getNumOptimisticGets() == 1);
+
+    // Anything that needs the lock is left to the caller.
+    v->lock(ep_current_time() + 10);
+    assert(h.optimisticGet(k, hk, 0, false, &nru) == NULL);
+    v->unlock();
+
+    std::string big(HashTable::getDefaultInlineValueSize() + 1, 'x');
+    Item bi(k, 0, 0, big.c_str(), big.length());
+    assert(h.set(bi, row_id) == WAS_DIRTY);
+    assert(h.optimisticGet(k, hk, 0, false, &nru) == NULL);
+
+    Item ei(k, 0, ep_real_time() - 1, small.c_str(), small.length());
+    assert(h.set(ei, row_id) == WAS_DIRTY);
+    assert(h.optimisticGet(k, hk, 0, false, &nru) == NULL);
+
+    HashTable::setDefaultOptimisticReads(false);
+    Item i2(k, 0, 0, small.c_str(), small.length());
+    assert(h.set(i2, row_id) == WAS_DIRTY);
+    assert(h.optimisticGet(k, hk, 0, false, &nru) == NULL);
+    HashTable::setDefaultOptimisticReads(true);
+    itm = h.optimisticGet(k, hk, 0, false, &nru);
+    assert(itm);
+    delete itm;
+}
+
+/*
+ * Writers keep storing values made of a single repeated character
+ * with a length derived from that character while readers check that
+ * every lock free read returns one of them intact.
+ */
+class OptimisticGenerator : public Generator<bool> {
+public:
+
+    OptimisticGenerator(const std::vector<std::string> &k,
+                        HashTable &h) : keys(k), ht(h), started() {}
+
+    bool operator()() {
+        int me = started.incr(1);
+        if (me < 2) {
+            write(me);
+        } else {
+            read();
+        }
+        return true;
+    }
+
+private:
+
+    void write(int me) {
+        int64_t row_id = -1;
+        for (int round = 0; round < 50; ++round) {
+            std::vector<std::string>::iterator it;
+            for (it = keys.begin(); it != keys.end(); ++it) {
+                char c = static_cast<char>('a' + (rand() % 20));
+                std::string val(c - 'a' + 1, c);
+                Item itm(*it, 0, 0, val.c_str(), val.length());
+                ht.set(itm, row_id);
+            }
+            if (me == 0) {
+                ht.resize(round % 2 ? 1000 : 30);
+            }
+        }
+    }
+
+    void read() {
+        bool nru;
+        for (int round = 0; round < 200; ++round) {
+            std::vector<std::string>::iterator it;
+            for (it = keys.begin(); it != keys.end(); ++it) {
+                Item *itm = ht.optimisticGet(*it, ht.hash(*it), 0, false, &nru);
+                if (itm) {
+                    std::string val(itm->getValue()->to_s());
+                    assert(!val.empty());
+                    assert(val.length() == static_cast<size_t>(val[0] - 'a' + 1));
+                    assert(val == std::string(val.length(), val[0]));
+                    assert(itm->getKey() == *it);
+                    delete itm;
+                }
+            }
+        }
+    }
+
+    std::vector<std::string>  keys;
+    HashTable                &ht;
+    Atomic<int>               started;
+};
+
+static void testConcurrentOptimisticGet() {
+    HashTable h(global_stats, 5, 3);
+    std::vector<std::string> keys = generateKeys(200);
+    storeMany(h, keys);
+
+    OptimisticGenerator gen(keys, h);
+    getCompletedThreads(6, &gen);
+    verifyFound(h, keys);
+
+    // Whether the readers got through while the writers were busy is
+    // up to the scheduler, but with the writers gone they have to.
+    if (HashTable::getDefaultInlineValueSize() != 0) {
+        bool nru;
+        int64_t row_id = -1;
+        Item small(keys[0], 0, 0, "a", 1);
+        h.set(small, row_id);
+        Item *itm = h.optimisticGet(keys[0], h.hash(keys[0]), 0, false, &nru);
+        assert(itm);
+        assert(itm->getKey() == keys[0]);
+        delete itm;
+        assert(h.getNumOptimisticGets() > 0);
+    }
+}
+
+static int numReleased;
+
+static void countRelease(void *p) {
+    (void)p;
+    ++numReleased;
+}
+
+static void testEpochReclaimer() {
+    EpochReclaimer r;
+    int a, b;
+
+    // Retired while a reader is inside, so it has to stay...
+    EpochReclaimer::enter();
+    r.retire(&a, countRelease);
+    assert(r.reclaim() == 0);
+    assert(r.getNumRetired() == 1);
+    EpochReclaimer::leave();
+
+    // ...until the reader is gone.
+    assert(r.reclaim() == 1);
+    assert(numReleased == 1);
+
+    // Readers that start after the retire don't hold it up.
+    r.retire(&b, countRelease);
+    EpochReclaimer::enter();
+    assert(r.reclaim() == 1);
+    EpochReclaimer::leave();
+    assert(numReleased == 2);
+    assert(r.getNumRetired() == 0);
+}
+
+/*
+ * Chi-squared statistic for the given bucket counts against a uniform
+ * distribution.
+ */
+static double chiSquared(const std::vector<size_t> &counts, size_t total) {
+    double expected = static_cast<double>(total) / counts.size();
+    double rv = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        double d = counts[i] - expected;
+        rv += d * d / expected;
+    }
+    return rv;
+}
+
+static void assertUniform(const std::vector<size_t> &counts, size_t total) {
+    double df = counts.size() - 1;
+    double chi = chiSquared(counts, total);
+    // Six standard deviations away is not going to happen by chance.
+    if (chi > df + 6 * sqrt(2 * df)) {
+        std::cerr << "Skewed distribution: chi^2 = " << chi
+                  << " for " << df << " degrees of freedom" << std::endl;
+        abort();
+    }
+}
+
+static void testHashDistribution() {
+    HashTable h(global_stats);
+    const size_t numKeys(200000);
+    std::vector<size_t> prime(1531), low(1024), high(128);
+
+    for (size_t i = 0; i < numKeys; ++i) {
+        // Keys with a long common prefix and a short varying suffix.
+        char buf[32];
+        snprintf(buf, sizeof(buf), "user::%06d", static_cast<int>(i));
+        uint64_t v = h.hash(buf, strlen(buf));
+        assert(v == hash64(buf, strlen(buf)));
+        ++prime[v % prime.size()];
+        ++low[v & (low.size() - 1)];
+        ++high[v >> 57];
+    }
+
+    assertUniform(prime, numKeys);
+    assertUniform(low, numKeys);
+    assertUniform(high, numKeys);
+
+    // Flipping any one input bit should flip about half the output bits.
+    std::string key("user::000123");
+    uint64_t orig = hash64(key.data(), key.size());
+    size_t flipped(0), trials(0);
+    for (size_t i = 0; i < key.size(); ++i) {
+        for (int bit = 0; bit < 8; ++bit) {
+            std::string k(key);
+            k[i] ^= static_cast<char>(1 << bit);
+            uint64_t diff = orig ^ hash64(k.data(), k.size());
+            for (; diff; diff &= diff - 1) {
+                ++flipped;
+            }
+            ++trials;
+        }
+    }
+    double avg = static_cast<double>(flipped) / trials;
+    assert(avg > 28 && avg < 36);
+
+    // Every key length goes through a different path in the hash.
+    char longkey[200];
+    memset(longkey, 'x', sizeof(longkey));
+    for (size_t len = 1; len < sizeof(longkey); ++len) {
+        assert(hash64(longkey, len) != hash64(longkey, len - 1));
+    }
+}
+
+static void testTaggedOverflow() {
+    HashTable h(global_stats, 1, 1);
+    assert(h.getLayout() == tagged);
+    assert(h.getOverflowMemory() == 0);
+
+    std::vector<std::string> keys = generateKeys(TaggedBucket::SLOTS * 4);
+    storeMany(h, keys);
+    assert(h.getOverflowMemory() == 3 * sizeof(TaggedBucket));
+    verifyFound(h, keys);
+
+    // Empty out the overflow groups and make sure they're released.
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        assert(h.del(*it));
+        assert(!h.find(*it));
+    }
+    assert(h.getNumItems() == 0);
+    assert(h.getOverflowMemory() == 0);
+
+    storeMany(h, keys);
+    h.resize(3);
+    verifyFound(h, keys);
+    h.clear();
+    assert(count(h) == 0);
+    assert(h.getOverflowMemory() == 0);
+}
+
+class KeyCollector : public HashTableVisitor {
+public:
+    KeyCollector() : stopAfter(0) {}
+
+    void visit(StoredValue *v) {
+        ++seen[v->getKey()];
+    }
+
+    bool shouldContinue() {
+        return stopAfter == 0 || seen.size() < stopAfter;
+    }
+
+    std::map<std::string, int> seen;
+    size_t stopAfter;
+};
+
+static void testPauseResumeVisit() {
+    HashTable h(global_stats, 3079, 47);
+    std::vector<std::string> keys = generateKeys(5000);
+    storeMany(h, keys);
+
+    // A visit in one go.
+    KeyCollector all;
+    size_t visited = 0;
+    HashTable::Position pos = h.pauseResumeVisit(all, HashTable::Position(),
+                                                 0, visited);
+    assert(pos == h.endPosition());
+    assert(visited == 5000);
+    assert(all.seen.size() == 5000);
+
+    // In chunks of about 100 items, each item exactly once.
+    KeyCollector chunked;
+    visited = 0;
+    size_t chunks = 0;
+    pos = HashTable::Position();
+    while (pos != h.endPosition()) {
+        size_t before = visited;
+        pos = h.pauseResumeVisit(chunked, pos, 100, visited);
+        assert(visited - before >= 100 || pos == h.endPosition());
+        ++chunks;
+    }
+    assert(chunks >= 50 && chunks < 60);
+    assert(visited == 5000);
+    assert(chunked.seen.size() == 5000);
+    std::map<std::string, int>::iterator it;
+    for (it = chunked.seen.begin(); it != chunked.seen.end(); ++it) {
+        assert(it->second == 1);
+    }
+
+    // A resize in between starts the visit over.
+    KeyCollector resized;
+    visited = 0;
+    pos = h.pauseResumeVisit(resized, HashTable::Position(), 1000, visited);
+    assert(pos != h.endPosition());
+    h.resize(6143);
+    pos = h.pauseResumeVisit(resized, pos, 0, visited);
+    assert(pos == h.endPosition());
+    assert(resized.seen.size() == 5000);
+    assert(visited > 5000);
+
+    // A position in the new buckets survives the end of a migration.
+    assert(h.startResize(12289));
+    assert(h.migrate(6100));
+    KeyCollector migrating;
+    visited = 0;
+    pos = h.pauseResumeVisit(migrating, HashTable::Position(), 10, visited);
+    assert(pos.getBucket() < 12289);
+    assert(!h.migrate(10000));
+    size_t first = visited;
+    pos = h.pauseResumeVisit(migrating, pos, 0, visited);
+    assert(pos == h.endPosition());
+    assert(visited - first < 5000);
+
+    // Stopping the visitor ends the visit.
+    KeyCollector stopped;
+    stopped.stopAfter = 10;
+    visited = 0;
+    pos = h.pauseResumeVisit(stopped, HashTable::Position(), 0, visited);
+    assert(pos == h.endPosition());
+    assert(visited < 5000);
+}
+
+static void testVisitQueue() {
+    HashTable h(global_stats, 3079, 47);
+    std::vector<std::string> keys = generateKeys(1000);
+    storeMany(h, keys);
+    KeyCollector c;
+    size_t visited = 0;
+    HashTable::Position partway = h.pauseResumeVisit(c, HashTable::Position(),
+                                                     10, visited);
+
+    std::vector<uint16_t> vbs;
+    vbs.push_back(1);
+    vbs.push_back(3);
+    vbs.push_back(5);
+    vbs.push_back(7);
+    VBucketVisitorCursor cursor;
+    cursor.vbid.set(5);
+
+    // Workers take vbuckets in turn from the cursor on, stopping
+    // leaves the cursor at the first one not visited to the end.
+    {
+        VBucketVisitQueue q(vbs, 2, &cursor);
+        assert(q.hasCursor());
+        VBucketVisitQueue busy(vbs, 1, &cursor);
+        assert(!busy.hasCursor());
+
+        uint16_t vbid;
+        HashTable::Position pos;
+        assert(q.next(0, vbid, pos) && vbid == 5);
+        assert(pos == HashTable::Position());
+        assert(q.next(1, vbid, pos) && vbid == 7);
+        assert(q.next(0, vbid, pos) && vbid == 1);
+        q.stop(1, h.endPosition());
+        q.stop(0, partway);
+        assert(q.isStopping());
+        assert(!q.next(1, vbid, pos));
+        assert(!q.finish());
+        assert(q.finish());
+        assert(cursor.vbid.get() == 1);
+        assert(cursor.position == partway);
+        assert(cursor.laps.get() == 0);
+    }
+
+    // The next visit picks up there and goes all the way round.
+    {
+        VBucketVisitQueue q(vbs, 1, &cursor);
+        uint16_t vbid;
+        HashTable::Position pos;
+        uint16_t expect[] = { 1, 3, 5, 7 };
+        for (size_t i = 0; i < 4; ++i) {
+            assert(q.next(0, vbid, pos));
+            assert(vbid == expect[i]);
+            assert(pos == (i == 0 ? partway : HashTable::Position()));
+        }
+        assert(!q.next(0, vbid, pos));
+        assert(q.finish());
+        assert(cursor.laps.get() == 1);
+        assert(cursor.vbid.get() == 1);
+        assert(cursor.position == HashTable::Position());
+    }
+
+    // Nobody is left holding it.
+    assert(cursor.acquire());
+    cursor.release();
+}
+
+static void runTests() {
     testHashSize();
     testHashSizeTwo();
     testReverseDeletions();
@@ -571,7 +1410,9 @@ int main() {
     testAddExpiry();
     testDepthCounting();
     testPoisonKey();
+    testHashDistribution();
     testResize();
+    testIncrementalResize();
     testConcurrentAccessResize();
     testAutoResize();
     testSizeStats();
@@ -580,5 +1421,32 @@ int main() {
     testSizeStatsSoftDelFlush();
     testSizeStatsEject();
     testSizeStatsEjectFlush();
+    testSlabPool();
+    testDefragment();
+    testBlobCompression();
+    testCompressValue();
+    testEjectItem();
+    testOptimisticGet();
+    testConcurrentOptimisticGet();
+    testVisitMulti();
+    testPauseResumeVisit();
+    testVisitQueue();
+}
+
+int main() {
+    putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
+    global_stats.setMaxDataSize(64*1024*1024);
+    HashTable::setDefaultNumBuckets(3);
+    alarm(60);
+    testEpochReclaimer();
+    runTests();
+
+    HashTable::setDefaultLayout(tagged);
+    runTests();
+    testTaggedOverflow();
+    testInlineValues();
+
+    HashTable::setDefaultInlineValueSize(0);
+    runTests();
     exit(0);
 }
@@ -0,0 +1,133 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <cassert>
+#include <sstream>
+
+#include <checkpoint.hh>
+#include <queueditem.hh>
+#include <stats.hh>
+#include <vbucket.hh>
+
+#include "threadtests.hh"
+
+/*
+ * Measures CheckpointManager::queueDirty throughput with a growing number
+ * of threads writing to the same vbucket, while a flusher thread drains
+ * the persistence cursor now and then.  Each thread updates its own keys
+ * over and over, so most of the mutations are deduplicated.
+ *
+ * usage: queue_dirty_bench [max threads] [mutations per thread]
+ */
+
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return 0;
+    }
+
+    rel_time_t (*ep_current_time)() = basic_current_time;
+
+    time_t ep_real_time() {
+        return time(NULL);
+    }
+}
+
+EPStats global_stats;
+CheckpointConfig checkpoint_config;
+
+static const size_t KEYS_PER_THREAD = 10000;
+
+class QueueDirtyGenerator : public Generator<bool> {
+public:
+
+    QueueDirtyGenerator(CheckpointManager &m, RCPtr<VBucket> &v, size_t n) :
+        cm(m), vb(v), numMutations(n) {}
+
+    bool operator()() {
+        int me = started.incr(1);
+        std::vector<std::string> keys;
+        for (size_t i = 0; i < KEYS_PER_THREAD; ++i) {
+            std::stringstream ss;
+            ss << "key_" << me << "_" << i;
+            keys.push_back(ss.str());
+        }
+
+        for (size_t i = 0; i < numMutations; ++i) {
+            queued_item qi(QueuedItem::New(keys[i % keys.size()], 0, queue_op_set));
+            if (cm.queueDirty(qi, vb)) {
+                vb->doStatsForQueueing(*qi, qi->size());
+            }
+        }
+        return true;
+    }
+
+private:
+    CheckpointManager &cm;
+    RCPtr<VBucket>    &vb;
+    size_t             numMutations;
+    Atomic<int>        started;
+};
+
+struct flusher_args {
+    CheckpointManager *cm;
+    Atomic<bool>       done;
+};
+
+extern "C" {
+    static void *launch_flusher_thread(void *arg) {
+        flusher_args *args = static_cast<flusher_args*>(arg);
+        std::vector<queued_item> items;
+        while (!args->done.get()) {
+            args->cm->getAllItemsForPersistence(items);
+            items.clear();
+            usleep(1000);
+        }
+        return NULL;
+    }
+}
+
+static void run(size_t threads, size_t numMutations) {
+    // A replica vbucket only gets a new checkpoint when its master says
+    // so, so all the items stay in the one open checkpoint.
+    RCPtr<VBucket> vb(new VBucket(0, vbucket_state_replica, global_stats,
+                                  checkpoint_config));
+    CheckpointManager cm(global_stats, 0, checkpoint_config, 1);
+    QueueDirtyGenerator gen(cm, vb, numMutations);
+
+    flusher_args args;
+    args.cm = &cm;
+    args.done.set(false);
+    pthread_t flusher;
+    int rc = pthread_create(&flusher, NULL, launch_flusher_thread, &args);
+    assert(rc == 0);
+
+    size_t stagedBefore = global_stats.chkStagedItems.get();
+    hrtime_t start = gethrtime();
+    getCompletedThreads(threads, &gen);
+    hrtime_t elapsed = gethrtime() - start;
+
+    args.done.set(true);
+    rc = pthread_join(flusher, NULL);
+    assert(rc == 0);
+
+    double ops = static_cast<double>(threads * numMutations);
+    size_t staged = global_stats.chkStagedItems.get() - stagedBefore;
+    printf("%3d threads  %12.0f mutations/s  %5.1f%% staged\n",
+           static_cast<int>(threads),
+           ops / (static_cast<double>(elapsed) / 1000000000.0),
+           100.0 * static_cast<double>(staged) / ops);
+}
+
+int main(int argc, char **argv) {
+    putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
+    size_t maxThreads = argc > 1 ? atoi(argv[1]) : 16;
+    size_t numMutations = argc > 2 ? atoi(argv[2]) : 500000;
+
+    for (size_t n = 1; n <= maxThreads; n *= 2) {
+        run(n, numMutations);
+    }
+    return 0;
+}
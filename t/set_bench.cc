@@ -0,0 +1,102 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cassert>
+#include <sstream>
+
+#include <ep.hh>
+#include <item.hh>
+#include <stats.hh>
+
+#include "threadtests.hh"
+
+/*
+ * Measures HashTable::set throughput with a growing number of threads,
+ * once with every thread hammering the same key and once with each
+ * thread updating its own keys.  The second case is where the hash
+ * table and engine wide counters used to be the contention point.
+ *
+ * usage: set_bench [max threads] [sets per thread]
+ */
+
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return 0;
+    }
+
+    rel_time_t (*ep_current_time)() = basic_current_time;
+
+    time_t ep_real_time() {
+        return time(NULL);
+    }
+}
+
+EPStats global_stats;
+
+static const size_t KEYS_PER_THREAD = 1000;
+
+class SetGenerator : public Generator<bool> {
+public:
+
+    SetGenerator(HashTable &h, bool single, size_t n) :
+        ht(h), singleKey(single), numSets(n) {}
+
+    bool operator()() {
+        std::vector<std::string> keys;
+        if (singleKey) {
+            keys.push_back("the_one_key");
+        } else {
+            int me = started.incr(1);
+            for (size_t i = 0; i < KEYS_PER_THREAD; ++i) {
+                std::stringstream ss;
+                ss << "key_" << me << "_" << i;
+                keys.push_back(ss.str());
+            }
+        }
+
+        std::string val(16, 'v');
+        int64_t row_id = -1;
+        for (size_t i = 0; i < numSets; ++i) {
+            Item itm(keys[i % keys.size()], 0, 0, val.c_str(), val.length());
+            ht.set(itm, row_id);
+        }
+        return true;
+    }
+
+private:
+    HashTable     &ht;
+    bool           singleKey;
+    size_t         numSets;
+    Atomic<int>    started;
+};
+
+static void run(bool singleKey, size_t threads, size_t numSets) {
+    HashTable ht(global_stats, 196613, 47);
+    SetGenerator gen(ht, singleKey, numSets);
+
+    hrtime_t start = gethrtime();
+    getCompletedThreads(threads, &gen);
+    hrtime_t elapsed = gethrtime() - start;
+
+    double ops = static_cast<double>(threads * numSets);
+    printf("%-10s %3d threads  %12.0f sets/s\n",
+           singleKey ? "single-key" : "multi-key", static_cast<int>(threads),
+           ops / (static_cast<double>(elapsed) / 1000000000.0));
+    ht.clear();
+}
+
+int main(int argc, char **argv) {
+    putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
+    size_t maxThreads = argc > 1 ? atoi(argv[1]) : 16;
+    size_t numSets = argc > 2 ? atoi(argv[2]) : 1000000;
+
+    for (size_t n = 1; n <= maxThreads; n *= 2) {
+        run(true, n, numSets);
+    }
+    for (size_t n = 1; n <= maxThreads; n *= 2) {
+        run(false, n, numSets);
+    }
+    return 0;
+}
@@ -0,0 +1,98 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+
+#include <string.h>
+
+#include "txnsizer.hh"
+
+#undef NDEBUG
+#include <assert.h>
+
+static const hrtime_t SECOND(1000000000);
+
+static void testStatic() {
+    TxnSizer sizer(100, 4000, 500);
+    assert(sizer.getSize() == 4000);
+    // Slow commits don't matter unless adaptive sizing is enabled.
+    assert(sizer.commitDone(4000, 5000, 0, 0, SECOND) == 4000);
+    assert(sizer.getReason() == TxnSizer::txn_size_static);
+    assert(sizer.getNumAdjustments() == 0);
+
+    sizer.setMaxSize(2000);
+    assert(sizer.getSize() == 2000);
+}
+
+static void testShrinkOnSlowCommits() {
+    TxnSizer sizer(100, 4000, 500);
+    sizer.setEnabled(true);
+    // Twice as slow as the target, so half the size.
+    assert(sizer.commitDone(4000, 1000, 0, 0, SECOND) == 2000);
+    assert(sizer.getReason() == TxnSizer::txn_size_slow_commits);
+    // Never shrink by more than half at once.
+    assert(sizer.commitDone(2000, 100000, 0, 0, SECOND) == 1000);
+    // ...nor below the minimum.
+    for (int i = 0; i < 10; ++i) {
+        sizer.commitDone(sizer.getSize(), 100000, 0, 0, SECOND);
+    }
+    assert(sizer.getSize() == 100);
+    assert(sizer.getNumAdjustments() == 6);
+}
+
+static void testGrowWhenQueueGrows() {
+    TxnSizer sizer(100, 4000, 500);
+    sizer.setEnabled(true);
+    sizer.setMaxSize(1000);
+    sizer.commitDone(1000, 1000, 0, 0, SECOND);
+    assert(sizer.getSize() == 500);
+
+    // A full transaction committing on target while items come in twice
+    // as fast as they go out.
+    assert(sizer.commitDone(500, 400, 10000, 5000, 2 * SECOND) == 625);
+    assert(sizer.getReason() == TxnSizer::txn_size_queue_growing);
+    assert(sizer.getFillRate() == 10000);
+    assert(sizer.getDrainRate() == 5000);
+
+    // Nothing to gain from a bigger size if the queue runs dry anyway.
+    assert(sizer.commitDone(10, 400, 30000, 20000, 4 * SECOND) == 625);
+    assert(sizer.getReason() == TxnSizer::txn_size_queue_drained);
+
+    // Keeping up with fast commits still grows, up to the maximum.
+    for (int i = 0; i < 10; ++i) {
+        sizer.commitDone(sizer.getSize(), 10, 30000, 30000, 5 * SECOND + i);
+    }
+    assert(sizer.getSize() == 1000);
+    assert(sizer.getReason() == TxnSizer::txn_size_fast_commits);
+}
+
+static void testSteady() {
+    TxnSizer sizer(100, 1000, 500);
+    sizer.setEnabled(true);
+    // Close enough to the target.
+    assert(sizer.commitDone(1000, 400, 0, 0, SECOND) == 1000);
+    assert(sizer.getReason() == TxnSizer::txn_size_steady);
+    assert(strcmp(TxnSizer::reasonName(sizer.getReason()), "steady") == 0);
+    assert(sizer.getNumAdjustments() == 0);
+}
+
+static void testDisable() {
+    TxnSizer sizer(100, 4000, 500);
+    sizer.setEnabled(true);
+    assert(sizer.getReason() == TxnSizer::txn_size_steady);
+    sizer.commitDone(4000, 1000, 0, 0, SECOND);
+    assert(sizer.getSize() == 2000);
+    sizer.setEnabled(false);
+    assert(sizer.getSize() == 4000);
+    assert(sizer.getReason() == TxnSizer::txn_size_static);
+}
+
+int main(int argc, char **argv) {
+    (void)argc; (void)argv;
+
+    testStatic();
+    testShrinkOnSlowCommits();
+    testGrowWhenQueueGrows();
+    testSteady();
+    testDisable();
+
+    return 0;
+}
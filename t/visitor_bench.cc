@@ -0,0 +1,165 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cassert>
+#include <sstream>
+#include <vector>
+
+#include <item.hh>
+#include <stats.hh>
+#include <stored-value.hh>
+#include <vbucket_visit.hh>
+
+#include "threadtests.hh"
+
+/*
+ * Measures how long a pass over every item of a set of vbuckets takes
+ * as it's spread over more workers, the way the pagers spread their
+ * visits when visitor_threads is above 1.
+ *
+ * Each worker takes vbuckets from a shared VBucketVisitQueue and
+ * visits them in chunks with a visitor of its own, which collects the
+ * keys of expired items like the expiry pager does.  The keys found
+ * by the workers are merged once they're all done.
+ *
+ * usage: visitor_bench [max threads] [vbuckets] [items per vbucket]
+ */
+
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return 0;
+    }
+
+    rel_time_t (*ep_current_time)() = basic_current_time;
+
+    time_t ep_real_time() {
+        return time(NULL);
+    }
+}
+
+EPStats global_stats;
+
+static const size_t CHUNK_SIZE = 10000;
+
+class ExpiredCollector : public HashTableVisitor {
+public:
+    ExpiredCollector() : startTime(ep_real_time()) {}
+
+    void visit(StoredValue *v) {
+        if (v->isExpired(startTime)) {
+            expired.push_back(v->getKey());
+        }
+    }
+
+    std::vector<std::string> expired;
+
+private:
+    time_t startTime;
+};
+
+class VisitGenerator : public Generator<bool> {
+public:
+
+    VisitGenerator(std::vector<HashTable*> &v, VBucketVisitQueue &q,
+                   size_t workers) :
+        vbuckets(v), queue(q), collectors(workers) {}
+
+    bool operator()() {
+        size_t me = started.incr(1);
+        ExpiredCollector &collector = collectors[me];
+        uint16_t vbid;
+        HashTable::Position pos;
+        while (queue.next(me, vbid, pos)) {
+            HashTable &ht = *vbuckets[vbid];
+            while (pos != ht.endPosition()) {
+                size_t items = 0;
+                pos = ht.pauseResumeVisit(collector, pos, CHUNK_SIZE, items);
+                queue.countChunk(items);
+            }
+            queue.countVBucket();
+        }
+        queue.finish();
+        return true;
+    }
+
+    size_t merge() {
+        std::vector<std::string> all;
+        for (size_t i = 0; i < collectors.size(); ++i) {
+            all.insert(all.end(), collectors[i].expired.begin(),
+                       collectors[i].expired.end());
+        }
+        return all.size();
+    }
+
+private:
+    std::vector<HashTable*>     &vbuckets;
+    VBucketVisitQueue           &queue;
+    std::vector<ExpiredCollector> collectors;
+    Atomic<size_t>               started;
+};
+
+static double run(std::vector<HashTable*> &vbuckets, size_t threads,
+                  size_t expected, VBucketVisitorCursor &cursor) {
+    std::vector<uint16_t> vbs;
+    for (size_t i = 0; i < vbuckets.size(); ++i) {
+        vbs.push_back(static_cast<uint16_t>(i));
+    }
+    VBucketVisitQueue queue(vbs, threads, &cursor);
+    VisitGenerator gen(vbuckets, queue, threads);
+
+    hrtime_t start = gethrtime();
+    getCompletedThreads(threads, &gen);
+    size_t expired = gen.merge();
+    hrtime_t elapsed = gethrtime() - start;
+
+    assert(expired == expected);
+    return static_cast<double>(elapsed) / 1000000.0;
+}
+
+int main(int argc, char **argv) {
+    putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
+    size_t maxThreads = argc > 1 ? atoi(argv[1]) : 16;
+    size_t numVBuckets = argc > 2 ? atoi(argv[2]) : 256;
+    size_t perVBucket = argc > 3 ? atoi(argv[3]) : 4000;
+
+    std::string val(32, 'v');
+    std::vector<HashTable*> vbuckets;
+    size_t expected = 0;
+    for (size_t vb = 0; vb < numVBuckets; ++vb) {
+        HashTable *ht = new HashTable(global_stats, 3079, 47);
+        for (size_t i = 0; i < perVBucket; ++i) {
+            std::stringstream ss;
+            ss << "key_" << vb << "_" << i;
+            // Every other item expired long ago.
+            Item itm(ss.str(), 0, i % 2, val.c_str(), val.length());
+            int64_t row_id = -1;
+            ht->set(itm, row_id);
+            expected += i % 2;
+        }
+        vbuckets.push_back(ht);
+    }
+
+    printf("%d vbuckets of %d items\n\n", static_cast<int>(numVBuckets),
+           static_cast<int>(perVBucket));
+    printf("%-9s%12s%10s%16s\n", "threads", "pass (ms)", "speedup", "items/s");
+    VBucketVisitorCursor cursor;
+    double base = 0;
+    for (size_t n = 1; n <= maxThreads; n *= 2) {
+        double ms = run(vbuckets, n, expected, cursor);
+        if (n == 1) {
+            base = ms;
+        }
+        double items = static_cast<double>(numVBuckets * perVBucket);
+        printf("%7d  %12.1f%9.2fx%16.0f\n", static_cast<int>(n), ms,
+               base / ms, items / (ms / 1000.0));
+    }
+    assert(cursor.laps.get() > 0);
+
+    for (size_t vb = 0; vb < numVBuckets; ++vb) {
+        vbuckets[vb]->clear();
+        delete vbuckets[vb];
+    }
+    return 0;
+}
@@ -0,0 +1,86 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef TAGGED_BUCKET_HH
+#define TAGGED_BUCKET_HH 1
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+class StoredValue;
+
+/**
+ * A fixed width group of hash table slots used by the "tagged" hash
+ * table layout.
+ *
+ * Every slot has a one byte tag derived from the key's hash stored in
+ * a dense array at the front of the group, so a lookup first compares
+ * all the tags at once (using SSE2 where it's available) and only
+ * follows the StoredValue pointers whose tag matched.  Most lookups
+ * touch one cache line of tags plus a single key.
+ *
+ * A tag of zero marks an empty slot, real tags always have the high
+ * bit set.  When all the slots of a group are in use, further entries
+ * go to an overflow group chained from the last one.
+ *
+ * Instances are plain old data and are allocated with calloc.
+ */
+struct TaggedBucket {
+    static const int SLOTS = 16;
+
+    uint8_t        tags[SLOTS];  //!< Per-slot hash tags, 0 == empty.
+    StoredValue   *slots[SLOTS]; //!< The values stored in this group.
+    TaggedBucket  *overflow;     //!< Next group for this bucket, if any.
+
+    /**
+     * Get the tag to use for the given hash value.
+     *
+     * The bucket index is taken from the hash modulo the table size,
+     * so use the high order bits here.
+     */
+    static uint8_t tagFor(uint64_t h) {
+        return static_cast<uint8_t>(0x80 | (h >> 57));
+    }
+
+    /**
+     * Get a bitmask of the slots in this group carrying the given tag.
+     *
+     * Bit n of the result is set if tags[n] == tag.
+     */
+    uint32_t match(uint8_t tag) const {
+#ifdef __SSE2__
+        __m128i needle = _mm_set1_epi8(static_cast<char>(tag));
+        __m128i haystack = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tags));
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(needle,
+                                                                      haystack)));
+#else
+        uint32_t rv = 0;
+        for (int i = 0; i < SLOTS; ++i) {
+            if (tags[i] == tag) {
+                rv |= (1 << i);
+            }
+        }
+        return rv;
+#endif
+    }
+
+    /**
+     * Get a bitmask of the slots in this group that are in use.
+     */
+    uint32_t used() const {
+        return ~match(0) & ((1 << SLOTS) - 1);
+    }
+
+    /**
+     * Get the index of the lowest bit set in a (non-zero) mask.
+     */
+    static int firstSlot(uint32_t mask) {
+        return __builtin_ctz(mask);
+    }
+};
+
+#endif /* TAGGED_BUCKET_HH */
@@ -155,6 +155,8 @@ public:
             config.setBgMaxPending(value);
         } else if (key.compare("tap_backlog_limit") == 0) {
             config.setBackfillBacklogLimit(value);
+        } else if (key.compare("tap_batch_max_bytes") == 0) {
+            config.setBatchMaxBytes(value);
         }
     }
 
@@ -185,6 +187,7 @@ TapConfig::TapConfig(EventuallyPersistentEngine &e)
     requeueSleepTime = config.getTapRequeueSleepTime();
     backfillBacklogLimit = config.getTapBacklogLimit();
     backfillResidentThreshold = config.getTapBackfillResident();
+    batchMaxBytes = config.getTapBatchMaxBytes();
 }
 
 void TapConfig::addConfigChangeListener(EventuallyPersistentEngine &engine) {
@@ -207,6 +210,8 @@ void TapConfig::addConfigChangeListener(EventuallyPersistentEngine &engine) {
                               new TapConfigChangeListener(engine.getTapConfig()));
     configuration.addValueChangedListener("tap_backfill_resident",
                               new TapConfigChangeListener(engine.getTapConfig()));
+    configuration.addValueChangedListener("tap_batch_max_bytes",
+                              new TapConfigChangeListener(engine.getTapConfig()));
 }
 
 TapProducer::TapProducer(EventuallyPersistentEngine &theEngine,
@@ -909,11 +914,13 @@ ENGINE_ERROR_CODE TapProducer::processAck(uint32_t s,
     }
 
     bool notifyTapNotificationThread = false;
+    bool notifyDurability = false;
 
     switch (status) {
     case PROTOCOL_BINARY_RESPONSE_SUCCESS:
         /* And explicit ack this message! */
         if (iter != tapLog.end()) {
+            notifyDurability = isReplicating();
             // If this ACK is for TAP_CHECKPOINT messages, indicate that the checkpoint
             // is synced between the master and slave nodes.
             if ((iter->event == TAP_CHECKPOINT_START || iter->event == TAP_CHECKPOINT_END)
@@ -952,6 +959,9 @@ ENGINE_ERROR_CODE TapProducer::processAck(uint32_t s,
         if (notifyTapNotificationThread) {
             engine.notifyNotificationThread();
         }
+        if (notifyDurability) {
+            engine.getEpStore()->getDurabilityMonitor().acked(getName(), s);
+        }
 
         lh.lock();
         if (mayCompleteDumpOrTakeover_UNLOCKED() && idle_UNLOCKED()) {
@@ -1096,8 +1106,9 @@ public:
             RCPtr<VBucket> vb = epstore->getVBucket(vbucket);
             if (vb) {
                 int bucket_num(0);
-                LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-                StoredValue *v = epstore->fetchValidValue(vb, key, bucket_num);
+                uint64_t h = vb->ht.hash(key);
+                VersionedLockHolder lh = vb->ht.getLockedBucket(h, &bucket_num);
+                StoredValue *v = epstore->fetchValidValue(vb, key, h, bucket_num);
                 if (v) {
                     rowid = v->getId();
                     const TapConfig &config = epe->getTapConfig();
@@ -1109,7 +1120,7 @@ public:
                     epe->getTapConnMap().performTapOp(name, tapop, gcb.val.getValue());
                     // As an item is deleted from hash table, push the item
                     // deletion event into the TAP queue.
-                    queued_item qitem(new QueuedItem(key, vbucket, queue_op_del, -1));
+                    queued_item qitem(QueuedItem::New(key, vbucket, queue_op_del, -1));
                     std::list<queued_item> del_items;
                     del_items.push_back(qitem);
                     epe->getTapConnMap().setEvents(name, &del_items);
@@ -1212,6 +1223,41 @@ void TapProducer::completeBGFetchJob(Item *itm, uint16_t vbid, bool implicitEnqu
     }
 }
 
+tap_key_state TapProducer::getKeyState(uint16_t vbucket, const std::string &key,
+                                       uint32_t &s) {
+    LockHolder lh(queueLock);
+    if (!isBackfillCompleted_UNLOCKED() || !vbucketFilter(vbucket)) {
+        return tap_key_pending;
+    }
+    std::map<uint16_t, TapCheckpointState>::iterator it = tapCheckpointState.find(vbucket);
+    if (it == tapCheckpointState.end() || !it->second.isBgFetchCompleted()) {
+        // A value being fetched from disk may be the key's.
+        return tap_key_pending;
+    }
+    RCPtr<VBucket> vb = engine.getVBucket(vbucket);
+    if (!vb || !vb->checkpointManager.isTAPCursorPastKey(name, key)) {
+        return tap_key_pending;
+    }
+
+    std::list<queued_item>::iterator qit = queue->begin();
+    for (; qit != queue->end(); ++qit) {
+        if ((*qit)->getVBucketId() == vbucket && (*qit)->getKey() == key) {
+            return tap_key_pending;
+        }
+    }
+    // Acks come in order, so the last message with the key is the one
+    // that matters.
+    std::list<TapLogElement>::reverse_iterator lit = tapLog.rbegin();
+    for (; lit != tapLog.rend(); ++lit) {
+        if ((lit->event == TAP_MUTATION || lit->event == TAP_DELETION) &&
+            lit->vbucket == vbucket && lit->item->getKey() == key) {
+            s = lit->seqno;
+            return tap_key_sent;
+        }
+    }
+    return tap_key_acked;
+}
+
 Item* TapProducer::nextBgFetchedItem_UNLOCKED() {
     assert(!backfilledItems.empty());
     Item *rv = backfilledItems.front();
@@ -1511,6 +1557,11 @@ queued_item TapProducer::nextFgFetched_UNLOCKED(bool &shouldPause) {
         uint16_t invalid_count = 0;
         uint16_t open_checkpoint_count = 0;
         uint16_t wait_for_ack_count = 0;
+        // Runs of mutations are taken from the checkpoints in batches
+        // until the budget runs out, then one item per vbucket as usual.
+        std::vector<queued_item> batch;
+        size_t batchBytes = 0;
+        size_t batchMaxBytes = engine.getTapConfig().getBatchMaxBytes();
 
         std::map<uint16_t, TapCheckpointState>::iterator it = tapCheckpointState.begin();
         for (; it != tapCheckpointState.end(); ++it) {
@@ -1524,6 +1575,22 @@ queued_item TapProducer::nextFgFetched_UNLOCKED(bool &shouldPause) {
                 continue;
             }
 
+            if (batchBytes < batchMaxBytes) {
+                vb->checkpointManager.getItemsForTAPConnection(name, batch,
+                                                  std::numeric_limits<size_t>::max(),
+                                                  batchMaxBytes - batchBytes);
+                if (!batch.empty()) {
+                    it->second.lastItem = false;
+                    std::vector<queued_item>::iterator bit = batch.begin();
+                    for (; bit != batch.end(); ++bit) {
+                        batchBytes += (*bit)->size();
+                        addEvent_UNLOCKED(*bit);
+                    }
+                    batch.clear();
+                    continue;
+                }
+            }
+
             bool isLastItem = false;
             queued_item qi = vb->checkpointManager.nextItem(name, isLastItem);
             switch(qi->getOperation()) {
@@ -1809,9 +1876,9 @@ Item* TapProducer::getNextItem(const void *c, uint16_t *vbucket, tap_event_t &re
         }
 
         ++stats.numTapBGFetched;
-        qi = queued_item(new QueuedItem(itm->getKey(), itm->getVBucketId(),
-                                        ret == TAP_MUTATION ? queue_op_set : queue_op_del,
-                                        -1, itm->getId()));
+        qi = queued_item(QueuedItem::New(itm->getKey(), itm->getVBucketId(),
+                                         ret == TAP_MUTATION ? queue_op_set : queue_op_del,
+                                         -1, itm->getId()));
     } else if (hasItemFromVBHashtable_UNLOCKED()) { // Item from memory backfill or checkpoints
         if (waitForCheckpointMsgAck()) {
             getLogger()->log(EXTENSION_LOG_INFO, NULL,
@@ -1847,7 +1914,7 @@ Item* TapProducer::getNextItem(const void *c, uint16_t *vbucket, tap_event_t &re
                 ret = TAP_MUTATION;
             } else if (r == ENGINE_KEY_ENOENT) {
                 // Item was deleted and set a message type to tap_deletion.
-                itm = new Item(qi->getKey().c_str(), qi->getKey().length(), 0,
+                itm = new Item(qi->getKeyBytes(), qi->getKeyLen(), 0,
                                0, 0, 0, -1, qi->getVBucketId());
                 itm->setSeqno(qi->getSeqno());
                 ret = TAP_DELETION;
@@ -1879,7 +1946,7 @@ Item* TapProducer::getNextItem(const void *c, uint16_t *vbucket, tap_event_t &re
             }
             ++stats.numTapFGFetched;
         } else if (qi->getOperation() == queue_op_del) {
-            itm = new Item(qi->getKey().c_str(), qi->getKey().length(), 0,
+            itm = new Item(qi->getKeyBytes(), qi->getKeyLen(), 0,
                            0, 0, 0, -1, qi->getVBucketId());
             itm->setSeqno(qi->getSeqno());
             ret = TAP_DELETION;
@@ -112,6 +112,15 @@ typedef enum {
     checkpoint_end_synced
 } tap_checkpoint_state;
 
+/**
+ * How far a TAP stream got with the latest mutation of a key.
+ */
+typedef enum {
+    tap_key_pending,            //!< not sent yet, or not known to be
+    tap_key_sent,               //!< sent and waiting for an ack
+    tap_key_acked               //!< sent and acked
+} tap_key_state;
+
 /**
  * Checkpoint state of each vbucket in TAP stream.
  */
@@ -190,6 +199,10 @@ public:
         return backfillResidentThreshold;
     }
 
+    size_t getBatchMaxBytes() const {
+        return batchMaxBytes;
+    }
+
 protected:
     friend class TapConfigChangeListener;
     friend class EventuallyPersistentEngine;
@@ -233,6 +246,10 @@ protected:
         backfillResidentThreshold = value;
     }
 
+    void setBatchMaxBytes(size_t value) {
+        batchMaxBytes = value;
+    }
+
     static void addConfigChangeListener(EventuallyPersistentEngine &engine);
 
 private:
@@ -256,6 +273,9 @@ private:
     size_t backfillBacklogLimit;
     double backfillResidentThreshold;
 
+    // Bytes of mutations a TAP producer may take from the checkpoints at once
+    size_t batchMaxBytes;
+
     EventuallyPersistentEngine &engine;
 };
 
@@ -610,6 +630,24 @@ public:
         clearQueues_UNLOCKED();
     }
 
+    /**
+     * Is this a replication stream, whose acks tell what a replica got?
+     */
+    bool isReplicating() const {
+        return registeredTAPClient.get() && supportAck && !dumpQueue;
+    }
+
+    /**
+     * Find out how far the stream got with the latest mutation of a key.
+     *
+     * @param vbucket the vbucket of the key
+     * @param key the key
+     * @param s set to the seqno of the message that carried the mutation
+     *          if it's waiting for an ack
+     * @return the state of the mutation in the stream
+     */
+    tap_key_state getKeyState(uint16_t vbucket, const std::string &key, uint32_t &s);
+
 private:
     friend class EventuallyPersistentEngine;
     friend class TapConnMap;
@@ -668,7 +706,7 @@ private:
      * @return true if the the queue was empty
      */
     bool addEvent_UNLOCKED(const std::string &key, uint16_t vbid, enum queue_operation op) {
-        queued_item qi(new QueuedItem(key, vbid, op));
+        queued_item qi(QueuedItem::New(key, vbid, op));
         return addEvent_UNLOCKED(qi);
     }
 
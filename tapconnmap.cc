@@ -592,6 +592,10 @@ void CompleteDiskBackfillTapOperation::perform(TapProducer *tc, void *) {
     tc->completeDiskBackfill();
 }
 
+void DisconnectTapOperation::perform(TapProducer *tc, void *) {
+    tc->setDisconnect(true);
+}
+
 void ScheduleDiskBackfillTapOperation::perform(TapProducer *tc, void *) {
     tc->scheduleDiskBackfill();
 }
@@ -55,6 +55,14 @@ public:
     void perform(TapProducer *tc, void* arg);
 };
 
+/**
+ * Disconnect a tap connection, which has to start over when it comes back.
+ */
+class DisconnectTapOperation : public TapOperation<void*> {
+public:
+    void perform(TapProducer *tc, void* arg);
+};
+
 /**
  * Complete a bg fetch job and give the item to the given tap connection.
  */
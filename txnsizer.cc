@@ -0,0 +1,127 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+#include "txnsizer.hh"
+
+#include <algorithm>
+
+// How much of a new commit time goes into the moving average.
+static const double COMMIT_TIME_WEIGHT(0.25);
+// Don't trust the rates over periods shorter than this.
+static const hrtime_t RATE_PERIOD(1000000000);
+
+TxnSizer::TxnSizer(size_t lo, size_t hi, size_t t) :
+    enabled(false), minSize(lo), maxSize(hi), target(t), size(hi),
+    reason(txn_size_static), commitTimeAvg(0), fillRate(0), drainRate(0),
+    numAdjustments(0), lastSampleTime(0), lastEnqueued(0), lastPersisted(0)
+{}
+
+void TxnSizer::setEnabled(bool to) {
+    enabled.set(to);
+    if (!to) {
+        size.set(maxSize.get());
+        reason.set(txn_size_static);
+    } else if (getReason() == txn_size_static) {
+        // Nothing to go on until the first commit.
+        reason.set(txn_size_steady);
+    }
+}
+
+size_t TxnSizer::clamp(size_t sz) {
+    size_t hi = maxSize.get();
+    return std::max(std::min(sz, hi), std::min(minSize.get(), hi));
+}
+
+void TxnSizer::setMinSize(size_t lo) {
+    minSize.set(lo);
+    if (enabled.get()) {
+        size.set(clamp(size.get()));
+    }
+}
+
+void TxnSizer::setMaxSize(size_t hi) {
+    maxSize.set(hi);
+    size.set(enabled.get() ? clamp(size.get()) : hi);
+}
+
+void TxnSizer::updateRates(size_t enqueued, size_t persisted, hrtime_t now) {
+    if (lastSampleTime == 0 || enqueued < lastEnqueued || persisted < lastPersisted) {
+        // First sample, or the stats were reset.
+        lastSampleTime = now;
+        lastEnqueued = enqueued;
+        lastPersisted = persisted;
+        return;
+    }
+    if (now - lastSampleTime < RATE_PERIOD) {
+        return;
+    }
+    double secs = static_cast<double>(now - lastSampleTime) / RATE_PERIOD;
+    fillRate.set(static_cast<double>(enqueued - lastEnqueued) / secs);
+    drainRate.set(static_cast<double>(persisted - lastPersisted) / secs);
+    lastSampleTime = now;
+    lastEnqueued = enqueued;
+    lastPersisted = persisted;
+}
+
+size_t TxnSizer::commitDone(size_t items, size_t commitTime,
+                            size_t enqueued, size_t persisted, hrtime_t now) {
+    updateRates(enqueued, persisted, now);
+    if (!enabled.get()) {
+        return size.get();
+    }
+
+    double avg = commitTimeAvg.get();
+    if (avg == 0) {
+        avg = static_cast<double>(commitTime);
+    } else {
+        avg += COMMIT_TIME_WEIGHT * (static_cast<double>(commitTime) - avg);
+    }
+    commitTimeAvg.set(avg);
+
+    size_t current = size.get();
+    size_t next = current;
+    double goal = static_cast<double>(target.get());
+    if (goal > 0 && avg > goal) {
+        // Commits take about as long as the number of items in them, but
+        // never shrink by more than half at once.
+        next = std::max(static_cast<size_t>(current * (goal / avg)), current / 2);
+        reason.set(txn_size_slow_commits);
+    } else if (items < current) {
+        reason.set(txn_size_queue_drained);
+    } else if (fillRate.get() > drainRate.get()) {
+        next = current + std::max(current / 4, static_cast<size_t>(1));
+        reason.set(txn_size_queue_growing);
+    } else if (goal == 0 || avg < goal / 2) {
+        next = current + std::max(current / 8, static_cast<size_t>(1));
+        reason.set(txn_size_fast_commits);
+    } else {
+        reason.set(txn_size_steady);
+    }
+    next = clamp(next);
+
+    if (next != current) {
+        size.set(next);
+        ++numAdjustments;
+        // The commit times so far were for a different size.
+        commitTimeAvg.set(0);
+    }
+    return next;
+}
+
+const char *TxnSizer::reasonName(reason_t r) {
+    switch (r) {
+    case txn_size_static:
+        return "static";
+    case txn_size_steady:
+        return "steady";
+    case txn_size_slow_commits:
+        return "slow_commits";
+    case txn_size_queue_growing:
+        return "queue_growing";
+    case txn_size_fast_commits:
+        return "fast_commits";
+    case txn_size_queue_drained:
+        return "queue_drained";
+    }
+    return "unknown";
+}
@@ -0,0 +1,137 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef TXNSIZER_HH
+#define TXNSIZER_HH 1
+
+#include "common.hh"
+#include "atomic.hh"
+
+/**
+ * Picks the number of mutations a flusher puts in a transaction.
+ *
+ * Big transactions spread the cost of a commit over more items, but
+ * take longer to commit and so hold up everyone waiting for them to be
+ * on disk.  While adaptive sizing is enabled, every commit is fed back
+ * here: the size shrinks when commits take longer than the target, and
+ * grows while commits are fast or the disk write queue fills faster
+ * than it drains.  Otherwise the size is simply the maximum.
+ */
+class TxnSizer {
+public:
+
+    /**
+     * Why the size is what it is.
+     */
+    enum reason_t {
+        txn_size_static,         //!< adaptive sizing is disabled
+        txn_size_steady,         //!< commits are close enough to the target
+        txn_size_slow_commits,   //!< commits take longer than the target
+        txn_size_queue_growing,  //!< items are queued faster than persisted
+        txn_size_fast_commits,   //!< commits take well under the target
+        txn_size_queue_drained   //!< the last transaction wasn't full
+    };
+
+    TxnSizer(size_t lo = 1, size_t hi = 1, size_t target = 0);
+
+    /**
+     * Record the outcome of a commit and pick the next size.
+     *
+     * @param items the number of items in the transaction
+     * @param commitTime the milliseconds the commit took
+     * @param enqueued the total number of items queued for persistence
+     * @param persisted the total number of items persisted
+     * @param now the current time
+     *
+     * @return the number of items for the next transaction
+     */
+    size_t commitDone(size_t items, size_t commitTime,
+                      size_t enqueued, size_t persisted, hrtime_t now);
+
+    void setEnabled(bool to);
+
+    bool isEnabled() {
+        return enabled.get();
+    }
+
+    /**
+     * Set the smallest size to pick.
+     */
+    void setMinSize(size_t lo);
+
+    /**
+     * Set the largest size to pick, which is the size while adaptive
+     * sizing is disabled.
+     */
+    void setMaxSize(size_t hi);
+
+    /**
+     * Set the commit time (in milliseconds) to aim for.
+     */
+    void setCommitTimeTarget(size_t to) {
+        target.set(to);
+    }
+
+    size_t getSize() {
+        return size.get();
+    }
+
+    reason_t getReason() {
+        return static_cast<reason_t>(reason.get());
+    }
+
+    /**
+     * Get the moving average of the commit times since the last change
+     * of size, in milliseconds.
+     */
+    double getCommitTimeAvg() {
+        return commitTimeAvg.get();
+    }
+
+    /**
+     * Get the number of items queued for persistence per second.
+     */
+    double getFillRate() {
+        return fillRate.get();
+    }
+
+    /**
+     * Get the number of items persisted per second.
+     */
+    double getDrainRate() {
+        return drainRate.get();
+    }
+
+    /**
+     * Get the number of times the size changed.
+     */
+    size_t getNumAdjustments() {
+        return numAdjustments.get();
+    }
+
+    static const char *reasonName(reason_t r);
+
+private:
+
+    size_t clamp(size_t sz);
+
+    void updateRates(size_t enqueued, size_t persisted, hrtime_t now);
+
+    Atomic<bool> enabled;
+    Atomic<size_t> minSize;
+    Atomic<size_t> maxSize;
+    Atomic<size_t> target;
+    Atomic<size_t> size;
+    Atomic<int> reason;
+    Atomic<double> commitTimeAvg;
+    Atomic<double> fillRate;
+    Atomic<double> drainRate;
+    Atomic<size_t> numAdjustments;
+
+    // Only touched by the flusher feeding the commits.
+    hrtime_t lastSampleTime;
+    size_t lastEnqueued;
+    size_t lastPersisted;
+
+    DISALLOW_COPY_AND_ASSIGN(TxnSizer);
+};
+
+#endif // TXNSIZER_HH
@@ -86,6 +86,14 @@ const vbucket_state_t VBucket::REPLICA = static_cast<vbucket_state_t>(htonl(vbuc
 const vbucket_state_t VBucket::PENDING = static_cast<vbucket_state_t>(htonl(vbucket_state_pending));
 const vbucket_state_t VBucket::DEAD = static_cast<vbucket_state_t>(htonl(vbucket_state_dead));
 
+size_t VBucket::bfilterKeyCount = 0;
+double VBucket::bfilterFpProb = 0.01;
+
+void VBucket::setBloomFilterSize(size_t keyCount, double fpProb) {
+    bfilterKeyCount = keyCount;
+    bfilterFpProb = fpProb;
+}
+
 void VBucket::fireAllOps(EventuallyPersistentEngine &engine, ENGINE_ERROR_CODE code) {
     if (pendingOpsStart > 0) {
         hrtime_t now = gethrtime();
@@ -149,18 +157,25 @@ void VBucket::doStatsForQueueing(QueuedItem& qi, size_t itemBytes)
 
 void VBucket::doStatsForFlushing(QueuedItem& qi, size_t itemBytes)
 {
-    if (dirtyQueueSize > 0) {
-        --dirtyQueueSize;
+    doStatsForFlushing(1, qi.getQueuedTime(), itemBytes);
+}
+
+void VBucket::doStatsForFlushing(size_t numItems, uint64_t queuedTimes, size_t itemBytes)
+{
+    if (dirtyQueueSize > numItems) {
+        dirtyQueueSize.decr(numItems);
+    } else {
+        dirtyQueueSize.set(0);
     }
-    if (dirtyQueueMem > sizeof(QueuedItem)) {
-        dirtyQueueMem.decr(sizeof(QueuedItem));
+    if (dirtyQueueMem > numItems * sizeof(QueuedItem)) {
+        dirtyQueueMem.decr(numItems * sizeof(QueuedItem));
     } else {
         dirtyQueueMem.set(0);
     }
-    ++dirtyQueueDrain;
+    dirtyQueueDrain.incr(numItems);
 
-    if (dirtyQueueAge > qi.getQueuedTime()) {
-        dirtyQueueAge.decr(qi.getQueuedTime());
+    if (dirtyQueueAge > queuedTimes) {
+        dirtyQueueAge.decr(queuedTimes);
     } else {
         dirtyQueueAge.set(0);
     }
@@ -172,6 +187,17 @@ void VBucket::doStatsForFlushing(QueuedItem& qi, size_t itemBytes)
     }
 }
 
+void VBucket::doStatsForPersisting(rel_time_t queued)
+{
+    rel_time_t now = ep_current_time();
+    rel_time_t lag = now > queued ? now - queued : 0;
+    persistenceLag.set(lag);
+    // Only the flusher owning the vbucket writes its items.
+    if (lag > persistenceLagMax) {
+        persistenceLagMax.set(lag);
+    }
+}
+
 void VBucket::resetStats() {
     opsCreate.set(0);
     opsUpdate.set(0);
@@ -183,6 +209,7 @@ void VBucket::resetStats() {
     dirtyQueueFill.set(0);
     dirtyQueueAge.set(0);
     dirtyQueuePendingWrites.set(0);
+    persistenceLagMax.set(0);
     dirtyQueueDrain.set(0);
 }
 
@@ -207,6 +234,20 @@ void VBucket::queueBGFetchItem(VBucketBGFetchItem *fetch,
     bgFetcher->notifyBGEvent();
 }
 
+void VBucket::queueBGFetchItems(const std::vector<VBucketBGFetchItem *> &fetches,
+                                BgFetcher *bgFetcher) {
+    if (fetches.empty()) {
+        return;
+    }
+    LockHolder lh(pendingBGFetchesLock);
+    std::vector<VBucketBGFetchItem *>::const_iterator it;
+    for (it = fetches.begin(); it != fetches.end(); ++it) {
+        pendingBGFetches.push(*it);
+    }
+    assert(bgFetcher);
+    bgFetcher->notifyBGEvent(fetches.size());
+}
+
 bool VBucket::getBGFetchItems(vb_bgfetch_queue_t &fetches) {
     LockHolder lh(pendingBGFetchesLock);
     while (!pendingBGFetches.empty()) {
@@ -228,7 +269,7 @@ void VBucket::addStats(bool details, ADD_STAT add_stat, const void *c) {
         addStat("num_referenced", ht.getNumReferenced(), add_stat, c);
         addStat("ht_memory", ht.memorySize(), add_stat, c);
         addStat("ht_item_memory", ht.getItemMemory(), add_stat, c);
-        addStat("ht_cache_size", ht.cacheSize, add_stat, c);
+        addStat("ht_cache_size", ht.cacheSize.get(), add_stat, c);
         addStat("num_ejects", ht.getNumEjects(), add_stat, c);
         addStat("ops_create", opsCreate, add_stat, c);
         addStat("ops_update", opsUpdate, add_stat, c);
@@ -240,5 +281,21 @@ void VBucket::addStats(bool details, ADD_STAT add_stat, const void *c) {
         addStat("queue_drain", dirtyQueueDrain, add_stat, c);
         addStat("queue_age", getQueueAge(), add_stat, c);
         addStat("pending_writes", dirtyQueuePendingWrites, add_stat, c);
+        rel_time_t oldest;
+        if (checkpointManager.getOldestQueuedTimeForPersistence(oldest)) {
+            rel_time_t now = ep_current_time();
+            addStat("oldest_dirty_age", now > oldest ? now - oldest : 0, add_stat, c);
+        } else {
+            addStat("oldest_dirty_age", 0, add_stat, c);
+        }
+        addStat("persistence_lag", persistenceLag, add_stat, c);
+        addStat("persistence_lag_max", persistenceLagMax, add_stat, c);
+        if (bFilter) {
+            addStat("bfilter_size", bFilter->getNumBits(), add_stat, c);
+            addStat("bfilter_hashes", bFilter->getNumHashes(), add_stat, c);
+            addStat("bfilter_bits_set", bFilter->getNumBitsSet(), add_stat, c);
+            addStat("bfilter_fp_prob", bFilter->getFalsePositiveProb(),
+                    add_stat, c);
+        }
     }
 }
@@ -15,6 +15,7 @@
 #include "queueditem.hh"
 #include "common.hh"
 #include "atomic.hh"
+#include "bloomfilter.hh"
 #include "stored-value.hh"
 #include "checkpoint.hh"
 
@@ -129,12 +130,16 @@ public:
     VBucket(int i, vbucket_state_t newState, EPStats &st, CheckpointConfig &checkpointConfig,
             vbucket_state_t initState = vbucket_state_dead, uint64_t checkpointId = 1) :
         ht(st), checkpointManager(st, i, checkpointConfig, checkpointId), id(i), state(newState),
-        initialState(initState), stats(st) {
+        initialState(initState), stats(st), bFilter(NULL) {
 
         backfill.isBackfillPhase = false;
         pendingOpsStart = 0;
-        stats.memOverhead.incr(sizeof(VBucket)
-                               + ht.memorySize() + sizeof(CheckpointManager));
+        if (bfilterKeyCount > 0) {
+            bFilter = new BloomFilter(bfilterKeyCount, bfilterFpProb);
+            stats.bfilterMemory.incr(bFilter->memorySize());
+        }
+        stats.memOverhead.incr(sizeof(VBucket) + ht.memorySize()
+                               + sizeof(CheckpointManager) + bloomFilterMemory());
         assert(stats.memOverhead.get() < GIGANTOR);
     }
 
@@ -150,8 +155,13 @@ public:
             delete pendingBGFetches.front();
             pendingBGFetches.pop();
         }
-        stats.memOverhead.decr(sizeof(VBucket) + ht.memorySize() + sizeof(CheckpointManager));
+        stats.memOverhead.decr(sizeof(VBucket) + ht.memorySize()
+                               + sizeof(CheckpointManager) + bloomFilterMemory());
         assert(stats.memOverhead.get() < GIGANTOR);
+        if (bFilter) {
+            stats.bfilterMemory.decr(bFilter->memorySize());
+            delete bFilter;
+        }
         getLogger()->log(EXTENSION_LOG_INFO, NULL,
                          "Destroying vbucket %d\n", id);
     }
@@ -183,6 +193,16 @@ public:
 
     void doStatsForQueueing(QueuedItem& item, size_t itemBytes);
     void doStatsForFlushing(QueuedItem& item, size_t itemBytes);
+    /**
+     * Do the stats for flushing a number of items at once.
+     * @param queuedTimes the sum of the items' queued times
+     * @param itemBytes the sum of the items' sizes
+     */
+    void doStatsForFlushing(size_t numItems, uint64_t queuedTimes, size_t itemBytes);
+    /**
+     * Do the stats for writing an item queued at a given time.
+     */
+    void doStatsForPersisting(rel_time_t queued);
     void resetStats();
 
     // Get age sum in millisecond
@@ -236,6 +256,8 @@ public:
 
     bool getBGFetchItems(vb_bgfetch_queue_t &fetches);
     void queueBGFetchItem(VBucketBGFetchItem *fetch, BgFetcher *bgFetcher);
+    void queueBGFetchItems(const std::vector<VBucketBGFetchItem *> &fetches,
+                           BgFetcher *bgFetcher);
     size_t numPendingBGFetchItems(void) {
         LockHolder lh(pendingBGFetchesLock);
         return pendingBGFetches.size();
@@ -245,6 +267,42 @@ public:
         return !pendingBGFetches.empty();
     }
 
+    /**
+     * Record that the key with the given hash has been written to, or
+     * deleted on, disk.
+     */
+    void addKeyToFilter(uint64_t h) {
+        if (bFilter) {
+            bFilter->addKey(h);
+        }
+    }
+
+    /**
+     * Check whether the key with the given hash may be on disk.
+     *
+     * @return false only if the Bloom filter rules the key out
+     */
+    bool maybeKeyExistsOnDisk(uint64_t h) const {
+        return bFilter == NULL || bFilter->maybeKeyExists(h);
+    }
+
+    bool hasBloomFilter() const {
+        return bFilter != NULL;
+    }
+
+    size_t bloomFilterMemory() const {
+        return bFilter ? bFilter->memorySize() : 0;
+    }
+
+    /**
+     * Set the size of the Bloom filters of vbuckets created from now
+     * on.  A key count of zero creates vbuckets without one.
+     *
+     * @param keyCount the number of keys to size each filter for
+     * @param fpProb the false positive probability at that many keys
+     */
+    static void setBloomFilterSize(size_t keyCount, double fpProb);
+
     static const char* toString(vbucket_state_t s) {
         switch(s) {
         case vbucket_state_active: return "active"; break;
@@ -285,6 +343,10 @@ public:
     Atomic<size_t>  dirtyQueueDrain;
     Atomic<uint64_t> dirtyQueueAge;
     Atomic<size_t>  dirtyQueuePendingWrites;
+    // Seconds the last mutation written waited for the flusher, and the
+    // most any did.
+    Atomic<rel_time_t> persistenceLag;
+    Atomic<rel_time_t> persistenceLagMax;
 
     Atomic<size_t>  numExpiredItems;
 
@@ -305,6 +367,12 @@ private:
     Mutex pendingBGFetchesLock;
     std::queue<VBucketBGFetchItem *> pendingBGFetches;
 
+    //! Keys that may be on disk, only kept under full eviction.
+    BloomFilter *bFilter;
+
+    static size_t bfilterKeyCount;
+    static double bfilterFpProb;
+
     DISALLOW_COPY_AND_ASSIGN(VBucket);
 };
 
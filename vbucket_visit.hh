@@ -0,0 +1,225 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef VBUCKET_VISIT_HH
+#define VBUCKET_VISIT_HH 1
+
+#include "config.h"
+
+#include <cassert>
+#include <vector>
+
+#include "atomic.hh"
+#include "common.hh"
+#include "locks.hh"
+#include "stored-value.hh"
+
+/**
+ * Where a task's vbucket visits got to.
+ *
+ * A task that keeps one of these has each visit pick up where the
+ * last one stopped rather than starting over at the first item of the
+ * first vbucket, so a visit that stops early, or gets recreated,
+ * doesn't keep covering the same part of the data.
+ */
+class VBucketVisitorCursor {
+public:
+    VBucketVisitorCursor() : vbid(0), inUse(false) {}
+
+    /**
+     * Claim the cursor for a visit.
+     *
+     * @return false if another visit is using it
+     */
+    bool acquire() {
+        return inUse.cas(false, true);
+    }
+
+    void release() {
+        inUse.set(false);
+    }
+
+    bool isInUse() {
+        return inUse.get();
+    }
+
+    //! The vbucket the next visit starts in.
+    Atomic<uint16_t>    vbid;
+    //! Where in that vbucket's hash table it starts.
+    HashTable::Position position;
+    //! Number of times every vbucket has been visited.
+    Atomic<size_t>      laps;
+    //! Number of vbuckets visited to the end.
+    Atomic<size_t>      vbuckets;
+    //! Number of items visited.
+    Atomic<size_t>      items;
+    //! Number of chunks the visits were done in.
+    Atomic<size_t>      chunks;
+
+private:
+    Atomic<bool>        inUse;
+
+    DISALLOW_COPY_AND_ASSIGN(VBucketVisitorCursor);
+};
+
+/**
+ * The vbuckets of one visit, shared by the workers it's spread over.
+ *
+ * Workers take the next vbucket whenever they're done with one rather
+ * than being dealt a fixed share up front, so a worker that drew a few
+ * big vbuckets doesn't leave the others idle at the end.
+ *
+ * With a cursor the visit starts where the last one using it stopped.
+ * Once the last worker is finished the cursor is left at the first
+ * vbucket that wasn't visited to the end, so stopping early with
+ * several workers may visit a few vbuckets again next time.
+ */
+class VBucketVisitQueue {
+public:
+
+    /**
+     * @param vbs the vbuckets to visit, in ascending order
+     * @param workers the number of workers taking from the queue
+     * @param c the cursor to start from and update, may be NULL
+     */
+    VBucketVisitQueue(const std::vector<uint16_t> &vbs, size_t workers,
+                      VBucketVisitorCursor *c) :
+        taken(workers, static_cast<size_t>(NONE)), positions(workers),
+        remaining(workers), nextVb(0), stopping(false), cursor(c) {
+        if (cursor && !cursor->acquire()) {
+            // An earlier visit is still going with it, start at the top.
+            cursor = NULL;
+        }
+        size_t first = 0;
+        if (cursor) {
+            uint16_t startvb = cursor->vbid.get();
+            while (first < vbs.size() && vbs[first] < startvb) {
+                ++first;
+            }
+            if (first < vbs.size() && vbs[first] == startvb) {
+                startPosition = cursor->position;
+            }
+        }
+        vbList.insert(vbList.end(), vbs.begin() + first, vbs.end());
+        vbList.insert(vbList.end(), vbs.begin(), vbs.begin() + first);
+    }
+
+    ~VBucketVisitQueue() {
+        if (cursor) {
+            cursor->release();
+        }
+    }
+
+    /**
+     * Take the next vbucket, which also marks the one the worker had
+     * before as visited to the end.
+     *
+     * @param worker the worker taking it
+     * @param vbid set to the vbucket to visit
+     * @param pos set to where to start in its hash table
+     * @return false if there are none left
+     */
+    bool next(size_t worker, uint16_t &vbid, HashTable::Position &pos) {
+        LockHolder lh(mutex);
+        taken[worker] = NONE;
+        if (stopping || nextVb == vbList.size()) {
+            return false;
+        }
+        taken[worker] = nextVb;
+        vbid = vbList[nextVb];
+        pos = nextVb == 0 ? startPosition : HashTable::Position();
+        ++nextVb;
+        return true;
+    }
+
+    /**
+     * Stop handing out vbuckets.
+     *
+     * @param worker the worker stopping
+     * @param pos how far it got in the vbucket it has
+     */
+    void stop(size_t worker, const HashTable::Position &pos) {
+        LockHolder lh(mutex);
+        stopping = true;
+        positions[worker] = pos;
+    }
+
+    bool isStopping() {
+        LockHolder lh(mutex);
+        return stopping;
+    }
+
+    /**
+     * Called by each worker once it's out of vbuckets or has stopped.
+     *
+     * @return true for the last worker to finish
+     */
+    bool finish() {
+        LockHolder lh(mutex);
+        assert(remaining > 0);
+        if (--remaining > 0) {
+            return false;
+        }
+        if (cursor) {
+            saveCursor();
+            cursor->release();
+            cursor = NULL;
+        }
+        return true;
+    }
+
+    bool hasCursor() const {
+        return cursor != NULL;
+    }
+
+    void countChunk(size_t items) {
+        if (cursor) {
+            ++cursor->chunks;
+            cursor->items.incr(items);
+        }
+    }
+
+    void countVBucket() {
+        if (cursor) {
+            ++cursor->vbuckets;
+        }
+    }
+
+private:
+
+    void saveCursor() {
+        size_t first = nextVb;
+        HashTable::Position pos = first == 0 ? startPosition
+                                             : HashTable::Position();
+        for (size_t i = 0; i < taken.size(); ++i) {
+            if (taken[i] < first) {
+                first = taken[i];
+                pos = positions[i];
+            }
+        }
+        if (first == vbList.size()) {
+            // Made it all the way round, the next visit starts over
+            // where this one did.
+            ++cursor->laps;
+            cursor->position = HashTable::Position();
+        } else {
+            cursor->vbid.set(vbList[first]);
+            cursor->position = pos;
+        }
+    }
+
+    static const size_t NONE = static_cast<size_t>(-1);
+
+    Mutex                            mutex;
+    std::vector<uint16_t>            vbList;
+    // Index in vbList of the vbucket each worker is in, or NONE.
+    std::vector<size_t>              taken;
+    std::vector<HashTable::Position> positions;
+    size_t                           remaining;
+    size_t                           nextVb;
+    bool                             stopping;
+    VBucketVisitorCursor            *cursor;
+    HashTable::Position              startPosition;
+
+    DISALLOW_COPY_AND_ASSIGN(VBucketVisitQueue);
+};
+
+#endif /* VBUCKET_VISIT_HH */
@@ -154,6 +154,27 @@ private:
     int         warmupState;
 };
 
+/**
+ * Adds the keys deleted on disk to the Bloom filter of their vbucket,
+ * so getMeta still fetches the metadata of their tombstones.
+ */
+class LoadDeletedKeyCallback : public Callback<GetValue> {
+public:
+    LoadDeletedKeyCallback(RCPtr<VBucket> &b) : vb(b) {}
+
+    void callback(GetValue &val) {
+        Item *i = val.getValue();
+        if (i != NULL) {
+            vb->addKeyToFilter(vb->ht.hash(i->getKey()));
+            delete i;
+            val.setValue(NULL);
+        }
+    }
+
+private:
+    RCPtr<VBucket> vb;
+};
+
 void LoadStorageKVPairCallback::initVBucket(uint16_t vbid,
                                             const vbucket_state &vbs) {
     RCPtr<VBucket> vb = vbuckets.getBucket(vbid);
@@ -182,6 +203,8 @@ void LoadStorageKVPairCallback::callback(GetValue &val) {
                                  epstore->getEPEngine().getCheckpointConfig()));
             vbuckets.addBucket(vb);
         }
+        // Whether or not it fits in memory, the key is on disk.
+        vb->addKeyToFilter(vb->ht.hash(i->getKey()));
         bool succeeded(false);
         int retry = 2;
         do {
@@ -341,6 +364,8 @@ bool Warmup::loadingMutationLog(Dispatcher&, TaskId)
 {
     shared_ptr<Callback<GetValue> > cb(createLKVPCB(initialVbState, false,
                                                     state.getState()));
+    // Before any traffic is let in, whichever way the keys get loaded.
+    loadDeletedKeys();
     bool success = false;
 
     try {
@@ -371,6 +396,22 @@ bool Warmup::loadingMutationLog(Dispatcher&, TaskId)
     return true;
 }
 
+void Warmup::loadDeletedKeys(void)
+{
+    if (!store->roUnderlying->getStorageProperties().hasPersistedDeletions()) {
+        return;
+    }
+
+    std::map<uint16_t, vbucket_state>::const_iterator it;
+    for (it = initialVbState.begin(); it != initialVbState.end(); ++it) {
+        RCPtr<VBucket> vb = store->vbuckets.getBucket(it->first);
+        if (vb && vb->hasBloomFilter()) {
+            shared_ptr<Callback<GetValue> > cb(new LoadDeletedKeyCallback(vb));
+            store->roUnderlying->dumpDeleted(it->first, cb);
+        }
+    }
+}
+
 bool Warmup::estimateDatabaseItemCount(Dispatcher&, TaskId)
 {
     hrtime_t st = gethrtime();
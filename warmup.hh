@@ -98,6 +98,8 @@ private:
 
     void transition(int to);
 
+    void loadDeletedKeys(void);
+
 
     LoadStorageKVPairCallback *createLKVPCB(const std::map<uint16_t, vbucket_state> &st,
                                             bool maybeEnable, int warmupState);